@@ -0,0 +1,141 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <functional>
+#include <string>
+
+#include <argparse/argparse.hpp>
+
+#include "file.hpp"
+#include "bit_ops.hpp"
+
+// Measures the bitfield operations that run on every pass of the event loop, for a torrent with many pieces.
+// Each word parallel operation is timed next to the bit at a time loop that it replaced, on the worst case input:
+// a bitfield that is set everywhere except its last bit, so that every scan has to look at the whole field.
+static volatile long long sink; // keeps results alive so that the loops are not optimized away
+
+// run f repeatedly and report the average time of one call
+static double time_op(const std::string &name, int repeat, const std::function<long long()> &f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; i++)
+    {
+        sink = f();
+    }
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / repeat;
+    std::cout << std::setw(34) << std::left << name << std::right << std::fixed << std::setprecision(2) << std::setw(12) << us << " us" << std::endl;
+    return us;
+}
+
+int main(int argc, char *argv[])
+{
+    argparse::ArgumentParser program("bench_bitfield");
+    int num_bits;
+    int repeat;
+
+    program.add_argument("-n").default_value(1 << 20).store_into(num_bits); // the number of pieces
+    program.add_argument("-r").default_value(200).store_into(repeat);       // the number of calls timed per operation
+
+    try
+    {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception &err)
+    {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(1);
+    };
+
+    File::BitField have(num_bits);
+    File::BitField peer(num_bits);
+    for (int i = 0; i < num_bits - 1; i++)
+    {
+        have.set_bit(i);
+    }
+    for (int i = 0; i < num_bits; i++)
+    {
+        peer.set_bit(i);
+    }
+    File::BitField sparse(num_bits);
+    for (int i = 0; i < num_bits; i += 1000)
+    {
+        sparse.set_bit(i);
+    }
+
+    std::cout << num_bits << " bits, " << Util::bit_ops_isa() << " kernels" << std::endl;
+
+    double old_match = time_op("first_match, bit at a time", repeat, [&]()
+                               {
+        for (int i = 0; i < num_bits; i++)
+        {
+            if (!have.is_bit_set(i) && peer.is_bit_set(i))
+            {
+                return (long long)i;
+            }
+        }
+        return -1ll; });
+    double new_match = time_op("first_match", repeat, [&]()
+                               { return have.first_match(&peer); });
+
+    double old_unflipped = time_op("first_unflipped, bit at a time", repeat, [&]()
+                                   {
+        for (int i = 0; i < num_bits; i++)
+        {
+            if (!have.is_bit_set(i))
+            {
+                return (long long)i;
+            }
+        }
+        return -1ll; });
+    double new_unflipped = time_op("first_unflipped", repeat, [&]()
+                                   { return have.first_unflipped(); });
+
+    double old_all = time_op("all_flipped, bit at a time", repeat, [&]()
+                             {
+        for (int i = 0; i < num_bits; i++)
+        {
+            if (!have.is_bit_set(i))
+            {
+                return 0ll;
+            }
+        }
+        return 1ll; });
+    time_op("all_flipped (cached count)", repeat, [&]()
+            { return have.all_flipped(); });
+
+    time_op("count of set bits, bit at a time", repeat, [&]()
+            {
+        long long count = 0;
+        for (int i = 0; i < num_bits; i++)
+        {
+            count += have.is_bit_set(i);
+        }
+        return count; });
+    time_op("and_not and recount", repeat, [&]()
+            {
+        File::BitField copy = peer;
+        copy.and_not(&have);
+        return (long long)copy.count(); });
+
+    time_op("walk a sparse field, bit at a time", repeat, [&]()
+            {
+        long long count = 0;
+        for (int i = 0; i < num_bits; i++)
+        {
+            count += sparse.is_bit_set(i);
+        }
+        return count; });
+    time_op("walk a sparse field, find_next_set", repeat, [&]()
+            {
+        long long count = 0;
+        for (int i = sparse.find_next_set(0); i != -1; i = sparse.find_next_set(i + 1))
+        {
+            count++;
+        }
+        return count; });
+
+    std::cout << "speedup: first_match " << std::setprecision(1) << old_match / new_match << "x, first_unflipped "
+              << old_unflipped / new_unflipped << "x, all_flipped " << old_all << " us to constant time" << std::endl;
+    return 0;
+}
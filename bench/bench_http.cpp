@@ -0,0 +1,168 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <argparse/argparse.hpp>
+
+#include "http_response.hpp"
+#include "tracker_protocol.hpp"
+
+// Measures the parsing of tracker responses, the way they come off the socket.
+// The streaming parser is fed canned responses with a compact peer list, framed with a Content-Length and chunked,
+// in segments of a few sizes, and timed next to the split() based parse that it replaced. The old parse took the
+// whole response from one read and could not handle the segmented or chunked cases at all, so it only gets the
+// single buffer.
+static volatile long long sink; // keeps results alive so that the loops are not optimized away
+
+// run f repeatedly and report the rate of calls and of bytes
+static double time_op(const std::string &name, int repeat, size_t bytes, const std::function<long long()> &f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeat; i++)
+    {
+        sink = f();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double per_second = repeat / seconds;
+    std::cout << std::setw(40) << std::left << name << std::right << std::fixed << std::setprecision(0) << std::setw(12)
+              << per_second << " parses/s" << std::setprecision(1) << std::setw(10) << per_second * bytes / (1024 * 1024)
+              << " MiB/s" << std::endl;
+    return per_second;
+}
+
+// the split() of the old parse, which copies every token into its own string
+static std::vector<std::string> split(std::string input, std::string delimiter)
+{
+    std::vector<std::string> tokens;
+    size_t last_break_end = 0;
+    size_t found_pos = input.find(delimiter, last_break_end);
+    while (found_pos != std::string::npos)
+    {
+        size_t substr_len = found_pos - last_break_end + 1;
+        tokens.push_back(input.substr(last_break_end, substr_len));
+        last_break_end = found_pos + delimiter.length();
+        found_pos = input.find(delimiter, last_break_end);
+    }
+    tokens.push_back(input.substr(last_break_end, std::string::npos));
+    return tokens;
+}
+
+// the old parse of a response, which found its status and length and took the last line as the body
+static long long old_parse(const std::string &http_resp)
+{
+    int response_code = 0;
+    int payload_length = 0;
+    std::vector<std::string> lines = split(http_resp, "\r\n");
+    for (auto &line : lines)
+    {
+        std::vector<std::string> words = split(line, " ");
+        if (words[0] == "HTTP/1.1 ")
+            response_code = stoi(words[1]);
+        else if (words[0] == "Content-Length: ")
+            payload_length = stoi(words[1]);
+    }
+    return response_code + payload_length + (long long)lines.back().length();
+}
+
+// feed the response to the parser in segments of segment bytes, as reads from the socket would
+static long long new_parse(TrackerProtocol::HttpResponse &response, const std::string &http_resp, size_t segment)
+{
+    response.reset();
+    for (size_t i = 0; i < http_resp.length() && !response.complete(); i += segment)
+    {
+        response.feed(http_resp.data() + i, std::min(segment, http_resp.length() - i));
+    }
+    return response.status + (long long)response.body.length();
+}
+
+int main(int argc, char *argv[])
+{
+    argparse::ArgumentParser program("bench_http");
+    int num_peers;
+    int repeat;
+
+    program.add_argument("-n").default_value(200).store_into(num_peers); // the number of peers in each response
+    program.add_argument("-r").default_value(100000).store_into(repeat); // the number of parses timed per case
+
+    try
+    {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception &err)
+    {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(1);
+    };
+
+    // a compact peer list of 6 bytes per peer. Bytes that would read as a line break are left out, since the old
+    // parse took the last line as the body
+    std::string compact;
+    for (int i = 0; i < num_peers; i++)
+    {
+        unsigned char peer[6] = {10, (unsigned char)(i >> 8), (unsigned char)(i & 0xff), 1, 0x1a, 0xe1};
+        for (unsigned char &c : peer)
+        {
+            c = c == '\r' || c == '\n' ? c + 2 : c;
+        }
+        compact.append((char *)peer, 6);
+    }
+    std::string payload = "d8:completei12e10:incompletei34e8:intervali1800e12:min intervali900e5:peers" +
+                          std::to_string(compact.length()) + ":" + compact + "e";
+
+    std::string length_response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: " +
+                                  std::to_string(payload.length()) + "\r\n\r\n" + payload;
+
+    // the chunked response splits the payload into chunks of up to 256 bytes
+    std::string chunked_response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nTransfer-Encoding: chunked\r\n\r\n";
+    for (size_t i = 0; i < payload.length(); i += 256)
+    {
+        std::string chunk = payload.substr(i, 256);
+        char size[16];
+        snprintf(size, sizeof(size), "%zx\r\n", chunk.length());
+        chunked_response += size + chunk + "\r\n";
+    }
+    chunked_response += "0\r\n\r\n";
+
+    TrackerProtocol::HttpResponse response(TrackerProtocol::HTTP_HEADER_MAX_SIZE, TrackerProtocol::HTTP_MAX_SIZE);
+    if (new_parse(response, length_response, 7) == 0 || response.body != payload ||
+        new_parse(response, chunked_response, 7) == 0 || response.body != payload)
+    {
+        std::cerr << "the parser did not read the canned responses back" << std::endl;
+        exit(1);
+    }
+
+    std::cout << num_peers << " peers, " << length_response.length() << " byte response" << std::endl;
+
+    double old_rate = time_op("split() parse, one read", repeat, length_response.length(), [&]()
+                              { return old_parse(length_response); });
+    double new_rate = time_op("content-length, one read", repeat, length_response.length(), [&]()
+                              { return new_parse(response, length_response, length_response.length()); });
+    for (size_t segment : {1448, 512, 64})
+    {
+        time_op("content-length, " + std::to_string(segment) + " byte reads", repeat, length_response.length(), [&]()
+                { return new_parse(response, length_response, segment); });
+    }
+    for (size_t segment : {chunked_response.length(), (size_t)1448, (size_t)64})
+    {
+        std::string name = segment == chunked_response.length() ? "one read" : std::to_string(segment) + " byte reads";
+        time_op("chunked, " + name, repeat, chunked_response.length(), [&]()
+                { return new_parse(response, chunked_response, segment); });
+    }
+
+    // the whole announce, with the payload decoded into peers
+    TrackerProtocol::HttpTracker tracker("http://127.0.0.1/announce", std::string(20, 'a'), std::string(20, 'b'), 6881,
+                                         nullptr, nullptr, nullptr);
+    time_op("parse and decode the peers", repeat / 10, length_response.length(), [&]()
+            {
+        new_parse(response, length_response, 1448);
+        std::vector<Peer::PeerClient> peers;
+        tracker.parse_payload(response.body, peers);
+        return (long long)peers.size(); });
+
+    std::cout << "speedup over split(): " << std::setprecision(1) << new_rate / old_rate << "x" << std::endl;
+    return 0;
+}
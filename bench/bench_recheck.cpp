@@ -0,0 +1,89 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdio>
+
+#include <argparse/argparse.hpp>
+
+#include "recheck.hpp"
+#include "hash.h"
+
+// Measures how fast an existing download is rechecked on startup.
+// Generates a file of pseudo random pieces, then rechecks it with an increasing number of threads
+// and reports the throughput of each run. The file is read from the page cache after the first run,
+// so the numbers show hashing throughput unless the file is larger than memory.
+int main(int argc, char *argv[])
+{
+    argparse::ArgumentParser program("bench_recheck");
+    std::string path;
+    int size_mb;
+    int piece_kb;
+    int max_threads;
+
+    program.add_argument("-f").default_value("bench_recheck.bin").store_into(path);
+    program.add_argument("-s").default_value(1024).store_into(size_mb);   // size of the generated file, in MiB
+    program.add_argument("-pl").default_value(1024).store_into(piece_kb); // piece length, in KiB
+    program.add_argument("-t").default_value((int)std::thread::hardware_concurrency()).store_into(max_threads);
+
+    try
+    {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception &err)
+    {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(1);
+    };
+
+    long long length = (long long)size_mb * 1024 * 1024;
+    long long piece_length = (long long)piece_kb * 1024;
+
+    // write the file one piece at a time, hashing each piece as we go
+    std::cout << "generating " << size_mb << " MiB in " << path << std::endl;
+    std::string piece_hashes;
+    {
+        std::ofstream out(path, std::ios::out | std::ios::trunc | std::ios::binary);
+        std::vector<uint64_t> piece(piece_length / sizeof(uint64_t));
+        uint64_t state = 0x9E3779B97F4A7C15ull;
+        for (long long offset = 0; offset < length; offset += piece_length)
+        {
+            for (uint64_t &word : piece)
+            {
+                // xorshift64
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                word = state;
+            }
+            long long size = std::min(piece_length, length - offset);
+            piece_hashes += Hash::truncated_sha1_hash((const uint8_t *)piece.data(), size, 20);
+            out.write((const char *)piece.data(), size);
+        }
+    }
+
+    // double the number of threads each run, finishing with the requested number
+    std::vector<int> thread_counts;
+    for (int threads = 1; threads < max_threads; threads *= 2)
+    {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(std::max(1, max_threads));
+
+    for (int threads : thread_counts)
+    {
+        std::vector<uint8_t> good_pieces;
+        auto start = std::chrono::steady_clock::now();
+        long long matched = File::recheck_file(path, piece_length, length, piece_hashes, threads, good_pieces, 0);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << std::setw(3) << threads << " threads: " << std::fixed << std::setprecision(2)
+                  << length / seconds / 1e9 << " GB/s (" << matched << " of " << good_pieces.size() << " pieces match)" << std::endl;
+    }
+
+    std::remove(path.c_str());
+    return 0;
+}
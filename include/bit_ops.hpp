@@ -0,0 +1,32 @@
+#ifndef BIT_OPS_HPP
+#define BIT_OPS_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+namespace Util
+{
+	// Kernels over arrays of 64 bit words, the storage of a bitfield.
+	// Each has a portable version that works a word at a time. On x86 an AVX2 version that works four words at a time
+	// is picked on first use if the processor supports it, and on 64 bit ARM a NEON version that works two at a time is used.
+
+	// the index of the first word where want has a set bit that have does not, or num_words if there is none
+	size_t first_word_and_not(const uint64_t *want, const uint64_t *have, size_t num_words);
+
+	// the index of the first word that has an unset bit, or num_words if there is none
+	size_t first_word_not_full(const uint64_t *words, size_t num_words);
+
+	// the index of the first word that has a set bit, or num_words if there is none
+	size_t first_word_nonzero(const uint64_t *words, size_t num_words);
+
+	// the number of set bits in the words
+	size_t popcount_words(const uint64_t *words, size_t num_words);
+
+	// clear every bit of dest that is set in src
+	void and_not_words(uint64_t *dest, const uint64_t *src, size_t num_words);
+
+	// the name of the kernels in use, "avx2", "neon" or "portable"
+	const char *bit_ops_isa();
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef CHOKER_HPP
+#define CHOKER_HPP
+
+#include <vector>
+#include <random>
+
+#include "session.hpp"
+
+namespace Peer
+{
+	static const int CHOKE_INTERVAL_SECONDS = 10; // the time between two rounds of the choker
+	static const int OPTIMISTIC_ROUNDS = 3;		  // the rounds of the choker between two rotations of the optimistic unchoke
+	static const int DEFAULT_UNCHOKE_SLOTS = 4;	  // the number of peers that are unchoked at once, with the optimistic unchoke
+
+	// Decides which peers we upload to, tit for tat.
+	// Every round, the interested peers that send us blocks the fastest are unchoked, or the peers that we upload to the
+	// fastest once we are seeding, and every other peer is choked. One slot goes to an optimistic unchoke instead: a
+	// peer picked at random regardless of its rate, so that new peers get a chance to show what they can send us.
+	// The optimistic unchoke is kept for several rounds before it rotates to another peer.
+	class Choker
+	{
+	private:
+		int slots;			  // the number of peers unchoked at once
+		int rounds;			  // the number of rounds run so far
+		int optimistic;		  // the socket of the optimistically unchoked peer, or -1
+		std::mt19937 rng;
+
+		// the rate that a peer is ranked by
+		static double rate(Session *session, bool seeding);
+
+		// whether a peer can be unchoked: its handshake arrived and it wants our pieces
+		static bool candidate(Session *session);
+
+	public:
+		// create a choker that keeps slots peers unchoked, at least one
+		Choker(int slots);
+
+		// run a round: unchoke the fastest peers and the optimistic unchoke, and choke the rest
+		void rechoke(std::vector<Session *> &sessions, bool seeding);
+
+		// unchoke interested peers while there are free slots, without choking anyone, so that a peer does not wait
+		// for the next round when the slots are not all in use
+		void fill_slots(std::vector<Session *> &sessions);
+	};
+}
+
+#endif
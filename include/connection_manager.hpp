@@ -0,0 +1,121 @@
+#ifndef CONNECTION_MANAGER_HPP
+#define CONNECTION_MANAGER_HPP
+
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+
+#include "peer.hpp"
+#include "reactor.hpp"
+
+namespace Peer
+{
+	static const int CONNECT_TIMEOUT_SECONDS = 10;	  // the time a connect may take before it is given up on
+	static const int CONNECT_RETRY_MIN = 30;		  // seconds before a peer is tried again after its first failure, doubled for each failure after
+	static const int CONNECT_RETRY_MAX = 30 * 60;	  // the most seconds before a failed peer is tried again
+	static const int MAX_CONNECT_FAILURES = 5;		  // failures in a row after which a peer is forgotten
+	static const size_t MAX_CANDIDATES = 4096;		  // the most peers remembered, beyond which new ones from the trackers are dropped
+	static const int DEFAULT_MAX_HALF_OPEN = 16;	  // connects in progress at once
+	static const int DEFAULT_MAX_PEERS = 50;		  // connected peers, with the connects in progress, that we stop connecting at
+
+	// Connects to the peers that the trackers return, a few at a time.
+	// Peers are remembered as candidates, and connects start from tick(), on the event loop, while there are fewer than
+	// max_half_open in progress and fewer than max_peers peers in total. A connect that does not finish within the timeout
+	// is given up on, and a peer that failed is tried again after a backoff that doubles with each failure, until it is
+	// forgotten. Candidates that sent us blocks quickly in an earlier connection are connected first, then those that
+	// never failed. A connected socket is handed to on_connected, whose session the owner reports back through
+	// disconnected() when it closes.
+	class ConnectionManager
+	{
+	private:
+		// a peer that we may connect to
+		struct Candidate
+		{
+			sockaddr_in addr;
+			bool busy;											  // whether a connect to it is in progress, or it is connected
+			int failures;										  // connects or connections that failed in a row
+			double throughput;									  // the bytes per second it sent us in its last connection, 0 if none
+			std::chrono::steady_clock::time_point retry_at;		  // when it may be connected to again
+			std::chrono::steady_clock::time_point connected_at; // when its current connection started
+		};
+
+		// a connect in progress, which reports to the manager when its socket becomes writable or fails
+		class Attempt : public Net::Handler
+		{
+		public:
+			ConnectionManager *manager;
+			int socket;
+			uint64_t key;										  // the key of the candidate
+			std::chrono::steady_clock::time_point deadline;		  // when the connect times out
+			bool done;											  // whether the connect finished, and the socket was removed from the reactor
+			int error;											  // the error of a finished connect, 0 if it succeeded
+
+			Attempt(ConnectionManager *manager, int socket, uint64_t key, std::chrono::steady_clock::time_point deadline);
+			void on_writable();
+			void on_error();
+
+			// stop watching the socket, and leave the attempt for the manager's next tick()
+			void finish(int error);
+		};
+
+		Net::Reactor *reactor;
+		sockaddr_in self_addr;	// our own address, which a tracker may return to us
+		size_t max_half_open;
+		size_t max_peers;
+		std::function<void(PeerClient &)> on_connected;
+
+		std::unordered_map<uint64_t, Candidate> candidates;			  // every remembered peer, by address
+		std::unordered_map<int, std::unique_ptr<Attempt>> attempts;	  // connects in progress, by socket
+		std::vector<int> finished;									  // sockets of attempts that finished since the last tick()
+
+		size_t ready;											  // candidates that could be connected to at the last scan
+		bool rescan;											  // whether candidates changed since the last scan
+		std::chrono::steady_clock::time_point next_scan;		  // when a waiting candidate's backoff runs out
+
+		// a key for a peer's address and port
+		static uint64_t peer_key(const sockaddr_in &addr);
+
+		// the time before a candidate with failures failures is tried again
+		static std::chrono::seconds backoff(int failures);
+
+		// count a failure against a candidate, and forget it after too many
+		void fail(uint64_t key, std::chrono::steady_clock::time_point now);
+
+		// start a nonblocking connect to a candidate
+		void connect_to(uint64_t key, Candidate &candidate, std::chrono::steady_clock::time_point now);
+
+		// hand a finished attempt's socket on, or count its failure
+		void complete(Attempt &attempt, std::chrono::steady_clock::time_point now);
+
+		// start connects to the best candidates that are ready, at most count of them
+		void start_connects(size_t count, std::chrono::steady_clock::time_point now);
+
+	public:
+		// create a manager that keeps at most max_half_open connects in progress and max_peers peers, both at least one
+		ConnectionManager(Net::Reactor *reactor, sockaddr_in self_addr, size_t max_half_open, size_t max_peers,
+						  std::function<void(PeerClient &)> on_connected);
+		~ConnectionManager();
+
+		// remember the peers that a tracker returned, skipping ourselves and peers that are already known
+		void add_peers(std::vector<PeerClient> &peers);
+
+		// a connection that on_connected started closed after downloaded bytes. Peers that sent us something are tried
+		// again after the shortest backoff, and others as if the connect failed
+		void disconnected(const sockaddr_in &addr, long long downloaded);
+
+		// hand on finished connects, time out slow ones, and start new ones while num_peers connected peers leave room.
+		// Called from the event loop at least once a second, and never from inside a reactor callback
+		void tick(size_t num_peers);
+
+		// whether the candidates that are ready to be connected to would not fill the free slots,
+		// so that the trackers should be asked for more
+		bool want_peers(size_t num_peers);
+
+		// the number of connects in progress
+		size_t half_open();
+	};
+}
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef DISK_IO_HPP
+#define DISK_IO_HPP
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+#include "spsc_queue.hpp"
+#include "storage.hpp"
+#include "resume.hpp"
+
+namespace Disk
+{
+	static const size_t QUEUE_SIZE = 1024; // the number of jobs (and results) that can be queued at once
+	static const int FLUSH_POLL_MS = 100;  // how long a flush waits for results before checking whether the disk thread is idle
+
+	// Resume data to save once everything written before it is flushed to disk
+	struct ResumeJob
+	{
+		File::ResumeData data;			// the state to save. Its file size and modification time are filled in after the flush
+		std::string path;				// where the resume file is written
+		std::vector<File::FileSpan> files; // the files of the download, whose size and modification time are saved
+	};
+
+	// A verified piece that should be written to storage, or resume data to save
+	struct WriteJob
+	{
+		uint32_t piece_index;		// the index of the piece being written
+		long long offset;			// the byte offset in the torrent where the piece starts
+		const uint8_t *data;		// the piece's data. Must stay valid until the result for this job is popped
+		uint32_t length;			// the number of bytes to write
+		ResumeJob *resume = nullptr; // if set, the job saves this resume data instead of writing a piece.
+									// Must stay valid until the result for this job is popped
+	};
+
+	// The outcome of a write job, posted back to the network loop
+	struct WriteResult
+	{
+		uint32_t piece_index;		// the index of the piece that was written
+		bool ok;					// whether every byte of the piece (or the resume file) made it to storage
+		ResumeJob *resume = nullptr; // the resume data that was saved, if the job was a resume save
+	};
+
+	// Writes pieces to storage on its own thread, so that a slow disk never stalls the network loop.
+	// The network loop pushes jobs onto a lock free queue, and the disk thread drains every queued job
+	// at once, merging pieces that are contiguous on disk into a single vectored write.
+	// Resume saves go through the same queue, so that the flush before one covers every piece submitted before it.
+	// Results come back on a second queue, and notify_fd becomes readable when there are results to pop.
+	class DiskThread
+	{
+	private:
+		File::Storage *storage; // where pieces are written to
+
+		Util::SpscQueue<WriteJob> jobs;		   // jobs from the network loop to the disk thread
+		Util::SpscQueue<WriteResult> results;  // results from the disk thread to the network loop
+		std::atomic<uint32_t> job_signal;	   // bumped for each pushed job, the disk thread waits on it when idle
+		std::atomic<bool> running;			   // cleared to stop the disk thread
+		std::atomic<uint64_t> submitted;	   // the number of jobs pushed by the network loop
+		std::atomic<uint64_t> completed;	   // the number of jobs whose results have been pushed
+		int event_fd;						   // eventfd that is signalled when results are pushed
+		std::thread worker;					   // the disk thread
+
+		// the disk thread's loop
+		void run();
+
+		// write a batch of jobs, coalescing runs that are contiguous on disk
+		void write_batch(std::vector<WriteJob> &batch);
+
+		// flush storage to disk, then save the job's resume data with the size and modification time of the download
+		void save_resume(WriteJob &job);
+
+		// push a result, waiting for room if the network loop has fallen behind
+		void push_result(WriteResult result);
+
+		// signal the eventfd so that the network loop pops results
+		void notify();
+
+	public:
+		DiskThread(File::Storage *storage);
+		~DiskThread();
+
+		// queue a piece to be written, or resume data to be saved
+		// return false if the queue is full, in which case the caller should retry later
+		bool submit(WriteJob job);
+
+		// whether every submitted job has been written and its result pushed. Results pushed before this
+		// returns true can then be popped with drain_results
+		bool idle();
+
+		// clear the notification, then pop every finished write into out
+		void drain_results(std::vector<WriteResult> &out);
+
+		// the file descriptor to poll for readability. It is cleared by drain_results
+		int notify_fd();
+	};
+}
+
+#endif
@@ -4,25 +4,53 @@
 #include <vector>
 #include <string>
 #include <queue>
+#include <deque>
 #include <memory>
+#include <unordered_map>
 #include <fstream>
 #include <cmath>
 
 #include "message.hpp"
+#include "piece_pool.hpp"
+#include "storage.hpp"
+#include "disk_io.hpp"
+#include "hash_pool.hpp"
+#include "resume.hpp"
+#include "send_queue.hpp"
+#include "piece_picker.hpp"
+#include "request_table.hpp"
 #include "hash.h"
 #include "bencode.hpp"
 
 namespace File
 {
-	// A bitfield used in the bittorrent protocol. Wraps a vector of bytes.
+	// A bitfield used in the bittorrent protocol.
+	// Bits are stored in 64 bit words in the order they have on the wire: bit 0 is the highest bit of the first word.
+	// Scans work a word at a time, or several words at a time with SIMD, and the number of set bits is kept up to date
+	// so that checking whether every bit is set is constant time. Bits past num_bits are always unset.
 	struct BitField
 	{
-		std::vector<uint8_t> bits; // the bitfield, stored as a byte vector
-		uint32_t num_bits;		   // the size of the bitfield. This field is needed because some bits will be unused
+	private:
+		std::vector<uint64_t> words; // the bitfield, 64 bits to a word
+		uint32_t set_bits;			 // the number of set bits
+
+		// the word that holds bit_index, and the mask of the bit in it
+		static uint32_t word_index(uint32_t bit_index);
+		static uint64_t bit_mask(uint32_t bit_index);
+
+		// the mask of the bits of the last word that are part of the bitfield
+		uint64_t last_word_mask();
+
+	public:
+		uint32_t num_bits; // the size of the bitfield. This field is needed because some bits will be unused
 
 		// Construct a bitfield by interpreting a buffer as a bitfield message
 		BitField(Messages::Buffer *buff, uint32_t num_bits);
 
+		// Construct a bitfield of num_bits bits from the num_bytes bytes of a bitfield message's payload.
+		// Missing bytes are treated as unset, and extra bytes and bits are ignored
+		BitField(const uint8_t *payload, uint32_t num_bytes, uint32_t num_bits);
+
 		// Initialize a bit field that can hold num_bits number of bits, all unflipped
 		BitField(uint32_t num_bits);
 
@@ -32,7 +60,7 @@ namespace File
 		// set the bit representing bit_index to be true
 		void set_bit(uint32_t bit_index);
 
-		// unset the bit representing bit_index to be true
+		// unset the bit representing bit_index
 		void unset_bit(uint32_t bit_index);
 
 		// find the first bit_index where this bitfield has an unflipped bit, but the BitField other
@@ -40,14 +68,38 @@ namespace File
 		// return the bit_index if found, or -1 if no such bit_index exists
 		int first_match(BitField *other);
 
+		// find the first bit_index at or after from where this bitfield is unset and other is set
+		// return the bit_index if found, or -1
+		int next_match(BitField *other, uint32_t from);
+
 		// find the first bit_index in this bitfield that is not set to true
 		// return this bit_index if found, or -1
 		int first_unflipped();
 
+		// find the first set bit at or after from
+		// return its bit_index if found, or -1
+		int find_next_set(uint32_t from);
+
 		// see if all bits are flipped in this bitfield
 		// return true if they are, false if not
 		bool all_flipped();
 
+		// the number of set bits
+		uint32_t count();
+
+		// unset every bit that is set in other, which has the same number of bits
+		void and_not(BitField *other);
+
+		// the number of bytes the bitfield takes on the wire
+		uint32_t num_bytes();
+
+		// write the num_bytes() bytes of the bitfield, as they are on the wire, to dest
+		void copy_bytes(uint8_t *dest);
+
+		// replace the bitfield with the first num_bytes bytes at src, as they are on the wire.
+		// Missing bytes are treated as unset, and extra bytes and bits are ignored
+		void load_bytes(const uint8_t *src, uint32_t num_bytes);
+
 		// pack this bitfield into a buffer
 		// The returned buffer must be freed by the caller.
 		Messages::Buffer *pack();
@@ -90,20 +142,48 @@ namespace File
 		uint32_t piece_index;	// the piece index of this piece
 
 		std::unique_ptr<BitField> block_bitfield; // a bitfield tracking which blocks have been downloaded by the torrent
-		std::unique_ptr<uint8_t[]> data;		  // pointer to a buffer that we write to when we download. Size piece_size.
+		std::unique_ptr<uint8_t[]> data;		  // buffer leased from the piece pool that we write to when we download.
+												  // nullptr until the first block of this piece is queued, and after the piece is written out.
 
+		Hash::sha1sum_ptr hash_ctx; // running hash of the blocks at the start of this piece that have arrived in order.
+									// nullptr until the first block of this piece is written
+		uint32_t hashed_blocks;		// the number of blocks at the start of this piece that have been fed to hash_ctx
+
+		std::deque<Block> pending_blocks; // blocks of a started piece that have not been requested yet
 
 		long long piece_size; // the max size of this piece
 		uint32_t num_blocks;  // the number of blocks in this piece
 
 		Piece(std::string piece_hash, uint32_t piece_index, long long size);
 
+		// the length of the block at block_index, only the last block can be shorter than block_size
+		uint32_t block_length(uint32_t block_index);
+
 		// Return a vector of unfinished block structs using the block bitfield
 		std::vector<Block> get_unfinished_blocks();
 	};
 
+	// Settings for how a torrent stores and verifies its data
+	struct TorrentConfig
+	{
+		long long memory_budget;  // the most bytes that the buffers of in flight pieces may hold
+		StorageMode storage_mode; // how downloaded data is stored
+		int hash_threads;		  // the number of threads that verify finished pieces
+		bool resume;			  // whether fast resume data is loaded from and saved next to the download
+		bool recheck;			  // whether an existing download is always hashed again on startup, even if resume data covers it
+		int recheck_threads;	  // the number of threads that hash an existing download on startup
+		int max_open_files;		  // the most files of a multi file torrent that are kept open at once
+
+		TorrentConfig();
+	};
+
 	// A base torrent file. To be inherited by either a multi file torrent, or a single file torrent.
 	// Contains information about piece length, number of pieces.
+	// The torrent object will both
+	// - keep track of all requests for blocks that have not been downloaded. This is so that we can quickly
+	// determine the next requests that have to be made.
+	// - keep track of all pieces that have been downloaded via a piece bitfield.
+	// Pieces are addressed by their offset in the torrent, and the storage maps offsets to the torrent's files.
 	class Torrent
 	{
 	protected:
@@ -111,55 +191,206 @@ namespace File
 		long long private_field; // field indicating if peers must show peer_id
 
 		std::string pieces; // concatenation of 20 byte SHA1 hashes, with one per piece
+		std::string name;	// the name of the file, or of the directory that the files are saved in
+		std::vector<FileSpan> files; // the files of the torrent in order, one for a single file torrent
 
 		// construct a metadata class using a string buffer containing all metadata
 		Torrent(std::string metainfo_buffer);
-	};
 
-	// A torrent consisting of a single file.
-	// The torrent object will both
-	// - keep track of all requests for blocks that have not been downloaded. This is so that we can quickly
-	// determine the next requests that have to be made.
-	// - keep track of all pieces that have been downloaded via a piece bitfield.
-	class SingleFileTorrent : public Torrent
-	{
+		// Open the storage for files, set up according to config, then build the pieces and find the pieces that
+		// are already downloaded. Called by subclasses once they know the files of the torrent.
+		void open(std::vector<FileSpan> files, TorrentConfig config);
+
 	private:
-		std::string name;	 // the name of the file being torrented
 		std::vector<Piece> piece_vec; // vector of pieces, indexed by piece indices
-		std::ofstream out_stream; 		// the file stream that this torrent should write out to
+		std::unique_ptr<Storage> storage; // where this torrent writes out to, and reads back from when seeding
+		std::unique_ptr<PiecePool> piece_pool;	// buffers for pieces that are being downloaded. Unused when the storage is memory mapped
+		std::deque<std::unique_ptr<Disk::ResumeJob>> saving_resume; // resume saves handed to the disk thread, in order, until they finish. Outlives the disk thread
+		std::unique_ptr<Disk::DiskThread> disk; // writes verified pieces, unless the storage is memory mapped, and saves resume data off the network thread
+		std::deque<Disk::WriteJob> pending_writes; // verified pieces and resume saves that did not fit in the disk queue yet
+		std::unique_ptr<Hash::HashPool> hasher;	   // verifies finished pieces off the network thread
+		std::vector<Hash::sha1sum_ptr> free_hash_ctxs; // running hashes returned by verified pieces, reused by new pieces
+		std::string resume_path;					   // where fast resume data is kept, empty if it is not used
+
+		std::unique_ptr<PiecePicker> picker; // chooses the next piece to start, rarest first
+		std::vector<uint32_t> active_pieces; // pieces that were started and are not verified yet, in the order they started
+		RequestTable requests;				 // blocks that were requested and have not arrived, with the peers they were asked from
+		bool endgame;						 // whether every block that is left is in flight, so blocks are asked from several peers
+		std::unordered_map<int, std::vector<Block>> cancels; // blocks that arrived from another peer, to cancel by the peer they were asked from
+		std::vector<uint32_t> finished_log; // pieces finished since the torrent was opened, in order, for peers to be told about
+
+		// Restore the piece and block bitfields from the resume file, given the size and modification time that
+		// the download had before we opened it. If the download has not changed since the resume file was saved,
+		// only pieces whose writes had not finished are hashed again. Otherwise every piece that was done is hashed again.
+		// return true if the resume file was used
+		bool load_resume(long long file_size, long long file_mtime);
+
+		// Hash every piece of the existing download in parallel with num_threads threads,
+		// and rebuild the piece bitfield from the pieces that match
+		void recheck_existing(int num_threads);
+
+		// set every block of every finished piece, so that none of them are requested again
+		void fill_finished_blocks();
+
+		// hash the piece at index as it is in storage
+		// return true if it matches its expected hash
+		bool check_piece(uint32_t index);
+
+		// feed the blocks that continue the in order prefix of the piece at index into its running hash
+		void advance_piece_hash(uint32_t index, uint8_t *dest);
+
+		// act on the outcome of verifying the piece at index
+		void on_piece_verified(uint32_t index, bool ok);
+
+		// mark the piece at index as downloaded, once it can be read back from storage, and log it to be announced
+		void finish_piece(uint32_t index);
+
+		// hand verified pieces to the disk thread, keeping any that do not fit for later
+		void flush_pending_writes();
+
+		// the byte offset in the torrent where the piece at index starts
+		long long piece_offset(uint32_t index);
+
+		// pack the header of a piece message for a block into dest, which holds PIECE_HEADER_LENGTH bytes
+		void pack_piece_header(uint8_t *dest, uint32_t index, uint32_t begin, uint32_t length);
+
+		// start downloading the piece at index: lease its buffer and make its missing blocks pending
+		// return false if the memory budget is used up
+		bool start_piece(uint32_t index);
+
+		// move pending blocks of the piece at index to blocks, until it holds count blocks
+		void take_blocks(uint32_t index, size_t count, std::vector<Block> &blocks);
+
+		// make the blocks of requests that will not be answered pending again, so that they are asked from another peer,
+		// unless they are still in flight to some other peer
+		void return_requests(std::vector<InFlightRequest> &returned);
+
+		// check if every block that is left is in flight: every missing piece is started, and none has pending blocks
+		bool all_blocks_in_flight();
+
+		// the buffer that the piece at index is downloaded into: either the mapped file, or a leased piece buffer.
+		// return nullptr if the piece has no buffer
+		uint8_t *piece_data(uint32_t index);
 
 	public:
 		uint32_t num_pieces; // the number of pieces in this torrent
 		
 		std::unique_ptr<BitField> piece_bitfield; // bitfield of pieces. Used for fast intersection with peer bitfields
-		std::queue<Block> block_queue;			  // queue of block requests that we are currently trying to make
-		uint32_t downloaded;						// the number of bytes downloaded for this torrent
-		uint32_t uploaded; 							// the number of bytes uploaded for this torrent
-		long long length;	 // the length of the file in bytes
+		long long downloaded;						// the number of bytes downloaded for this torrent
+		long long uploaded; 						// the number of bytes uploaded for this torrent
+		long long length;	 // the length of the torrent in bytes, the sum of the lengths of its files
+
+		virtual ~Torrent() {}
+
+		// the number of bytes of the torrent that we do not have yet
+		long long bytes_left();
+
+		// Save the piece bitfield, and the block bitfields of pieces that are partly written to the file, next to the
+		// download. The disk thread flushes the download to disk first, then writes the file, so this returns before the
+		// file is saved. Does nothing if resume data is not used.
+		void save_resume();
+
+		// block until every piece and resume save handed to the disk thread has been written, and act on the results
+		void flush_writes();
+
+		// Choose up to count blocks to request from the peer owner, which has the pieces set in peer_bitfield, add them
+		// to blocks, and record them as in flight to owner. Only blocks that are not in flight are chosen.
+		// Blocks of pieces that are already started come first, so that pieces finish and free their buffers.
+		// After those, the rarest pieces that the peer has are started, each leasing a buffer from the piece pool,
+		// until the memory budget is used up.
+		// In endgame, once every block that is left is in flight, blocks that are in flight to other peers are asked
+		// from this peer as well, and the duplicates are cancelled as soon as a copy arrives.
+		void pick_blocks(int owner, BitField *peer_bitfield, size_t count, std::vector<Block> &blocks);
+
+		// move the blocks whose requests to the peer owner should be cancelled to blocks
+		void take_cancels(int owner, std::vector<Block> &blocks);
+
+		// whether any peer has requests to cancel
+		bool has_cancels();
+
+		// the number of pieces finished since the torrent was opened. A peer's cursor starts here when it is sent our bitfield
+		size_t num_finished();
+
+		// move the pieces finished since cursor to pieces, and advance cursor past them
+		void take_finished(size_t &cursor, std::vector<uint32_t> &pieces);
+
+		// the number of blocks requested from the peer owner that have not arrived
+		int requests_in_flight(int owner);
 
-		SingleFileTorrent(std::string metainfo_buffer);
+		// hand back every block requested from the peer owner, because it choked us or left
+		void release_requests(int owner);
 
-		// Get all unfinished blocks from all unfinished piece vectors,
-		// and place these into the block queue
-		void update_block_queue();
+		// hand back every block whose request went unanswered for REQUEST_TIMEOUT_MS
+		void expire_requests();
 
-		// Interpret a buffer as a piece message, then write its contents to the representing piece struct
-		// and its data field. This function will not write unless the provided block stays within the piece
-		// size bounds.
+		// count the pieces of a peer's bitfield towards their availability
+		void add_availability(BitField *peer_bitfield);
+
+		// count a piece that a peer announced with a have message towards its availability
+		void add_availability(uint32_t index);
+
+		// stop counting the pieces of a peer's bitfield, when the peer leaves or sends a new bitfield
+		void remove_availability(BitField *peer_bitfield);
+
+		// Write the length bytes of data, which arrived from the peer owner, as the block of the piece at index that
+		// starts at begin, to the piece's buffer (the piece's data field, or the mapped file). This function will not
+		// write unless the block is one of the piece's blocks, and has not been written already.
+		// Blocks are hashed as soon as they extend the in order prefix of the piece. Once every block is written,
+		// the piece is verified right away if it arrived in order, or the hash pool finishes the tail that is left.
 		// This function is used when leeching
-		void write_block(Messages::Buffer *buff);
+		void write_block(uint32_t index, uint32_t begin, const uint8_t *data, uint32_t length, int owner);
+
+		// Return where the length bytes of the block of the piece at index that starts at begin belong,
+		// so that they can be received there directly, or nullptr if the block is not one we are missing.
+		// The destination stays valid until the block is written, or until another block is written to the piece
+		// (which may complete it), so callers that receive a block in parts ask again before each part.
+		uint8_t *block_destination(uint32_t index, uint32_t begin, uint32_t length);
+
+		// Mark the block that was received at its destination from the peer owner as written, and hash or verify the piece.
+		// Every other peer that the block was asked from gets a cancel.
+		void block_written(uint32_t index, uint32_t begin, int owner);
+
+		// the file descriptor that becomes readable when the hash pool has verified pieces
+		int hash_notify_fd();
+
+		// Act on verified pieces: pieces that match their hash are written out (or marked as downloaded
+		// when the storage is mapped), and pieces that do not match are downloaded again.
+		void process_hash_results();
+
+		// the file descriptor that becomes readable when the disk thread has finished writes or resume saves
+		int disk_notify_fd();
+
+		// Mark pieces whose writes have finished as downloaded, and return their buffers to the piece pool.
+		// Pieces that failed to write are downloaded again, and finished resume saves are dropped.
+		void process_disk_completions();
 
-		// Return a piece message formatted into the buffer
+		// Queue a piece message for a block of a piece that we have onto a peer's send queue.
+		// Only the header is copied: the block is queued as a range of storage that is sent from the page cache
+		// with sendfile. Its bytes count as uploaded once the session writes them to the socket.
+		// return false if the block is not one we can serve
 		// This function is used when seeding
-		Messages::Buffer *get_piece(uint32_t index, uint32_t begin, uint32_t length);
+		bool queue_block(Net::SendQueue &queue, uint32_t index, uint32_t begin, uint32_t length);
 	};
 
-	// TODO: finish this
+	// A torrent consisting of a single file.
+	class SingleFileTorrent : public Torrent
+	{
+	public:
+		// Create a torrent from its metainfo, set up according to config
+		SingleFileTorrent(std::string metainfo_buffer, TorrentConfig config = TorrentConfig());
+	};
+
+	// A torrent consisting of several files, saved in a directory named after the torrent.
+	// The files are laid back to back, so pieces and blocks may span several of them.
 	class MultipleFileTorrent : public Torrent
 	{
-	private:
-		std::string name; // the name of the directory to save files
+	public:
+		// Create a torrent from its metainfo, set up according to config
+		MultipleFileTorrent(std::string metainfo_buffer, TorrentConfig config = TorrentConfig());
 	};
+
+	// Create a single or multiple file torrent, depending on whether the info dictionary of its metainfo lists files
+	std::unique_ptr<Torrent> create_torrent(std::string metainfo_buffer, TorrentConfig config = TorrentConfig());
 }
 
 #endif
\ No newline at end of file
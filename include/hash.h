@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <string>
+#include <memory>
 
 #include <assert.h>
 #include <openssl/evp.h>
@@ -26,11 +27,20 @@ namespace Hash {
 
     int sha1sum_destroy(struct sha1sum_ctx*);
 
+    // destroys a sha1sum_ctx, so that it can be owned by a unique_ptr
+    struct sha1sum_deleter {
+		void operator()(sha1sum_ctx *ctx) { sha1sum_destroy(ctx); }
+	};
+    using sha1sum_ptr = std::unique_ptr<sha1sum_ctx, sha1sum_deleter>;
+
     uint64_t sha1sum_truncated_head(uint8_t *sha1_hash);
 
 	// get the len byte truncated SHA1 hash of the payload
     // return as a string
     std::string truncated_sha1_hash(std::string payload, size_t len);
+
+	// get the len byte truncated SHA1 hash of payload_len bytes at payload, without copying them
+    std::string truncated_sha1_hash(const uint8_t *payload, size_t payload_len, size_t len);
 }
 
 #endif
@@ -0,0 +1,71 @@
+#ifndef HASH_POOL_HPP
+#define HASH_POOL_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#include "hash.h"
+
+namespace Hash
+{
+	// A piece that should be checked against its expected SHA1 hash
+	struct HashJob
+	{
+		uint32_t piece_index;  // the index of the piece being checked
+		const uint8_t *data;   // the piece's data. Must stay valid and unchanged until the result for this job is popped
+		size_t length;		   // the number of bytes at data
+		std::string expected;  // the 20 byte SHA1 hash from the metainfo
+		sha1sum_ctx *ctx;	   // a running hash of the piece's bytes before data, finished by the worker.
+							   // nullptr if data is the whole piece. Must not be touched until the result is popped
+	};
+
+	// The outcome of a hash job, posted back to the network loop
+	struct HashResult
+	{
+		uint32_t piece_index; // the index of the piece that was checked
+		bool ok;			  // whether the piece matched its expected hash
+	};
+
+	// A pool of threads that verify pieces off the network loop.
+	// Each worker owns one sha1sum_ctx that it resets between jobs, and hashes the piece where it lies
+	// instead of copying it. A job can also carry the piece's own running hash, in which case the worker
+	// only hashes the tail that is left. notify_fd becomes readable when there are results to pop.
+	class HashPool
+	{
+	private:
+		std::vector<std::thread> workers; // the hashing threads
+
+		std::mutex jobs_mutex;				// guards jobs and running
+		std::condition_variable jobs_ready; // signalled when a job is queued or the pool is stopping
+		std::deque<HashJob> jobs;			// jobs waiting for a worker
+		bool running;						// cleared to stop the workers
+
+		std::mutex results_mutex;		 // guards results
+		std::vector<HashResult> results; // finished jobs waiting to be popped
+		int event_fd;					 // eventfd that is signalled when results are pushed
+
+		// a worker's loop
+		void run();
+
+	public:
+		// Start num_threads workers, at least one
+		HashPool(int num_threads);
+		~HashPool();
+
+		// queue a piece to be checked
+		void submit(HashJob job);
+
+		// clear the notification, then pop every finished job into out
+		void drain_results(std::vector<HashResult> &out);
+
+		// the file descriptor to poll for readability. It is cleared by drain_results
+		int notify_fd();
+	};
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef HTTP_RESPONSE_HPP
+#define HTTP_RESPONSE_HPP
+
+#include <string>
+#include <cstddef>
+
+namespace TrackerProtocol {
+	// An HTTP/1.1 response that is parsed as its bytes arrive.
+	// Bytes can be fed in pieces of any size, split anywhere, and each byte is looked at once: header lines are
+	// gathered in one reused buffer and parsed in place, and the body is appended straight to its string, so nothing
+	// is copied into substrings along the way. The body may have a Content-Length, be chunked, or run until the
+	// connection closes. A response that breaks the protocol or is larger than the limits puts the parser in an
+	// error state instead of stopping the client.
+	class HttpResponse {
+	public:
+		static const size_t MAX_CHUNK_LINE = 1024; // the longest chunk size line taken, with its extensions
+
+		enum State {
+			STATUS_LINE,	// reading the status line
+			HEADERS,		// reading header lines, until the empty one
+			BODY,			// reading a body of known length, or one that runs until the connection closes
+			CHUNK_SIZE,		// reading the size line of a chunk
+			CHUNK_DATA,		// reading the bytes of a chunk
+			CHUNK_END,		// reading the line break after a chunk
+			TRAILERS,		// reading trailer lines after the last chunk, until the empty one
+			COMPLETE,		// the whole response arrived
+			FAILED			// the response is malformed or too large, see error
+		};
+
+	private:
+		size_t max_header_size;		 // the most bytes of the status line and headers taken
+		size_t max_body_size;		 // the most bytes of body taken
+
+		State state;
+		std::string line;			 // the part of the current line that arrived so far
+		size_t header_size;			 // bytes of the status line and headers so far
+		long long content_length;	 // the length of the body from its header, -1 if there is none
+		long long remaining;		 // bytes left in the body or the current chunk, -1 if the body runs until close
+		bool chunked;				 // whether the body uses chunked transfer encoding
+
+		// act on a complete line, without its line break
+		void handle_line();
+
+		// act on a header line
+		void handle_header();
+
+		// the headers ended, so work out how the body is framed
+		void start_body();
+
+		// stop parsing with an error
+		void fail(const std::string &reason);
+
+	public:
+		int status;			   // the status code
+		bool keep_alive;	   // whether the connection can carry another request after this response
+		std::string body;	   // the body, with any chunked framing removed
+		std::string error;	   // why the parser failed
+
+		HttpResponse(size_t max_header_size, size_t max_body_size);
+
+		// forget the response, to parse the next one on the same connection
+		void reset();
+
+		// parse length bytes of the response
+		// return the number of bytes used, which is less than length only once the response is complete or failed
+		size_t feed(const char *data, size_t length);
+
+		// the connection closed: complete a body that runs until close, and fail a response that is cut short
+		void finish();
+
+		// whether no byte of the response has arrived yet
+		bool empty();
+
+		bool complete();
+		bool failed();
+	};
+}
+
+#endif
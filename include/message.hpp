@@ -28,6 +28,9 @@ namespace Messages
     static const uint8_t PORT_ID = 9;
     static const int HAVE_LENGTH = 5;
     static const int REQUEST_LENGTH = 13;
+    static const int CANCEL_LENGTH = 13;
+    static const uint32_t MAX_MESSAGE_LENGTH = 1 << 22; // the longest message we accept, longer ones come from a broken peer
+    static const int PIECE_HEADER_LENGTH = 13; // the len, id, index and begin fields that come before the block of a piece message
 
     // Holds data that is recv'd on the wire. Because we use nonblocking sockets,
     // we need buffers for each peer that will be held as long as a message is not read completely in a single recv.
@@ -301,6 +304,19 @@ namespace Messages
             total_length = REQUEST_LENGTH + sizeof(len);
         }
 
+        // unpack the index, begin and length fields that follow the id of a request message
+        Request(const uint8_t *payload) : BaseMessage(REQUEST_LENGTH, REQUEST_ID)
+        {
+            memcpy(&index, payload, sizeof(index));
+            memcpy(&begin, payload + sizeof(index), sizeof(begin));
+            memcpy(&length, payload + sizeof(index) + sizeof(begin), sizeof(length));
+
+            index = ntohl(index);
+            begin = ntohl(begin);
+            length = ntohl(length);
+            total_length = REQUEST_LENGTH + sizeof(len);
+        }
+
         Request(Buffer *buff) : BaseMessage(buff)
         {
             // we already read len, id in BaseMessage constructor
@@ -350,6 +366,25 @@ namespace Messages
         }
     };
 
+    // A cancel message in the bittorrent protocol
+    // It has the same fields as a request, and withdraws the request for the same block
+    class Cancel : public Request
+    {
+    public:
+        Cancel(uint32_t index, uint32_t begin, uint32_t length) : Request(index, begin, length)
+        {
+            len = CANCEL_LENGTH;
+            id = CANCEL_ID;
+        }
+
+        // unpack the index, begin and length fields that follow the id of a cancel message
+        Cancel(const uint8_t *payload) : Request(payload)
+        {
+            len = CANCEL_LENGTH;
+            id = CANCEL_ID;
+        }
+    };
+
     // ----------------------VARIABLE LENGTH MESSAGES -----------------------------
     // A bitfield message, as specified by bittorrent protocol
     // Because bitfields are also implemented as an important struct with other
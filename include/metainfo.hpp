@@ -1,6 +1,7 @@
 #ifndef METAINFO_HPP
 #define METAINFO_HPP
 #include <string>
+#include <vector>
 #include <fstream>
 #include <stdio.h>
 
@@ -18,6 +19,10 @@ namespace Metainfo
 	// read the announce url from a string buffer containing the metainfo file
 	std::string read_announce_url(std::string metainfo_buffer);
 
+	// read the tiers of tracker urls from a string buffer containing the metainfo file, from its announce-list (BEP 12),
+	// or a single tier of the announce url if it has no list. Empty if the metainfo names no tracker
+	std::vector<std::vector<std::string>> read_announce_tiers(std::string metainfo_buffer);
+
 	// read the metainfo and pack into a string buffer
 	std::string read_metainfo_to_buffer(std::string filename);
 }
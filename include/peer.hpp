@@ -9,9 +9,12 @@
 
 #include "message.hpp"
 #include "file.hpp"
+#include "ring_buffer.hpp"
+#include "rate_counter.hpp"
 
 namespace Peer
 {
+    static const int RATE_WINDOW_SECONDS = 5; // the window that a peer's transfer rates are averaged over
 
     struct PeerClient
     {
@@ -25,14 +28,13 @@ namespace Peer
         bool sent_shake; // did we send the handshake with this peer yet?
         bool recv_shake; // did we recv the handshake with this peer yet?
         bool connected;  // did we connect to this peer yet?
-        bool reading;    // is this peer in the middle of sending a message?
 
-        int outgoing_requests; // the number of requests that we do not have pieces for yet.
-                               // We will maintain a const number of outgoing requests.
-
-        Messages::Buffer *buffer;      // this peer's buffer that stores bytes for an incoming message
+        Util::RingBuffer *recv_buffer; // this peer's incoming bytes, which may hold several messages. Created by its session
         File::BitField *peer_bitfield; // this peer's bitfield
 
+        Util::RateCounter download_rate; // the rate that this peer sends us blocks at
+        Util::RateCounter upload_rate;   // the rate that we send this peer bytes at
+
         sockaddr_in sockaddr;                                               // this peer's socket address
         PeerClient(std::string peer_id_str, std::string ip_addr, int port); // overload for dictionary mode
         PeerClient(uint32_t ip_addr, uint16_t port);                        // overload for binary mode
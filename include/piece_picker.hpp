@@ -0,0 +1,75 @@
+#ifndef PIECE_PICKER_HPP
+#define PIECE_PICKER_HPP
+
+#include <vector>
+#include <random>
+#include <memory>
+#include <cstdint>
+
+namespace File
+{
+	struct BitField;
+
+	static const uint32_t PICK_SCAN_LIMIT = 64; // the most candidates a pick looks at in the buckets, and among the peer's pieces
+
+	// Chooses which piece to start downloading next, rarest first.
+	// Every piece has an availability: the number of connected peers that have it. Pieces that we still have to
+	// start, the candidates, are kept in buckets by availability, so a piece moves between buckets in constant time
+	// when a peer announces it or leaves, and picking only looks at the rarest pieces instead of scanning every piece.
+	// A piece goes into its bucket at a random position, so ties between equally rare pieces are broken at random.
+	// A peer that lacks the rarest pieces does not make a pick walk every bucket: after a bounded number of misses, the
+	// candidates that the peer has are found a word at a time, and the rarest of a bounded number of them is picked.
+	class PiecePicker
+	{
+	private:
+		static constexpr uint32_t NOT_CANDIDATE = UINT32_MAX; // the position of a piece that is not in any bucket
+
+		std::vector<uint32_t> availability;		   // the number of peers that have each piece
+		std::vector<uint32_t> position;			   // the position of each candidate in its bucket, or NOT_CANDIDATE
+		std::vector<std::vector<uint32_t>> buckets; // candidate pieces, indexed by their availability
+		size_t candidates;							// the number of candidate pieces
+		std::unique_ptr<BitField> excluded;			// the pieces that are not candidates, set
+		std::mt19937 rng;
+
+		// put the candidate at index into the bucket of its availability, at a random position
+		void insert(uint32_t index);
+
+		// take the candidate at index out of its bucket
+		void erase(uint32_t index);
+
+	public:
+		// create a picker for num_pieces pieces, none of which are candidates or available
+		PiecePicker(uint32_t num_pieces);
+		~PiecePicker();
+
+		// make the piece at index eligible to be picked
+		void add_candidate(uint32_t index);
+
+		// stop the piece at index from being picked, once it is started or finished
+		void remove_candidate(uint32_t index);
+
+		// a peer announced that it has the piece at index
+		void increment(uint32_t index);
+
+		// a peer that had the piece at index left
+		void decrement(uint32_t index);
+
+		// count every piece set in a peer's bitfield as available
+		void add_bitfield(BitField *bitfield);
+
+		// undo add_bitfield, when the peer leaves or replaces its bitfield
+		void remove_bitfield(BitField *bitfield);
+
+		// the number of pieces that can still be picked
+		size_t num_candidates();
+
+		// the number of peers that have the piece at index
+		uint32_t get_availability(uint32_t index);
+
+		// find the rarest candidate that the peer with bitfield has
+		// return its index, or -1 if the peer has no candidate
+		int pick(BitField *bitfield);
+	};
+}
+
+#endif
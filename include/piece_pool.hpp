@@ -0,0 +1,45 @@
+#ifndef PIECE_POOL_HPP
+#define PIECE_POOL_HPP
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+namespace File
+{
+	static const long long DEFAULT_MEMORY_BUDGET = 256ll * 1024 * 1024; // default number of bytes that piece buffers may hold
+
+	// A pool of piece sized buffers bounded by a memory budget.
+	// Pieces lease a buffer when we first start requesting their blocks, and return it once the piece
+	// has been verified and written out. This keeps memory proportional to the number of in flight pieces
+	// instead of the size of the torrent.
+	class PiecePool
+	{
+	private:
+		long long buffer_size; // the size of every buffer handed out, the torrent's piece length
+		uint32_t max_buffers;  // the number of buffers that fit within the memory budget
+		uint32_t leased;	   // the number of buffers currently held by pieces
+
+		std::vector<std::unique_ptr<uint8_t[]>> free_buffers; // buffers that were returned and can be reused
+
+	public:
+		// Create a pool of buffer_size buffers that holds at most memory_budget bytes.
+		// The pool always allows at least one buffer, so that a torrent can make progress.
+		PiecePool(long long buffer_size, long long memory_budget);
+
+		// check if a buffer can be leased without going over the memory budget
+		bool can_lease();
+
+		// lease a buffer of buffer_size bytes
+		// return nullptr if the memory budget is exhausted
+		std::unique_ptr<uint8_t[]> lease();
+
+		// return a leased buffer to the pool
+		void release(std::unique_ptr<uint8_t[]> buffer);
+
+		// the number of bytes currently leased out to pieces
+		long long bytes_leased();
+	};
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef RATE_COUNTER_HPP
+#define RATE_COUNTER_HPP
+
+#include <vector>
+#include <chrono>
+
+namespace Util
+{
+	// Measures a transfer rate over a sliding window of whole seconds.
+	// Bytes are counted into one bucket per second, and buckets for seconds that passed without any bytes are
+	// cleared when the counter is next used, so adding bytes and reading the rate are both constant time.
+	class RateCounter
+	{
+	private:
+		std::vector<long long> buckets;					 // bytes counted in each second of the window, by second modulo the window
+		long long current_second;						 // the second since start that the newest bucket counts
+		std::chrono::steady_clock::time_point start;	 // when the counter was created
+		long long total;								 // every byte ever counted
+
+		// the seconds since start, as a fraction
+		double elapsed();
+
+		// clear the buckets of seconds that passed since the counter was last used
+		void advance();
+
+	public:
+		// Create a counter that averages over the last window_seconds seconds
+		RateCounter(int window_seconds);
+
+		// count bytes that were transferred now
+		void add(long long bytes);
+
+		// the average number of bytes per second over the window, or over the time since the counter was created
+		// if that is shorter (but at least a second)
+		double rate();
+
+		// the number of bytes counted since the counter was created
+		long long total_bytes();
+	};
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <vector>
+#include <unordered_set>
+#include <functional>
+#include <cstdint>
+#include <sys/epoll.h>
+
+namespace Net
+{
+	static const int MAX_EVENTS = 256; // the most readiness events handled per wait
+
+	// Something that owns a file descriptor registered with a Reactor, and is told when it is ready.
+	// Descriptors are registered edge triggered, so a handler must read or write until EAGAIN,
+	// otherwise it is not told again.
+	class Handler
+	{
+	public:
+		virtual ~Handler() {}
+
+		// the descriptor has bytes to read, or a connection to accept
+		virtual void on_readable() {}
+
+		// the descriptor can be written to, or a nonblocking connect has finished
+		virtual void on_writable() {}
+
+		// the descriptor has an error, or the other side hung up and there is nothing left to read
+		virtual void on_error() {}
+	};
+
+	// A handler that calls a function when its descriptor is readable, for eventfds and listeners
+	class CallbackHandler : public Handler
+	{
+	private:
+		std::function<void()> callback;
+
+	public:
+		CallbackHandler(std::function<void()> callback);
+		void on_readable();
+	};
+
+	// An epoll event loop. Handlers are added and removed in O(1), and each wait only
+	// touches the descriptors that are ready, so its cost does not depend on the number of connections.
+	class Reactor
+	{
+	private:
+		int epoll_fd;
+		std::vector<epoll_event> events;		// filled by epoll_wait
+		std::unordered_set<Handler *> removed; // handlers removed while dispatching, whose remaining events are skipped
+
+	public:
+		Reactor();
+		~Reactor();
+
+		// register fd for events (EPOLLIN, EPOLLOUT), edge triggered, reporting to handler
+		void add(int fd, uint32_t events, Handler *handler);
+
+		// stop watching fd. Safe to call from a handler, even for the handler being run.
+		// The handler must stay alive until run_once returns
+		void remove(int fd, Handler *handler);
+
+		// wait at most timeout_ms milliseconds for descriptors to become ready, and call their handlers
+		// return the number of ready descriptors
+		int run_once(int timeout_ms);
+	};
+}
+
+#endif
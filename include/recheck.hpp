@@ -0,0 +1,31 @@
+#ifndef RECHECK_HPP
+#define RECHECK_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "storage.hpp"
+
+namespace File
+{
+	static const long long RECHECK_CHUNK_SIZE = 8ll * 1024 * 1024; // the number of bytes a thread claims at a time while rechecking
+
+	// Hash every piece of the file at path against the concatenation of 20 byte SHA1 hashes in piece_hashes.
+	// The file is mapped read only and split into chunks that num_threads threads claim one at a time.
+	// While a thread hashes a chunk, the kernel is asked to read ahead the chunk it is likely to claim next,
+	// so that disk reads and hashing overlap.
+	// good_pieces is resized to the number of pieces, and set to 1 for every piece that matches.
+	// Progress and throughput are printed every report_interval_ms milliseconds if it is positive.
+	// return the number of pieces that match, or -1 if the file cannot be mapped
+	long long recheck_file(std::string path, long long piece_length, long long length, const std::string &piece_hashes,
+						   int num_threads, std::vector<uint8_t> &good_pieces, int report_interval_ms);
+
+	// Hash every piece of a torrent's storage in the same way as recheck_file, for downloads that cannot be
+	// mapped as a single file. Every chunk is read into a buffer of the thread that claims it, and the
+	// storage is asked to read ahead instead.
+	long long recheck_storage(Storage *storage, long long piece_length, long long length, const std::string &piece_hashes,
+							  int num_threads, std::vector<uint8_t> &good_pieces, int report_interval_ms);
+}
+
+#endif
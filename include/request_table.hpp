@@ -0,0 +1,78 @@
+#ifndef REQUEST_TABLE_HPP
+#define REQUEST_TABLE_HPP
+
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+
+namespace File
+{
+	static const int REQUEST_TIMEOUT_MS = 20000; // how long a request may go unanswered before its block is asked from another peer
+
+	// A block that was requested from a peer and has not arrived yet
+	struct InFlightRequest
+	{
+		uint32_t index;									 // the piece index of the block
+		uint32_t begin;									 // the byte offset of the block in the piece
+		uint32_t length;								 // the length of the block
+		int owner;										 // the peer that the block was requested from
+		std::chrono::steady_clock::time_point sent_time; // when the request was made
+	};
+
+	// Every block that is requested and not received yet, keyed by piece and block offset, with the peers it was
+	// requested from. Outside of endgame a block is only asked from one peer, so no bandwidth goes to duplicates.
+	// The requests of a peer that chokes us, leaves, or stops answering can be found and handed back to be asked again,
+	// and when a block arrives, the other peers it was asked from are the ones to cancel.
+	// Requests are also queued in the order they were made, so expiring them only looks at the ones that are due.
+	class RequestTable
+	{
+	private:
+		// a request in the order they were made, which may have been answered or released since
+		struct SentRequest
+		{
+			uint64_t key;									 // the key of the block
+			int owner;										 // the peer that the block was requested from
+			std::chrono::steady_clock::time_point sent_time; // when the request was made, which tells it from a later one
+		};
+
+		std::unordered_map<uint64_t, std::vector<InFlightRequest>> requests; // requests by piece index and block offset
+		std::unordered_map<int, int> owner_counts;							 // the number of requests in flight to each peer
+		std::deque<SentRequest> sent_order;									 // every request, oldest first
+
+		// the key of the block of the piece at index that starts at begin
+		static uint64_t key(uint32_t index, uint32_t begin);
+
+		// lower the count of owner by one
+		void uncount(int owner);
+
+	public:
+		// record that the block was requested from owner now, unless it already was
+		void add(uint32_t index, uint32_t begin, uint32_t length, int owner);
+
+		// forget every request for the block, because it arrived, and add them to removed
+		void remove(uint32_t index, uint32_t begin, std::vector<InFlightRequest> &removed);
+
+		// whether the block is in flight to any peer
+		bool contains(uint32_t index, uint32_t begin);
+
+		// whether the block is in flight to owner
+		bool requested_from(uint32_t index, uint32_t begin, int owner);
+
+		// forget every request made to owner, and add them to released
+		void release(int owner, std::vector<InFlightRequest> &released);
+
+		// forget every request that was made more than timeout ago, and add them to expired.
+		// Only the requests that are due, and the answered ones queued before them, are looked at
+		void expire(std::chrono::milliseconds timeout, std::vector<InFlightRequest> &expired);
+
+		// the number of requests in flight to owner
+		int count(int owner);
+
+		// the number of blocks in flight
+		size_t size();
+	};
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef RESOLVER_HPP
+#define RESOLVER_HPP
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <netinet/in.h>
+
+#include "reactor.hpp"
+
+namespace Net
+{
+	// Looks a host name up off the event loop.
+	// Each lookup runs getaddrinfo on a thread of its own, which signals an eventfd registered with the reactor when it
+	// is done, so a slow or unreachable DNS server holds up nothing but the lookup. A lookup that is cancelled, or whose
+	// resolver is destroyed, runs to its end on its thread and its result is dropped.
+	class Resolver : public Handler
+	{
+	private:
+		// the state of a lookup, shared with its thread
+		struct Lookup
+		{
+			int event_fd;			// signalled by the thread once ok and addr are set
+			std::atomic<bool> ok;	// whether the host resolved
+			sockaddr_in addr;		// the first IPv4 address of the host
+
+			Lookup(int event_fd);
+			~Lookup();
+		};
+
+		Reactor *reactor;
+		std::function<void(bool, sockaddr_in)> on_resolved; // takes whether the host resolved, and its address
+		std::shared_ptr<Lookup> lookup;						  // the lookup in progress, or nullptr
+
+	public:
+		Resolver(Reactor *reactor, std::function<void(bool, sockaddr_in)> on_resolved);
+		~Resolver();
+
+		// start looking up host and port, replacing any lookup in progress. on_resolved is called from the reactor
+		// return false if the lookup could not be started
+		bool resolve(const std::string &host, const std::string &port);
+
+		// drop the lookup in progress, if any, without calling on_resolved
+		void cancel();
+
+		// whether a lookup is in progress
+		bool busy();
+
+		void on_readable();
+	};
+}
+
+#endif
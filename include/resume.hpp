@@ -0,0 +1,45 @@
+#ifndef RESUME_HPP
+#define RESUME_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+#include "storage.hpp"
+
+namespace File
+{
+	// The state of a download that is saved next to it, so that a restart can pick up where it left off
+	// without checking every piece again. It is stored as a bencoded dictionary.
+	struct ResumeData
+	{
+		long long file_size;  // the size of the download (the total size of its files) when the state was saved
+		long long file_mtime; // the modification time of the download in nanoseconds when the state was saved
+
+		std::string piece_bits;							 // the bytes of the piece bitfield
+		std::map<uint32_t, std::string> partial_pieces;	 // bytes of the block bitfields of unfinished pieces, by piece index.
+														 // only saved when blocks are written straight to the file
+		std::vector<uint32_t> uncertain_pieces;			 // pieces that were verified, but not known to be on disk yet
+
+		ResumeData();
+
+		// read the resume data at path
+		// return false if there is no resume file, or it cannot be parsed
+		bool load(std::string path);
+
+		// write the resume data to path. The file is replaced atomically, so a crash never leaves half a file behind
+		// return false if the file cannot be written
+		bool save(std::string path);
+	};
+
+	// get the size and modification time (in nanoseconds) of the file at path
+	// return false if the file does not exist
+	bool stat_file(std::string path, long long &size, long long &mtime);
+
+	// get the total size and the latest modification time (in nanoseconds) of the files of a torrent
+	// return false if none of the files exist
+	bool stat_files(const std::vector<FileSpan> &files, long long &size, long long &mtime);
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef RING_BUFFER_HPP
+#define RING_BUFFER_HPP
+
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <sys/uio.h>
+
+namespace Util
+{
+	// A fixed size ring of bytes for a single thread, used to receive a peer's messages.
+	// The free space is handed out as at most two iovecs, so a single readv fills the ring up to
+	// the read position, and messages are framed from it afterwards.
+	class RingBuffer
+	{
+	private:
+		std::unique_ptr<uint8_t[]> data; // the ring
+		size_t ring_size;				 // the size of the ring, a power of two
+		size_t mask;					 // ring_size - 1, for wrapping positions
+		size_t head;					 // the position of the first unread byte. Positions only grow, and are wrapped on use
+		size_t tail;					 // the position after the last written byte
+
+	public:
+		// Create a ring that holds at least capacity bytes
+		RingBuffer(size_t capacity);
+
+		// the number of bytes the ring holds
+		size_t capacity();
+
+		// the number of unread bytes
+		size_t size();
+
+		// the number of bytes that can be written before the ring is full
+		size_t space();
+
+		// point iov at the free space of the ring, in order
+		// return the number of iovecs used, 0 if the ring is full
+		int free_iov(iovec iov[2]);
+
+		// mark len bytes of the free space as written
+		void commit(size_t len);
+
+		// return a pointer to the len unread bytes starting offset bytes after the read position,
+		// or nullptr if they wrap around the end of the ring
+		const uint8_t *contiguous(size_t offset, size_t len);
+
+		// copy the len unread bytes starting offset bytes after the read position into dest
+		void copy(size_t offset, uint8_t *dest, size_t len);
+
+		// mark len bytes as read
+		void consume(size_t len);
+	};
+}
+
+#endif
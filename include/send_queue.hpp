@@ -0,0 +1,60 @@
+#ifndef SEND_QUEUE_HPP
+#define SEND_QUEUE_HPP
+
+#include <deque>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+#include "storage.hpp"
+
+namespace Net
+{
+	static const size_t SEND_HIGH_WATER = 1024 * 1024; // unsent bytes for a peer past which we stop generating requests and blocks for it
+	static const int SEND_MAX_IOV = 64;				   // the most slices written by a single call
+
+	// The bytes waiting to be written to a nonblocking socket, as a queue of slices.
+	// A slice is either bytes that the queue owns, such as a packed message, or a range of a torrent's storage
+	// that is sent from the page cache with sendfile. Byte slices that are next to each other are written with a
+	// single call, and a partly written slice keeps its offset, so the queue is flushed again whenever the socket
+	// becomes writable.
+	class SendQueue
+	{
+	private:
+		struct Slice
+		{
+			std::unique_ptr<uint8_t[]> data; // the bytes to write, or nullptr for a range of storage
+			File::Storage *storage;			 // the storage that the range is in
+			long long offset;				 // the byte offset of the range in the storage
+			size_t length;					 // the number of bytes in the slice
+			size_t sent;					 // the number of bytes of the slice that were written
+		};
+
+		std::deque<Slice> slices;
+		size_t queued; // the number of unsent bytes
+
+	public:
+		SendQueue();
+
+		// queue length bytes owned by data
+		void push(std::unique_ptr<uint8_t[]> data, size_t length);
+
+		// queue length bytes of storage, starting at offset
+		void push_file(File::Storage *storage, long long offset, size_t length);
+
+		// the number of unsent bytes
+		size_t size();
+
+		bool empty();
+
+		// whether so many bytes are waiting that nothing more should be generated for this socket
+		bool above_high_water();
+
+		// write as much of the queue to the nonblocking socket sock_fd as it takes without blocking, but no more than
+		// limit bytes. The bytes written from ranges of storage are added to storage_sent, if it is given
+		// return false if the socket failed
+		bool flush(int sock_fd, size_t limit = SIZE_MAX, size_t *storage_sent = nullptr);
+	};
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef SESSION_HPP
+#define SESSION_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <deque>
+#include <chrono>
+
+#include "peer.hpp"
+#include "reactor.hpp"
+#include "send_queue.hpp"
+#include "token_bucket.hpp"
+#include "message.hpp"
+#include "file.hpp"
+
+namespace Peer
+{
+	static const size_t RECV_BUFFER_SIZE = 256 * 1024; // the size of a peer's receive ring, which holds a few blocks
+	static const int RTT_SAMPLE_INTERVAL_MS = 1000;	   // how often the round trip time to a peer is read from its socket
+	static const double REQUEST_QUEUE_GAIN = 2.0;	   // the number of bandwidth-delay products of requests kept outstanding with a peer.
+													   // more than one, so that a peer whose queue is full can show that it is faster
+
+	// State shared by every session of a torrent
+	struct SessionContext
+	{
+		File::Torrent *torrent;			 // the torrent that the sessions download and seed
+		Net::Reactor *reactor;			 // the event loop that the sessions' sockets are registered with
+		std::string info_hash;			 // the 20 byte info hash that peers must handshake with
+		std::string client_id;			 // our peer id
+		int outgoing_request_queue_size;	 // the fewest requests we keep outstanding with a single peer
+		int max_outgoing_request_queue_size; // the most requests we keep outstanding with a single peer
+		int incoming_request_queue_size; // the most requests from a single peer that wait to be served
+		Util::BandwidthLimit *global_limit;	 // the rate limits shared with every other torrent, or nullptr
+		Util::BandwidthLimit torrent_limit;	 // the rate limits of this torrent
+		long long peer_upload_limit;		 // the upload limit that new sessions start with, in bytes per second, 0 for unlimited
+		long long peer_download_limit;		 // the download limit that new sessions start with, in bytes per second, 0 for unlimited
+		std::vector<int> closed;		 // sockets of sessions that closed since the owner last removed them
+		bool interest_changed;			 // whether a peer became interested or not interested since the owner last checked
+	};
+
+	// A connection to a single peer, driven by readiness events from the reactor.
+	// The session reads and dispatches the peer's messages as they arrive, and pump() sends whatever the
+	// state of the connection and the torrent call for: our handshake, interest, requests and the blocks the
+	// peer asked for. Whether the peer is choked is decided by the owner's choker. Messages go through a send queue that is flushed without blocking, and nothing
+	// new is generated for a peer whose queue is above its high water mark.
+	class Session : public Net::Handler
+	{
+	private:
+		SessionContext &context;
+		bool is_closed;
+
+		std::vector<uint8_t> scratch; // holds a message that wraps around the end of the receive ring
+
+		// a piece message whose block is being received straight into its destination
+		struct IncomingBlock
+		{
+			bool active;	   // whether the rest of a block is expected before any other message
+			uint32_t index;	   // the index of the piece
+			uint32_t begin;	   // the byte offset of the block in the piece
+			uint32_t length;   // the length of the block
+			uint32_t received; // the number of bytes of the block that were received
+		};
+		IncomingBlock incoming_block;
+
+		double rtt_ms;									  // the round trip time to the peer that the kernel measured, 0 if unknown
+		std::chrono::steady_clock::time_point rtt_sampled; // when rtt_ms was last read
+		int request_depth;								  // the number of requests to keep outstanding with the peer
+		bool throttled;									  // whether a read or write stopped because a rate limit ran out.
+														  // the socket is not drained, so it raises no new event until refill()
+
+		Net::SendQueue send_queue;			   // messages waiting to be written to the peer
+		std::deque<File::Block> peer_requests; // blocks the peer requested that are not in the send queue yet
+		size_t have_cursor;					   // the torrent's finished pieces up to here were sent to the peer, in our bitfield or as haves
+
+		// read everything the socket has into the receive ring, handling every message that completes. Reading stops
+		// early when a download limit runs out, which leaves the bytes in the socket so that TCP pushes back on the peer
+		// return false if the connection was closed
+		bool receive();
+
+		// handle every complete message in the receive ring, and drop them from it
+		// return false if the connection was closed
+		bool frame_messages();
+
+		// if the message at the front of the receive ring is a piece message whose header has arrived but whose block
+		// has not, move the part of the block that is buffered to its destination and receive the rest there
+		// return whether the block is now received directly
+		bool start_incoming_block(size_t length);
+
+		// account for received bytes of the incoming block, and write the block once all of it is there
+		void advance_incoming_block(size_t received);
+
+		// act on the peer's handshake, the length bytes at msg
+		void handle_handshake(const uint8_t *msg, size_t length);
+
+		// act on a message, given the len bytes that follow its length prefix, starting with its id
+		void handle_message(const uint8_t *msg, uint32_t len);
+
+		// queue a packed message to be sent, and free it
+		void queue_message(Messages::Buffer *buff);
+
+		// size the request queue to the peer's bandwidth-delay product: the rate it sends at times the round trip time,
+		// in blocks, with some headroom, between the context's floor and ceiling
+		void update_request_depth();
+
+		// queue our handshake, if it has not been sent yet
+		void queue_handshake();
+
+		// queue the blocks the peer requested, while the send queue is below its high water mark
+		void serve_requests();
+
+		// write as much of the send queue as the socket and the upload limits take
+		// return false if the connection was closed
+		bool flush();
+
+	public:
+		PeerClient peer;			 // the state of the peer on the other end
+		Util::BandwidthLimit limit; // the rate limits of this peer alone
+
+		// Create a session for the peer, whose socket is nonblocking and either connected or connecting,
+		// and register the socket with the context's reactor
+		Session(SessionContext &context, PeerClient peer);
+		~Session();
+
+		void on_readable();
+		void on_writable();
+		void on_error();
+
+		// queue the messages that the state of the connection calls for, and flush the send queue
+		void pump();
+
+		// stop watching the socket and report it to the owner, who destroys the session after the reactor's round
+		void close_session(std::string reason);
+
+		// whether the connection has been closed
+		bool closed();
+
+		// add tokens to the peer's buckets for elapsed_ms milliseconds, after the global and torrent buckets were refilled,
+		// and carry on with a read or write that a limit stopped
+		void refill(long long elapsed_ms);
+
+		// choke or unchoke the peer, if it is not already. Choking it discards the blocks it requested
+		void set_choking(bool choke);
+
+		// a line describing the peer's transfer rates, round trip time and request queue
+		std::string stats();
+	};
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+namespace Util
+{
+	// A bounded lock free queue for exactly one producer thread and one consumer thread.
+	// Slots live in a ring whose size is a power of two, and the producer and consumer
+	// only ever publish their own index, so neither side takes a lock.
+	template <typename T>
+	class SpscQueue
+	{
+	private:
+		std::vector<T> slots; // the ring of slots
+		size_t mask;		  // slots.size() - 1, for wrapping indices
+
+		alignas(64) std::atomic<size_t> head; // the next slot to pop. Only written by the consumer
+		alignas(64) std::atomic<size_t> tail; // the next slot to push. Only written by the producer
+
+	public:
+		// Create a queue that holds at least capacity items
+		SpscQueue(size_t capacity)
+		{
+			size_t size = 1;
+			while (size < capacity)
+			{
+				size <<= 1;
+			}
+			slots = std::vector<T>(size);
+			mask = size - 1;
+			head.store(0);
+			tail.store(0);
+		}
+
+		// push an item, called by the producer
+		// return false if the queue is full
+		bool push(T item)
+		{
+			size_t t = tail.load(std::memory_order_relaxed);
+			if (t - head.load(std::memory_order_acquire) == slots.size())
+			{
+				return false;
+			}
+			slots[t & mask] = std::move(item);
+			tail.store(t + 1, std::memory_order_release);
+			return true;
+		}
+
+		// pop an item into item, called by the consumer
+		// return false if the queue is empty
+		bool pop(T &item)
+		{
+			size_t h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire))
+			{
+				return false;
+			}
+			item = std::move(slots[h & mask]);
+			head.store(h + 1, std::memory_order_release);
+			return true;
+		}
+
+		// check if the queue is empty. Only a hint when called from the producer
+		bool empty()
+		{
+			return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef STORAGE_HPP
+#define STORAGE_HPP
+
+#include <string>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+#include <sys/uio.h>
+#include <sys/types.h>
+
+namespace File
+{
+	static const int DEFAULT_MAX_OPEN_FILES = 128; // default number of files that a multi file torrent keeps open at once
+
+	// How a torrent stores its downloaded data on disk
+	enum StorageMode
+	{
+		PWRITE, // pieces are buffered in memory, then written to the file once verified
+		MMAP	// the file is preallocated and mapped, and blocks are written straight to their final offset
+	};
+
+	// The backing store for a torrent's data.
+	// All offsets are byte offsets from the start of the torrent.
+	class Storage
+	{
+	public:
+		virtual ~Storage() {}
+
+		// write len bytes from src to the torrent starting at offset
+		// return true if all bytes were written
+		virtual bool write(long long offset, const uint8_t *src, size_t len) = 0;
+
+		// write the iovcnt buffers in iov back to back, starting at offset
+		// return true if all bytes were written
+		virtual bool writev(long long offset, const iovec *iov, int iovcnt) = 0;
+
+		// read len bytes of the torrent starting at offset into dst
+		// return true if all bytes were read
+		virtual bool read(long long offset, uint8_t *dst, size_t len) = 0;
+
+		// flush written data to the disk
+		virtual void sync() = 0;
+
+		// send at most len bytes of the torrent starting at offset to the nonblocking socket sock_fd, straight from
+		// the page cache with sendfile. Sends fewer bytes when the socket is full, or at the end of a file.
+		// return the number of bytes sent, or -1 with errno set (EAGAIN if the socket is full)
+		virtual ssize_t send(int sock_fd, long long offset, size_t len) = 0;
+
+		// return a pointer to the mapped bytes at offset, or nullptr if this storage is not memory mapped
+		virtual uint8_t *mapped([[maybe_unused]] long long offset) { return nullptr; }
+
+		// ask the kernel to start reading len bytes starting at offset, because we will read them soon
+		virtual void prefetch([[maybe_unused]] long long offset, [[maybe_unused]] long long len) {}
+	};
+
+	// A file of a torrent, and where its bytes are within the torrent
+	struct FileSpan
+	{
+		std::string path; // where the file is saved
+		long long offset; // the byte offset in the torrent where the file starts
+		long long length; // the length of the file in bytes
+	};
+
+	// Storage backed by a single file that is written with pwrite and read with pread
+	class FileStorage : public Storage
+	{
+	private:
+		int fd;			  // the file descriptor of the output file
+		long long length; // the length of the file in bytes
+
+	public:
+		// Open (or create) the file at path and size it to length bytes. Existing data is kept.
+		FileStorage(std::string path, long long length);
+		~FileStorage();
+
+		bool write(long long offset, const uint8_t *src, size_t len);
+		bool writev(long long offset, const iovec *iov, int iovcnt);
+		bool read(long long offset, uint8_t *dst, size_t len);
+		void sync();
+		ssize_t send(int sock_fd, long long offset, size_t len);
+		void prefetch(long long offset, long long len);
+	};
+
+	// Storage backed by a preallocated file that is mapped into memory.
+	// Blocks are copied straight into the mapped pages, and hashing and seeding read from them,
+	// so no piece buffers are needed.
+	class MmapStorage : public Storage
+	{
+	private:
+		int fd;			  // the file descriptor of the output file
+		long long length; // the length of the file (and the mapping) in bytes
+		uint8_t *base;	  // the start of the mapping
+
+	public:
+		// Open (or create) the file at path, preallocate length bytes and map it read/write. Existing data is kept.
+		MmapStorage(std::string path, long long length);
+		~MmapStorage();
+
+		bool write(long long offset, const uint8_t *src, size_t len);
+		bool writev(long long offset, const iovec *iov, int iovcnt);
+		bool read(long long offset, uint8_t *dst, size_t len);
+		void sync();
+		ssize_t send(int sock_fd, long long offset, size_t len);
+		uint8_t *mapped(long long offset);
+		void prefetch(long long offset, long long len);
+	};
+
+	// An LRU cache of open file descriptors for the files of a torrent, so that torrents with more files than
+	// we may keep open still work. Files are opened on first use, and the least recently used file that no
+	// thread is using is closed when the cache is full. Safe to use from several threads.
+	class FileHandleCache
+	{
+	private:
+		struct Handle
+		{
+			int fd;								 // the open file descriptor, or -1 if the file is closed
+			int users;							 // the number of threads using fd, a file in use is never closed
+			bool dirty;							 // whether fd was written to since it was last synced
+			std::list<uint32_t>::iterator lru_pos; // where the file is in lru, if it is open
+		};
+
+		const std::vector<FileSpan> &files; // the files that handles are opened for
+		size_t capacity;					// the most files kept open when none of them are in use
+		std::vector<Handle> handles;		// handles by file index
+		std::list<uint32_t> lru;			// indices of open files, most recently used first
+		std::mutex mutex;
+
+		// close the least recently used files that are not in use until there is room for another one
+		void evict();
+
+	public:
+		FileHandleCache(const std::vector<FileSpan> &files, size_t capacity);
+		~FileHandleCache();
+
+		// return an open file descriptor for the file at index, which stays open until it is released.
+		// writing marks the file so that sync flushes it
+		int acquire(uint32_t index, bool writing);
+
+		// stop using the file descriptor of the file at index
+		void release(uint32_t index);
+
+		// flush every open file that was written to. Files are also flushed before they are closed
+		void sync();
+	};
+
+	// Storage backed by the files of a multi file torrent, which are laid back to back to form the torrent.
+	// The file that holds an offset is found with a binary search over the sorted file offsets, so a write that
+	// crosses file boundaries becomes one pwrite per file it touches.
+	class MultiFileStorage : public Storage
+	{
+	private:
+		std::vector<FileSpan> files;		 // the files of the torrent, sorted by offset
+		std::vector<long long> file_starts; // the offset of every file, for the binary search
+		FileHandleCache handles;			 // open file descriptors of recently used files
+
+		// the index of the first non empty file that holds the byte at offset
+		uint32_t file_at(long long offset);
+
+		// call op(file index, offset in the file, offset in the range, length) for every piece of the
+		// len bytes starting at offset that falls in a single file.
+		// return false if the range is out of bounds or op returns false
+		template <typename Op>
+		bool for_each_span(long long offset, long long len, Op op);
+
+	public:
+		// Create the directories and files of the torrent, and size every file. Existing data is kept.
+		// At most max_open_files files are kept open at once.
+		MultiFileStorage(std::vector<FileSpan> files, int max_open_files);
+
+		bool write(long long offset, const uint8_t *src, size_t len);
+		bool writev(long long offset, const iovec *iov, int iovcnt);
+		bool read(long long offset, uint8_t *dst, size_t len);
+		void sync();
+		ssize_t send(int sock_fd, long long offset, size_t len);
+		void prefetch(long long offset, long long len);
+	};
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef TOKEN_BUCKET_HPP
+#define TOKEN_BUCKET_HPP
+
+#include <initializer_list>
+
+namespace Util
+{
+	static const int REFILL_INTERVAL_MS = 100; // how often the owner refills every bucket
+	static const int BUCKET_BURST_MS = 250;	   // the most time's worth of tokens that a bucket saves up while it is idle
+
+	// Limits a transfer to a rate in bytes per second.
+	// The bucket holds tokens, one per byte, that are spent as bytes are transferred and added back on a timer by
+	// refill(). A transfer takes at most the tokens that are available, so checking and spending them is a few
+	// integer operations, cheap enough for every send and receive. A bucket with a rate of 0 is unlimited.
+	class TokenBucket
+	{
+	private:
+		long long limit;  // bytes per second, 0 for unlimited
+		long long burst;  // the most tokens the bucket holds
+		long long tokens; // the bytes that can be transferred before the next refill
+
+	public:
+		// create a bucket for bytes_per_second, 0 for unlimited, that starts full
+		TokenBucket(long long bytes_per_second = 0);
+
+		// change the rate, keeping the tokens that fit the new burst
+		void set_rate(long long bytes_per_second);
+
+		// the rate in bytes per second, 0 if unlimited
+		long long rate();
+
+		// add the tokens for elapsed_ms milliseconds, up to the burst
+		void refill(long long elapsed_ms);
+
+		// the number of bytes that can be transferred now, LLONG_MAX if unlimited
+		long long available();
+
+		// spend tokens for bytes that were transferred
+		void consume(long long bytes);
+	};
+
+	// The buckets for both directions of a scope: everything, a torrent or a peer
+	struct BandwidthLimit
+	{
+		TokenBucket upload;	  // bytes we send
+		TokenBucket download; // bytes we receive
+	};
+
+	// the number of bytes that every one of the buckets allows now. Null buckets are skipped
+	long long available(std::initializer_list<TokenBucket *> buckets);
+
+	// spend tokens from every one of the buckets. Null buckets are skipped
+	void consume(std::initializer_list<TokenBucket *> buckets, long long bytes);
+}
+
+#endif
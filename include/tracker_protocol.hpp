@@ -2,79 +2,256 @@
 #define TRACKER_PROTOCOL_HPP
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <functional>
 #include <curl/curl.h>
 
 #include "bencode.hpp"
 #include "peer.hpp"
 #include "metainfo.hpp"
 #include "net_utils.hpp"
+#include "reactor.hpp"
+#include "http_response.hpp"
+#include "resolver.hpp"
 
 namespace TrackerProtocol {
     const int HTTP_HEADER_MAX_SIZE = 10 * 1024; // set an arbitrary maximum size for an HTTP header from tracker
-	const int HTTP_MAX_SIZE = 10 * 1024; // set an arbitrary maximum size for an HTTP message from tracker
+	const int HTTP_MAX_SIZE = 1024 * 1024; // the largest body of an HTTP response from a tracker, tens of thousands of peers
 	const int HTTP_OK = 200; // status code for HTTP OK
-	
-	sockaddr_in get_tracker_addr(const std::string announce_url);
+
+	const int DEFAULT_INTERVAL = 30 * 60;		// seconds between announces, for a tracker that does not say
+	const int ANNOUNCE_TIMEOUT = 30;			// seconds an announce may take before it is given up on
+	const int EARLY_ANNOUNCE_MIN = 5 * 60;		// the fewest seconds between announces of a torrent short of peers, to a tracker without a min interval
+	const int MIN_INTERVAL_FLOOR = 60;			// the fewest seconds between announces, whatever min interval a tracker asks for
+	const int RETRY_BACKOFF_MIN = 15;			// seconds before the first retry of a failed announce, doubled for each failure after
+	const int RETRY_BACKOFF_MAX = 30 * 60;		// the most seconds between retries of a failed announce
+	const int RESOLVE_TTL = 30 * 60;			// seconds that the address of a tracker's host is used before it is looked up again
+
+	// get the host of announce_url, and its port or the default port of its scheme
+	// return false if the url could not be parsed
+	bool get_tracker_host(const std::string announce_url, std::string *host, std::string *port);
 
     // Event types for a tracker request that is sent by the client -> tracker
 	enum EventType {
-		STARTED, 
+		STARTED,
 		STOPPED,
 		COMPLETED,
 		EMPTY // same as unspecified
 	};
 
-	struct TrackerManager { 
+	// The totals of the torrent that an announce reports, read when the announce is sent
+	struct AnnounceStats {
+		long long uploaded;
+		long long downloaded;
+		long long left;
+	};
 
+	// A tracker that a torrent announces to, over and over, from the event loop.
+	// The announce itself is a nonblocking exchange that a subclass drives with readiness events from the reactor.
+	// This class decides when to announce: right away for an event, every interval after a successful announce, and
+	// after a growing backoff when one fails or times out. Events are sent in order, and each is retried until the
+	// tracker takes it, except STOPPED, which is only tried once.
+	class Tracker : public Net::Handler {
+	protected:
 		// Request fields
+		std::string announce_url;
 		std::string info_hash;
 		std::string peer_id;
-		std::string uploaded;
-		std::string downloaded;
-		std::string left;
-		std::string announce_url; 
-
 		int client_port; 			// port number that the client is listening on, must be between 6881-6889
-		int compact;		
-		int no_peer_id; 	
 
-		EventType event; 	
+		Net::Reactor *reactor;
+		std::function<AnnounceStats()> get_stats;							  // reads the totals to report
+		std::function<void(std::vector<Peer::PeerClient> &)> on_peers;		  // takes the peers of a response
+
+		std::deque<EventType> events; 	 // events that the tracker was not told about yet, the front one first
+		bool in_progress;				 // whether an announce is being exchanged
+		bool started;					 // whether the tracker took our STARTED event
+		bool stopped;					 // whether we announced STOPPED, after which there are no regular announces
+		int failures;					 // announces that failed in a row
+		std::chrono::steady_clock::time_point next_announce; // when the next regular announce is due
+		std::chrono::steady_clock::time_point last_announce; // when the last announce succeeded
+		std::chrono::steady_clock::time_point deadline;		  // when the announce in progress times out
+
+		sockaddr_in tracker_addr;								  // the address of the tracker's host, valid while address_cached()
+		bool address_known;										  // whether tracker_addr was looked up, and no announce failed since
+		std::chrono::steady_clock::time_point address_expires;  // when tracker_addr is looked up again
+		Net::Resolver resolver;									  // looks the tracker's host up off the event loop
+
+		// whether tracker_addr can be used without looking the host up
+		bool address_cached();
+
+		// start looking the tracker's host up, after which on_address() is called, or the announce fails
+		// return false if the url is bad or the lookup could not be started
+		bool resolve();
+
+		// the lookup that resolve() started finished
+		void resolved(bool ok, sockaddr_in addr);
+
+		// tracker_addr was looked up for the announce in progress, so carry on with it
+		virtual void on_address() = 0;
+
+		// the event of the announce that is due, EMPTY for a regular one
+		EventType current_event();
+
+		// start an announce of event with the stats, without blocking
+		// return false if it could not be started
+		virtual bool start(EventType event, AnnounceStats stats) = 0;
 
+		// give up on the announce in progress, if any, and release its socket
+		virtual void abort() = 0;
+
+		// the seconds an announce may take before it is given up on
+		virtual int announce_timeout();
+
+		// called on every tick(), for subclasses that keep timers of their own
+		virtual void on_tick() {}
+
+		// the subclass got a response, whose fields are filled in. Hand its peers on and schedule the next announce
+		void succeeded(std::vector<Peer::PeerClient> &peers);
+
+		// the announce in progress failed, retry it after a backoff
+		void failed(std::string reason);
+
+		// start the announce that is due
+		void begin();
+
+	public:
 		// Response fields
-		std::string failure_reason; 
-		std::string tracker_id;  
+		std::string failure_reason;
+		std::string tracker_id;
 
-		int interval;  
+		int interval;
 		int min_interval;
-		int num_seeders;  
-		int num_leechers;  
-		
-		std::vector<Peer::PeerClient> peers; // peers we got from a response
-		
-		// tcp stuff 
+		int num_seeders;
+		int num_leechers;
+
+		Tracker(std::string announce_url, std::string info_hash, std::string peer_id, int client_port, Net::Reactor *reactor,
+				std::function<AnnounceStats()> get_stats, std::function<void(std::vector<Peer::PeerClient> &)> on_peers);
+		virtual ~Tracker() {}
+
+		// tell the tracker about an event as soon as the announces before it are done. STOPPED drops every event
+		// that was not sent yet, and is not sent at all if the tracker never took our STARTED
+		void announce(EventType event);
+
+		// start an announce that is due, and time out one that took too long. Called from the event loop at least
+		// once a second. A torrent that wants more peers may announce before interval is up: after min_interval, if
+		// the tracker sent one, or else after a quarter of interval, but never sooner than EARLY_ANNOUNCE_MIN
+		void tick(bool want_peers);
+
+		// the seconds after a successful announce that a torrent short of peers waits before it announces again
+		int early_announce_gap();
+
+		// whether an announce is in progress or waiting to be sent
+		bool busy();
+
+		// whether an announce is being exchanged
+		bool announcing();
+
+		// whether the tracker took our STARTED and its last announce succeeded
+		bool working();
+
+		// whether the last announce failed
+		bool failing();
+
+		std::string get_announce_url();
+	};
+
+	// A tracker that is announced to with an HTTP GET.
+	// The response is parsed as it arrives, and the connection is kept for the next announce if the tracker allows it
+	class HttpTracker : public Tracker {
+	private:
+		// tcp stuff
 		int sock;
-		sockaddr_in tracker_addr;
+		bool connected;				 // whether the connect of sock finished
+		bool idle;					 // whether sock is a kept-alive connection with no announce on it
+		bool reused;				 // whether the announce in progress went out on a kept-alive connection
+		std::string request;		 // the request being sent
+		size_t request_sent;		 // the bytes of the request that were sent
+		HttpResponse response;		 // the response, parsed as far as it arrived
 
-		// bool flags for state
-		bool sent_completed;
+		bool start(EventType event, AnnounceStats stats);
+		void abort();
+		void on_address();
+
+		// start a nonblocking connect to the tracker's address
+		// return false if it could not be started
+		bool open_connection();
+
+		// close the connection, if there is one
+		void close_connection();
+
+		// send as much of the request as the socket takes
+		// return false if the socket failed
+		bool send_request();
+
+		// read what the socket has, and finish the announce once the whole response arrived
+		void recv_response();
+
+		// finish the announce with the complete response
+		void finish_response();
 
-		TrackerManager(std::string torrent_file, std::string p_id, int c_port);
+	public:
+		HttpTracker(std::string announce_url, std::string info_hash, std::string peer_id, int client_port, Net::Reactor *reactor,
+					std::function<AnnounceStats()> get_stats, std::function<void(std::vector<Peer::PeerClient> &)> on_peers);
+		~HttpTracker();
 
-		// given the fields for this Tracker, construct an HTTP string 
+		void on_readable();
+		void on_writable();
+		void on_error();
+
+		// given the fields for this Tracker, construct an HTTP string
 		// that will be sent
-		std::string construct_http_string();
+		std::string construct_http_string(EventType event, AnnounceStats stats);
+
+		// given a bencoded response payload, update fields for this Tracker and add its peers
+		// return false if the payload is not a valid response, or the tracker refused the announce
+		bool parse_payload(std::string payload, std::vector<Peer::PeerClient> &peers);
+	};
+
+	// create the tracker for announce_url, over UDP for a udp:// url and over HTTP otherwise
+	std::unique_ptr<Tracker> create_tracker(std::string announce_url, std::string info_hash, std::string peer_id, int client_port, Net::Reactor *reactor,
+											std::function<AnnounceStats()> get_stats, std::function<void(std::vector<Peer::PeerClient> &)> on_peers);
+
+	// The trackers of a torrent, in the tiers of its announce-list (BEP 12).
+	// Tiers are used in order: a tier is only announced to once every tracker of the tiers before it failed, and the
+	// tiers after it are dropped again when it works. Within a tier, whose urls are shuffled on load, every tracker is
+	// announced to at once, so the first peers come from the fastest of them rather than after the timeouts of the slow
+	// ones. The first to answer moves to the front of the tier and takes the regular announces on its own, while the
+	// others stand by until it fails.
+	class TrackerManager {
+	private:
+		std::vector<std::vector<std::unique_ptr<Tracker>>> tiers;
+		size_t activated; // the number of tiers, from the first, that were announced to
+		bool stopping;	  // whether we announced STOPPED, after which no tier is started
+
+		// tick the trackers of the activated tiers from index from on, that have an exchange in progress
+		void tick_announcing(size_t from, bool want_peers);
 
-		// given an HTTP response packed into a string, parse and 
-		// update fields for this Tracker
-		void parse_payload(std::string payload);
+		// tick the trackers of a tier that are due to announce, and promote the first that works
+		// return whether the tier works, so that the tiers after it are not needed
+		bool tick_tier(std::vector<std::unique_ptr<Tracker>> &tier, bool want_peers);
 
-		// send the HTTP request over the socket
-		void send_http();
+	public:
+		// create the trackers that the metainfo lists. Peers from their responses are handed to on_peers
+		TrackerManager(std::string metainfo_buffer, std::string peer_id, int client_port, Net::Reactor *reactor,
+					   std::function<AnnounceStats()> get_stats, std::function<void(std::vector<Peer::PeerClient> &)> on_peers);
 
-		// recv the HTTP response over the socket
-		void recv_http();
+		// tell every tracker of the tiers in use about an event
+		void announce(EventType event);
+
+		// let every tracker announce when it is due
+		void tick(bool want_peers);
+
+		// whether any tracker has an announce in progress or waiting
+		bool busy();
+
+		// bool flags for state
+		bool sent_completed;
 	};
 }
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,109 @@
+#ifndef UDP_TRACKER_HPP
+#define UDP_TRACKER_HPP
+
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstdint>
+
+#include "tracker_protocol.hpp"
+
+namespace TrackerProtocol {
+	const uint64_t UDP_PROTOCOL_ID = 0x41727101980ull;	// the magic constant that a connect request starts with
+	const int UDP_CONNECTION_ID_LIFETIME = 60;			// seconds that a connection id from the tracker may be used for
+	const int UDP_RETRANSMIT_BASE_MS = 3000;			// milliseconds before a lost request is sent again, doubled for each resend
+	const int UDP_MAX_ATTEMPTS = 4;						// times a request is sent before the exchange is given up on
+	const int UDP_MAX_PACKET = 65507;					// the largest UDP payload over IPv4, so that no response is cut short
+
+	// actions of the UDP tracker protocol
+	enum UdpAction {
+		UDP_CONNECT = 0,
+		UDP_ANNOUNCE = 1,
+		UDP_SCRAPE = 2,
+		UDP_ERROR = 3
+	};
+
+	// A tracker that is announced to over UDP, as in BEP 15.
+	// An exchange is a request datagram and its response. Before announcing or scraping, the client gets a connection
+	// id from the tracker with a connect exchange, and reuses the id until it expires after a minute, so most announces
+	// are a single round trip. A request that gets no response is sent again after a timeout that doubles each time,
+	// and the exchange fails after a few attempts. The socket is created on first use and stays registered with the reactor.
+	// Halfway between two announces, while the tracker is otherwise idle, the torrent is scraped for its swarm counts.
+	class UdpTracker : public Tracker {
+	private:
+		// the exchange that a connect is made for
+		enum Operation {
+			NONE,
+			ANNOUNCE,
+			SCRAPE
+		};
+
+		int sock;
+
+		uint64_t connection_id;											 // the id the tracker gave us, valid until connection_expires
+		std::chrono::steady_clock::time_point connection_expires;	 // when connection_id has to be renewed
+		bool has_connection_id;
+
+		Operation operation;				   // the exchange in progress
+		bool connecting;					   // whether the request in flight is the connect that operation waits on
+		uint32_t transaction_id;			   // the id of the request in flight, which its response echoes
+		std::vector<uint8_t> packet;		   // the request in flight, kept to be sent again
+		std::vector<uint8_t> datagram;		   // holds a response, as large as a datagram can be
+		int attempts;						   // the times the request in flight was sent
+		int retransmit_base_ms;				   // milliseconds before the first resend of a request
+		std::chrono::steady_clock::time_point retransmit_at; // when the request in flight is sent again
+		bool scrape_due;					   // whether a scrape is scheduled since the last announce
+		std::chrono::steady_clock::time_point scrape_at;	 // when the scheduled scrape is sent
+
+		EventType announce_event;			   // the event of the announce in progress
+		AnnounceStats announce_stats;		   // the totals of the announce in progress
+		uint32_t key;						   // a random key that identifies us to the tracker if our address changes
+		std::mt19937 rng;
+
+		bool start(EventType event, AnnounceStats stats);
+		void abort();
+		int announce_timeout();
+		void on_tick();
+		void on_address();
+
+		// create the socket, connected to the tracker's address
+		// return false if it could not be created
+		bool open_socket();
+
+		// close the socket, if there is one
+		void close_socket();
+
+		// send the request for operation, or the connect that has to come first
+		void send_request();
+
+		// start sending the request in packet, under a new transaction id
+		void begin_exchange();
+
+		// send the request in packet, and schedule its resend
+		void transmit();
+
+		// act on a datagram from the tracker
+		void handle_response(const uint8_t *data, size_t length);
+
+		// the exchange in progress failed
+		void fail_operation(std::string reason);
+
+	public:
+		int num_completed; // the number of peers that finished the torrent, from the last scrape
+
+		UdpTracker(std::string announce_url, std::string info_hash, std::string peer_id, int client_port, Net::Reactor *reactor,
+				   std::function<AnnounceStats()> get_stats, std::function<void(std::vector<Peer::PeerClient> &)> on_peers,
+				   int retransmit_base_ms = UDP_RETRANSMIT_BASE_MS);
+		~UdpTracker();
+
+		void on_readable();
+
+		// ask the tracker for the torrent's seeders, leechers and completed downloads, which fill num_seeders,
+		// num_leechers and num_completed when the response arrives. Called from tick() halfway to the next announce
+		// return false if an announce is in progress, or the tracker could not be reached
+		bool scrape();
+	};
+}
+
+#endif
@@ -0,0 +1,281 @@
+#include "bit_ops.hpp"
+
+#include <bit>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BIT_OPS_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+// the across-vector reductions are AArch64 only, so 32 bit ARM uses the portable kernels
+#include <arm_neon.h>
+#define BIT_OPS_NEON 1
+#endif
+
+namespace Util
+{
+    // the kernels picked for this processor
+    struct Kernels
+    {
+        size_t (*first_word_and_not)(const uint64_t *, const uint64_t *, size_t);
+        size_t (*first_word_not_full)(const uint64_t *, size_t);
+        size_t (*first_word_nonzero)(const uint64_t *, size_t);
+        size_t (*popcount_words)(const uint64_t *, size_t);
+        void (*and_not_words)(uint64_t *, const uint64_t *, size_t);
+        const char *isa;
+    };
+
+    // ----------------------PORTABLE -----------------------------
+
+    static size_t portable_first_word_and_not(const uint64_t *want, const uint64_t *have, size_t num_words)
+    {
+        for (size_t i = 0; i < num_words; i++)
+        {
+            if ((want[i] & ~have[i]) != 0)
+            {
+                return i;
+            }
+        }
+        return num_words;
+    }
+
+    static size_t portable_first_word_not_full(const uint64_t *words, size_t num_words)
+    {
+        for (size_t i = 0; i < num_words; i++)
+        {
+            if (words[i] != ~0ull)
+            {
+                return i;
+            }
+        }
+        return num_words;
+    }
+
+    static size_t portable_first_word_nonzero(const uint64_t *words, size_t num_words)
+    {
+        for (size_t i = 0; i < num_words; i++)
+        {
+            if (words[i] != 0)
+            {
+                return i;
+            }
+        }
+        return num_words;
+    }
+
+    static size_t portable_popcount_words(const uint64_t *words, size_t num_words)
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < num_words; i++)
+        {
+            count += std::popcount(words[i]);
+        }
+        return count;
+    }
+
+    static void portable_and_not_words(uint64_t *dest, const uint64_t *src, size_t num_words)
+    {
+        for (size_t i = 0; i < num_words; i++)
+        {
+            dest[i] &= ~src[i];
+        }
+    }
+
+#ifdef BIT_OPS_X86
+    // ----------------------AVX2 -----------------------------
+    // each loop handles four words with one instruction, and leaves the tail to the portable version
+
+    __attribute__((target("avx2"))) static size_t avx2_first_word_and_not(const uint64_t *want, const uint64_t *have, size_t num_words)
+    {
+        size_t i = 0;
+        for (; i + 4 <= num_words; i += 4)
+        {
+            __m256i w = _mm256_loadu_si256((const __m256i *)(want + i));
+            __m256i h = _mm256_loadu_si256((const __m256i *)(have + i));
+
+            // testc is set when every bit of w is also set in h
+            if (!_mm256_testc_si256(h, w))
+            {
+                break;
+            }
+        }
+        return i + portable_first_word_and_not(want + i, have + i, num_words - i);
+    }
+
+    __attribute__((target("avx2"))) static size_t avx2_first_word_not_full(const uint64_t *words, size_t num_words)
+    {
+        __m256i ones = _mm256_set1_epi64x(-1);
+        size_t i = 0;
+        for (; i + 4 <= num_words; i += 4)
+        {
+            __m256i w = _mm256_loadu_si256((const __m256i *)(words + i));
+            if (!_mm256_testc_si256(w, ones))
+            {
+                break;
+            }
+        }
+        return i + portable_first_word_not_full(words + i, num_words - i);
+    }
+
+    __attribute__((target("avx2"))) static size_t avx2_first_word_nonzero(const uint64_t *words, size_t num_words)
+    {
+        size_t i = 0;
+        for (; i + 4 <= num_words; i += 4)
+        {
+            __m256i w = _mm256_loadu_si256((const __m256i *)(words + i));
+            if (!_mm256_testz_si256(w, w))
+            {
+                break;
+            }
+        }
+        return i + portable_first_word_nonzero(words + i, num_words - i);
+    }
+
+    // AVX2 has no vector popcount, but the processors that have AVX2 all have the popcnt instruction
+    __attribute__((target("avx2,popcnt"))) static size_t avx2_popcount_words(const uint64_t *words, size_t num_words)
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < num_words; i++)
+        {
+            count += _mm_popcnt_u64(words[i]);
+        }
+        return count;
+    }
+
+    __attribute__((target("avx2"))) static void avx2_and_not_words(uint64_t *dest, const uint64_t *src, size_t num_words)
+    {
+        size_t i = 0;
+        for (; i + 4 <= num_words; i += 4)
+        {
+            __m256i d = _mm256_loadu_si256((const __m256i *)(dest + i));
+            __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+            _mm256_storeu_si256((__m256i *)(dest + i), _mm256_andnot_si256(s, d));
+        }
+        portable_and_not_words(dest + i, src + i, num_words - i);
+    }
+#endif
+
+#ifdef BIT_OPS_NEON
+    // ----------------------NEON -----------------------------
+    // each loop handles two words with one instruction, and leaves the tail to the portable version
+
+    // whether any bit of the vector is set
+    static inline bool neon_any(uint64x2_t v)
+    {
+        return vmaxvq_u32(vreinterpretq_u32_u64(v)) != 0;
+    }
+
+    static size_t neon_first_word_and_not(const uint64_t *want, const uint64_t *have, size_t num_words)
+    {
+        size_t i = 0;
+        for (; i + 2 <= num_words; i += 2)
+        {
+            if (neon_any(vbicq_u64(vld1q_u64(want + i), vld1q_u64(have + i))))
+            {
+                break;
+            }
+        }
+        return i + portable_first_word_and_not(want + i, have + i, num_words - i);
+    }
+
+    static size_t neon_first_word_not_full(const uint64_t *words, size_t num_words)
+    {
+        size_t i = 0;
+        for (; i + 2 <= num_words; i += 2)
+        {
+            if (neon_any(vreinterpretq_u64_u32(vmvnq_u32(vreinterpretq_u32_u64(vld1q_u64(words + i))))))
+            {
+                break;
+            }
+        }
+        return i + portable_first_word_not_full(words + i, num_words - i);
+    }
+
+    static size_t neon_first_word_nonzero(const uint64_t *words, size_t num_words)
+    {
+        size_t i = 0;
+        for (; i + 2 <= num_words; i += 2)
+        {
+            if (neon_any(vld1q_u64(words + i)))
+            {
+                break;
+            }
+        }
+        return i + portable_first_word_nonzero(words + i, num_words - i);
+    }
+
+    static size_t neon_popcount_words(const uint64_t *words, size_t num_words)
+    {
+        size_t count = 0;
+        size_t i = 0;
+        for (; i + 2 <= num_words; i += 2)
+        {
+            count += vaddlvq_u8(vcntq_u8(vreinterpretq_u8_u64(vld1q_u64(words + i))));
+        }
+        return count + portable_popcount_words(words + i, num_words - i);
+    }
+
+    static void neon_and_not_words(uint64_t *dest, const uint64_t *src, size_t num_words)
+    {
+        size_t i = 0;
+        for (; i + 2 <= num_words; i += 2)
+        {
+            vst1q_u64(dest + i, vbicq_u64(vld1q_u64(dest + i), vld1q_u64(src + i)));
+        }
+        portable_and_not_words(dest + i, src + i, num_words - i);
+    }
+#endif
+
+    static Kernels select_kernels()
+    {
+#ifdef BIT_OPS_X86
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        {
+            return Kernels{avx2_first_word_and_not, avx2_first_word_not_full, avx2_first_word_nonzero,
+                           avx2_popcount_words, avx2_and_not_words, "avx2"};
+        }
+#endif
+#ifdef BIT_OPS_NEON
+        return Kernels{neon_first_word_and_not, neon_first_word_not_full, neon_first_word_nonzero,
+                       neon_popcount_words, neon_and_not_words, "neon"};
+#endif
+        return Kernels{portable_first_word_and_not, portable_first_word_not_full, portable_first_word_nonzero,
+                       portable_popcount_words, portable_and_not_words, "portable"};
+    }
+
+    // picked once, on first use
+    static const Kernels &kernels()
+    {
+        static const Kernels selected = select_kernels();
+        return selected;
+    }
+
+    size_t first_word_and_not(const uint64_t *want, const uint64_t *have, size_t num_words)
+    {
+        return kernels().first_word_and_not(want, have, num_words);
+    }
+
+    size_t first_word_not_full(const uint64_t *words, size_t num_words)
+    {
+        return kernels().first_word_not_full(words, num_words);
+    }
+
+    size_t first_word_nonzero(const uint64_t *words, size_t num_words)
+    {
+        return kernels().first_word_nonzero(words, num_words);
+    }
+
+    size_t popcount_words(const uint64_t *words, size_t num_words)
+    {
+        return kernels().popcount_words(words, num_words);
+    }
+
+    void and_not_words(uint64_t *dest, const uint64_t *src, size_t num_words)
+    {
+        kernels().and_not_words(dest, src, num_words);
+    }
+
+    const char *bit_ops_isa()
+    {
+        return kernels().isa;
+    }
+}
@@ -0,0 +1,99 @@
+#include "choker.hpp"
+
+#include <algorithm>
+#include <unordered_set>
+
+namespace Peer
+{
+    Choker::Choker(int slots) : rng(std::random_device{}())
+    {
+        this->slots = std::max(1, slots);
+        rounds = 0;
+        optimistic = -1;
+    }
+
+    double Choker::rate(Session *session, bool seeding)
+    {
+        return seeding ? session->peer.upload_rate.rate() : session->peer.download_rate.rate();
+    }
+
+    bool Choker::candidate(Session *session)
+    {
+        return !session->closed() && session->peer.recv_shake && session->peer.peer_interested;
+    }
+
+    void Choker::rechoke(std::vector<Session *> &sessions, bool seeding)
+    {
+        std::vector<Session *> interested;
+        for (Session *session : sessions)
+        {
+            if (candidate(session))
+            {
+                interested.push_back(session);
+            }
+        }
+
+        // rank the peers by rate, with ties broken at random so that peers that sent nothing yet take turns
+        std::shuffle(interested.begin(), interested.end(), rng);
+        std::stable_sort(interested.begin(), interested.end(), [seeding](Session *a, Session *b)
+                         { return rate(a, seeding) > rate(b, seeding); });
+
+        // the fastest peers take every slot but the optimistic one
+        size_t regular = std::min(interested.size(), (size_t)(slots - 1));
+        std::unordered_set<Session *> unchoke(interested.begin(), interested.begin() + regular);
+
+        // keep the optimistic unchoke until it is time to rotate, unless it left, lost interest or earned a regular slot
+        Session *chosen = nullptr;
+        if (rounds % OPTIMISTIC_ROUNDS != 0)
+        {
+            for (size_t i = regular; i < interested.size(); i++)
+            {
+                if (interested[i]->peer.socket == optimistic)
+                {
+                    chosen = interested[i];
+                }
+            }
+        }
+        if (chosen == nullptr && regular < interested.size())
+        {
+            std::uniform_int_distribution<size_t> pick(regular, interested.size() - 1);
+            chosen = interested[pick(rng)];
+        }
+        optimistic = chosen != nullptr ? chosen->peer.socket : -1;
+        if (chosen != nullptr)
+        {
+            unchoke.insert(chosen);
+        }
+        rounds++;
+
+        for (Session *session : sessions)
+        {
+            session->set_choking(unchoke.count(session) == 0);
+        }
+    }
+
+    void Choker::fill_slots(std::vector<Session *> &sessions)
+    {
+        int unchoked = 0;
+        for (Session *session : sessions)
+        {
+            if (candidate(session) && !session->peer.am_choking)
+            {
+                unchoked++;
+            }
+        }
+
+        for (Session *session : sessions)
+        {
+            if (unchoked >= slots)
+            {
+                break;
+            }
+            if (candidate(session) && session->peer.am_choking)
+            {
+                session->set_choking(false);
+                unchoked++;
+            }
+        }
+    }
+}
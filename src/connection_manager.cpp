@@ -0,0 +1,293 @@
+#include "connection_manager.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+
+namespace Peer
+{
+    ConnectionManager::Attempt::Attempt(ConnectionManager *manager, int socket, uint64_t key, std::chrono::steady_clock::time_point deadline)
+    {
+        this->manager = manager;
+        this->socket = socket;
+        this->key = key;
+        this->deadline = deadline;
+        done = false;
+        error = 0;
+    }
+
+    void ConnectionManager::Attempt::on_writable()
+    {
+        // the first writable event tells us whether the connect succeeded
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        {
+            error = errno;
+        }
+        finish(error);
+    }
+
+    void ConnectionManager::Attempt::on_error()
+    {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &len);
+        finish(error != 0 ? error : ECONNRESET);
+    }
+
+    void ConnectionManager::Attempt::finish(int error)
+    {
+        if (done)
+        {
+            return;
+        }
+        done = true;
+        this->error = error;
+        manager->reactor->remove(socket, this);
+        manager->finished.push_back(socket);
+    }
+
+    ConnectionManager::ConnectionManager(Net::Reactor *reactor, sockaddr_in self_addr, size_t max_half_open, size_t max_peers,
+                                         std::function<void(PeerClient &)> on_connected)
+    {
+        this->reactor = reactor;
+        this->self_addr = self_addr;
+        this->max_half_open = std::max((size_t)1, max_half_open);
+        this->max_peers = std::max((size_t)1, max_peers);
+        this->on_connected = on_connected;
+        ready = 0;
+        rescan = false;
+        next_scan = std::chrono::steady_clock::time_point::max();
+    }
+
+    ConnectionManager::~ConnectionManager()
+    {
+        for (auto &entry : attempts)
+        {
+            if (!entry.second->done)
+            {
+                reactor->remove(entry.first, entry.second.get());
+            }
+            close(entry.first);
+        }
+    }
+
+    uint64_t ConnectionManager::peer_key(const sockaddr_in &addr)
+    {
+        return (uint64_t)addr.sin_addr.s_addr << 16 | addr.sin_port;
+    }
+
+    std::chrono::seconds ConnectionManager::backoff(int failures)
+    {
+        int seconds = CONNECT_RETRY_MIN;
+        for (int i = 1; i < failures && seconds < CONNECT_RETRY_MAX; i++)
+        {
+            seconds *= 2;
+        }
+        return std::chrono::seconds(std::min(seconds, CONNECT_RETRY_MAX));
+    }
+
+    void ConnectionManager::add_peers(std::vector<PeerClient> &peers)
+    {
+        auto now = std::chrono::steady_clock::now();
+        for (PeerClient &peer : peers)
+        {
+            // skip this client, and stop remembering peers once there are plenty
+            if ((peer.sockaddr.sin_addr.s_addr == self_addr.sin_addr.s_addr && peer.sockaddr.sin_port == self_addr.sin_port) ||
+                candidates.size() >= MAX_CANDIDATES)
+            {
+                continue;
+            }
+
+            // a peer that is already known keeps its history and backoff
+            if (candidates.emplace(peer_key(peer.sockaddr), Candidate{peer.sockaddr, false, 0, 0, now, now}).second)
+            {
+                rescan = true;
+            }
+        }
+    }
+
+    void ConnectionManager::disconnected(const sockaddr_in &addr, long long downloaded)
+    {
+        // incoming connections are not candidates
+        auto it = candidates.find(peer_key(addr));
+        if (it == candidates.end() || !it->second.busy)
+        {
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        Candidate &candidate = it->second;
+        if (downloaded > 0)
+        {
+            double seconds = std::max(1.0, std::chrono::duration<double>(now - candidate.connected_at).count());
+            candidate.throughput = downloaded / seconds;
+            candidate.failures = 0;
+            candidate.busy = false;
+            candidate.retry_at = now + backoff(1);
+        }
+        else
+        {
+            fail(it->first, now);
+        }
+        rescan = true;
+    }
+
+    void ConnectionManager::fail(uint64_t key, std::chrono::steady_clock::time_point now)
+    {
+        Candidate &candidate = candidates[key];
+        candidate.busy = false;
+        candidate.failures++;
+        if (candidate.failures >= MAX_CONNECT_FAILURES)
+        {
+            candidates.erase(key);
+            return;
+        }
+        candidate.retry_at = now + backoff(candidate.failures);
+    }
+
+    void ConnectionManager::connect_to(uint64_t key, Candidate &candidate, std::chrono::steady_clock::time_point now)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+        if (sock < 0)
+        {
+            // out of descriptors, which is not the peer's fault, so it stays ready
+            std::cout << "socket failed: " << strerror(errno) << std::endl;
+            return;
+        }
+        candidate.busy = true;
+
+        auto attempt = std::make_unique<Attempt>(this, sock, key, now + std::chrono::seconds(CONNECT_TIMEOUT_SECONDS));
+        if (connect(sock, (sockaddr *)&candidate.addr, sizeof(sockaddr_in)) == 0)
+        {
+            // a connect to a local peer may finish at once
+            attempt->done = true;
+            finished.push_back(sock);
+        }
+        else if (errno == EINPROGRESS)
+        {
+            reactor->add(sock, EPOLLOUT, attempt.get());
+        }
+        else
+        {
+            attempt->done = true;
+            attempt->error = errno;
+            finished.push_back(sock);
+        }
+        attempts[sock] = std::move(attempt);
+    }
+
+    void ConnectionManager::complete(Attempt &attempt, std::chrono::steady_clock::time_point now)
+    {
+        Candidate &candidate = candidates[attempt.key];
+        PeerClient peer = PeerClient();
+        peer.sockaddr = candidate.addr;
+        rescan = true;
+
+        if (attempt.error != 0)
+        {
+            std::cout << "connect failed: " << strerror(attempt.error) << ": " << peer.to_string() << std::endl;
+            close(attempt.socket);
+            fail(attempt.key, now);
+            return;
+        }
+
+        candidate.connected_at = now;
+        peer.socket = attempt.socket;
+        peer.connected = true;
+        on_connected(peer);
+    }
+
+    void ConnectionManager::start_connects(size_t count, std::chrono::steady_clock::time_point now)
+    {
+        // the candidates that are ready, and when the next one that is waiting out its backoff will be
+        std::vector<std::pair<uint64_t, Candidate *>> eligible;
+        next_scan = std::chrono::steady_clock::time_point::max();
+        for (auto &entry : candidates)
+        {
+            Candidate &candidate = entry.second;
+            if (candidate.busy)
+            {
+                continue;
+            }
+            if (candidate.retry_at <= now)
+            {
+                eligible.push_back({entry.first, &candidate});
+            }
+            else
+            {
+                next_scan = std::min(next_scan, candidate.retry_at);
+            }
+        }
+
+        // the fastest peers of earlier connections first, then the ones that failed the least
+        count = std::min(count, eligible.size());
+        std::partial_sort(eligible.begin(), eligible.begin() + count, eligible.end(), [](auto &a, auto &b)
+                          {
+            if (a.second->throughput != b.second->throughput)
+            {
+                return a.second->throughput > b.second->throughput;
+            }
+            return a.second->failures < b.second->failures; });
+
+        for (size_t i = 0; i < count; i++)
+        {
+            connect_to(eligible[i].first, *eligible[i].second, now);
+        }
+        ready = eligible.size() - count;
+        rescan = false;
+    }
+
+    void ConnectionManager::tick(size_t num_peers)
+    {
+        auto now = std::chrono::steady_clock::now();
+
+        // hand on the attempts that finished, and report whether any connected
+        auto hand_over = [&]()
+        {
+            for (int sock : finished)
+            {
+                auto it = attempts.find(sock);
+                std::unique_ptr<Attempt> attempt = std::move(it->second);
+                attempts.erase(it);
+                if (attempt->error == 0)
+                {
+                    num_peers++;
+                }
+                complete(*attempt, now);
+            }
+            finished.clear();
+        };
+        hand_over();
+
+        // give up on connects that took too long
+        for (auto &entry : attempts)
+        {
+            if (!entry.second->done && now >= entry.second->deadline)
+            {
+                entry.second->finish(ETIMEDOUT);
+            }
+        }
+        hand_over();
+
+        // candidates are only looked through when there is room, and something changed or a backoff ran out
+        size_t busy = num_peers + attempts.size();
+        if (attempts.size() < max_half_open && busy < max_peers && (rescan || now >= next_scan))
+        {
+            start_connects(std::min(max_half_open - attempts.size(), max_peers - busy), now);
+            hand_over();
+        }
+    }
+
+    bool ConnectionManager::want_peers(size_t num_peers)
+    {
+        return ready == 0 && num_peers + attempts.size() < max_peers;
+    }
+
+    size_t ConnectionManager::half_open()
+    {
+        return attempts.size();
+    }
+}
@@ -0,0 +1,174 @@
+#include "disk_io.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <limits.h>
+
+namespace Disk
+{
+    DiskThread::DiskThread(File::Storage *storage) : jobs(QUEUE_SIZE), results(QUEUE_SIZE)
+    {
+        this->storage = storage;
+        job_signal.store(0);
+        running.store(true);
+        submitted.store(0);
+        completed.store(0);
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        worker = std::thread(&DiskThread::run, this);
+    }
+
+    DiskThread::~DiskThread()
+    {
+        // wake the disk thread so that it sees running is cleared, it finishes queued jobs before exiting
+        running.store(false);
+        job_signal.fetch_add(1);
+        job_signal.notify_one();
+        worker.join();
+        close(event_fd);
+    }
+
+    bool DiskThread::submit(WriteJob job)
+    {
+        if (!jobs.push(job))
+        {
+            return false;
+        }
+        submitted.fetch_add(1);
+        job_signal.fetch_add(1, std::memory_order_release);
+        job_signal.notify_one();
+        return true;
+    }
+
+    bool DiskThread::idle()
+    {
+        return completed.load() == submitted.load();
+    }
+
+    void DiskThread::drain_results(std::vector<WriteResult> &out)
+    {
+        // clear the eventfd before popping, so that a result pushed after this point signals again
+        uint64_t count;
+        ssize_t n = read(event_fd, &count, sizeof(count));
+        (void)n;
+
+        WriteResult result;
+        while (results.pop(result))
+        {
+            out.push_back(result);
+        }
+    }
+
+    int DiskThread::notify_fd()
+    {
+        return event_fd;
+    }
+
+    void DiskThread::notify()
+    {
+        uint64_t one = 1;
+        ssize_t n = write(event_fd, &one, sizeof(one));
+        (void)n;
+    }
+
+    void DiskThread::run()
+    {
+        std::vector<WriteJob> batch;
+        while (true)
+        {
+            // read the signal before checking the queue, so that a push after the check wakes us
+            uint32_t seen = job_signal.load(std::memory_order_acquire);
+
+            // a resume save ends the batch, so that the pieces before it are written before the flush
+            WriteJob job;
+            bool popped = false;
+            while (jobs.pop(job))
+            {
+                popped = true;
+                if (job.resume != nullptr)
+                {
+                    write_batch(batch);
+                    batch.clear();
+                    save_resume(job);
+                    continue;
+                }
+                batch.push_back(job);
+            }
+
+            if (popped)
+            {
+                write_batch(batch);
+                batch.clear();
+                continue;
+            }
+
+            if (!running.load())
+            {
+                break;
+            }
+
+            job_signal.wait(seen);
+        }
+    }
+
+    void DiskThread::write_batch(std::vector<WriteJob> &batch)
+    {
+        std::sort(batch.begin(), batch.end(), [](const WriteJob &a, const WriteJob &b)
+                  { return a.offset < b.offset; });
+
+        std::vector<iovec> iov;
+        size_t run_start = 0;
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            iov.push_back(iovec{(void *)batch[i].data, batch[i].length});
+
+            // keep extending the run while the next piece starts where this one ends
+            bool last = i + 1 == batch.size();
+            bool contiguous = !last && batch[i].offset + batch[i].length == batch[i + 1].offset;
+            if (contiguous && iov.size() < IOV_MAX)
+            {
+                continue;
+            }
+
+            bool ok = storage->writev(batch[run_start].offset, iov.data(), iov.size());
+            if (!ok)
+            {
+                std::cerr << "disk write failed at offset " << batch[run_start].offset << std::endl;
+            }
+
+            for (size_t j = run_start; j <= i; j++)
+            {
+                push_result(WriteResult{batch[j].piece_index, ok});
+            }
+            notify();
+
+            iov.clear();
+            run_start = i + 1;
+        }
+    }
+
+    void DiskThread::save_resume(WriteJob &job)
+    {
+        // the resume data must never claim a piece that is not on disk yet
+        storage->sync();
+
+        ResumeJob *resume = job.resume;
+        File::stat_files(resume->files, resume->data.file_size, resume->data.file_mtime);
+        bool ok = resume->data.save(resume->path);
+        push_result(WriteResult{job.piece_index, ok, resume});
+        notify();
+    }
+
+    void DiskThread::push_result(WriteResult result)
+    {
+        // if the network loop has fallen behind, make sure it is woken up, then wait for room
+        while (!results.push(result))
+        {
+            notify();
+            std::this_thread::yield();
+        }
+        completed.fetch_add(1);
+    }
+}
@@ -1,15 +1,20 @@
 #include "file.hpp"
+#include "recheck.hpp"
+#include "bit_ops.hpp"
 
 #include <iostream>
+#include <algorithm>
+#include <thread>
+#include <bit>
+#include <poll.h>
 namespace File
 {
 
-    BitField::BitField(Messages::Buffer *buff, uint32_t num_bits)
+    BitField::BitField(Messages::Buffer *buff, uint32_t num_bits) : BitField(num_bits)
     {
         // read len and id fields from the buffer
         uint32_t len;
         uint8_t id;
-        uint32_t num_bytes;
 
         int idx = 0;
         memcpy(&len, buff->ptr.get() + idx, sizeof(len));
@@ -19,88 +24,178 @@ namespace File
         idx += sizeof(id);
 
         // need to pass in number of bits, because we only get the number of bytes from the bitfield message
+        load_bytes(buff->ptr.get() + idx, len - sizeof(id));
+    }
+    BitField::BitField(uint32_t num_bits)
+    {
         this->num_bits = num_bits;
-        num_bytes = len - sizeof(id);
-        bits = std::vector<uint8_t>(num_bytes, 0);
+        words = std::vector<uint64_t>((num_bits + 63) / 64, 0); // we can have extra trailing bits at the end
+        set_bits = 0;
+    }
+    BitField::BitField(const uint8_t *payload, uint32_t num_bytes, uint32_t num_bits) : BitField(num_bits)
+    {
+        load_bytes(payload, num_bytes);
+    }
 
-        // read bitfield data from after the len and id fields
-        for (int i = 0; i < num_bytes; i++)
-        {
-            bits[i] = (buff->ptr.get() + idx)[i];
-        }
+    uint32_t BitField::word_index(uint32_t bit_index)
+    {
+        return bit_index / 64;
     }
 
-    BitField::BitField(uint32_t num_bits)
+    uint64_t BitField::bit_mask(uint32_t bit_index)
     {
-        this->num_bits = num_bits;
-        uint32_t len = std::ceil((double)num_bits / 8.0); // we can have extra trailing bits at the end
-        bits = std::vector<uint8_t>(len, 0);
+        return 1ull << (63 - bit_index % 64);
+    }
+
+    uint64_t BitField::last_word_mask()
+    {
+        uint32_t used = num_bits % 64;
+        return used == 0 ? ~0ull : ~0ull << (64 - used);
     }
 
     bool BitField::is_bit_set(uint32_t bit_index)
     {
-        uint32_t byte_index = bit_index / 8; // the index in the vector for this piece index
-        uint32_t offset = bit_index % 8;     // the bit we are interested in
-        return ((bits[byte_index] >> (7 - offset)) & 1) != 0;
+        return (words[word_index(bit_index)] & bit_mask(bit_index)) != 0;
     }
 
     void BitField::set_bit(uint32_t bit_index)
     {
-        uint32_t byte_index = bit_index / 8; // the index in the vector for this piece index
-        uint32_t offset = bit_index % 8;     // the bit we are interested in
-
-        // bitshift the correct bit
-        bits[byte_index] |= 1 << (7 - offset);
+        uint64_t &word = words[word_index(bit_index)];
+        if ((word & bit_mask(bit_index)) == 0)
+        {
+            word |= bit_mask(bit_index);
+            set_bits++;
+        }
     }
 
     void BitField::unset_bit(uint32_t bit_index)
     {
-        uint32_t byte_index = bit_index / 8; // the index in the vector for this piece index
-        uint32_t offset = bit_index % 8;     // the bit we are interested in
-
-        // bitshift the correct bit
-        bits[byte_index] &= 0 << (7 - offset);
+        uint64_t &word = words[word_index(bit_index)];
+        if ((word & bit_mask(bit_index)) != 0)
+        {
+            word &= ~bit_mask(bit_index);
+            set_bits--;
+        }
     }
 
     int BitField::first_match(BitField *other)
     {
-        for (int i = 0; i < num_bits; i++)
+        return next_match(other, 0);
+    }
+
+    int BitField::next_match(BitField *other, uint32_t from)
+    {
+        size_t num_words = std::min(words.size(), other->words.size());
+        if (from >= num_bits || word_index(from) >= num_words)
         {
-            if (!is_bit_set(i) && other->is_bit_set(i))
+            return -1;
+        }
+
+        // the rest of the word that from is in, then whole words
+        size_t i = word_index(from);
+        uint64_t word = other->words[i] & ~words[i] & (~0ull >> (from % 64));
+        if (word == 0)
+        {
+            i++;
+            i += Util::first_word_and_not(other->words.data() + i, words.data() + i, num_words - i);
+            if (i == num_words)
             {
-                return i;
+                return -1;
             }
+            word = other->words[i] & ~words[i];
         }
-        return -1;
+
+        // the highest bit of the word is the lowest bit index
+        int index = i * 64 + std::countl_zero(word);
+        return (uint32_t)index < num_bits ? index : -1;
     }
 
     int BitField::first_unflipped()
     {
-        for (int i = 0; i < num_bits; i++)
+        if (all_flipped())
+        {
+            return -1;
+        }
+
+        // the last word is only full up to num_bits, so it is checked with its unused bits set
+        size_t full_words = words.size() - 1;
+        size_t i = Util::first_word_not_full(words.data(), full_words);
+        uint64_t word = i < full_words ? words[i] : words[i] | ~last_word_mask();
+        return i * 64 + std::countl_one(word);
+    }
+
+    int BitField::find_next_set(uint32_t from)
+    {
+        if (from >= num_bits)
+        {
+            return -1;
+        }
+
+        // the rest of the word that from is in, then whole words
+        size_t i = word_index(from);
+        uint64_t word = words[i] & (~0ull >> (from % 64));
+        if (word == 0)
         {
-            if (!is_bit_set(i))
+            i++;
+            i += Util::first_word_nonzero(words.data() + i, words.size() - i);
+            if (i == words.size())
             {
-                return i;
+                return -1;
             }
+            word = words[i];
         }
-        return -1;
+        return i * 64 + std::countl_zero(word);
     }
 
     bool BitField::all_flipped()
     {
-        for (int i = 0; i < num_bits; i++)
+        return set_bits == num_bits;
+    }
+
+    uint32_t BitField::count()
+    {
+        return set_bits;
+    }
+
+    void BitField::and_not(BitField *other)
+    {
+        Util::and_not_words(words.data(), other->words.data(), std::min(words.size(), other->words.size()));
+        set_bits = Util::popcount_words(words.data(), words.size());
+    }
+
+    uint32_t BitField::num_bytes()
+    {
+        return (num_bits + 7) / 8;
+    }
+
+    void BitField::copy_bytes(uint8_t *dest)
+    {
+        for (uint32_t i = 0; i < num_bytes(); i++)
         {
-            if (!is_bit_set(i))
-            {
-                return false;
-            }
+            dest[i] = words[i / 8] >> (56 - 8 * (i % 8));
         }
-        return true;
+    }
+
+    void BitField::load_bytes(const uint8_t *src, uint32_t num_bytes)
+    {
+        std::fill(words.begin(), words.end(), 0);
+        uint32_t length = std::min(num_bytes, this->num_bytes());
+        for (uint32_t i = 0; i < length; i++)
+        {
+            words[i / 8] |= (uint64_t)src[i] << (56 - 8 * (i % 8));
+        }
+
+        // a peer may set the spare bits at the end, which are not pieces
+        if (!words.empty())
+        {
+            words.back() &= last_word_mask();
+        }
+        set_bits = Util::popcount_words(words.data(), words.size());
     }
 
     Messages::Buffer *BitField::pack()
     {
-        uint32_t len = bits.size() + sizeof(Messages::BITFIELD_ID);
+        uint32_t len = num_bytes() + sizeof(Messages::BITFIELD_ID);
         Messages::Buffer *buff = new Messages::Buffer((uint32_t) (len + sizeof(len)));
 
         int idx = 0;
@@ -114,7 +209,7 @@ namespace File
         idx += sizeof(Messages::BITFIELD_ID);
 
         // pack bitfield
-        memcpy(buff->ptr.get() + idx, bits.data(), bits.size());
+        copy_bytes(buff->ptr.get() + idx);
 
         return buff;
     }
@@ -144,8 +239,19 @@ namespace File
         piece_size = size;
         num_blocks = std::ceil((double)piece_size / Piece::block_size);
 
-        data = std::make_unique<uint8_t[]>(size); // the piece will hold exactly size bytes
+        data = nullptr; // leased from the piece pool once we start requesting this piece
         block_bitfield = std::make_unique<BitField>(num_blocks);
+        hash_ctx = nullptr;
+        hashed_blocks = 0;
+    }
+
+    uint32_t Piece::block_length(uint32_t block_index)
+    {
+        if (block_index == num_blocks - 1)
+        {
+            return piece_size - (num_blocks - 1) * Piece::block_size;
+        }
+        return Piece::block_size;
     }
 
     std::vector<Block> Piece::get_unfinished_blocks()
@@ -179,17 +285,121 @@ namespace File
 
         piece_length = std::get<long long>(info_dict["piece length"]);
         pieces = std::get<std::string>(info_dict["pieces"]);
+        name = std::get<std::string>(info_dict["name"]);
+    }
+
+    TorrentConfig::TorrentConfig()
+    {
+        memory_budget = DEFAULT_MEMORY_BUDGET;
+        storage_mode = StorageMode::PWRITE;
+        hash_threads = 1;
+        resume = true;
+        recheck = false;
+        recheck_threads = std::max(1u, std::thread::hardware_concurrency());
+        max_open_files = DEFAULT_MAX_OPEN_FILES;
+    }
+
+    SingleFileTorrent::SingleFileTorrent(std::string metainfo_buffer, TorrentConfig config) : Torrent(metainfo_buffer)
+    {
+        bencode::data data = bencode::decode(metainfo_buffer);
+        auto metainfo_dict = std::get<bencode::dict>(data);
+        auto info_dict = std::get<bencode::dict>(metainfo_dict["info"]);
+
+        long long file_length = std::get<long long>(info_dict["length"]);
+        open({FileSpan{name, 0, file_length}}, config);
     }
 
-    SingleFileTorrent::SingleFileTorrent(std::string metainfo_buffer) : Torrent(metainfo_buffer)
-    {   
+    MultipleFileTorrent::MultipleFileTorrent(std::string metainfo_buffer, TorrentConfig config) : Torrent(metainfo_buffer)
+    {
         bencode::data data = bencode::decode(metainfo_buffer);
         auto metainfo_dict = std::get<bencode::dict>(data);
         auto info_dict = std::get<bencode::dict>(metainfo_dict["info"]);
+        auto files_list = std::get<bencode::list>(info_dict["files"]);
 
-        name = std::get<std::string>(info_dict["name"]);
-        length = std::get<long long>(info_dict["length"]);
-        out_stream = std::ofstream(name);
+        std::vector<FileSpan> spans;
+        long long offset = 0;
+        for (auto &entry : files_list)
+        {
+            auto file_dict = std::get<bencode::dict>(entry);
+            auto path_list = std::get<bencode::list>(file_dict["path"]);
+            long long file_length = std::get<long long>(file_dict["length"]);
+
+            // every file is saved under the torrent's directory, so its path must not leave it
+            std::string path = name;
+            for (auto &component : path_list)
+            {
+                std::string part = std::get<std::string>(component);
+                if (part == "" || part == "." || part == ".." || part.find('/') != std::string::npos)
+                {
+                    std::cerr << "Invalid file path in " << name << ": " << part << std::endl;
+                    exit(1);
+                }
+                path += "/" + part;
+            }
+
+            spans.push_back(FileSpan{path, offset, file_length});
+            offset += file_length;
+        }
+        open(spans, config);
+    }
+
+    std::unique_ptr<Torrent> create_torrent(std::string metainfo_buffer, TorrentConfig config)
+    {
+        bencode::data data = bencode::decode(metainfo_buffer);
+        auto metainfo_dict = std::get<bencode::dict>(data);
+        auto info_dict = std::get<bencode::dict>(metainfo_dict["info"]);
+
+        if (info_dict.find("files") != info_dict.end())
+        {
+            return std::make_unique<MultipleFileTorrent>(metainfo_buffer, config);
+        }
+        return std::make_unique<SingleFileTorrent>(metainfo_buffer, config);
+    }
+
+    void Torrent::open(std::vector<FileSpan> files, TorrentConfig config)
+    {
+        this->files = files;
+        length = 0;
+        for (FileSpan &file : files)
+        {
+            length += file.length;
+        }
+        resume_path = config.resume ? name + ".resume" : "";
+
+        // look at the download before opening it, because opening it can touch its modification time
+        long long existing_size = -1;
+        long long existing_mtime = -1;
+        if (!stat_files(files, existing_size, existing_mtime))
+        {
+            existing_size = -1;
+        }
+
+        if (files.size() > 1 && config.storage_mode == MMAP)
+        {
+            std::cout << "memory mapped storage only supports single file torrents, writing " << name << " with pwrite" << std::endl;
+            config.storage_mode = PWRITE;
+        }
+
+        switch (config.storage_mode)
+        {
+        case PWRITE:
+            if (files.size() == 1)
+            {
+                storage = std::make_unique<FileStorage>(files[0].path, length);
+            }
+            else
+            {
+                storage = std::make_unique<MultiFileStorage>(files, config.max_open_files);
+            }
+            break;
+
+        case MMAP:
+            storage = std::make_unique<MmapStorage>(files[0].path, length);
+            break;
+        }
+        disk = std::make_unique<Disk::DiskThread>(storage.get());
+        piece_pool = std::make_unique<PiecePool>(piece_length, config.memory_budget);
+        hasher = std::make_unique<Hash::HashPool>(config.hash_threads);
 
         num_pieces = pieces.length() / 20; // pieces is a concatenation of 20 byte hashes, so divide by 20 to number of pieces
         piece_vec = std::vector<Piece>();
@@ -197,6 +407,7 @@ namespace File
 
         // init tracking stats
         downloaded = 0;
+        endgame = false;
         uploaded = 0;
 
         for (int i = 0; i < num_pieces - 1; i++)
@@ -210,91 +421,465 @@ namespace File
         uint32_t bytes_left = length - (num_pieces - 1) * piece_length;
         piece_vec.push_back(Piece(last_piece_hash, num_pieces - 1, bytes_left));
 
-        update_block_queue();
+        bool resumed = false;
+        if (resume_path != "" && existing_size >= 0)
+        {
+            resumed = load_resume(existing_size, existing_mtime);
+        }
+
+        // verify data that is already on disk if we have no record of it we can trust
+        if (existing_size > 0 && (config.recheck || !resumed))
+        {
+            recheck_existing(config.recheck_threads);
+        }
+        fill_finished_blocks();
+
+        // every piece that we do not have yet can be picked
+        picker = std::make_unique<PiecePicker>(num_pieces);
+        for (uint32_t i = 0; i < num_pieces; i++)
+        {
+            if (!piece_bitfield->is_bit_set(i))
+            {
+                picker->add_candidate(i);
+            }
+        }
     }
 
-    void SingleFileTorrent::update_block_queue()
+    bool Torrent::load_resume(long long file_size, long long file_mtime)
     {
-        for (int i = 0; i < num_pieces; i++)
+        ResumeData resume;
+        if (!resume.load(resume_path))
+        {
+            return false;
+        }
+
+        if (resume.file_size != file_size || resume.file_size != length || resume.piece_bits.size() != piece_bitfield->num_bytes())
+        {
+            std::cout << "resume data does not match " << name << std::endl;
+            return false;
+        }
+
+        BitField saved_pieces((const uint8_t *)resume.piece_bits.data(), resume.piece_bits.size(), num_pieces);
+
+        // pieces that we cannot trust without hashing them again
+        std::vector<uint32_t> uncertain = resume.uncertain_pieces;
+        bool unchanged = resume.file_mtime == file_mtime;
+
+        for (uint32_t i = 0; i < num_pieces; i++)
         {
-            std::vector<Block> blocks = piece_vec[i].get_unfinished_blocks();
-            for (Block &b : blocks)
+            if (!saved_pieces.is_bit_set(i))
             {
-                block_queue.push(b);
+                continue;
+            }
+            if (unchanged)
+            {
+                piece_bitfield->set_bit(i);
+            }
+            else
+            {
+                uncertain.push_back(i);
             }
         }
+
+        // blocks of partial pieces are only trustworthy if nothing touched the file since they were saved
+        if (unchanged && storage->mapped(0) != nullptr)
+        {
+            for (auto &entry : resume.partial_pieces)
+            {
+                BitField *blocks = entry.first < num_pieces ? piece_vec[entry.first].block_bitfield.get() : nullptr;
+                if (blocks != nullptr && entry.second.size() == blocks->num_bytes())
+                {
+                    blocks->load_bytes((const uint8_t *)entry.second.data(), entry.second.size());
+                }
+            }
+        }
+
+        int rechecked = 0;
+        for (uint32_t index : uncertain)
+        {
+            if (index < num_pieces && !piece_bitfield->is_bit_set(index))
+            {
+                rechecked++;
+                if (check_piece(index))
+                {
+                    piece_bitfield->set_bit(index);
+                }
+            }
+        }
+
+        // a partial piece may have every block, but was not verified before we stopped
+        for (uint32_t i = 0; i < num_pieces; i++)
+        {
+            if (!piece_bitfield->is_bit_set(i) && piece_vec[i].block_bitfield->all_flipped())
+            {
+                rechecked++;
+                if (check_piece(i))
+                {
+                    piece_bitfield->set_bit(i);
+                }
+                else
+                {
+                    for (uint32_t j = 0; j < piece_vec[i].block_bitfield->num_bits; j++)
+                    {
+                        piece_vec[i].block_bitfield->unset_bit(j);
+                    }
+                }
+            }
+        }
+
+        std::cout << "resumed " << name << ": " << length - bytes_left() << " of " << length << " bytes, rechecked " << rechecked << " pieces" << std::endl;
+        return true;
     }
 
-    void SingleFileTorrent::write_block(Messages::Buffer *buff)
+    void Torrent::recheck_existing(int num_threads)
     {
-        uint32_t len;   // the length of the message
-        uint8_t id;     // the id of the message. note that this must be the piece message id, because we checked prior to recv
-        uint32_t index; // the index of the piece
-        uint32_t begin; // the byte offset where this block begins
+        std::cout << "checking existing data in " << name << " with " << num_threads << " threads" << std::endl;
 
-        int idx = 0;
-        // read len
-        memcpy(&len, buff->ptr.get() + idx, sizeof(len));
-        idx += sizeof(len);
+        // a single file is mapped, the files of a multi file torrent are read through the storage
+        std::vector<uint8_t> good_pieces;
+        if (files.size() > 1)
+        {
+            recheck_storage(storage.get(), piece_length, length, pieces, num_threads, good_pieces, 1000);
+        }
+        else if (recheck_file(files[0].path, piece_length, length, pieces, num_threads, good_pieces, 1000) < 0)
+        {
+            std::cout << "failed to map " << files[0].path << " for checking" << std::endl;
+            return;
+        }
 
-        // read id
-        memcpy(&id, buff->ptr.get() + idx, sizeof(id));
-        idx += sizeof(id);
+        piece_bitfield = std::make_unique<BitField>(num_pieces);
+        for (uint32_t i = 0; i < num_pieces; i++)
+        {
+            if (good_pieces[i])
+            {
+                piece_bitfield->set_bit(i);
+            }
 
-        // read index
-        memcpy(&index, buff->ptr.get() + idx, sizeof(index));
-        idx += sizeof(index);
+            // a bad piece that every block was written for must be downloaded again
+            else if (piece_vec[i].block_bitfield->all_flipped())
+            {
+                for (uint32_t j = 0; j < piece_vec[i].block_bitfield->num_bits; j++)
+                {
+                    piece_vec[i].block_bitfield->unset_bit(j);
+                }
+            }
+        }
+    }
 
-        // read begin
-        memcpy(&begin, buff->ptr.get() + idx, sizeof(begin));
-        idx += sizeof(begin);
+    void Torrent::fill_finished_blocks()
+    {
+        for (uint32_t i = 0; i < num_pieces; i++)
+        {
+            if (piece_bitfield->is_bit_set(i))
+            {
+                for (uint32_t j = 0; j < piece_vec[i].num_blocks; j++)
+                {
+                    piece_vec[i].block_bitfield->set_bit(j);
+                }
+            }
+        }
+    }
 
-        // convert to little endian
-        index = ntohl(index);
-        begin = ntohl(begin);
+    bool Torrent::check_piece(uint32_t index)
+    {
+        Piece &piece = piece_vec[index];
+        uint8_t *mapped = storage->mapped(piece_offset(index));
+        if (mapped != nullptr)
+        {
+            return Hash::truncated_sha1_hash(mapped, piece.piece_size, 20) == piece.piece_hash;
+        }
 
-        std::cout << "got block: piece index " << index << " begin: " << begin << std::endl;
+        std::unique_ptr<uint8_t[]> buffer = std::make_unique<uint8_t[]>(piece.piece_size);
+        if (!storage->read(piece_offset(index), buffer.get(), piece.piece_size))
+        {
+            return false;
+        }
+        return Hash::truncated_sha1_hash(buffer.get(), piece.piece_size, 20) == piece.piece_hash;
+    }
 
-        // check that the piece conforms to a block that we requested
-        uint32_t data_len = len - sizeof(index) - sizeof(begin) - sizeof(id);
-        bool within_bounds = begin + data_len <= piece_vec[index].piece_size;
-        if (within_bounds && piece_vec[index].data != nullptr)
+    long long Torrent::bytes_left()
+    {
+        long long left = 0;
+        for (uint32_t i = 0; i < num_pieces; i++)
+        {
+            if (!piece_bitfield->is_bit_set(i))
+            {
+                left += piece_vec[i].piece_size;
+            }
+        }
+        return left;
+    }
+
+    void Torrent::save_resume()
+    {
+        if (resume_path == "")
+        {
+            return;
+        }
+
+        // the disk thread fills in the size and modification time of the download once it has flushed it
+        saving_resume.push_back(std::make_unique<Disk::ResumeJob>());
+        Disk::ResumeJob *job = saving_resume.back().get();
+        job->path = resume_path;
+        job->files = files;
+        ResumeData &resume = job->data;
+        resume.piece_bits = std::string(piece_bitfield->num_bytes(), '\0');
+        piece_bitfield->copy_bytes((uint8_t *)resume.piece_bits.data());
+
+        bool blocks_on_disk = storage->mapped(0) != nullptr;
+        for (uint32_t i = 0; i < num_pieces; i++)
+        {
+            if (piece_bitfield->is_bit_set(i))
+            {
+                continue;
+            }
+
+            // every block is in, but the piece is still being verified or written
+            BitField *blocks = piece_vec[i].block_bitfield.get();
+            if (blocks->all_flipped())
+            {
+                resume.uncertain_pieces.push_back(i);
+            }
+            else if (blocks_on_disk && blocks->count() != 0)
+            {
+                std::string block_bits(blocks->num_bytes(), '\0');
+                blocks->copy_bytes((uint8_t *)block_bits.data());
+                resume.partial_pieces[i] = block_bits;
+            }
+        }
+
+        // the job queues behind the pieces that were handed over before it
+        Disk::WriteJob save{};
+        save.resume = job;
+        pending_writes.push_back(save);
+        flush_pending_writes();
+    }
+
+    void Torrent::flush_writes()
+    {
+        // act on results while waiting, so that the disk thread never waits for room in a full result queue,
+        // and pieces that did not fit in the job queue are handed over as it empties
+        while (!pending_writes.empty() || !disk->idle())
+        {
+            pollfd pfd{disk->notify_fd(), POLLIN, 0};
+            poll(&pfd, 1, Disk::FLUSH_POLL_MS);
+            process_disk_completions();
+        }
+        process_disk_completions();
+    }
+
+    long long Torrent::piece_offset(uint32_t index)
+    {
+        return (long long)index * piece_length;
+    }
+
+    uint8_t *Torrent::piece_data(uint32_t index)
+    {
+        // blocks go straight into the file when it is mapped
+        uint8_t *mapped = storage->mapped(piece_offset(index));
+        if (mapped != nullptr)
+        {
+            return mapped;
+        }
+        return piece_vec[index].data.get();
+    }
+
+    bool Torrent::start_piece(uint32_t index)
+    {
+        Piece &piece = piece_vec[index];
+
+        // lease a buffer for the piece. if the memory budget is used up, wait for in flight pieces to finish
+        if (piece_data(index) == nullptr)
+        {
+            if (!piece_pool->can_lease())
+            {
+                return false;
+            }
+            piece.data = piece_pool->lease();
+        }
+
+        picker->remove_candidate(index);
+        active_pieces.push_back(index);
+        std::vector<Block> blocks = piece.get_unfinished_blocks();
+        piece.pending_blocks.assign(blocks.begin(), blocks.end());
+        return true;
+    }
+
+    void Torrent::take_blocks(uint32_t index, size_t count, std::vector<Block> &blocks)
+    {
+        std::deque<Block> &pending = piece_vec[index].pending_blocks;
+        while (blocks.size() < count && !pending.empty())
         {
-            uint32_t block_index = begin / Piece::block_size;                             // the index of the block that we are writing
-            memcpy(piece_vec[index].data.get() + begin, buff->ptr.get() + idx, data_len); // write the block to the piece's buffer
-            piece_vec[index].block_bitfield->set_bit(block_index);
+            blocks.push_back(pending.front());
+            pending.pop_front();
+        }
+    }
+
+    void Torrent::pick_blocks(int owner, BitField *peer_bitfield, size_t count, std::vector<Block> &blocks)
+    {
+        if (peer_bitfield == nullptr)
+        {
+            return;
+        }
+        size_t first = blocks.size();
+
+        // finish the pieces that are already started
+        for (uint32_t index : active_pieces)
+        {
+            if (peer_bitfield->is_bit_set(index))
+            {
+                take_blocks(index, count, blocks);
+            }
+        }
+
+        // then start the rarest pieces that the peer has
+        while (blocks.size() < count)
+        {
+            int index = picker->pick(peer_bitfield);
+            if (index == -1 || !start_piece(index))
+            {
+                break;
+            }
+            take_blocks(index, count, blocks);
+        }
 
-            // if the piece is now finished, check the hash of the piece
-            if (piece_vec[index].block_bitfield->all_flipped())
+        // in endgame, ask this peer too for the blocks it has that are in flight to others
+        if (blocks.size() < count && all_blocks_in_flight())
+        {
+            if (!endgame)
             {
-                std::string piece_data = std::string((const char *) piece_vec[index].data.get(), piece_vec[index].piece_size);
-                std::string down_piece_hash = Hash::truncated_sha1_hash(piece_data, 20);
-                if (down_piece_hash != piece_vec[index].piece_hash)
+                std::cout << "entering endgame, " << requests.size() << " blocks left in flight" << std::endl;
+                endgame = true;
+            }
+            for (uint32_t index : active_pieces)
+            {
+                Piece &piece = piece_vec[index];
+                if (!peer_bitfield->is_bit_set(index))
+                {
+                    continue;
+                }
+                for (uint32_t i = 0; i < piece.num_blocks && blocks.size() < count; i++)
                 {
-                    std::cout << "piece hash did not match" << std::endl;
-                    // unflip all bits
-                    for (int i = 0; i < piece_vec[index].block_bitfield->num_bits; i++)
+                    uint32_t begin = i * Piece::block_size;
+                    if (!piece.block_bitfield->is_bit_set(i) && requests.contains(index, begin) && !requests.requested_from(index, begin, owner))
                     {
-                        piece_vec[index].block_bitfield->unset_bit(i);
+                        blocks.push_back(Block(index, begin, piece.block_length(i)));
                     }
                 }
+            }
+        }
 
-                // if piece hash matches, then we can just write this piece to out
-                else
-                {
-                    downloaded += piece_vec[index].piece_size;
-                    piece_bitfield->set_bit(index);
-                    std::cout << "piece hash matched, writing to out" << std::endl;
+        for (size_t i = first; i < blocks.size(); i++)
+        {
+            requests.add(blocks[i].index, blocks[i].begin, blocks[i].length, owner);
+        }
+    }
 
-                    // calculate the byte that this piece starts at
-                    uint32_t start_byte = index * piece_length;
-                    out_stream.seekp(start_byte, std::ios::beg);
-                    out_stream.write(reinterpret_cast<char *>(piece_vec[index].data.get()), piece_vec[index].piece_size);
+    bool Torrent::all_blocks_in_flight()
+    {
+        if (picker->num_candidates() != 0)
+        {
+            return false;
+        }
+        for (uint32_t index : active_pieces)
+        {
+            if (!piece_vec[index].pending_blocks.empty())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
 
-                    // free the piece data from memory
-                }
+    void Torrent::take_cancels(int owner, std::vector<Block> &blocks)
+    {
+        auto it = cancels.find(owner);
+        if (it == cancels.end())
+        {
+            return;
+        }
+        blocks.insert(blocks.end(), it->second.begin(), it->second.end());
+        cancels.erase(it);
+    }
+
+    bool Torrent::has_cancels()
+    {
+        return !cancels.empty();
+    }
+
+    size_t Torrent::num_finished()
+    {
+        return finished_log.size();
+    }
+
+    void Torrent::take_finished(size_t &cursor, std::vector<uint32_t> &pieces)
+    {
+        pieces.insert(pieces.end(), finished_log.begin() + cursor, finished_log.end());
+        cursor = finished_log.size();
+    }
+
+    int Torrent::requests_in_flight(int owner)
+    {
+        return requests.count(owner);
+    }
+
+    void Torrent::return_requests(std::vector<InFlightRequest> &returned)
+    {
+        for (InFlightRequest &request : returned)
+        {
+            // ask for returned blocks before blocks that were never asked for, since their pieces are further along
+            Piece &piece = piece_vec[request.index];
+            if (!piece.block_bitfield->is_bit_set(request.begin / Piece::block_size) && !requests.contains(request.index, request.begin))
+            {
+                piece.pending_blocks.push_front(Block(request.index, request.begin, request.length));
             }
         }
+    }
+
+    void Torrent::release_requests(int owner)
+    {
+        std::vector<InFlightRequest> released;
+        requests.release(owner, released);
+        return_requests(released);
+        cancels.erase(owner);
+    }
+
+    void Torrent::expire_requests()
+    {
+        std::vector<InFlightRequest> expired;
+        requests.expire(std::chrono::milliseconds(REQUEST_TIMEOUT_MS), expired);
+        for (InFlightRequest &request : expired)
+        {
+            std::cout << "request timed out: piece index " << request.index << " begin: " << request.begin << std::endl;
+        }
+        return_requests(expired);
+    }
+
+    void Torrent::add_availability(BitField *peer_bitfield)
+    {
+        picker->add_bitfield(peer_bitfield);
+    }
+
+    void Torrent::add_availability(uint32_t index)
+    {
+        picker->increment(index);
+    }
+
+    void Torrent::remove_availability(BitField *peer_bitfield)
+    {
+        picker->remove_bitfield(peer_bitfield);
+    }
+
+    void Torrent::write_block(uint32_t index, uint32_t begin, const uint8_t *data, uint32_t data_len, int owner)
+    {
+        std::cout << "got block: piece index " << index << " begin: " << begin << std::endl;
+
+        uint8_t *dest = block_destination(index, begin, data_len);
+        if (dest != nullptr)
+        {
+            memcpy(dest, data, data_len); // write the block to the piece's buffer
+            block_written(index, begin, owner);
+        }
 
         else
         {
@@ -302,33 +887,261 @@ namespace File
         }
     }
 
+    uint8_t *Torrent::block_destination(uint32_t index, uint32_t begin, uint32_t data_len)
+    {
+        // check that the piece conforms to a block that we requested
+        uint32_t block_index = begin / Piece::block_size; // the index of the block that we are writing
+        bool is_block = index < num_pieces && begin % Piece::block_size == 0 && block_index < piece_vec[index].num_blocks &&
+                        data_len == piece_vec[index].block_length(block_index);
+        uint8_t *dest = is_block ? piece_data(index) : nullptr;
+        if (dest == nullptr || piece_vec[index].block_bitfield->is_bit_set(block_index))
+        {
+            return nullptr;
+        }
+        return dest + begin;
+    }
 
-    Messages::Buffer *SingleFileTorrent::get_piece(uint32_t index, uint32_t begin, uint32_t length)
+    void Torrent::block_written(uint32_t index, uint32_t begin, int owner)
     {
-        uint32_t len = length + sizeof(index) + sizeof(begin) + sizeof(Messages::PIECE_ID);
-        Messages::Buffer *buff = new Messages::Buffer((uint32_t) (len + sizeof(len)));
+        uint32_t block_index = begin / Piece::block_size;
+        uint8_t *dest = piece_data(index);
+        Piece &piece = piece_vec[index];
+        piece.block_bitfield->set_bit(block_index);
+
+        // a block whose request was handed back may still arrive, and must not be asked for again
+        std::vector<InFlightRequest> removed;
+        requests.remove(index, begin, removed);
+        if (removed.empty())
+        {
+            auto pending = std::find_if(piece.pending_blocks.begin(), piece.pending_blocks.end(), [begin](Block &b)
+                                        { return b.begin == begin; });
+            if (pending != piece.pending_blocks.end())
+            {
+                piece.pending_blocks.erase(pending);
+            }
+        }
+
+        // the other peers that were asked for the block in endgame can stop sending it
+        for (InFlightRequest &request : removed)
+        {
+            if (request.owner != owner)
+            {
+                cancels[request.owner].push_back(Block(index, begin, request.length));
+            }
+        }
+
+        if (piece.hash_ctx == nullptr)
+        {
+            if (free_hash_ctxs.empty())
+            {
+                piece.hash_ctx = Hash::sha1sum_ptr(Hash::sha1sum_create(NULL, 0));
+            }
+            else
+            {
+                piece.hash_ctx = std::move(free_hash_ctxs.back());
+                free_hash_ctxs.pop_back();
+            }
+        }
+
+        // hash blocks as they arrive while the piece is unfinished, so that finishing it is cheap
+        if (!piece.block_bitfield->all_flipped())
+        {
+            advance_piece_hash(index, dest);
+        }
+
+        // every block arrived in order, so the piece can be verified right away
+        else if (piece.hashed_blocks + 1 == piece.num_blocks && block_index == piece.num_blocks - 1)
+        {
+            uint8_t checksum[20];
+            Hash::sha1sum_finish(piece.hash_ctx.get(), dest + begin, piece.block_length(block_index), checksum);
+            piece.hashed_blocks = piece.num_blocks;
+            on_piece_verified(index, piece.piece_hash.compare(0, std::string::npos, (const char *)checksum, sizeof(checksum)) == 0);
+        }
+
+        // have the hash pool finish the tail that arrived out of order, in place.
+        // no more blocks are written to the piece while it is being checked, because all of its bits are set
+        else
+        {
+            long long tail_start = piece.hashed_blocks * Piece::block_size;
+            hasher->submit(Hash::HashJob{index, dest + tail_start, (size_t)(piece.piece_size - tail_start), piece.piece_hash, piece.hash_ctx.get()});
+        }
+    }
+
+    int Torrent::hash_notify_fd()
+    {
+        return hasher->notify_fd();
+    }
+
+    void Torrent::advance_piece_hash(uint32_t index, uint8_t *dest)
+    {
+        Piece &piece = piece_vec[index];
+        while (piece.hashed_blocks < piece.num_blocks && piece.block_bitfield->is_bit_set(piece.hashed_blocks))
+        {
+            long long offset = piece.hashed_blocks * Piece::block_size;
+            Hash::sha1sum_update(piece.hash_ctx.get(), dest + offset, piece.block_length(piece.hashed_blocks));
+            piece.hashed_blocks++;
+        }
+    }
+
+    void Torrent::process_hash_results()
+    {
+        std::vector<Hash::HashResult> results;
+        hasher->drain_results(results);
+
+        for (Hash::HashResult &result : results)
+        {
+            on_piece_verified(result.piece_index, result.ok);
+        }
+    }
+
+    void Torrent::on_piece_verified(uint32_t index, bool ok)
+    {
+        Piece &piece = piece_vec[index];
+
+        // start the running hash over, a passing piece hands it on to the next piece
+        Hash::sha1sum_reset(piece.hash_ctx.get());
+        piece.hashed_blocks = 0;
+
+        if (!ok)
+        {
+            std::cout << "piece hash did not match" << std::endl;
+            // unflip all bits
+            for (uint32_t i = 0; i < piece.block_bitfield->num_bits; i++)
+            {
+                piece.block_bitfield->unset_bit(i);
+            }
+
+            // the piece stays started, and every block of it is requested again
+            std::vector<Block> blocks = piece.get_unfinished_blocks();
+            piece.pending_blocks.assign(blocks.begin(), blocks.end());
+            return;
+        }
+
+        free_hash_ctxs.push_back(std::move(piece.hash_ctx));
+        // a stale result may name a piece that is no longer active
+        auto active = std::find(active_pieces.begin(), active_pieces.end(), index);
+        if (active != active_pieces.end())
+        {
+            active_pieces.erase(active);
+        }
+
+        // if piece hash matches, then we can just write this piece to out.
+        // a buffered piece is handed to the disk thread, and is marked as downloaded once it is written.
+        // a mapped piece is already in place in the file
+        if (storage->mapped(0) == nullptr)
+        {
+            std::cout << "piece hash matched, writing to out" << std::endl;
+            pending_writes.push_back(Disk::WriteJob{index, piece_offset(index), piece.data.get(), (uint32_t)piece.piece_size});
+            flush_pending_writes();
+        }
+        else
+        {
+            std::cout << "piece hash matched" << std::endl;
+            finish_piece(index);
+        }
+    }
 
+    void Torrent::finish_piece(uint32_t index)
+    {
+        downloaded += piece_vec[index].piece_size;
+        piece_bitfield->set_bit(index);
+        finished_log.push_back(index);
+    }
+
+    void Torrent::flush_pending_writes()
+    {
+        while (!pending_writes.empty() && disk->submit(pending_writes.front()))
+        {
+            pending_writes.pop_front();
+        }
+    }
+
+    int Torrent::disk_notify_fd()
+    {
+        return disk->notify_fd();
+    }
+
+    void Torrent::process_disk_completions()
+    {
+        std::vector<Disk::WriteResult> results;
+        disk->drain_results(results);
+
+        for (Disk::WriteResult &result : results)
+        {
+            // resume saves finish in the order they were handed over
+            if (result.resume != nullptr)
+            {
+                if (!result.ok)
+                {
+                    std::cout << "failed to save resume data to " << result.resume->path << std::endl;
+                }
+                saving_resume.pop_front();
+                continue;
+            }
+
+            Piece &piece = piece_vec[result.piece_index];
+
+            // the piece is on disk, so free its data from memory. Seeding reads it back from the file
+            if (result.ok)
+            {
+                finish_piece(result.piece_index);
+                piece_pool->release(std::move(piece.data));
+            }
+
+            // keep the buffer, and download the piece again
+            else
+            {
+                std::cout << "failed to write piece " << result.piece_index << std::endl;
+                for (uint32_t i = 0; i < piece.block_bitfield->num_bits; i++)
+                {
+                    piece.block_bitfield->unset_bit(i);
+                }
+                active_pieces.push_back(result.piece_index);
+                std::vector<Block> blocks = piece.get_unfinished_blocks();
+                piece.pending_blocks.assign(blocks.begin(), blocks.end());
+            }
+        }
+
+        // the queue has room again
+        flush_pending_writes();
+    }
+
+    void Torrent::pack_piece_header(uint8_t *dest, uint32_t index, uint32_t begin, uint32_t length)
+    {
+        uint32_t len = length + sizeof(index) + sizeof(begin) + sizeof(Messages::PIECE_ID);
         int idx = 0;
 
         // pack len and idx
         uint32_t big_endian_len = htonl(len);
-        memcpy(buff->ptr.get() + idx, &big_endian_len, sizeof(big_endian_len));
+        memcpy(dest + idx, &big_endian_len, sizeof(big_endian_len));
         idx += sizeof(big_endian_len);
 
-        memcpy(buff->ptr.get() + idx, &Messages::PIECE_ID, sizeof(Messages::PIECE_ID));
+        memcpy(dest + idx, &Messages::PIECE_ID, sizeof(Messages::PIECE_ID));
         idx += sizeof(Messages::PIECE_ID);
 
         // pack index and begin, note that these must be in network endian
         uint32_t big_endian_index = htonl(index);
-        memcpy(buff->ptr.get() + idx, &big_endian_index, sizeof(big_endian_index));
+        memcpy(dest + idx, &big_endian_index, sizeof(big_endian_index));
         idx += sizeof(big_endian_index);
 
         uint32_t big_endian_begin = htonl(begin);
-        memcpy(buff->ptr.get() + idx, &big_endian_begin, sizeof(big_endian_begin));
-        idx += sizeof(big_endian_begin);    
+        memcpy(dest + idx, &big_endian_begin, sizeof(big_endian_begin));
+    }
 
-        memcpy(buff->ptr.get() + idx, piece_vec[index].data.get() + begin, length);
+    bool Torrent::queue_block(Net::SendQueue &queue, uint32_t index, uint32_t begin, uint32_t length)
+    {
+        if (index >= num_pieces || !piece_bitfield->is_bit_set(index) || length == 0 ||
+            (long long)begin + length > piece_vec[index].piece_size)
+        {
+            return false;
+        }
 
-        return buff;
+        std::unique_ptr<uint8_t[]> header = std::make_unique<uint8_t[]>(Messages::PIECE_HEADER_LENGTH);
+        pack_piece_header(header.get(), index, begin, length);
+        queue.push(std::move(header), Messages::PIECE_HEADER_LENGTH);
+
+        // a piece is only in our bitfield once it is on disk, so the block is always sent from storage
+        queue.push_file(storage.get(), piece_offset(index) + begin, length);
+        return true;
     }
-}
\ No newline at end of file
+}
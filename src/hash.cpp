@@ -89,11 +89,16 @@ namespace Hash {
 	}
 
     std::string truncated_sha1_hash(std::string payload, size_t len) {
-		sha1sum_ctx *ctx = sha1sum_create(NULL, 0);
+		return truncated_sha1_hash((const uint8_t *) payload.c_str(), payload.length(), len);
+	}
+
+    std::string truncated_sha1_hash(const uint8_t *payload, size_t payload_len, size_t len) {
+		// reuse one context per thread rather than creating and destroying one for every call
+		static thread_local sha1sum_ptr ctx(sha1sum_create(NULL, 0));
 		char checksum[20];
-        int error = sha1sum_finish(ctx, (const uint8_t *) payload.c_str(), payload.length(), (uint8_t *)checksum);
+		int error = sha1sum_reset(ctx.get());
+        error |= sha1sum_finish(ctx.get(), payload, payload_len, (uint8_t *)checksum);
         assert(!error);
-        assert(sha1sum_destroy(ctx) == 0);
         return std::string(checksum, len);
 	}
 }
\ No newline at end of file
@@ -0,0 +1,108 @@
+#include "hash_pool.hpp"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace Hash
+{
+    HashPool::HashPool(int num_threads)
+    {
+        running = true;
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        if (num_threads < 1)
+        {
+            num_threads = 1;
+        }
+        for (int i = 0; i < num_threads; i++)
+        {
+            workers.push_back(std::thread(&HashPool::run, this));
+        }
+    }
+
+    HashPool::~HashPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+            running = false;
+        }
+        jobs_ready.notify_all();
+
+        for (std::thread &worker : workers)
+        {
+            worker.join();
+        }
+        close(event_fd);
+    }
+
+    void HashPool::submit(HashJob job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+            jobs.push_back(std::move(job));
+        }
+        jobs_ready.notify_one();
+    }
+
+    void HashPool::drain_results(std::vector<HashResult> &out)
+    {
+        // clear the eventfd before popping, so that a result pushed after this point signals again
+        uint64_t count;
+        ssize_t n = read(event_fd, &count, sizeof(count));
+        (void)n;
+
+        std::lock_guard<std::mutex> lock(results_mutex);
+        out.insert(out.end(), results.begin(), results.end());
+        results.clear();
+    }
+
+    int HashPool::notify_fd()
+    {
+        return event_fd;
+    }
+
+    void HashPool::run()
+    {
+        // one context per worker, reused for every piece this worker checks
+        sha1sum_ctx *ctx = sha1sum_create(NULL, 0);
+        uint8_t checksum[20];
+
+        while (true)
+        {
+            HashJob job;
+            {
+                std::unique_lock<std::mutex> lock(jobs_mutex);
+                jobs_ready.wait(lock, [this]
+                                { return !jobs.empty() || !running; });
+
+                if (jobs.empty())
+                {
+                    break;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+
+            // finish the piece's running hash if it has one, otherwise hash the whole piece
+            sha1sum_ctx *job_ctx = job.ctx;
+            if (job_ctx == nullptr)
+            {
+                job_ctx = ctx;
+                sha1sum_reset(job_ctx);
+            }
+            int error = sha1sum_finish(job_ctx, job.data, job.length, checksum);
+            bool ok = !error && job.expected.compare(0, std::string::npos, (const char *)checksum, sizeof(checksum)) == 0;
+
+            {
+                std::lock_guard<std::mutex> lock(results_mutex);
+                results.push_back(HashResult{job.piece_index, ok});
+            }
+
+            uint64_t one = 1;
+            ssize_t n = write(event_fd, &one, sizeof(one));
+            (void)n;
+        }
+
+        sha1sum_destroy(ctx);
+    }
+}
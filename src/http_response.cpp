@@ -0,0 +1,318 @@
+#include "http_response.hpp"
+
+#include <cstring>
+#include <cstdlib>
+#include <strings.h>
+
+namespace TrackerProtocol
+{
+    // whether the header line starts with the name, followed by its colon, in any case
+    static bool header_is(const std::string &line, const char *name)
+    {
+        size_t length = strlen(name);
+        return line.size() > length && line[length] == ':' && strncasecmp(line.data(), name, length) == 0;
+    }
+
+    // the value of a header line, without the spaces around it
+    static const char *header_value(const std::string &line, size_t *value_length)
+    {
+        size_t start = line.find(':') + 1;
+        size_t end = line.size();
+        while (start < end && (line[start] == ' ' || line[start] == '\t'))
+        {
+            start++;
+        }
+        while (end > start && (line[end - 1] == ' ' || line[end - 1] == '\t'))
+        {
+            end--;
+        }
+        *value_length = end - start;
+        return line.data() + start;
+    }
+
+    // whether the value has token as one of its comma separated parts, in any case
+    static bool value_has(const char *value, size_t value_length, const char *token)
+    {
+        size_t length = strlen(token);
+        for (size_t i = 0; i + length <= value_length; i++)
+        {
+            bool starts = i == 0 || value[i - 1] == ',' || value[i - 1] == ' ';
+            bool ends = i + length == value_length || value[i + length] == ',' || value[i + length] == ' ' || value[i + length] == ';';
+            if (starts && ends && strncasecmp(value + i, token, length) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    HttpResponse::HttpResponse(size_t max_header_size, size_t max_body_size)
+    {
+        this->max_header_size = max_header_size;
+        this->max_body_size = max_body_size;
+        reset();
+    }
+
+    void HttpResponse::reset()
+    {
+        state = STATUS_LINE;
+        line.clear();
+        header_size = 0;
+        content_length = -1;
+        remaining = 0;
+        chunked = false;
+        status = 0;
+        keep_alive = false;
+        body.clear();
+        error.clear();
+    }
+
+    void HttpResponse::fail(const std::string &reason)
+    {
+        state = FAILED;
+        error = reason;
+    }
+
+    size_t HttpResponse::feed(const char *data, size_t length)
+    {
+        size_t used = 0;
+        while (used < length && state != COMPLETE && state != FAILED)
+        {
+            // body bytes go straight to the body
+            if (state == BODY || state == CHUNK_DATA)
+            {
+                size_t take = length - used;
+                if (remaining >= 0 && (size_t)remaining < take)
+                {
+                    take = remaining;
+                }
+                if (body.size() + take > max_body_size)
+                {
+                    fail("body too large");
+                    break;
+                }
+                body.append(data + used, take);
+                used += take;
+                if (remaining >= 0)
+                {
+                    remaining -= take;
+                    if (remaining == 0)
+                    {
+                        state = state == BODY ? COMPLETE : CHUNK_END;
+                    }
+                }
+                continue;
+            }
+
+            // everything else is lines, which are gathered until their line break
+            const char *newline = (const char *)memchr(data + used, '\n', length - used);
+            size_t take = newline != nullptr ? newline - (data + used) + 1 : length - used;
+            bool header = state == STATUS_LINE || state == HEADERS || state == TRAILERS;
+            if (header ? header_size + take > max_header_size : line.size() + take > MAX_CHUNK_LINE)
+            {
+                fail(header ? "headers too large" : "chunk size line too long");
+                break;
+            }
+            line.append(data + used, take);
+            used += take;
+            if (header)
+            {
+                header_size += take;
+            }
+
+            if (newline != nullptr)
+            {
+                // lines end in CRLF, but a bare LF is taken too
+                line.pop_back();
+                if (!line.empty() && line.back() == '\r')
+                {
+                    line.pop_back();
+                }
+                handle_line();
+                line.clear();
+            }
+        }
+        return used;
+    }
+
+    void HttpResponse::handle_line()
+    {
+        switch (state)
+        {
+        case STATUS_LINE:
+        {
+            // "HTTP/1.1 200 OK". HTTP/1.1 connections stay open unless a header says otherwise, HTTP/1.0 ones do not
+            if (line.size() < 12 || line.compare(0, 7, "HTTP/1.") != 0 || line[8] != ' ')
+            {
+                fail("bad status line");
+                return;
+            }
+            status = atoi(line.c_str() + 9);
+            keep_alive = line[7] == '1';
+            state = HEADERS;
+            break;
+        }
+        case HEADERS:
+        {
+            if (line.empty())
+            {
+                start_body();
+            }
+            else
+            {
+                handle_header();
+            }
+            break;
+        }
+        case CHUNK_SIZE:
+        {
+            // the size is in hex, and may be followed by extensions after a semicolon
+            char *end;
+            long long size = strtoll(line.c_str(), &end, 16);
+            if (end == line.c_str() || size < 0 || (*end != '\0' && *end != ';' && *end != ' '))
+            {
+                fail("bad chunk size");
+                return;
+            }
+            if (size == 0)
+            {
+                state = TRAILERS;
+            }
+            else if (body.size() + size > max_body_size)
+            {
+                fail("body too large");
+            }
+            else
+            {
+                remaining = size;
+                state = CHUNK_DATA;
+            }
+            break;
+        }
+        case CHUNK_END:
+        {
+            if (!line.empty())
+            {
+                fail("chunk longer than its size");
+                return;
+            }
+            state = CHUNK_SIZE;
+            break;
+        }
+        case TRAILERS:
+        {
+            // trailer fields are not needed
+            if (line.empty())
+            {
+                state = COMPLETE;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    void HttpResponse::handle_header()
+    {
+        if (line.find(':') == std::string::npos)
+        {
+            fail("bad header line");
+            return;
+        }
+        size_t value_length;
+        const char *value = header_value(line, &value_length);
+
+        if (header_is(line, "content-length"))
+        {
+            char *end;
+            content_length = strtoll(value, &end, 10);
+            if (end == value || end != value + value_length || content_length < 0)
+            {
+                fail("bad content length");
+            }
+        }
+        else if (header_is(line, "transfer-encoding"))
+        {
+            chunked = value_has(value, value_length, "chunked");
+        }
+        else if (header_is(line, "connection"))
+        {
+            if (value_has(value, value_length, "close"))
+            {
+                keep_alive = false;
+            }
+            else if (value_has(value, value_length, "keep-alive"))
+            {
+                keep_alive = true;
+            }
+        }
+    }
+
+    void HttpResponse::start_body()
+    {
+        // an interim response such as 100 Continue is followed by the real one
+        if (status >= 100 && status < 200)
+        {
+            state = STATUS_LINE;
+            content_length = -1;
+            chunked = false;
+            return;
+        }
+
+        // these never have a body
+        if (status == 204 || status == 304)
+        {
+            state = COMPLETE;
+        }
+        else if (chunked)
+        {
+            state = CHUNK_SIZE;
+        }
+        else if (content_length >= 0)
+        {
+            if ((size_t)content_length > max_body_size)
+            {
+                fail("body too large");
+                return;
+            }
+            remaining = content_length;
+            state = remaining == 0 ? COMPLETE : BODY;
+        }
+
+        // without a length, the body ends when the connection does
+        else
+        {
+            remaining = -1;
+            keep_alive = false;
+            state = BODY;
+        }
+    }
+
+    void HttpResponse::finish()
+    {
+        if (state == BODY && remaining < 0)
+        {
+            state = COMPLETE;
+        }
+        else if (state != COMPLETE && state != FAILED)
+        {
+            fail("connection closed before the response was complete");
+        }
+    }
+
+    bool HttpResponse::empty()
+    {
+        return state == STATUS_LINE && header_size == 0;
+    }
+
+    bool HttpResponse::complete()
+    {
+        return state == COMPLETE;
+    }
+
+    bool HttpResponse::failed()
+    {
+        return state == FAILED;
+    }
+}
@@ -2,18 +2,31 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
-#include <poll.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <queue>
+#include <thread>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <sstream>
+#include <chrono>
 
 #include <argparse/argparse.hpp>
 
 #include "client.hpp"
 #include "peer.hpp"
+#include "session.hpp"
+#include "choker.hpp"
+#include "connection_manager.hpp"
+#include "token_bucket.hpp"
+#include "reactor.hpp"
 #include "message.hpp"
 #include "metainfo.hpp"
 #include "tracker_protocol.hpp"
@@ -21,6 +34,20 @@
 #include "file.hpp"
 #include "hash.h"
 
+// the most time between two rounds in which every session is given a chance to send
+static const int PUMP_INTERVAL_MS = 1000;
+
+// the most time that the trackers are given to take our STOPPED announce on shutdown
+static const int STOP_ANNOUNCE_TIMEOUT_MS = 5000;
+
+// set by SIGINT/SIGTERM so that the event loop can save its state and exit cleanly
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int)
+{
+    stop_requested = 1;
+}
+
 int main(int argc, char *argv[])
 {
     // get arguments from command line
@@ -30,8 +57,27 @@ int main(int argc, char *argv[])
     int port;
     int timeout;
     int outgoing_request_queue_size;
+    int max_outgoing_request_queue_size;
     int incoming_request_queue_size;
     int listen_queue_size;
+    int memory_budget_mb;
+    bool use_mmap;
+    int hash_threads;
+    bool no_resume;
+    int resume_interval;
+    bool recheck;
+    int max_open_files;
+    int stats_interval;
+    int unchoke_slots;
+    int upload_limit;
+    int download_limit;
+    int torrent_upload_limit;
+    int torrent_download_limit;
+    int peer_upload_limit;
+    int peer_download_limit;
+    bool limit_commands;
+    int max_half_open;
+    int max_peers;
 
     int newfd;
     sockaddr_storage remoteaddr;
@@ -42,9 +88,28 @@ int main(int argc, char *argv[])
     program.add_argument("-id").default_value("EZ6969").store_into(client_id);
     program.add_argument("-p").default_value(6881).store_into(port);
     program.add_argument("-t").default_value(120 * 1000).store_into(timeout); // default timeout to 2 minutes
-    program.add_argument("-oq").default_value(10).store_into(outgoing_request_queue_size);
-    program.add_argument("-iq").default_value(30).store_into(incoming_request_queue_size);
+    program.add_argument("-oq").default_value(10).store_into(outgoing_request_queue_size);      // fewest requests outstanding per peer
+    program.add_argument("-oqx").default_value(500).store_into(max_outgoing_request_queue_size); // most requests outstanding per peer, for fast peers
+    program.add_argument("-iq").default_value(500).store_into(incoming_request_queue_size);
     program.add_argument("-lq").default_value(20).store_into(listen_queue_size);
+    program.add_argument("-mb").default_value(256).store_into(memory_budget_mb); // memory budget for in flight pieces, in MiB
+    program.add_argument("-mmap").flag().store_into(use_mmap);                     // write blocks straight into a mapped output file
+    program.add_argument("-ht").default_value((int)std::max(1u, std::thread::hardware_concurrency() - 1)).store_into(hash_threads); // threads that verify pieces
+    program.add_argument("-nr").flag().store_into(no_resume);                          // do not load or save fast resume data
+    program.add_argument("-ri").default_value(30).store_into(resume_interval);         // seconds between saves of fast resume data
+    program.add_argument("-c").flag().store_into(recheck);                             // hash an existing download on startup even if resume data covers it
+    program.add_argument("-of").default_value(File::DEFAULT_MAX_OPEN_FILES).store_into(max_open_files); // files of a multi file torrent kept open at once
+    program.add_argument("-si").default_value(10).store_into(stats_interval);           // seconds between per peer stats lines, 0 to disable
+    program.add_argument("-us").default_value(Peer::DEFAULT_UNCHOKE_SLOTS).store_into(unchoke_slots); // peers uploaded to at once, with the optimistic unchoke
+    program.add_argument("-ul").default_value(0).store_into(upload_limit);             // KiB/s uploaded by the whole client, 0 for unlimited
+    program.add_argument("-dl").default_value(0).store_into(download_limit);           // KiB/s downloaded by the whole client, 0 for unlimited
+    program.add_argument("-tul").default_value(0).store_into(torrent_upload_limit);    // KiB/s uploaded for the torrent, 0 for unlimited
+    program.add_argument("-tdl").default_value(0).store_into(torrent_download_limit);  // KiB/s downloaded for the torrent, 0 for unlimited
+    program.add_argument("-pul").default_value(0).store_into(peer_upload_limit);       // KiB/s uploaded to each peer, 0 for unlimited
+    program.add_argument("-pdl").default_value(0).store_into(peer_download_limit);     // KiB/s downloaded from each peer, 0 for unlimited
+    program.add_argument("-lc").flag().store_into(limit_commands);                    // read rate limit changes from stdin while running
+    program.add_argument("-ho").default_value(Peer::DEFAULT_MAX_HALF_OPEN).store_into(max_half_open); // connects to peers in progress at once
+    program.add_argument("-mp").default_value(Peer::DEFAULT_MAX_PEERS).store_into(max_peers);         // connected peers, incoming and outgoing, at most
 
     try
     {
@@ -60,456 +125,328 @@ int main(int argc, char *argv[])
     // get our address
     self_addr = get_self_sockaddr(port);
 
-    // send to tracker, get peers
-    TrackerProtocol::TrackerManager tracker(torrent_file, Client::unique_peer_id(client_id), port);
-    tracker.send_http();
-    tracker.recv_http();
-
-    // request queue for seeding
-    std::queue<File::Block> requests;
-
-    // get all base peers from the tracker
-    std::vector<Peer::PeerClient> peers = tracker.peers;
-
-    // remove this client from the peers list
-    // we assume that the peers list contains peers that do not include ourselves
-    peers.erase(std::remove_if(peers.begin(), peers.end(), [&](Peer::PeerClient peer)
-                               { return peer.sockaddr.sin_addr.s_addr == self_addr.sin_addr.s_addr &&
-                                        peer.sockaddr.sin_port == self_addr.sin_port; }),
-                peers.end());
-
-    std::cout << "Got: " << peers.size() << " peers " << std::endl;
-
-    // remove self from the peer list
-    int fd_count = peers.size() + 1;
-
-    // set up poll vector
-    std::vector<pollfd> pfds = std::vector<pollfd>(fd_count);
-
     // get 20 byte info hash
     std::string metainfo_buffer = Metainfo::read_metainfo_to_buffer(torrent_file);
     std::string info_dict_str = Metainfo::read_info_dict_str(metainfo_buffer);
     std::string info_hash = Hash::truncated_sha1_hash(info_dict_str, 20);
-    File::SingleFileTorrent torrent = File::SingleFileTorrent(metainfo_buffer);
-
-    // get listener socket
-    int listener = get_listener_socket(port, listen_queue_size);
-    fcntl(listener, F_SETFL, O_NONBLOCK);
 
-    // add the listener socket
-    pfds[0].fd = listener;
-    pfds[0].events = POLLIN;
-
-    // create socket for all peers, and set to nonblocking
-    // connect on these sockets
-    for (int i = 1; i < pfds.size(); i++)
+    File::TorrentConfig config;
+    config.memory_budget = (long long)memory_budget_mb * 1024 * 1024;
+    config.storage_mode = use_mmap ? File::StorageMode::MMAP : File::StorageMode::PWRITE;
+    config.hash_threads = hash_threads;
+    config.resume = !no_resume;
+    config.recheck = recheck;
+    config.max_open_files = max_open_files;
+    std::unique_ptr<File::Torrent> torrent = File::create_torrent(metainfo_buffer, config);
+
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+    signal(SIGPIPE, SIG_IGN); // sendfile to a closed peer must fail instead of killing us
+
+    // curl's global state is set up once, before any tracker uses curl, and torn down on exit
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    time_t last_resume_save = time(nullptr);
+    time_t last_pump = time(nullptr);
+    time_t last_stats = time(nullptr);
+    time_t last_choke = time(nullptr);
+
+    Net::Reactor reactor;
+
+    Peer::SessionContext context;
+    context.torrent = torrent.get();
+    context.reactor = &reactor;
+    context.info_hash = info_hash;
+    context.client_id = client_id;
+    context.outgoing_request_queue_size = outgoing_request_queue_size;
+    context.max_outgoing_request_queue_size = std::max(outgoing_request_queue_size, max_outgoing_request_queue_size);
+    context.incoming_request_queue_size = incoming_request_queue_size;
+    context.interest_changed = false;
+
+    // rate limits, in bytes per second. The global limits would be shared by the contexts of every torrent
+    Util::BandwidthLimit global_limit;
+    global_limit.upload.set_rate((long long)upload_limit * 1024);
+    global_limit.download.set_rate((long long)download_limit * 1024);
+    context.global_limit = &global_limit;
+    context.torrent_limit.upload.set_rate((long long)torrent_upload_limit * 1024);
+    context.torrent_limit.download.set_rate((long long)torrent_download_limit * 1024);
+    context.peer_upload_limit = (long long)peer_upload_limit * 1024;
+    context.peer_download_limit = (long long)peer_download_limit * 1024;
+    auto last_refill = std::chrono::steady_clock::now();
+
+    // every connected peer, by socket, so that closed sessions are removed in O(1)
+    std::unordered_map<int, std::unique_ptr<Peer::Session>> sessions;
+
+    // give every session a chance to send requests, after the torrent's state changed under them
+    bool pump_all = false;
+    auto pump_sessions = [&]()
     {
-        // create and set socket to be non blocking
-        int peer_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        fcntl(peer_sock, F_SETFL, O_NONBLOCK);
-
-        pfds[i].fd = peer_sock;
-        pfds[i].events = POLLIN | POLLOUT;
-        peers[i - 1].socket = peer_sock;
-        int connect_ret = connect(peer_sock, (sockaddr *)(&peers[i - 1].sockaddr), sizeof(sockaddr_in));
-
-        // connecting on non blocking sockets should give EINPROGRESS
-        if (errno != EINPROGRESS)
+        for (auto &entry : sessions)
         {
-            std::cout << "Nonblocking connect failed" << std::endl;
-            std::cout << strerror(errno) << std::endl;
+            entry.second->pump();
         }
-    }
+        pump_all = false;
+    };
 
-    // main poll event loop
-    while (true)
+    // decides which peers we upload to
+    Peer::Choker choker(unchoke_slots);
+    auto session_list = [&]()
     {
-        int poll_peers = poll(pfds.data(), pfds.size(), timeout);
+        std::vector<Peer::Session *> list;
+        for (auto &entry : sessions)
+        {
+            list.push_back(entry.second.get());
+        }
+        return list;
+    };
 
-        // no peers responded
-        // should send another request to tracker
+    // buckets are only refilled on a timer while some limit is set
+    auto limited = [&]()
+    {
+        return global_limit.upload.rate() != 0 || global_limit.download.rate() != 0 || context.torrent_limit.upload.rate() != 0 ||
+               context.torrent_limit.download.rate() != 0 || context.peer_upload_limit != 0 || context.peer_download_limit != 0;
+    };
 
-        for (int i = 0; i < pfds.size(); i++)
+    // with -lc, lines on stdin change a limit while we run: "<global|torrent|peer> <up|down> <KiB/s>", 0 for unlimited
+    std::string command_buffer;
+    Net::CallbackHandler command_handler([&]()
+                                         {
+        char buf[256];
+        ssize_t n;
+        while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0)
         {
-            int peer_idx = i - 1;
+            command_buffer.append(buf, n);
+        }
 
-            if (pfds[i].revents & POLLOUT)
+        size_t newline;
+        while ((newline = command_buffer.find('\n')) != std::string::npos)
+        {
+            std::istringstream line(command_buffer.substr(0, newline));
+            command_buffer.erase(0, newline + 1);
+
+            std::string scope;
+            std::string direction;
+            long long kib = -1;
+            line >> scope >> direction >> kib;
+            if ((direction != "up" && direction != "down") || kib < 0)
             {
-                // verify that we're connected
-                int error = 0;
-                socklen_t len = sizeof(error);
-                int retval = getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len);
-
-                // if we haven't handshake with this peer yet, send handshake
-                if (retval == 0 && !peers[peer_idx].sent_shake)
-                {
-                    Messages::Handshake client_handshake = Messages::Handshake(19, "BitTorrent protocol", info_hash, client_id);
-                    Messages::Buffer *buff = client_handshake.pack();
-
-                    // send the buffer over the wire
-                    uint32_t remaining_bytes = buff->total_length;
-                    assert(sendall(pfds[i].fd, (buff->ptr).get(), &remaining_bytes) >= 0);
-                    delete buff;
-
-                    peers[peer_idx].sent_shake = true;
-                }
-
-                // if we arent already interested in this peer, see if we got their bitfield
-                // then check if they have any pieces we need. If they do, then send an interested message
-                else if (retval == 0 && peers[peer_idx].peer_bitfield != nullptr && !peers[peer_idx].am_interested)
-                {
-                    int match_idx = torrent.piece_bitfield->first_match(peers[peer_idx].peer_bitfield);
-
-                    // we need a piece from this peer, so send interested
-                    if (match_idx != -1)
-                    {
-                        Messages::Interested interested_msg = Messages::Interested();
-                        Messages::Buffer *buff = interested_msg.pack();
-
-                        uint32_t remaining_bytes = buff->total_length;
-                        assert(sendall(pfds[i].fd, (buff->ptr).get(), &remaining_bytes) >= 0);
-
-                        delete buff;
-                        peers[peer_idx].am_interested = true;
-
-                        std::cout << "sent interested" << std::endl;
-                    }
-                }
-
-                // if we are interested in this peer, see if they still have any pieces we need
-                // if they dont, update by sending not interested. If they do, send requests if we arent choked
-                else if (retval == 0 && peers[peer_idx].am_interested && !peers[peer_idx].peer_choking)
-                {
-                    int match_idx = torrent.piece_bitfield->first_match(peers[peer_idx].peer_bitfield);
-
-                    // we should be notinterested, so send this message to our peer
-                    if (match_idx == -1)
-                    {
-                        Messages::NotInterested notinterested_msg = Messages::NotInterested();
-                        Messages::Buffer *buff = notinterested_msg.pack();
-
-                        uint32_t remaining_bytes = buff->total_length;
-                        assert(sendall(pfds[i].fd, (buff->ptr).get(), &remaining_bytes) >= 0);
-
-                        delete buff;
-                        peers[peer_idx].am_interested = false;
-                        std::cout << "sent notinterested" << std::endl;
-                    }
-
-                    // peer still has pieces we need, so send requests (number of reqs based on args)
-                    // try to maintain 10 requests outgoing for this peer.
-                    else
-                    {
-                        // if block queue is empty, try to refresh
-
-                        if (torrent.block_queue.empty())
-                        {
-                            torrent.update_block_queue();
-                        }
-
-                        // send at most outgoing_request_queue_size requests
-                        while (!torrent.block_queue.empty() && peers[peer_idx].outgoing_requests < outgoing_request_queue_size)
-                        {
-                            File::Block block = torrent.block_queue.front();
-                            Messages::Request request = Messages::Request(block.index, block.begin, block.length);
-                            Messages::Buffer *buff = request.pack();
-                            uint32_t remaining_bytes = buff->total_length;
-                            assert(sendall(pfds[i].fd, (buff->ptr).get(), &remaining_bytes) >= 0);
-
-                            std::cout << "sent request: " << block.to_string() << std::endl;
-
-                            delete buff;
-                            peers[peer_idx].outgoing_requests++;
-                            torrent.block_queue.pop();
-                        }
-                    }
-                }
+                std::cout << "usage: <global|torrent|peer> <up|down> <KiB/s>" << std::endl;
+                continue;
+            }
+            bool up = direction == "up";
+            long long rate = kib * 1024;
 
-                else if (requests.size() < outgoing_request_queue_size && peers[peer_idx].am_choking)
+            if (scope == "global")
+            {
+                (up ? global_limit.upload : global_limit.download).set_rate(rate);
+            }
+            else if (scope == "torrent")
+            {
+                (up ? context.torrent_limit.upload : context.torrent_limit.download).set_rate(rate);
+            }
+            else if (scope == "peer")
+            {
+                (up ? context.peer_upload_limit : context.peer_download_limit) = rate;
+                for (auto &entry : sessions)
                 {
-                    Messages::Unchoke unchoke_msg = Messages::Unchoke();
-                    Messages::Buffer *buff = unchoke_msg.pack();
-
-                    uint32_t remaining_bytes = buff->total_length;
-                    assert(sendall(pfds[i].fd, (buff->ptr).get(), &remaining_bytes) >= 0);
-
-                    delete buff;
-                    peers[peer_idx].am_choking = false;
-                    std::cout << "sent unchoke" << std::endl;
+                    Util::BandwidthLimit &limit = entry.second->limit;
+                    (up ? limit.upload : limit.download).set_rate(rate);
                 }
+            }
+            else
+            {
+                std::cout << "usage: <global|torrent|peer> <up|down> <KiB/s>" << std::endl;
+                continue;
+            }
+            std::cout << scope << " " << direction << " limit set to " << kib << " KiB/s" << std::endl;
 
-                else if (requests.size() >= outgoing_request_queue_size && !peers[peer_idx].am_choking) {
-                    Messages::Choke choke_msg = Messages::Choke();
-                    Messages::Buffer *buff = choke_msg.pack();
-
-                    uint32_t remaining_bytes = buff->total_length;
-                    assert(sendall(pfds[i].fd, (buff->ptr).get(), &remaining_bytes) >= 0);
-
-                    delete buff;
-                    peers[peer_idx].am_choking = true;
-                    std::cout << "sent choke" << std::endl;
-                }
+            // sessions that a lifted limit stopped carry on at the next refill
+            last_refill = std::chrono::steady_clock::now() - std::chrono::milliseconds(Util::REFILL_INTERVAL_MS);
+        } });
+    if (limit_commands)
+    {
+        fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+        reactor.add(STDIN_FILENO, EPOLLIN, &command_handler);
+    }
 
-                // if peer refuses/resets the connection,
-                // set their socket to not be polled
-                if (retval != 0)
-                {
-                    std::cout << "getsockopt failed" << std::endl;
-                    std::cout << strerror(retval) << std::endl;
-                    pfds[i].fd = -1;
-                }
+    // connects to the peers that the trackers return, and starts a session for each connection that succeeds
+    Peer::ConnectionManager connections(&reactor, self_addr, max_half_open, max_peers, [&](Peer::PeerClient &peer)
+                                        {
+        sessions[peer.socket] = std::make_unique<Peer::Session>(context, peer);
+        sessions[peer.socket]->pump(); });
 
-                if (error != 0)
-                {
-                    std::cout << "getsockopt error" << std::endl;
-                    std::cout << strerror(error) << std::endl;
-                    pfds[i].fd = -1;
-                }
+    // get listener socket, and accept every pending connection when it is readable
+    int listener = get_listener_socket(port, listen_queue_size);
+    fcntl(listener, F_SETFL, O_NONBLOCK);
 
-                
+    Net::CallbackHandler accept_handler([&]()
+                                        {
+        while (true)
+        {
+            addrlen = sizeof(remoteaddr);
+            newfd = accept4(listener, (sockaddr *)&remoteaddr, &addrlen, SOCK_NONBLOCK);
+            if (newfd == -1)
+            {
+                break;
             }
 
-            // check if new connections can be made
-            if (pfds[i].revents & POLLIN && pfds[i].fd == listener)
+            // the connects we started count against the limit too, since they are about to be peers
+            if (sessions.size() + connections.half_open() >= (size_t)max_peers)
             {
-                addrlen = sizeof(remoteaddr);
-                newfd = accept(listener, (sockaddr *)&remoteaddr, &addrlen);
-
-                // add the new connection to our list
-                if (newfd != -1)
-                {
-                    pfds.push_back(pollfd());
-                    pfds[pfds.size() - 1].fd = newfd;
-                    pfds[pfds.size() - 1].events = POLLIN | POLLOUT;
-                    // add a new peer object
-                    peers.push_back(Peer::PeerClient());
-                    peers[peers.size() - 1].socket = newfd;
-                }
+                close(newfd);
+                continue;
             }
 
-            // ready to read on the peer socket
-            else if (pfds[i].revents & POLLIN)
+            // add a new peer object for the connection
+            Peer::PeerClient peer = Peer::PeerClient();
+            if (remoteaddr.ss_family == AF_INET)
             {
-                int bytes_recv = 0;
-
-                // peek the recv to see if the connection has closed
-                uint8_t dummy_byte[4];
-                int peek_recv = recv(pfds[i].fd, &dummy_byte, 4, MSG_PEEK);
-
-                // error occurred on the peer client
-                if (peek_recv == -1)
-                {
-                    std::cout << "Recv failed: " << strerror(errno) << std::endl;
-                    std::cout << peers[peer_idx].to_string() << std::endl;
-
-                    // stop polling the socket
-                    pfds[i].fd = -1;
-                }
-
-                // socket has closed by the peer client
-                else if (peek_recv == 0)
-                {
-                    std::cout << "peer connection closed: " << i << std::endl;
-                    pfds[i].fd = -1;
-                }
-
-                // the peer is sending a continuation of a previous message
-                // place the new bytes in the previously made buffer, and continue
-                else if (peers[peer_idx].reading)
-                {
-                    uint32_t total_len = (peers[peer_idx].buffer)->total_length;
-                    uint32_t bytes_read = (peers[peer_idx].buffer)->bytes_read;
+                peer.sockaddr = *(sockaddr_in *)&remoteaddr;
+            }
+            peer.socket = newfd;
+            peer.connected = true;
+            sessions[newfd] = std::make_unique<Peer::Session>(context, peer);
+            sessions[newfd]->pump();
+        } });
+    reactor.add(listener, EPOLLIN, &accept_handler);
+
+    // the disk thread finished writing pieces or saving resume data
+    Net::CallbackHandler disk_handler([&]()
+                                      {
+        torrent->process_disk_completions();
+        pump_all = true; });
+    reactor.add(torrent->disk_notify_fd(), EPOLLIN, &disk_handler);
+
+    // the hash pool finished verifying pieces
+    Net::CallbackHandler hash_handler([&]()
+                                      {
+        torrent->process_hash_results();
+        pump_all = true; });
+    reactor.add(torrent->hash_notify_fd(), EPOLLIN, &hash_handler);
+
+    // announce to the trackers from the event loop, with the torrent's totals at the time of each announce
+    TrackerProtocol::TrackerManager tracker(metainfo_buffer, Client::unique_peer_id(client_id), port, &reactor, [&]()
+                                            { return TrackerProtocol::AnnounceStats{torrent->uploaded, torrent->downloaded, torrent->bytes_left()}; }, [&](std::vector<Peer::PeerClient> &peers)
+                                            { connections.add_peers(peers); });
+    tracker.tick(true);
+
+    // main event loop, runs until we are asked to stop
+    while (!stop_requested)
+    {
+        // wake up in time to save resume data, and to pump every session
+        int wait_ms = std::min({timeout, resume_interval * 1000, PUMP_INTERVAL_MS});
+        reactor.run_once(limited() ? std::min(wait_ms, Util::REFILL_INTERVAL_MS) : wait_ms);
+        if (stop_requested)
+        {
+            break;
+        }
 
-                    // request the remaining number of bytes
-                    // place into ptr + bytes_read
-                    bytes_recv = recv(pfds[i].fd, ((peers[peer_idx].buffer)->ptr).get() + bytes_read, total_len - bytes_read, 0);
-                    peers[peer_idx].buffer->bytes_read += bytes_recv;
-                }
+        // add the tokens for the time that passed, widest scope first, so that sessions that a limit stopped
+        // find the global and torrent tokens when they carry on
+        auto now = std::chrono::steady_clock::now();
+        long long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_refill).count();
+        if (elapsed_ms >= Util::REFILL_INTERVAL_MS)
+        {
+            global_limit.upload.refill(elapsed_ms);
+            global_limit.download.refill(elapsed_ms);
+            context.torrent_limit.upload.refill(elapsed_ms);
+            context.torrent_limit.download.refill(elapsed_ms);
+            for (auto &entry : sessions)
+            {
+                entry.second->refill(elapsed_ms);
+            }
+            last_refill = now;
+        }
 
-                // peer is sending a new handshake message
-                else if (!peers[peer_idx].recv_shake)
-                {
-                    uint8_t pstrlen;
+        // destroy the sessions that closed while handling events
+        for (int fd : context.closed)
+        {
+            auto it = sessions.find(fd);
+            if (it != sessions.end())
+            {
+                connections.disconnected(it->second->peer.sockaddr, it->second->peer.download_rate.total_bytes());
+                sessions.erase(it);
+            }
+        }
+        context.closed.clear();
 
-                    // recv first byte. Note that because we peeked, this should give > 0 bytes
-                    bytes_recv = recv(pfds[i].fd, &pstrlen, 1, 0);
+        // the peers that we upload to are chosen again every round, by how fast they send to us, or how fast they take
+        // from us once we are seeding. A peer that becomes interested between rounds takes a free slot if there is one
+        if (time(nullptr) - last_choke >= Peer::CHOKE_INTERVAL_SECONDS)
+        {
+            std::vector<Peer::Session *> list = session_list();
+            choker.rechoke(list, torrent->piece_bitfield->all_flipped());
+            last_choke = time(nullptr);
+            context.interest_changed = false;
+            pump_all = true;
+        }
+        else if (context.interest_changed)
+        {
+            std::vector<Peer::Session *> list = session_list();
+            choker.fill_slots(list);
+            context.interest_changed = false;
+            pump_all = true;
+        }
 
-                    // create a buffer for the handshake length
-                    peers[peer_idx].buffer = new Messages::Buffer(pstrlen);
+        // cancels for endgame duplicates are sent right away
+        if (pump_all || torrent->has_cancels() || time(nullptr) - last_pump >= PUMP_INTERVAL_MS / 1000)
+        {
+            // requests that went unanswered for too long are handed to whichever peer pumps next
+            torrent->expire_requests();
+            pump_sessions();
+            last_pump = time(nullptr);
+        }
 
-                    // write pstrlen into the buffer
-                    memcpy(peers[peer_idx].buffer->ptr.get(), &pstrlen, sizeof(pstrlen));
-                    (peers[peer_idx].buffer)->bytes_read += bytes_recv;
+        if (stats_interval > 0 && time(nullptr) - last_stats >= stats_interval)
+        {
+            for (auto &entry : sessions)
+            {
+                std::cout << entry.second->stats() << std::endl;
+            }
+            last_stats = time(nullptr);
+        }
 
-                    // recv for rest of the bytes
-                    bytes_recv = recv(pfds[i].fd, peers[peer_idx].buffer->ptr.get() + sizeof(pstrlen), 49 + pstrlen - sizeof(pstrlen), 0);
-                    peers[peer_idx].buffer->bytes_read += bytes_recv;
-                    peers[peer_idx].reading |= true;
-                }
+        // start connects while there is room for more peers, and give up on the ones that hang
+        connections.tick(sessions.size());
 
-                // peer is sending other new messages...
-                // read the first 4 bytes, alloc the buffer, try to recv
-                else if (peers[peer_idx].sent_shake && peers[peer_idx].recv_shake)
-                {
-                    uint32_t len;
-                    uint8_t id;
-                    bytes_recv = recv(pfds[i].fd, &len, sizeof(len), 0);
-                    len = ntohl(len); // len is in big endian, so convert
-
-                    // non keep alive message
-                    // note that any fields that we write here will be in big endian, so we need to convert
-                    // downstream.
-                    if (len > 0 && bytes_recv > 0)
-                    {
-                        bytes_recv = recv(pfds[i].fd, &id, sizeof(id), 0);
-
-                        peers[peer_idx].buffer = new Messages::Buffer(len + 4); // need to include the length field
-
-                        // move the pointer when we write
-                        int idx = 0;
-                        memcpy(peers[peer_idx].buffer->ptr.get() + idx, &len, sizeof(len)); // write len into the buffer
-                        idx += sizeof(len);
-
-                        memcpy(peers[peer_idx].buffer->ptr.get() + idx, &id, sizeof(id)); // write id into the buffer
-                        idx += sizeof(id);
-
-                        (peers[peer_idx].buffer)->bytes_read += idx;
-
-                        // recv the payload if theres more
-                        bytes_recv = recv(pfds[i].fd, peers[peer_idx].buffer->ptr.get() + idx, len - sizeof(id), 0);
-                        peers[peer_idx].buffer->bytes_read += bytes_recv;
-                        peers[peer_idx].reading |= true;
-                    }
-                }
+        // re-announce when the trackers' intervals are up, and give up on announces that hang. A torrent that is
+        // out of peers to connect to asks for more as soon as the trackers allow
+        tracker.tick(connections.want_peers(sessions.size()));
 
-                // if the recv we did for the peer resulted in a completed message.
-                // if so, then unpack the message, free the buffer, set reading to false.
-                bool done_recv = (peers[peer_idx].buffer) && (peers[peer_idx].buffer)->bytes_read == (peers[peer_idx].buffer)->total_length;
-                if (done_recv)
-                {
-                    uint8_t id_in_buffer;
-                    // if no handshake yet, then this must be a handshake message
-                    if (!peers[peer_idx].recv_shake)
-                    {
-                        Messages::Handshake peer_handshake = Messages::Handshake(peers[peer_idx].buffer);
-                        peers[peer_idx].recv_shake = true;
-                        peers[peer_idx].peer_id = peer_handshake.get_peer_id();
-                        std::cout << "Handshake: " << peer_handshake.get_peer_id() << std::endl;
-
-                        // if info hash does not match, then we need to close
-                        if (peer_handshake.get_info_hash() != info_hash)
-                        {
-                            pfds[peer_idx].fd = -1;
-                            peers[peer_idx].recv_shake = false;
-                            close(pfds[peer_idx].fd);
-                            std::cout << "Handshake failed" << std::endl;
-                        }
-
-                        // on successful handshake, send our bitfield if we have pieces
-                        else if (torrent.piece_bitfield->first_unflipped() != 0){
-                            Messages::Buffer *buff = torrent.piece_bitfield->pack();
-                            // send the buffer over the wire
-                            uint32_t remaining_bytes = buff->total_length;
-                            assert(sendall(pfds[i].fd, (buff->ptr).get(), &remaining_bytes) >= 0);
-                            delete buff;
-
-                            std::cout << "sent bitfield" << std::endl;
-                        }
-                    }
-
-                    // other messages
-                    else
-                    {
-                        // skip the len field, and read the id
-                        memcpy(&id_in_buffer, peers[peer_idx].buffer->ptr.get() + 4, 1);
-
-                        switch (id_in_buffer)
-                        {
-                        case Messages::CHOKE_ID:
-                        {
-                            peers[peer_idx].peer_choking = true;
-                            std::cout << "got choke" << std::endl;
-                            break;
-                        }
-
-                        case Messages::UNCHOKE_ID:
-                        {
-                            peers[peer_idx].peer_choking = false;
-                            std::cout << "got unchoke" << std::endl;
-                            break;
-                        }
-                        case Messages::INTERESTED_ID:
-                        {
-                            peers[peer_idx].peer_interested = true;
-                            std::cout << "got interested" << std::endl;
-                            break;
-                        }
-                        case Messages::NOTINTERESTED_ID:
-                        {
-                            peers[peer_idx].peer_interested = false;
-                            std::cout << "got notinterested" << std::endl;
-                            break;
-                        }
-                        case Messages::HAVE_ID:
-                        {
-                            std::cout << "got have" << std::endl;
-                            break;
-                        }
-                        case Messages::BITFIELD_ID:
-                        {
-                            std::cout << "got bitfield" << std::endl;
-                            peers[peer_idx].peer_bitfield = new File::BitField(peers[peer_idx].buffer, torrent.num_pieces);
-                            break;
-                        }
-
-                        // Upon request, serve the piece to the client
-                        case Messages::REQUEST_ID:
-                        {
-                            std::cout << "got request" << std::endl;
-                            // parse buffer
-                            Messages::Request req = Messages::Request(peers[peer_idx].buffer);
-                            Messages::Buffer *buff = torrent.get_piece(req.length, req.begin, req.length);
-                            // send the buffer over the wire
-                            uint32_t remaining_bytes = buff->total_length;
-                            assert(sendall(pfds[i].fd, (buff->ptr).get(), &remaining_bytes) >= 0);
-                            delete buff;
-                            break;
-                        }
-
-                        // Upon getting a piece, parse and write the data to our output
-                        case Messages::PIECE_ID:
-                        {
-                            peers[peer_idx].outgoing_requests--;
-                            torrent.write_block(peers[peer_idx].buffer);
-                            break;
-                        }
-                        }
-                    }
-
-                    // clear out buffer
-                    delete peers[peer_idx].buffer;
-                    peers[peer_idx].buffer = nullptr;
-                    peers[peer_idx].reading = false;
-                }
-            }
+        if (time(nullptr) - last_resume_save >= resume_interval)
+        {
+            torrent->save_resume();
+            last_resume_save = time(nullptr);
         }
 
         // check if the torrent is done, all pieces in piece bitfield are flipped
-        if (torrent.piece_bitfield->all_flipped())
+        if (torrent->piece_bitfield->all_flipped())
         {
             if (!tracker.sent_completed)
             {
                 std::cout << "done with torrent" << std::endl;
                 // send a completed message
-                tracker.event = TrackerProtocol::EventType::COMPLETED;
-                tracker.downloaded = std::to_string(torrent.downloaded);
-                tracker.uploaded = std::to_string(torrent.uploaded);
-                tracker.left = std::to_string(torrent.length - torrent.downloaded);
-                tracker.send_http();
+                tracker.announce(TrackerProtocol::EventType::COMPLETED);
                 tracker.sent_completed = true;
+                torrent->save_resume();
             }
         }
     }
 
+    // finish the writes that are in flight, so that the resume data covers them, then wait for it to be saved
+    std::cout << "shutting down" << std::endl;
+    torrent->flush_writes();
+    torrent->save_resume();
+    torrent->flush_writes();
+
+    // tell the trackers that we left, but do not wait long for them
+    tracker.announce(TrackerProtocol::EventType::STOPPED);
+    auto stop_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(STOP_ANNOUNCE_TIMEOUT_MS);
+    while (tracker.busy() && std::chrono::steady_clock::now() < stop_deadline)
+    {
+        reactor.run_once(100);
+        tracker.tick(false);
+    }
+
+    curl_global_cleanup();
     return 0;
 }
\ No newline at end of file
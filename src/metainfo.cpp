@@ -21,6 +21,46 @@ namespace Metainfo
         return std::get<std::string>(metainfo_dict["announce"]);
     }
 
+    std::vector<std::vector<std::string>> read_announce_tiers(std::string metainfo_buffer)
+    {
+        bencode::data data = bencode::decode(metainfo_buffer);
+        auto metainfo_dict = std::get<bencode::dict>(data);
+        std::vector<std::vector<std::string>> tiers;
+
+        // a list of tiers, each a list of urls. Entries of the wrong type are skipped rather than trusted
+        auto list = metainfo_dict.find("announce-list");
+        if (list != metainfo_dict.end() && std::holds_alternative<bencode::list>(list->second.base()))
+        {
+            for (auto &tier_data : std::get<bencode::list>(list->second.base()))
+            {
+                if (!std::holds_alternative<bencode::list>(tier_data.base()))
+                {
+                    continue;
+                }
+                std::vector<std::string> tier;
+                for (auto &url : std::get<bencode::list>(tier_data.base()))
+                {
+                    if (std::holds_alternative<bencode::string>(url.base()))
+                    {
+                        tier.push_back(std::get<bencode::string>(url.base()));
+                    }
+                }
+                if (!tier.empty())
+                {
+                    tiers.push_back(tier);
+                }
+            }
+        }
+
+        // clients that support the list ignore the announce key when there is one
+        auto announce = metainfo_dict.find("announce");
+        if (tiers.empty() && announce != metainfo_dict.end() && std::holds_alternative<bencode::string>(announce->second.base()))
+        {
+            tiers.push_back({std::get<bencode::string>(announce->second.base())});
+        }
+        return tiers;
+    }
+
     std::string read_metainfo_to_buffer(std::string filename)
     {
         std::ifstream stream(filename, std::ifstream::in);
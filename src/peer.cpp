@@ -2,8 +2,9 @@
 
 namespace Peer
 {
-    PeerClient::PeerClient(std::string pid, std::string ip_addr, int p)
+    PeerClient::PeerClient(std::string pid, std::string ip_addr, int p) : download_rate(RATE_WINDOW_SECONDS), upload_rate(RATE_WINDOW_SECONDS)
     {
+        sockaddr.sin_family = AF_INET;
         inet_pton(AF_INET, ip_addr.c_str(), &(sockaddr.sin_addr));
         sockaddr.sin_port = htons(p);
 
@@ -15,13 +16,11 @@ namespace Peer
         sent_shake = false;
         connected = false;
         peer_id = "";
-        buffer = nullptr;
+        recv_buffer = nullptr;
         peer_bitfield = nullptr;
-        reading = false;
-        outgoing_requests = 0;
     }
 
-    PeerClient::PeerClient(uint32_t ip_addr, uint16_t p)
+    PeerClient::PeerClient(uint32_t ip_addr, uint16_t p) : download_rate(RATE_WINDOW_SECONDS), upload_rate(RATE_WINDOW_SECONDS)
     {
         sockaddr.sin_family = AF_INET;
         sockaddr.sin_port = p;
@@ -35,13 +34,11 @@ namespace Peer
         sent_shake = false;
         connected = false;
         peer_id = "";
-        buffer = nullptr;
+        recv_buffer = nullptr;
         peer_bitfield = nullptr;
-        reading = false;
-        outgoing_requests = 0;
     }
 
-    PeerClient::PeerClient()
+    PeerClient::PeerClient() : download_rate(RATE_WINDOW_SECONDS), upload_rate(RATE_WINDOW_SECONDS)
     {
         am_interested = false;
         am_choking = true;
@@ -51,10 +48,8 @@ namespace Peer
         sent_shake = false;
         connected = false;
         peer_id = "";
-        buffer = nullptr;
+        recv_buffer = nullptr;
         peer_bitfield = nullptr;
-        reading = false;
-        outgoing_requests = 0;
     }
 
     std::string PeerClient::to_string()
@@ -0,0 +1,179 @@
+#include "piece_picker.hpp"
+
+#include "file.hpp"
+
+namespace File
+{
+    PiecePicker::PiecePicker(uint32_t num_pieces) : rng(std::random_device{}())
+    {
+        availability = std::vector<uint32_t>(num_pieces, 0);
+        position = std::vector<uint32_t>(num_pieces, NOT_CANDIDATE);
+        candidates = 0;
+        excluded = std::make_unique<BitField>(num_pieces);
+        for (uint32_t i = 0; i < num_pieces; i++)
+        {
+            excluded->set_bit(i);
+        }
+    }
+
+    PiecePicker::~PiecePicker()
+    {
+    }
+
+    void PiecePicker::insert(uint32_t index)
+    {
+        uint32_t count = availability[index];
+        if (count >= buckets.size())
+        {
+            buckets.resize(count + 1);
+        }
+        std::vector<uint32_t> &bucket = buckets[count];
+
+        // swap the piece with a random member of the bucket, which moves to the end
+        bucket.push_back(index);
+        uint32_t pos = std::uniform_int_distribution<uint32_t>(0, bucket.size() - 1)(rng);
+        std::swap(bucket[pos], bucket.back());
+        position[bucket.back()] = bucket.size() - 1;
+        position[bucket[pos]] = pos;
+    }
+
+    void PiecePicker::erase(uint32_t index)
+    {
+        std::vector<uint32_t> &bucket = buckets[availability[index]];
+        uint32_t pos = position[index];
+
+        // move the last member of the bucket into the gap
+        bucket[pos] = bucket.back();
+        position[bucket[pos]] = pos;
+        bucket.pop_back();
+        position[index] = NOT_CANDIDATE;
+    }
+
+    void PiecePicker::add_candidate(uint32_t index)
+    {
+        if (position[index] == NOT_CANDIDATE)
+        {
+            insert(index);
+            excluded->unset_bit(index);
+            candidates++;
+        }
+    }
+
+    void PiecePicker::remove_candidate(uint32_t index)
+    {
+        if (position[index] != NOT_CANDIDATE)
+        {
+            erase(index);
+            excluded->set_bit(index);
+            candidates--;
+        }
+    }
+
+    void PiecePicker::increment(uint32_t index)
+    {
+        bool candidate = position[index] != NOT_CANDIDATE;
+        if (candidate)
+        {
+            erase(index);
+        }
+        availability[index]++;
+        if (candidate)
+        {
+            insert(index);
+        }
+    }
+
+    void PiecePicker::decrement(uint32_t index)
+    {
+        if (availability[index] == 0)
+        {
+            return;
+        }
+        bool candidate = position[index] != NOT_CANDIDATE;
+        if (candidate)
+        {
+            erase(index);
+        }
+        availability[index]--;
+        if (candidate)
+        {
+            insert(index);
+        }
+    }
+
+    void PiecePicker::add_bitfield(BitField *bitfield)
+    {
+        for (int i = bitfield->find_next_set(0); i != -1 && (uint32_t)i < availability.size(); i = bitfield->find_next_set(i + 1))
+        {
+            increment(i);
+        }
+    }
+
+    void PiecePicker::remove_bitfield(BitField *bitfield)
+    {
+        for (int i = bitfield->find_next_set(0); i != -1 && (uint32_t)i < availability.size(); i = bitfield->find_next_set(i + 1))
+        {
+            decrement(i);
+        }
+    }
+
+    size_t PiecePicker::num_candidates()
+    {
+        return candidates;
+    }
+
+    uint32_t PiecePicker::get_availability(uint32_t index)
+    {
+        return availability[index];
+    }
+
+    int PiecePicker::pick(BitField *bitfield)
+    {
+        // pieces that no peer has cannot be picked, so start with pieces that a single peer has.
+        // the peer usually has one of the first few pieces of the rarest bucket that is not empty
+        uint32_t looked = 0;
+        for (size_t count = 1; count < buckets.size() && looked < PICK_SCAN_LIMIT; count++)
+        {
+            for (uint32_t index : buckets[count])
+            {
+                if (bitfield->is_bit_set(index))
+                {
+                    return index;
+                }
+                if (++looked == PICK_SCAN_LIMIT)
+                {
+                    break;
+                }
+            }
+        }
+        if (looked < PICK_SCAN_LIMIT)
+        {
+            return -1;
+        }
+
+        // the peer lacks the rarest pieces, so take the rarest of the next candidates that it has, from a random piece on
+        uint32_t num_pieces = availability.size();
+        uint32_t start = std::uniform_int_distribution<uint32_t>(0, num_pieces - 1)(rng);
+        int best = -1;
+        uint32_t found = 0;
+        for (bool wrapped : {false, true})
+        {
+            // the second pass wraps around to the pieces before start. It is told apart by wrapped, not by where it
+            // starts, since start may be 0 as well
+            uint32_t from = wrapped ? 0 : start;
+            for (int i = excluded->next_match(bitfield, from); i != -1 && found < PICK_SCAN_LIMIT; i = excluded->next_match(bitfield, i + 1))
+            {
+                if (wrapped && (uint32_t)i >= start)
+                {
+                    break;
+                }
+                if (best == -1 || availability[i] < availability[best])
+                {
+                    best = i;
+                }
+                found++;
+            }
+        }
+        return best;
+    }
+}
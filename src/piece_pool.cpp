@@ -0,0 +1,56 @@
+#include "piece_pool.hpp"
+
+namespace File
+{
+    PiecePool::PiecePool(long long buffer_size, long long memory_budget)
+    {
+        this->buffer_size = buffer_size;
+        max_buffers = memory_budget / buffer_size;
+        if (max_buffers == 0)
+        {
+            max_buffers = 1;
+        }
+        leased = 0;
+    }
+
+    bool PiecePool::can_lease()
+    {
+        return leased < max_buffers;
+    }
+
+    std::unique_ptr<uint8_t[]> PiecePool::lease()
+    {
+        if (!can_lease())
+        {
+            return nullptr;
+        }
+
+        leased++;
+
+        // reuse a returned buffer before allocating a new one
+        if (!free_buffers.empty())
+        {
+            std::unique_ptr<uint8_t[]> buffer = std::move(free_buffers.back());
+            free_buffers.pop_back();
+            return buffer;
+        }
+
+        return std::make_unique<uint8_t[]>(buffer_size);
+    }
+
+    void PiecePool::release(std::unique_ptr<uint8_t[]> buffer)
+    {
+        if (buffer == nullptr)
+        {
+            return;
+        }
+
+        leased--;
+        free_buffers.push_back(std::move(buffer));
+    }
+
+    long long PiecePool::bytes_leased()
+    {
+        return leased * buffer_size;
+    }
+}
@@ -0,0 +1,60 @@
+#include "rate_counter.hpp"
+
+#include <algorithm>
+
+namespace Util
+{
+    RateCounter::RateCounter(int window_seconds)
+    {
+        buckets = std::vector<long long>(std::max(1, window_seconds), 0);
+        current_second = 0;
+        start = std::chrono::steady_clock::now();
+        total = 0;
+    }
+
+    double RateCounter::elapsed()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void RateCounter::advance()
+    {
+        long long second = (long long)elapsed();
+
+        // clear at most one window's worth of buckets, however long the counter sat idle
+        long long passed = std::min(second - current_second, (long long)buckets.size());
+        for (long long i = 1; i <= passed; i++)
+        {
+            buckets[(current_second + i) % buckets.size()] = 0;
+        }
+        current_second = second;
+    }
+
+    void RateCounter::add(long long bytes)
+    {
+        advance();
+        buckets[current_second % buckets.size()] += bytes;
+        total += bytes;
+    }
+
+    double RateCounter::rate()
+    {
+        advance();
+        long long sum = 0;
+        for (long long bytes : buckets)
+        {
+            sum += bytes;
+        }
+
+        // the window is the full seconds before this one, plus the part of this second that passed.
+        // it is at least a second, so that a burst right after the counter starts does not read as a huge rate
+        double now = elapsed();
+        double window = std::min(now, (double)(buckets.size() - 1) + (now - current_second));
+        return sum / std::max(1.0, window);
+    }
+
+    long long RateCounter::total_bytes()
+    {
+        return total;
+    }
+}
@@ -0,0 +1,96 @@
+#include "reactor.hpp"
+
+#include <iostream>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+
+namespace Net
+{
+    CallbackHandler::CallbackHandler(std::function<void()> callback)
+    {
+        this->callback = callback;
+    }
+
+    void CallbackHandler::on_readable()
+    {
+        callback();
+    }
+
+    Reactor::Reactor()
+    {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0)
+        {
+            std::cerr << "Failed to create epoll instance" << std::endl;
+            std::cerr << strerror(errno) << std::endl;
+            exit(1);
+        }
+        events = std::vector<epoll_event>(MAX_EVENTS);
+    }
+
+    Reactor::~Reactor()
+    {
+        close(epoll_fd);
+    }
+
+    void Reactor::add(int fd, uint32_t events, Handler *handler)
+    {
+        epoll_event event;
+        event.events = events | EPOLLET;
+        event.data.ptr = handler;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            std::cout << "epoll add failed: " << strerror(errno) << std::endl;
+        }
+
+        // the handler may be reusing the address of one that was removed this round
+        removed.erase(handler);
+    }
+
+    void Reactor::remove(int fd, Handler *handler)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        removed.insert(handler);
+    }
+
+    int Reactor::run_once(int timeout_ms)
+    {
+        removed.clear();
+        int ready = epoll_wait(epoll_fd, events.data(), events.size(), timeout_ms);
+        if (ready < 0)
+        {
+            if (errno != EINTR)
+            {
+                std::cout << "epoll wait failed: " << strerror(errno) << std::endl;
+            }
+            return 0;
+        }
+
+        for (int i = 0; i < ready; i++)
+        {
+            Handler *handler = (Handler *)events[i].data.ptr;
+            uint32_t flags = events[i].events;
+
+            // a hang up with bytes left is seen as readable, the read then finds the end of the stream.
+            // a handler that was removed earlier in this round gets no events, since its fd may already be reused
+            if ((flags & (EPOLLERR | EPOLLHUP)) && !(flags & EPOLLIN))
+            {
+                if (removed.count(handler) == 0)
+                {
+                    handler->on_error();
+                }
+                continue;
+            }
+            if ((flags & EPOLLIN) && removed.count(handler) == 0)
+            {
+                handler->on_readable();
+            }
+            if ((flags & EPOLLOUT) && removed.count(handler) == 0)
+            {
+                handler->on_writable();
+            }
+        }
+        return ready;
+    }
+}
@@ -0,0 +1,264 @@
+#include "recheck.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+
+namespace File
+{
+    // give the kernel advice about the bytes [start, end) of a mapping, widened to whole pages
+    static void advise_range(uint8_t *base, long long mapped_length, long long start, long long end, int advice)
+    {
+        static const long long page_size = sysconf(_SC_PAGESIZE);
+        start = start / page_size * page_size;
+        end = std::min(end, mapped_length);
+        if (start < end)
+        {
+            madvise(base + start, end - start, advice);
+        }
+    }
+
+    // Where a recheck reads the download from
+    class ChunkSource
+    {
+    public:
+        virtual ~ChunkSource() {}
+
+        // the number of bytes of the download that can be read, pieces past it cannot match
+        virtual long long available() = 0;
+
+        // ask for the bytes [start, end) to be read ahead, because a thread will hash them soon
+        virtual void prefetch(long long start, long long end) = 0;
+
+        // return the bytes [start, end), copying them into scratch if they are not in memory
+        // return nullptr if they cannot be read
+        virtual const uint8_t *load(long long start, long long end, std::vector<uint8_t> &scratch) = 0;
+
+        // the bytes [start, end) have been hashed
+        virtual void done([[maybe_unused]] long long start, [[maybe_unused]] long long end) {}
+    };
+
+    // reads a file that is mapped read only
+    class MappedSource : public ChunkSource
+    {
+    private:
+        uint8_t *base;
+        long long mapped_length;
+
+    public:
+        MappedSource(uint8_t *base, long long mapped_length) : base(base), mapped_length(mapped_length) {}
+
+        long long available() { return mapped_length; }
+
+        void prefetch(long long start, long long end)
+        {
+            advise_range(base, mapped_length, start, end, MADV_WILLNEED);
+        }
+
+        // the whole file is mapped, so nothing is copied
+        const uint8_t *load(long long start, long long, std::vector<uint8_t> &)
+        {
+            return base + start;
+        }
+
+        // we are done with these pages, so they do not need to stay mapped into our address space
+        void done(long long start, long long end)
+        {
+            advise_range(base, mapped_length, start, end, MADV_DONTNEED);
+        }
+    };
+
+    // reads a torrent's storage, a chunk at a time
+    class StorageSource : public ChunkSource
+    {
+    private:
+        Storage *storage;
+        long long length;
+
+    public:
+        StorageSource(Storage *storage, long long length) : storage(storage), length(length) {}
+
+        long long available() { return length; }
+
+        void prefetch(long long start, long long end)
+        {
+            end = std::min(end, length);
+            if (start < end)
+            {
+                storage->prefetch(start, end - start);
+            }
+        }
+
+        const uint8_t *load(long long start, long long end, std::vector<uint8_t> &scratch)
+        {
+            scratch.resize(end - start);
+            return storage->read(start, scratch.data(), end - start) ? scratch.data() : nullptr;
+        }
+    };
+
+    // hash every piece of the download read from source, see recheck_file
+    static long long recheck(ChunkSource &source, long long piece_length, long long length, const std::string &piece_hashes,
+                             int num_threads, std::vector<uint8_t> &good_pieces, int report_interval_ms)
+    {
+        uint32_t num_pieces = piece_hashes.length() / 20;
+        long long available = source.available();
+
+        if (num_threads < 1)
+        {
+            num_threads = 1;
+        }
+        uint32_t chunk_pieces = std::max(1ll, RECHECK_CHUNK_SIZE / piece_length);
+        uint32_t num_chunks = (num_pieces + chunk_pieces - 1) / chunk_pieces;
+        long long chunk_bytes = chunk_pieces * piece_length;
+
+        std::atomic<uint32_t> next_chunk(0);
+        std::atomic<long long> bytes_hashed(0);
+        std::atomic<long long> pieces_matched(0);
+        std::atomic<int> workers_left(num_threads);
+
+        // start reading the chunks that the threads claim first
+        source.prefetch(0, (long long)num_threads * chunk_bytes);
+
+        auto worker = [&]()
+        {
+            std::vector<uint8_t> scratch;
+            while (true)
+            {
+                uint32_t chunk = next_chunk.fetch_add(1);
+                if (chunk >= num_chunks)
+                {
+                    break;
+                }
+
+                // every thread claims one chunk at a time, so the chunk num_threads ahead is likely to be ours next
+                long long ahead = (long long)(chunk + num_threads) * chunk_bytes;
+                source.prefetch(ahead, ahead + chunk_bytes);
+
+                uint32_t first = chunk * chunk_pieces;
+                uint32_t last = std::min(first + chunk_pieces, num_pieces);
+                long long start = (long long)first * piece_length;
+                long long end = std::min({(long long)last * piece_length, length, available});
+                const uint8_t *data = start < end ? source.load(start, end, scratch) : nullptr;
+                if (data == nullptr)
+                {
+                    continue;
+                }
+
+                for (uint32_t i = first; i < last; i++)
+                {
+                    long long offset = (long long)i * piece_length;
+                    long long size = std::min(piece_length, length - offset);
+                    if (offset + size > end)
+                    {
+                        continue;
+                    }
+
+                    if (Hash::truncated_sha1_hash(data + (offset - start), size, 20).compare(0, 20, piece_hashes, (size_t)i * 20, 20) == 0)
+                    {
+                        good_pieces[i] = 1;
+                        pieces_matched++;
+                    }
+                    bytes_hashed += size;
+                }
+                source.done(start, end);
+            }
+            workers_left--;
+        };
+
+        std::vector<std::thread> threads;
+        auto start_time = std::chrono::steady_clock::now();
+        for (int i = 0; i < num_threads; i++)
+        {
+            threads.push_back(std::thread(worker));
+        }
+
+        // report progress while the threads work, checking often so that we do not wait long after they finish
+        if (report_interval_ms > 0)
+        {
+            auto last_report = start_time;
+            while (workers_left.load() > 0)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(std::min(report_interval_ms, 20)));
+                auto now = std::chrono::steady_clock::now();
+                if (now - last_report < std::chrono::milliseconds(report_interval_ms))
+                {
+                    continue;
+                }
+                last_report = now;
+
+                double seconds = std::chrono::duration<double>(now - start_time).count();
+                double done = bytes_hashed.load();
+                std::cout << "recheck: " << std::fixed << std::setprecision(1) << 100.0 * done / length << "% at "
+                          << done / seconds / (1024 * 1024) << " MiB/s" << std::endl;
+            }
+        }
+
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+
+        if (report_interval_ms > 0)
+        {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+            std::cout << "recheck: " << pieces_matched.load() << " of " << num_pieces << " pieces match, hashed "
+                      << bytes_hashed.load() << " bytes in " << std::fixed << std::setprecision(2) << seconds << " s" << std::endl;
+        }
+
+        return pieces_matched.load();
+    }
+
+    long long recheck_file(std::string path, long long piece_length, long long length, const std::string &piece_hashes,
+                           int num_threads, std::vector<uint8_t> &good_pieces, int report_interval_ms)
+    {
+        good_pieces.assign(piece_hashes.length() / 20, 0);
+
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return -1;
+        }
+
+        // pieces past the end of a short file cannot match
+        struct stat st;
+        fstat(fd, &st);
+        long long mapped_length = std::min((long long)st.st_size, length);
+        if (mapped_length <= 0)
+        {
+            close(fd);
+            return 0;
+        }
+
+        void *addr = mmap(nullptr, mapped_length, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)
+        {
+            return -1;
+        }
+        uint8_t *base = (uint8_t *)addr;
+        madvise(base, mapped_length, MADV_SEQUENTIAL);
+
+        MappedSource source(base, mapped_length);
+        long long matched = recheck(source, piece_length, length, piece_hashes, num_threads, good_pieces, report_interval_ms);
+        munmap(base, mapped_length);
+        return matched;
+    }
+
+    long long recheck_storage(Storage *storage, long long piece_length, long long length, const std::string &piece_hashes,
+                              int num_threads, std::vector<uint8_t> &good_pieces, int report_interval_ms)
+    {
+        good_pieces.assign(piece_hashes.length() / 20, 0);
+
+        StorageSource source(storage, length);
+        return recheck(source, piece_length, length, piece_hashes, num_threads, good_pieces, report_interval_ms);
+    }
+}
@@ -0,0 +1,133 @@
+#include "request_table.hpp"
+
+#include <algorithm>
+
+namespace File
+{
+    uint64_t RequestTable::key(uint32_t index, uint32_t begin)
+    {
+        return ((uint64_t)index << 32) | begin;
+    }
+
+    void RequestTable::uncount(int owner)
+    {
+        auto count = owner_counts.find(owner);
+        if (--count->second == 0)
+        {
+            owner_counts.erase(count);
+        }
+    }
+
+    void RequestTable::add(uint32_t index, uint32_t begin, uint32_t length, int owner)
+    {
+        if (requested_from(index, begin, owner))
+        {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        requests[key(index, begin)].push_back(InFlightRequest{index, begin, length, owner, now});
+        sent_order.push_back(SentRequest{key(index, begin), owner, now});
+        owner_counts[owner]++;
+    }
+
+    void RequestTable::remove(uint32_t index, uint32_t begin, std::vector<InFlightRequest> &removed)
+    {
+        auto it = requests.find(key(index, begin));
+        if (it == requests.end())
+        {
+            return;
+        }
+        for (InFlightRequest &request : it->second)
+        {
+            uncount(request.owner);
+            removed.push_back(request);
+        }
+        requests.erase(it);
+    }
+
+    bool RequestTable::contains(uint32_t index, uint32_t begin)
+    {
+        return requests.count(key(index, begin)) != 0;
+    }
+
+    bool RequestTable::requested_from(uint32_t index, uint32_t begin, int owner)
+    {
+        auto it = requests.find(key(index, begin));
+        if (it == requests.end())
+        {
+            return false;
+        }
+        return std::any_of(it->second.begin(), it->second.end(), [owner](InFlightRequest &request)
+                           { return request.owner == owner; });
+    }
+
+    void RequestTable::release(int owner, std::vector<InFlightRequest> &released)
+    {
+        if (owner_counts.count(owner) == 0)
+        {
+            return;
+        }
+        for (auto it = requests.begin(); it != requests.end();)
+        {
+            std::vector<InFlightRequest> &owners = it->second;
+            for (size_t i = 0; i < owners.size();)
+            {
+                if (owners[i].owner == owner)
+                {
+                    released.push_back(owners[i]);
+                    uncount(owner);
+                    owners.erase(owners.begin() + i);
+                }
+                else
+                {
+                    i++;
+                }
+            }
+            it = owners.empty() ? requests.erase(it) : std::next(it);
+        }
+    }
+
+    void RequestTable::expire(std::chrono::milliseconds timeout, std::vector<InFlightRequest> &expired)
+    {
+        auto now = std::chrono::steady_clock::now();
+        while (!sent_order.empty())
+        {
+            SentRequest &sent = sent_order.front();
+
+            // the request is still in flight if the table has it from the same peer, made at the same time
+            auto it = requests.find(sent.key);
+            std::vector<InFlightRequest> *owners = it == requests.end() ? nullptr : &it->second;
+            auto request = owners == nullptr ? std::vector<InFlightRequest>::iterator()
+                                             : std::find_if(owners->begin(), owners->end(), [&sent](InFlightRequest &request)
+                                                            { return request.owner == sent.owner && request.sent_time == sent.sent_time; });
+
+            // requests that were answered or released are dropped, up to the first one in flight that is not due yet
+            if (owners != nullptr && request != owners->end())
+            {
+                if (now - sent.sent_time <= timeout)
+                {
+                    break;
+                }
+                expired.push_back(*request);
+                uncount(request->owner);
+                owners->erase(request);
+                if (owners->empty())
+                {
+                    requests.erase(it);
+                }
+            }
+            sent_order.pop_front();
+        }
+    }
+
+    int RequestTable::count(int owner)
+    {
+        auto it = owner_counts.find(owner);
+        return it == owner_counts.end() ? 0 : it->second;
+    }
+
+    size_t RequestTable::size()
+    {
+        return requests.size();
+    }
+}
@@ -0,0 +1,101 @@
+#include "resolver.hpp"
+
+#include <thread>
+#include <cstring>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+namespace Net
+{
+    Resolver::Lookup::Lookup(int event_fd)
+    {
+        this->event_fd = event_fd;
+        ok = false;
+        memset(&addr, 0, sizeof(addr));
+    }
+
+    Resolver::Lookup::~Lookup()
+    {
+        close(event_fd);
+    }
+
+    Resolver::Resolver(Reactor *reactor, std::function<void(bool, sockaddr_in)> on_resolved)
+    {
+        this->reactor = reactor;
+        this->on_resolved = on_resolved;
+    }
+
+    Resolver::~Resolver()
+    {
+        cancel();
+    }
+
+    bool Resolver::resolve(const std::string &host, const std::string &port)
+    {
+        cancel();
+        int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd < 0)
+        {
+            return false;
+        }
+        std::shared_ptr<Lookup> started = std::make_shared<Lookup>(event_fd);
+
+        try
+        {
+            std::thread([started, host, port]()
+                        {
+                addrinfo hints;
+                addrinfo *servinfo;
+                memset(&hints, 0, sizeof(hints));
+                hints.ai_family = AF_INET;
+                hints.ai_socktype = SOCK_STREAM;
+
+                if (getaddrinfo(host.c_str(), port.c_str(), &hints, &servinfo) == 0)
+                {
+                    memcpy(&started->addr, servinfo->ai_addr, sizeof(sockaddr_in));
+                    freeaddrinfo(servinfo);
+                    started->ok = true;
+                }
+                uint64_t one = 1;
+                ssize_t written = write(started->event_fd, &one, sizeof(one));
+                (void)written; })
+                .detach();
+        }
+        catch (const std::system_error &)
+        {
+            return false;
+        }
+
+        lookup = started;
+        reactor->add(event_fd, EPOLLIN, this);
+        return true;
+    }
+
+    void Resolver::cancel()
+    {
+        if (lookup != nullptr)
+        {
+            reactor->remove(lookup->event_fd, this);
+            lookup.reset();
+        }
+    }
+
+    bool Resolver::busy()
+    {
+        return lookup != nullptr;
+    }
+
+    void Resolver::on_readable()
+    {
+        if (lookup == nullptr)
+        {
+            return;
+        }
+
+        // the lookup is finished with before on_resolved runs, since on_resolved may start another
+        std::shared_ptr<Lookup> done = lookup;
+        cancel();
+        on_resolved(done->ok, done->addr);
+    }
+}
@@ -0,0 +1,120 @@
+#include "resume.hpp"
+
+#include <fstream>
+#include <cstdio>
+#include <algorithm>
+#include <sys/stat.h>
+
+#include "bencode.hpp"
+
+namespace File
+{
+    ResumeData::ResumeData()
+    {
+        file_size = 0;
+        file_mtime = 0;
+    }
+
+    bool ResumeData::load(std::string path)
+    {
+        std::ifstream stream(path, std::ios::in | std::ios::binary);
+        if (!stream)
+        {
+            return false;
+        }
+        std::string buffer((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+        try
+        {
+            bencode::data data = bencode::decode(buffer);
+            auto resume_dict = std::get<bencode::dict>(data);
+
+            file_size = std::get<long long>(resume_dict["file size"]);
+            file_mtime = std::get<long long>(resume_dict["file mtime"]);
+            piece_bits = std::get<std::string>(resume_dict["pieces"]);
+
+            auto partial_dict = std::get<bencode::dict>(resume_dict["partial pieces"]);
+            for (auto &entry : partial_dict)
+            {
+                partial_pieces[std::stoul(entry.first)] = std::get<std::string>(entry.second);
+            }
+
+            auto uncertain_list = std::get<bencode::list>(resume_dict["uncertain pieces"]);
+            for (auto &entry : uncertain_list)
+            {
+                uncertain_pieces.push_back(std::get<long long>(entry));
+            }
+        }
+        catch (const std::exception &err)
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    bool ResumeData::save(std::string path)
+    {
+        bencode::dict partial_dict;
+        for (auto &entry : partial_pieces)
+        {
+            partial_dict[std::to_string(entry.first)] = entry.second;
+        }
+
+        bencode::list uncertain_list;
+        for (uint32_t index : uncertain_pieces)
+        {
+            uncertain_list.emplace_back((long long)index);
+        }
+
+        bencode::dict resume_dict;
+        resume_dict["file size"] = file_size;
+        resume_dict["file mtime"] = file_mtime;
+        resume_dict["pieces"] = piece_bits;
+        resume_dict["partial pieces"] = partial_dict;
+        resume_dict["uncertain pieces"] = uncertain_list;
+        std::string encoded = bencode::encode(resume_dict);
+
+        // write to a temporary file, then rename it over the old one
+        std::string tmp_path = path + ".tmp";
+        {
+            std::ofstream stream(tmp_path, std::ios::out | std::ios::trunc | std::ios::binary);
+            stream.write(encoded.data(), encoded.length());
+            if (!stream)
+            {
+                return false;
+            }
+        }
+        return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+    }
+
+    bool stat_file(std::string path, long long &size, long long &mtime)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0)
+        {
+            return false;
+        }
+        size = st.st_size;
+        mtime = (long long)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+        return true;
+    }
+
+    bool stat_files(const std::vector<FileSpan> &files, long long &size, long long &mtime)
+    {
+        bool found = false;
+        size = 0;
+        mtime = 0;
+        for (const FileSpan &file : files)
+        {
+            long long file_size, file_mtime;
+            if (stat_file(file.path, file_size, file_mtime))
+            {
+                found = true;
+                size += file_size;
+                mtime = std::max(mtime, file_mtime);
+            }
+        }
+        return found;
+    }
+}
@@ -0,0 +1,93 @@
+#include "ring_buffer.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+namespace Util
+{
+    RingBuffer::RingBuffer(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        ring_size = size;
+        mask = size - 1;
+        data = std::make_unique<uint8_t[]>(size);
+        head = 0;
+        tail = 0;
+    }
+
+    size_t RingBuffer::capacity()
+    {
+        return ring_size;
+    }
+
+    size_t RingBuffer::size()
+    {
+        return tail - head;
+    }
+
+    size_t RingBuffer::space()
+    {
+        return ring_size - size();
+    }
+
+    int RingBuffer::free_iov(iovec iov[2])
+    {
+        size_t free = space();
+        if (free == 0)
+        {
+            return 0;
+        }
+
+        // from the write position to the end of the ring, then from the start of the ring up to the read position
+        size_t start = tail & mask;
+        size_t first = std::min(free, ring_size - start);
+        iov[0].iov_base = data.get() + start;
+        iov[0].iov_len = first;
+        if (first == free)
+        {
+            return 1;
+        }
+        iov[1].iov_base = data.get();
+        iov[1].iov_len = free - first;
+        return 2;
+    }
+
+    void RingBuffer::commit(size_t len)
+    {
+        tail += len;
+    }
+
+    const uint8_t *RingBuffer::contiguous(size_t offset, size_t len)
+    {
+        size_t start = (head + offset) & mask;
+        if (start + len > ring_size)
+        {
+            return nullptr;
+        }
+        return data.get() + start;
+    }
+
+    void RingBuffer::copy(size_t offset, uint8_t *dest, size_t len)
+    {
+        size_t start = (head + offset) & mask;
+        size_t first = std::min(len, ring_size - start);
+        memcpy(dest, data.get() + start, first);
+        memcpy(dest + first, data.get(), len - first);
+    }
+
+    void RingBuffer::consume(size_t len)
+    {
+        head += len;
+
+        // start over at the beginning of the ring when it is empty, so that messages are less likely to wrap
+        if (head == tail)
+        {
+            head = 0;
+            tail = 0;
+        }
+    }
+}
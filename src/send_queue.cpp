@@ -0,0 +1,123 @@
+#include "send_queue.hpp"
+
+#include <errno.h>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+namespace Net
+{
+    SendQueue::SendQueue()
+    {
+        queued = 0;
+    }
+
+    void SendQueue::push(std::unique_ptr<uint8_t[]> data, size_t length)
+    {
+        if (length == 0)
+        {
+            return;
+        }
+        queued += length;
+        slices.push_back(Slice{std::move(data), nullptr, 0, length, 0});
+    }
+
+    void SendQueue::push_file(File::Storage *storage, long long offset, size_t length)
+    {
+        if (length == 0)
+        {
+            return;
+        }
+        queued += length;
+        slices.push_back(Slice{nullptr, storage, offset, length, 0});
+    }
+
+    size_t SendQueue::size()
+    {
+        return queued;
+    }
+
+    bool SendQueue::empty()
+    {
+        return slices.empty();
+    }
+
+    bool SendQueue::above_high_water()
+    {
+        return queued >= SEND_HIGH_WATER;
+    }
+
+    bool SendQueue::flush(int sock_fd, size_t limit, size_t *storage_sent)
+    {
+        while (!slices.empty() && limit > 0)
+        {
+            ssize_t n;
+            Slice &front = slices.front();
+            if (front.data == nullptr)
+            {
+                n = front.storage->send(sock_fd, front.offset + front.sent, std::min(limit, front.length - front.sent));
+
+                // the storage ran out of bytes before the range did
+                if (n == 0)
+                {
+                    return false;
+                }
+                if (n > 0 && storage_sent != nullptr)
+                {
+                    *storage_sent += n;
+                }
+            }
+            else
+            {
+                // gather the byte slices at the front of the queue
+                iovec iov[SEND_MAX_IOV];
+                int iovcnt = 0;
+                size_t i = 0;
+                size_t gathered = 0;
+                for (; i < slices.size() && iovcnt < SEND_MAX_IOV && slices[i].data != nullptr && gathered < limit; i++)
+                {
+                    iov[iovcnt].iov_base = slices[i].data.get() + slices[i].sent;
+                    iov[iovcnt].iov_len = std::min(limit - gathered, slices[i].length - slices[i].sent);
+                    gathered += iov[iovcnt].iov_len;
+                    iovcnt++;
+                }
+
+                // a piece header is followed by its block from storage, so hold it back to leave in the same segment
+                msghdr msg = {};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = iovcnt;
+                int flags = MSG_NOSIGNAL | (i < slices.size() ? MSG_MORE : 0);
+                n = sendmsg(sock_fd, &msg, flags);
+            }
+
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                return true;
+            }
+            if (n < 0)
+            {
+                return false;
+            }
+
+            // drop the slices that were written completely, and keep the offset into one that was not
+            queued -= n;
+            limit -= n;
+            while (n > 0)
+            {
+                Slice &slice = slices.front();
+                size_t written = std::min((size_t)n, slice.length - slice.sent);
+                slice.sent += written;
+                n -= written;
+                if (slice.sent == slice.length)
+                {
+                    slices.pop_front();
+                }
+            }
+        }
+        return true;
+    }
+}
@@ -0,0 +1,693 @@
+#include "session.hpp"
+
+#include <iostream>
+#include <errno.h>
+#include <algorithm>
+#include <sys/uio.h>
+#include <cmath>
+#include <sstream>
+#include <netinet/tcp.h>
+
+#include "net_utils.hpp"
+
+namespace Peer
+{
+    Session::Session(SessionContext &context, PeerClient peer) : context(context)
+    {
+        this->peer = peer;
+        is_closed = false;
+        rtt_ms = 0;
+        throttled = false;
+        limit.upload.set_rate(context.peer_upload_limit);
+        limit.download.set_rate(context.peer_download_limit);
+        request_depth = context.outgoing_request_queue_size;
+        incoming_block = IncomingBlock{false, 0, 0, 0, 0};
+        have_cursor = 0;
+
+        // the ring must fit the peer's bitfield message, which is longer than a block for large torrents
+        size_t bitfield_length = context.torrent->num_pieces / 8 + 1 + sizeof(uint32_t) + sizeof(uint8_t);
+        this->peer.recv_buffer = new Util::RingBuffer(std::max(RECV_BUFFER_SIZE, bitfield_length));
+        context.reactor->add(peer.socket, EPOLLIN | EPOLLOUT, this);
+    }
+
+    Session::~Session()
+    {
+        // blocks that were requested from the peer are asked from others
+        context.torrent->release_requests(peer.socket);
+        close(peer.socket);
+        delete peer.recv_buffer;
+
+        // the peer's pieces are no longer available from it
+        if (peer.peer_bitfield != nullptr)
+        {
+            context.torrent->remove_availability(peer.peer_bitfield);
+        }
+        delete peer.peer_bitfield;
+    }
+
+    void Session::close_session(std::string reason)
+    {
+        if (is_closed)
+        {
+            return;
+        }
+        std::cout << reason << ": " << peer.to_string() << std::endl;
+
+        is_closed = true;
+        context.reactor->remove(peer.socket, this);
+        context.closed.push_back(peer.socket);
+    }
+
+    bool Session::closed()
+    {
+        return is_closed;
+    }
+
+    void Session::on_readable()
+    {
+        if (receive())
+        {
+            pump();
+        }
+    }
+
+    void Session::on_writable()
+    {
+        // the first writable event on an outgoing connection tells us whether the connect succeeded
+        if (!peer.connected)
+        {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (getsockopt(peer.socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+            {
+                close_session(std::string("connect failed: ") + strerror(error));
+                return;
+            }
+            peer.connected = true;
+        }
+        pump();
+    }
+
+    void Session::on_error()
+    {
+        close_session("connection error");
+    }
+
+    bool Session::receive()
+    {
+        Util::RingBuffer *ring = peer.recv_buffer;
+        while (true)
+        {
+            // the rest of a block goes straight to its destination, and whatever follows it into the ring.
+            // the destination is looked up again each time, because another peer may have completed the block
+            iovec iov[3];
+            int iovcnt = 0;
+            size_t block_wanted = 0;
+            if (incoming_block.active)
+            {
+                block_wanted = incoming_block.length - incoming_block.received;
+                uint8_t *dest = context.torrent->block_destination(incoming_block.index, incoming_block.begin, incoming_block.length);
+                if (dest != nullptr)
+                {
+                    iov[0].iov_base = dest + incoming_block.received;
+                }
+
+                // the bytes are not needed anymore, but still have to be read past
+                else
+                {
+                    scratch.resize(block_wanted);
+                    iov[0].iov_base = scratch.data();
+                }
+                iov[0].iov_len = block_wanted;
+                iovcnt++;
+            }
+
+            // fill all the free space of the ring with the same call
+            iovcnt += ring->free_iov(iov + iovcnt);
+            size_t wanted = block_wanted + ring->space();
+
+            // read no more than every download limit allows, and stop reading when one runs out
+            Util::BandwidthLimit *global = context.global_limit;
+            long long quota = Util::available({global != nullptr ? &global->download : nullptr, &context.torrent_limit.download, &limit.download});
+            if (quota == 0)
+            {
+                throttled = true;
+                return true;
+            }
+            if ((size_t)quota < wanted)
+            {
+                wanted = quota;
+                size_t total = 0;
+                int used = 0;
+                for (; used < iovcnt && total < wanted; used++)
+                {
+                    iov[used].iov_len = std::min(iov[used].iov_len, wanted - total);
+                    total += iov[used].iov_len;
+                }
+                iovcnt = used;
+            }
+
+            ssize_t bytes_recv = readv(peer.socket, iov, iovcnt);
+            if (bytes_recv < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes_recv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                return true;
+            }
+            if (bytes_recv < 0)
+            {
+                close_session(std::string("Recv failed: ") + strerror(errno));
+                return false;
+            }
+            if (bytes_recv == 0)
+            {
+                close_session("peer connection closed");
+                return false;
+            }
+
+            Util::consume({global != nullptr ? &global->download : nullptr, &context.torrent_limit.download, &limit.download}, bytes_recv);
+            size_t block_recv = std::min((size_t)bytes_recv, block_wanted);
+            if (block_recv > 0)
+            {
+                advance_incoming_block(block_recv);
+            }
+            ring->commit(bytes_recv - block_recv);
+            if (!frame_messages())
+            {
+                return false;
+            }
+
+            // a short read emptied the socket, and bytes that arrive after it raise a new edge
+            if ((size_t)bytes_recv < wanted)
+            {
+                return true;
+            }
+        }
+    }
+
+    bool Session::frame_messages()
+    {
+        Util::RingBuffer *ring = peer.recv_buffer;
+        while (!is_closed)
+        {
+            size_t available = ring->size();
+
+            // the handshake starts with a 1 byte pstrlen, other messages with a 4 byte length
+            size_t length;
+            if (!peer.recv_shake)
+            {
+                if (available < 1)
+                {
+                    return true;
+                }
+                uint8_t pstrlen;
+                ring->copy(0, &pstrlen, sizeof(pstrlen));
+                length = 49 + pstrlen;
+            }
+            else
+            {
+                if (available < sizeof(uint32_t))
+                {
+                    return true;
+                }
+                uint32_t len;
+                ring->copy(0, (uint8_t *)&len, sizeof(len));
+                length = sizeof(len) + ntohl(len); // len is in big endian, so convert
+            }
+
+            if (length > ring->capacity() || length - sizeof(uint32_t) > Messages::MAX_MESSAGE_LENGTH)
+            {
+                close_session("message too long");
+                return false;
+            }
+            if (available < length)
+            {
+                start_incoming_block(length);
+                return true;
+            }
+
+            // parse the message where it is in the ring, unless it wraps around the end
+            const uint8_t *msg = ring->contiguous(0, length);
+            if (msg == nullptr)
+            {
+                scratch.resize(length);
+                ring->copy(0, scratch.data(), length);
+                msg = scratch.data();
+            }
+
+            if (!peer.recv_shake)
+            {
+                handle_handshake(msg, length);
+            }
+
+            // keep alive messages have no id
+            else if (length > sizeof(uint32_t))
+            {
+                handle_message(msg + sizeof(uint32_t), length - sizeof(uint32_t));
+            }
+            ring->consume(length);
+        }
+        return false;
+    }
+
+    bool Session::start_incoming_block(size_t length)
+    {
+        Util::RingBuffer *ring = peer.recv_buffer;
+        size_t available = ring->size();
+        if (!peer.recv_shake || available < Messages::PIECE_HEADER_LENGTH)
+        {
+            return false;
+        }
+
+        uint8_t header[Messages::PIECE_HEADER_LENGTH];
+        ring->copy(0, header, sizeof(header));
+        if (header[sizeof(uint32_t)] != Messages::PIECE_ID)
+        {
+            return false;
+        }
+        uint32_t index;
+        uint32_t begin;
+        memcpy(&index, header + sizeof(uint32_t) + sizeof(uint8_t), sizeof(index));
+        memcpy(&begin, header + sizeof(uint32_t) + sizeof(uint8_t) + sizeof(index), sizeof(begin));
+        index = ntohl(index);
+        begin = ntohl(begin);
+        uint32_t block_length = length - Messages::PIECE_HEADER_LENGTH;
+
+        // blocks we do not want are framed in the ring as usual, and dropped when they are complete
+        uint8_t *dest = context.torrent->block_destination(index, begin, block_length);
+        if (dest == nullptr)
+        {
+            return false;
+        }
+
+        // the ring holds nothing past this message, since it is incomplete
+        size_t buffered = available - Messages::PIECE_HEADER_LENGTH;
+        ring->copy(Messages::PIECE_HEADER_LENGTH, dest, buffered);
+        ring->consume(available);
+        incoming_block = IncomingBlock{true, index, begin, block_length, 0};
+        advance_incoming_block(buffered);
+        return true;
+    }
+
+    void Session::advance_incoming_block(size_t received)
+    {
+        peer.download_rate.add(received);
+        incoming_block.received += received;
+        if (incoming_block.received < incoming_block.length)
+        {
+            return;
+        }
+        incoming_block.active = false;
+
+        std::cout << "got block: piece index " << incoming_block.index << " begin: " << incoming_block.begin << std::endl;
+
+        // the block is only ours to mark if no other peer completed it while it was arriving
+        if (context.torrent->block_destination(incoming_block.index, incoming_block.begin, incoming_block.length) != nullptr)
+        {
+            context.torrent->block_written(incoming_block.index, incoming_block.begin, peer.socket);
+        }
+        else
+        {
+            std::cout << "invalid block" << std::endl;
+        }
+    }
+
+    void Session::handle_handshake(const uint8_t *msg, size_t length)
+    {
+        Messages::Buffer buff((uint8_t)(length - 49));
+        memcpy(buff.ptr.get(), msg, length);
+        buff.bytes_read = length;
+
+        Messages::Handshake peer_handshake = Messages::Handshake(&buff);
+        peer.recv_shake = true;
+        peer.peer_id = peer_handshake.get_peer_id();
+        std::cout << "Handshake: " << peer_handshake.get_peer_id() << std::endl;
+
+        // if info hash does not match, then we need to close
+        if (peer_handshake.get_info_hash() != context.info_hash)
+        {
+            close_session("Handshake failed");
+        }
+
+        // on successful handshake, send our bitfield if we have pieces. It must follow our own handshake,
+        // which is not sent yet if their handshake arrived before we saw our connect finish.
+        // pieces that finish after this are announced with have messages
+        else
+        {
+            have_cursor = context.torrent->num_finished();
+            if (context.torrent->piece_bitfield->count() != 0)
+            {
+                peer.connected = true;
+                queue_handshake();
+                queue_message(context.torrent->piece_bitfield->pack());
+                std::cout << "sent bitfield" << std::endl;
+            }
+        }
+    }
+
+    void Session::handle_message(const uint8_t *msg, uint32_t len)
+    {
+        uint8_t id = msg[0];
+        const uint8_t *payload = msg + sizeof(id);
+        uint32_t payload_length = len - sizeof(id);
+
+        switch (id)
+        {
+        case Messages::CHOKE_ID:
+        {
+            peer.peer_choking = true;
+            std::cout << "got choke" << std::endl;
+
+            // a choking peer discards our requests, so they have to be made again
+            context.torrent->release_requests(peer.socket);
+            break;
+        }
+        case Messages::UNCHOKE_ID:
+        {
+            peer.peer_choking = false;
+            std::cout << "got unchoke" << std::endl;
+            break;
+        }
+        case Messages::INTERESTED_ID:
+        {
+            peer.peer_interested = true;
+            context.interest_changed = true;
+            std::cout << "got interested" << std::endl;
+            break;
+        }
+        case Messages::NOTINTERESTED_ID:
+        {
+            peer.peer_interested = false;
+            context.interest_changed = true;
+            std::cout << "got notinterested" << std::endl;
+            break;
+        }
+        case Messages::HAVE_ID:
+        {
+            std::cout << "got have" << std::endl;
+            uint32_t index;
+            if (payload_length != sizeof(index))
+            {
+                break;
+            }
+            memcpy(&index, payload, sizeof(index));
+            index = ntohl(index);
+
+            // a peer that starts with no pieces may skip its bitfield and only send haves
+            if (peer.peer_bitfield == nullptr)
+            {
+                peer.peer_bitfield = new File::BitField(context.torrent->num_pieces);
+            }
+            if (index < context.torrent->num_pieces && !peer.peer_bitfield->is_bit_set(index))
+            {
+                peer.peer_bitfield->set_bit(index);
+                context.torrent->add_availability(index);
+            }
+            break;
+        }
+        case Messages::BITFIELD_ID:
+        {
+            std::cout << "got bitfield" << std::endl;
+            if (peer.peer_bitfield != nullptr)
+            {
+                context.torrent->remove_availability(peer.peer_bitfield);
+                delete peer.peer_bitfield;
+            }
+            peer.peer_bitfield = new File::BitField(payload, payload_length, context.torrent->num_pieces);
+            context.torrent->add_availability(peer.peer_bitfield);
+            break;
+        }
+
+        // Upon request, serve the piece to the client
+        case Messages::REQUEST_ID:
+        {
+            std::cout << "got request" << std::endl;
+            if (payload_length != Messages::REQUEST_LENGTH - sizeof(id))
+            {
+                break;
+            }
+            Messages::Request req = Messages::Request(payload);
+
+            // a choked peer's requests are not served
+            if (peer.am_choking)
+            {
+                break;
+            }
+
+            // the block is queued when the send queue has room for it
+            if (peer_requests.size() >= (size_t)context.incoming_request_queue_size)
+            {
+                std::cout << "too many requests, dropped block " << req.index << " " << req.begin << std::endl;
+                break;
+            }
+            peer_requests.push_back(File::Block{req.index, req.begin, req.length});
+            break;
+        }
+
+        // Upon cancel, drop the request if its block is not in the send queue yet
+        case Messages::CANCEL_ID:
+        {
+            std::cout << "got cancel" << std::endl;
+            if (payload_length != Messages::CANCEL_LENGTH - sizeof(id))
+            {
+                break;
+            }
+            Messages::Cancel cancel = Messages::Cancel(payload);
+            auto it = std::find_if(peer_requests.begin(), peer_requests.end(), [&cancel](File::Block &block)
+                                   { return block.index == cancel.index && block.begin == cancel.begin && block.length == cancel.length; });
+            if (it != peer_requests.end())
+            {
+                peer_requests.erase(it);
+            }
+            break;
+        }
+
+        // Upon getting a piece, write the block to our output
+        case Messages::PIECE_ID:
+        {
+            uint32_t index;
+            uint32_t begin;
+            if (payload_length < sizeof(index) + sizeof(begin))
+            {
+                break;
+            }
+            memcpy(&index, payload, sizeof(index));
+            memcpy(&begin, payload + sizeof(index), sizeof(begin));
+
+            peer.download_rate.add(payload_length - sizeof(index) - sizeof(begin));
+            context.torrent->write_block(ntohl(index), ntohl(begin), payload + sizeof(index) + sizeof(begin),
+                                         payload_length - sizeof(index) - sizeof(begin), peer.socket);
+            break;
+        }
+        }
+    }
+
+    void Session::update_request_depth()
+    {
+        // the kernel keeps a smoothed round trip time for the connection. Latencies of our own requests would include
+        // the time they wait behind the rest of the queue, and grow with it
+        auto now = std::chrono::steady_clock::now();
+        if (rtt_ms == 0 || now - rtt_sampled >= std::chrono::milliseconds(RTT_SAMPLE_INTERVAL_MS))
+        {
+            tcp_info info;
+            socklen_t len = sizeof(info);
+            if (getsockopt(peer.socket, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+            {
+                uint32_t rtt_us = info.tcpi_rtt != 0 ? info.tcpi_rtt : info.tcpi_rcv_rtt;
+                rtt_ms = rtt_us / 1000.0;
+            }
+            rtt_sampled = now;
+        }
+
+        double bdp_blocks = peer.download_rate.rate() * rtt_ms / 1000.0 / File::Piece::block_size;
+        int depth = std::max(context.outgoing_request_queue_size, (int)std::ceil(REQUEST_QUEUE_GAIN * bdp_blocks));
+        request_depth = std::min(depth, context.max_outgoing_request_queue_size);
+    }
+
+    std::string Session::stats()
+    {
+        std::ostringstream line;
+        line.precision(2);
+        line << std::fixed << peer.to_string() << ": down " << peer.download_rate.rate() / 1024 << " KiB/s, up "
+             << peer.upload_rate.rate() / 1024 << " KiB/s, " << (peer.am_choking ? "choked" : "unchoked") << ", rtt " << rtt_ms
+             << " ms, request depth " << request_depth << ", in flight " << context.torrent->requests_in_flight(peer.socket);
+        return line.str();
+    }
+
+    void Session::queue_message(Messages::Buffer *buff)
+    {
+        send_queue.push(std::move(buff->ptr), buff->total_length);
+        delete buff;
+    }
+
+    void Session::queue_handshake()
+    {
+        if (!peer.sent_shake)
+        {
+            Messages::Handshake client_handshake = Messages::Handshake(19, "BitTorrent protocol", context.info_hash, context.client_id);
+            queue_message(client_handshake.pack());
+            peer.sent_shake = true;
+        }
+    }
+
+    void Session::serve_requests()
+    {
+        while (!peer_requests.empty() && !send_queue.above_high_water())
+        {
+            File::Block block = peer_requests.front();
+            peer_requests.pop_front();
+
+            // the block is sent straight from the page cache
+            if (!context.torrent->queue_block(send_queue, block.index, block.begin, block.length))
+            {
+                std::cout << "could not serve block " << block.index << " " << block.begin << std::endl;
+            }
+        }
+    }
+
+    bool Session::flush()
+    {
+        Util::BandwidthLimit *global = context.global_limit;
+        long long quota = Util::available({global != nullptr ? &global->upload : nullptr, &context.torrent_limit.upload, &limit.upload});
+        size_t queued = send_queue.size();
+        size_t block_bytes = 0;
+        if (!send_queue.flush(peer.socket, quota, &block_bytes))
+        {
+            close_session(std::string("Send failed: ") + strerror(errno));
+            return false;
+        }
+
+        // the socket may still have room, so only a refill picks up where the limit stopped
+        size_t sent = queued - send_queue.size();
+        Util::consume({global != nullptr ? &global->upload : nullptr, &context.torrent_limit.upload, &limit.upload}, sent);
+        peer.upload_rate.add(sent);
+
+        // blocks are queued as ranges of storage, so only those bytes count as uploaded, once they are written
+        context.torrent->uploaded += block_bytes;
+        if (!send_queue.empty() && sent == (size_t)quota)
+        {
+            throttled = true;
+        }
+        return true;
+    }
+
+    void Session::refill(long long elapsed_ms)
+    {
+        limit.upload.refill(elapsed_ms);
+        limit.download.refill(elapsed_ms);
+        if (!throttled || is_closed)
+        {
+            return;
+        }
+        throttled = false;
+        if (receive())
+        {
+            pump();
+        }
+    }
+
+    void Session::set_choking(bool choke)
+    {
+        if (is_closed || !peer.recv_shake || peer.am_choking == choke)
+        {
+            return;
+        }
+
+        if (choke)
+        {
+            // the peer has to request again once it is unchoked
+            queue_message(Messages::Choke().pack());
+            peer_requests.clear();
+            std::cout << "sent choke" << std::endl;
+        }
+        else
+        {
+            queue_message(Messages::Unchoke().pack());
+            std::cout << "sent unchoke" << std::endl;
+        }
+        peer.am_choking = choke;
+    }
+
+    void Session::pump()
+    {
+        if (is_closed || !peer.connected)
+        {
+            return;
+        }
+
+        // if we haven't handshake with this peer yet, send handshake
+        queue_handshake();
+
+        File::Torrent *torrent = context.torrent;
+        if (peer.recv_shake)
+        {
+            // tell the peer about pieces that finished since it was sent our bitfield
+            std::vector<uint32_t> finished;
+            torrent->take_finished(have_cursor, finished);
+            for (uint32_t index : finished)
+            {
+                queue_message(Messages::Have(index).pack());
+            }
+
+            // withdraw requests for blocks that arrived from another peer in endgame
+            std::vector<File::Block> cancelled;
+            torrent->take_cancels(peer.socket, cancelled);
+            for (File::Block &block : cancelled)
+            {
+                queue_message(Messages::Cancel(block.index, block.begin, block.length).pack());
+                std::cout << "sent cancel: " << block.to_string() << std::endl;
+            }
+
+            // if we arent already interested in this peer, see if we got their bitfield
+            // then check if they have any pieces we need. If they do, then send an interested message
+            if (peer.peer_bitfield != nullptr && !peer.am_interested)
+            {
+                if (torrent->piece_bitfield->first_match(peer.peer_bitfield) != -1)
+                {
+                    queue_message(Messages::Interested().pack());
+                    peer.am_interested = true;
+                    std::cout << "sent interested" << std::endl;
+                }
+            }
+
+            // if we are interested in this peer, see if they still have any pieces we need
+            // if they dont, update by sending not interested. If they do, send requests if we arent choked
+            else if (peer.am_interested && !peer.peer_choking)
+            {
+                if (torrent->piece_bitfield->first_match(peer.peer_bitfield) == -1)
+                {
+                    queue_message(Messages::NotInterested().pack());
+                    peer.am_interested = false;
+                    std::cout << "sent notinterested" << std::endl;
+                }
+                else
+                {
+                    // try to maintain request_depth requests outgoing for this peer, for blocks of pieces it has.
+                    // the requests are written together when the queue is flushed
+                    std::vector<File::Block> blocks;
+                    update_request_depth();
+                    int in_flight = torrent->requests_in_flight(peer.socket);
+                    if (in_flight < request_depth && !send_queue.above_high_water())
+                    {
+                        torrent->pick_blocks(peer.socket, peer.peer_bitfield, request_depth - in_flight, blocks);
+                    }
+                    for (File::Block &block : blocks)
+                    {
+                        queue_message(Messages::Request(block.index, block.begin, block.length).pack());
+                        std::cout << "sent request: " << block.to_string() << std::endl;
+                    }
+                }
+            }
+
+            serve_requests();
+        }
+
+        // keep serving requests as the socket drains, until it is full or they run out
+        while (flush() && !peer_requests.empty() && !send_queue.above_high_water())
+        {
+            serve_requests();
+        }
+    }
+}
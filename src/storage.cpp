@@ -0,0 +1,500 @@
+#include "storage.hpp"
+
+#include <iostream>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <vector>
+#include <algorithm>
+
+namespace File
+{
+    // open the output file without truncating it, so that data from a previous run is kept
+    static int open_output_file(std::string path)
+    {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            std::cerr << "Failed to open " << path << std::endl;
+            std::cerr << strerror(errno) << std::endl;
+            exit(1);
+        }
+        return fd;
+    }
+
+    // write len bytes from src to fd at offset, retrying short writes
+    static bool write_fd(int fd, long long offset, const uint8_t *src, size_t len)
+    {
+        size_t total = 0;
+        while (total < len)
+        {
+            ssize_t n = pwrite(fd, src + total, len - total, offset + total);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            total += n;
+        }
+        return true;
+    }
+
+    // write the iovcnt buffers in iov back to back to fd at offset, retrying short writes
+    static bool writev_fd(int fd, long long offset, const iovec *iov, int iovcnt)
+    {
+        std::vector<iovec> remaining(iov, iov + iovcnt);
+        size_t first = 0; // the first buffer that still has bytes left to write
+
+        while (first < remaining.size())
+        {
+            ssize_t n = pwritev(fd, remaining.data() + first, remaining.size() - first, offset);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            offset += n;
+
+            // skip past the buffers that were written completely, then advance into a partially written one
+            while (first < remaining.size() && (size_t)n >= remaining[first].iov_len)
+            {
+                n -= remaining[first].iov_len;
+                first++;
+            }
+            if (first < remaining.size())
+            {
+                remaining[first].iov_base = (uint8_t *)remaining[first].iov_base + n;
+                remaining[first].iov_len -= n;
+            }
+        }
+        return true;
+    }
+
+    // read len bytes from fd at offset into dst, retrying short reads
+    static bool read_fd(int fd, long long offset, uint8_t *dst, size_t len)
+    {
+        size_t total = 0;
+        while (total < len)
+        {
+            ssize_t n = pread(fd, dst + total, len - total, offset + total);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            total += n;
+        }
+        return true;
+    }
+
+    // send at most len bytes of the file fd at offset to the socket sock_fd with sendfile
+    static ssize_t send_fd(int sock_fd, int fd, long long offset, size_t len)
+    {
+        off_t file_offset = offset;
+        ssize_t n;
+        do
+        {
+            n = sendfile(sock_fd, fd, &file_offset, len);
+        } while (n < 0 && errno == EINTR);
+        return n;
+    }
+
+    // create every missing directory above the file at path
+    static void make_parent_directories(std::string path)
+    {
+        for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+        {
+            std::string directory = path.substr(0, slash);
+            if (mkdir(directory.c_str(), 0755) < 0 && errno != EEXIST)
+            {
+                std::cerr << "Failed to create directory " << directory << std::endl;
+                std::cerr << strerror(errno) << std::endl;
+                exit(1);
+            }
+        }
+    }
+
+    FileStorage::FileStorage(std::string path, long long length)
+    {
+        this->length = length;
+        make_parent_directories(path); // the one file of a multi file torrent is still inside its directory
+        fd = open_output_file(path);
+
+        // size the file, holes are left sparse
+        if (ftruncate(fd, length) < 0)
+        {
+            std::cerr << "Failed to size " << path << std::endl;
+            std::cerr << strerror(errno) << std::endl;
+            exit(1);
+        }
+    }
+
+    FileStorage::~FileStorage()
+    {
+        close(fd);
+    }
+
+    bool FileStorage::write(long long offset, const uint8_t *src, size_t len)
+    {
+        return write_fd(fd, offset, src, len);
+    }
+
+    bool FileStorage::writev(long long offset, const iovec *iov, int iovcnt)
+    {
+        return writev_fd(fd, offset, iov, iovcnt);
+    }
+
+    bool FileStorage::read(long long offset, uint8_t *dst, size_t len)
+    {
+        return read_fd(fd, offset, dst, len);
+    }
+
+    void FileStorage::sync()
+    {
+        fdatasync(fd);
+    }
+
+    ssize_t FileStorage::send(int sock_fd, long long offset, size_t len)
+    {
+        return send_fd(sock_fd, fd, offset, len);
+    }
+
+    void FileStorage::prefetch(long long offset, long long len)
+    {
+        posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+    }
+
+    MmapStorage::MmapStorage(std::string path, long long length)
+    {
+        this->length = length;
+        make_parent_directories(path); // the one file of a multi file torrent is still inside its directory
+        fd = open_output_file(path);
+
+        // reserve the blocks up front so that writes into the mapping cannot fail with SIGBUS
+        // when the disk fills up. Fall back to a sparse file if the filesystem cannot preallocate.
+        if (fallocate(fd, 0, 0, length) < 0 && ftruncate(fd, length) < 0)
+        {
+            std::cerr << "Failed to preallocate " << path << std::endl;
+            std::cerr << strerror(errno) << std::endl;
+            exit(1);
+        }
+
+        void *addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            std::cerr << "Failed to mmap " << path << std::endl;
+            std::cerr << strerror(errno) << std::endl;
+            exit(1);
+        }
+        base = (uint8_t *)addr;
+    }
+
+    MmapStorage::~MmapStorage()
+    {
+        msync(base, length, MS_SYNC);
+        munmap(base, length);
+        close(fd);
+    }
+
+    bool MmapStorage::write(long long offset, const uint8_t *src, size_t len)
+    {
+        if (offset < 0 || offset + (long long)len > length)
+        {
+            return false;
+        }
+        memcpy(base + offset, src, len);
+        return true;
+    }
+
+    bool MmapStorage::writev(long long offset, const iovec *iov, int iovcnt)
+    {
+        for (int i = 0; i < iovcnt; i++)
+        {
+            if (!write(offset, (const uint8_t *)iov[i].iov_base, iov[i].iov_len))
+            {
+                return false;
+            }
+            offset += iov[i].iov_len;
+        }
+        return true;
+    }
+
+    bool MmapStorage::read(long long offset, uint8_t *dst, size_t len)
+    {
+        if (offset < 0 || offset + (long long)len > length)
+        {
+            return false;
+        }
+        memcpy(dst, base + offset, len);
+        return true;
+    }
+
+    void MmapStorage::sync()
+    {
+        msync(base, length, MS_SYNC);
+    }
+
+    ssize_t MmapStorage::send(int sock_fd, long long offset, size_t len)
+    {
+        // the mapping shares its pages with the page cache, so the file can be sent from without copying the mapping
+        return send_fd(sock_fd, fd, offset, len);
+    }
+
+    uint8_t *MmapStorage::mapped(long long offset)
+    {
+        return base + offset;
+    }
+
+    void MmapStorage::prefetch(long long offset, long long len)
+    {
+        static const long long page_size = sysconf(_SC_PAGESIZE);
+        long long start = offset / page_size * page_size;
+        long long end = std::min(offset + len, length);
+        if (start < end)
+        {
+            madvise(base + start, end - start, MADV_WILLNEED);
+        }
+    }
+
+    FileHandleCache::FileHandleCache(const std::vector<FileSpan> &files, size_t capacity) : files(files)
+    {
+        this->capacity = std::max((size_t)1, capacity);
+        handles = std::vector<Handle>(files.size(), Handle{-1, 0, false, lru.end()});
+    }
+
+    FileHandleCache::~FileHandleCache()
+    {
+        for (uint32_t index : lru)
+        {
+            if (handles[index].dirty)
+            {
+                fdatasync(handles[index].fd);
+            }
+            close(handles[index].fd);
+        }
+    }
+
+    void FileHandleCache::evict()
+    {
+        // files in use are skipped, so the cache can briefly hold more than its capacity
+        auto it = lru.end();
+        while (lru.size() >= capacity && it != lru.begin())
+        {
+            --it;
+            Handle &handle = handles[*it];
+            if (handle.users > 0)
+            {
+                continue;
+            }
+
+            // the data of a closed file must still reach the disk before the next sync returns
+            if (handle.dirty)
+            {
+                fdatasync(handle.fd);
+            }
+            close(handle.fd);
+            handle.fd = -1;
+            handle.dirty = false;
+            it = lru.erase(it);
+        }
+    }
+
+    int FileHandleCache::acquire(uint32_t index, bool writing)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Handle &handle = handles[index];
+
+        if (handle.fd < 0)
+        {
+            evict();
+            handle.fd = open_output_file(files[index].path);
+            lru.push_front(index);
+        }
+        else
+        {
+            lru.splice(lru.begin(), lru, handle.lru_pos);
+        }
+        handle.lru_pos = lru.begin();
+        handle.users++;
+        handle.dirty = handle.dirty || writing;
+        return handle.fd;
+    }
+
+    void FileHandleCache::release(uint32_t index)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        handles[index].users--;
+    }
+
+    void FileHandleCache::sync()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint32_t index : lru)
+        {
+            if (handles[index].dirty)
+            {
+                fdatasync(handles[index].fd);
+                handles[index].dirty = false;
+            }
+        }
+    }
+
+    MultiFileStorage::MultiFileStorage(std::vector<FileSpan> files, int max_open_files) : files(std::move(files)), handles(this->files, max_open_files)
+    {
+        for (FileSpan &file : this->files)
+        {
+            file_starts.push_back(file.offset);
+
+            // size every file up front, so that reads of pieces we do not have yet do not run past the end of a file
+            make_parent_directories(file.path);
+            int fd = open_output_file(file.path);
+            struct stat st;
+            if (fstat(fd, &st) < 0 || (st.st_size != file.length && ftruncate(fd, file.length) < 0))
+            {
+                std::cerr << "Failed to size " << file.path << std::endl;
+                std::cerr << strerror(errno) << std::endl;
+                exit(1);
+            }
+            close(fd);
+        }
+    }
+
+    uint32_t MultiFileStorage::file_at(long long offset)
+    {
+        // the last file that starts at or before offset. Empty files that start at the same offset come before it
+        uint32_t index = std::upper_bound(file_starts.begin(), file_starts.end(), offset) - file_starts.begin() - 1;
+        while (index < files.size() && files[index].length == 0)
+        {
+            index++;
+        }
+        return index;
+    }
+
+    template <typename Op>
+    bool MultiFileStorage::for_each_span(long long offset, long long len, Op op)
+    {
+        if (offset < 0 || len < 0 || files.empty() || offset + len > files.back().offset + files.back().length)
+        {
+            return false;
+        }
+
+        long long done = 0;
+        uint32_t index = file_at(offset);
+        while (done < len)
+        {
+            FileSpan &file = files[index];
+            long long file_offset = offset + done - file.offset;
+            long long span = std::min(len - done, file.length - file_offset);
+            if (span > 0 && !op(index, file_offset, done, span))
+            {
+                return false;
+            }
+            done += span;
+            index++;
+        }
+        return true;
+    }
+
+    bool MultiFileStorage::write(long long offset, const uint8_t *src, size_t len)
+    {
+        return for_each_span(offset, len, [&](uint32_t index, long long file_offset, long long done, long long span)
+                             {
+            int fd = handles.acquire(index, true);
+            bool ok = write_fd(fd, file_offset, src + done, span);
+            handles.release(index);
+            return ok; });
+    }
+
+    bool MultiFileStorage::writev(long long offset, const iovec *iov, int iovcnt)
+    {
+        long long len = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            len += iov[i].iov_len;
+        }
+
+        // walk the buffers alongside the files, handing each file the slices of the buffers that fall in it
+        int buffer = 0;
+        size_t buffer_offset = 0; // bytes of iov[buffer] that were handed to an earlier file
+        std::vector<iovec> slices;
+        return for_each_span(offset, len, [&](uint32_t index, long long file_offset, long long, long long span)
+                             {
+            slices.clear();
+            while (span > 0)
+            {
+                size_t take = std::min((size_t)span, iov[buffer].iov_len - buffer_offset);
+                slices.push_back(iovec{(uint8_t *)iov[buffer].iov_base + buffer_offset, take});
+                span -= take;
+                buffer_offset += take;
+                if (buffer_offset == iov[buffer].iov_len)
+                {
+                    buffer++;
+                    buffer_offset = 0;
+                }
+            }
+
+            int fd = handles.acquire(index, true);
+            bool ok = writev_fd(fd, file_offset, slices.data(), slices.size());
+            handles.release(index);
+            return ok; });
+    }
+
+    bool MultiFileStorage::read(long long offset, uint8_t *dst, size_t len)
+    {
+        return for_each_span(offset, len, [&](uint32_t index, long long file_offset, long long done, long long span)
+                             {
+            int fd = handles.acquire(index, false);
+            bool ok = read_fd(fd, file_offset, dst + done, span);
+            handles.release(index);
+            return ok; });
+    }
+
+    void MultiFileStorage::sync()
+    {
+        handles.sync();
+    }
+
+    ssize_t MultiFileStorage::send(int sock_fd, long long offset, size_t len)
+    {
+        if (offset < 0 || files.empty() || offset >= files.back().offset + files.back().length)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        // only send from the file that holds offset, the caller sends the rest of the range next
+        uint32_t index = file_at(offset);
+        long long file_offset = offset - files[index].offset;
+        size_t span = std::min((long long)len, files[index].length - file_offset);
+
+        int fd = handles.acquire(index, false);
+        ssize_t sent = send_fd(sock_fd, fd, file_offset, span);
+        int saved_errno = errno;
+        handles.release(index);
+        errno = saved_errno;
+        return sent;
+    }
+
+    void MultiFileStorage::prefetch(long long offset, long long len)
+    {
+        for_each_span(offset, len, [&](uint32_t index, long long file_offset, long long, long long span)
+                      {
+            int fd = handles.acquire(index, false);
+            posix_fadvise(fd, file_offset, span, POSIX_FADV_WILLNEED);
+            handles.release(index);
+            return true; });
+    }
+}
@@ -0,0 +1,74 @@
+#include "token_bucket.hpp"
+
+#include <algorithm>
+#include <climits>
+
+namespace Util
+{
+    TokenBucket::TokenBucket(long long bytes_per_second)
+    {
+        tokens = 0;
+        set_rate(bytes_per_second);
+        tokens = burst;
+    }
+
+    void TokenBucket::set_rate(long long bytes_per_second)
+    {
+        limit = std::max(0ll, bytes_per_second);
+
+        // a bucket holds at least a refill's worth, or the rate could never be reached
+        burst = std::max(limit * BUCKET_BURST_MS, limit * REFILL_INTERVAL_MS) / 1000;
+        tokens = std::min(tokens, burst);
+    }
+
+    long long TokenBucket::rate()
+    {
+        return limit;
+    }
+
+    void TokenBucket::refill(long long elapsed_ms)
+    {
+        if (limit == 0)
+        {
+            return;
+        }
+        tokens = std::min(burst, tokens + limit * elapsed_ms / 1000);
+    }
+
+    long long TokenBucket::available()
+    {
+        return limit == 0 ? LLONG_MAX : std::max(0ll, tokens);
+    }
+
+    void TokenBucket::consume(long long bytes)
+    {
+        if (limit != 0)
+        {
+            tokens -= bytes;
+        }
+    }
+
+    long long available(std::initializer_list<TokenBucket *> buckets)
+    {
+        long long allowed = LLONG_MAX;
+        for (TokenBucket *bucket : buckets)
+        {
+            if (bucket != nullptr)
+            {
+                allowed = std::min(allowed, bucket->available());
+            }
+        }
+        return allowed;
+    }
+
+    void consume(std::initializer_list<TokenBucket *> buckets, long long bytes)
+    {
+        for (TokenBucket *bucket : buckets)
+        {
+            if (bucket != nullptr)
+            {
+                bucket->consume(bytes);
+            }
+        }
+    }
+}
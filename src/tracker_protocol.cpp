@@ -1,107 +1,484 @@
 #include "tracker_protocol.hpp"
+#include "udp_tracker.hpp"
+
+#include <algorithm>
+#include <random>
+#include <unordered_set>
 
 namespace TrackerProtocol
 {
-    sockaddr_in get_tracker_addr(const std::string announce_url)
+    bool get_tracker_host(const std::string announce_url, std::string *host, std::string *port)
     {
         // get the host part and port of the announce url
-        char *host;
-        char *port;
-        curl_global_init(CURL_GLOBAL_DEFAULT);
+        char *host_part;
+        char *port_part;
         CURLU *handle = curl_url();
-        CURLUcode rc = curl_url_set(handle, CURLUPART_URL, announce_url.c_str(), 0);
-        rc = curl_url_get(handle, CURLUPART_HOST, &host, 0);
-        rc = curl_url_get(handle, CURLUPART_PORT, &port, 0);
 
-        std::string host_url(host);
-        std::string port_str(port);
-
-        // clean up stuff from curl
+        // curl does not speak udp://, but can still split such a url
+        CURLUcode rc = curl_url_set(handle, CURLUPART_URL, announce_url.c_str(), CURLU_NON_SUPPORT_SCHEME);
+        if (rc == CURLUE_OK)
+        {
+            rc = curl_url_get(handle, CURLUPART_HOST, &host_part, 0);
+        }
+        if (rc == CURLUE_OK)
+        {
+            rc = curl_url_get(handle, CURLUPART_PORT, &port_part, CURLU_DEFAULT_PORT);
+            if (rc != CURLUE_OK)
+            {
+                curl_free(host_part);
+            }
+        }
         curl_url_cleanup(handle);
-        curl_free(host);
-        curl_free(port);
+        if (rc != CURLUE_OK)
+        {
+            fprintf(stderr, "bad announce url: %s\n", announce_url.c_str());
+            return false;
+        }
+
+        *host = host_part;
+        *port = port_part;
+        curl_free(host_part);
+        curl_free(port_part);
+        return true;
+    }
 
-        // call getaddrinfo, return the first valid ip address we find
-        int status;
-        addrinfo hints;
-        addrinfo *servinfo;
-        memset(&hints, 0, sizeof hints);
+    Tracker::Tracker(std::string announce_url, std::string info_hash, std::string peer_id, int client_port, Net::Reactor *reactor,
+                     std::function<AnnounceStats()> get_stats, std::function<void(std::vector<Peer::PeerClient> &)> on_peers)
+        : resolver(reactor, [this](bool ok, sockaddr_in addr)
+                   { resolved(ok, addr); })
+    {
+        this->announce_url = announce_url;
+        this->info_hash = info_hash;
+        this->peer_id = peer_id;
+        this->client_port = client_port;
+        this->reactor = reactor;
+        this->get_stats = get_stats;
+        this->on_peers = on_peers;
+
+        in_progress = false;
+        started = false;
+        stopped = false;
+        failures = 0;
+        interval = DEFAULT_INTERVAL;
+        min_interval = 0;
+        num_seeders = 0;
+        num_leechers = 0;
+        tracker_id = "";
+        memset(&tracker_addr, 0, sizeof(tracker_addr));
+        address_known = false;
 
-        hints.ai_family = AF_INET;
-        hints.ai_socktype = SOCK_STREAM;
-        hints.ai_flags = AI_PASSIVE;
+        // the first announce tells the tracker that we started
+        events.push_back(EventType::STARTED);
+        next_announce = std::chrono::steady_clock::now();
+        last_announce = next_announce;
+    }
 
-        if ((status = getaddrinfo(host_url.c_str(), port_str.c_str(), &hints, &servinfo)) != 0)
+    bool Tracker::address_cached()
+    {
+        return address_known && std::chrono::steady_clock::now() < address_expires;
+    }
+
+    bool Tracker::resolve()
+    {
+        std::string host;
+        std::string port;
+        return get_tracker_host(announce_url, &host, &port) && resolver.resolve(host, port);
+    }
+
+    void Tracker::resolved(bool ok, sockaddr_in addr)
+    {
+        if (!ok)
         {
-            fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
-            exit(1);
+            abort();
+            failed("could not resolve the tracker's host");
+            return;
         }
+        tracker_addr = addr;
+        address_known = true;
+        address_expires = std::chrono::steady_clock::now() + std::chrono::seconds(RESOLVE_TTL);
+        on_address();
+    }
 
-        sockaddr_in tracker_addr_ret;
-        sockaddr_in *tracker_addr = (sockaddr_in *)(servinfo->ai_addr);
-        memcpy(&tracker_addr_ret, tracker_addr, sizeof(sockaddr_in));
-        curl_global_cleanup();
-        freeaddrinfo(servinfo);
+    EventType Tracker::current_event()
+    {
+        return events.empty() ? EventType::EMPTY : events.front();
+    }
 
-        return tracker_addr_ret;
+    void Tracker::announce(EventType event)
+    {
+        if (event == EventType::STOPPED)
+        {
+            stopped = true;
+            if (in_progress)
+            {
+                abort();
+                in_progress = false;
+            }
+            events.clear();
+            if (!started)
+            {
+                return;
+            }
+        }
+        events.push_back(event);
+
+        // an event goes out once the announce in progress is done
+        if (!in_progress)
+        {
+            begin();
+        }
     }
 
-    TrackerManager::TrackerManager(std::string torrent_file, std::string p_id, int c_port)
+    void Tracker::begin()
     {
-        // parse metafile and obtain announce url
-        std::string metainfo = Metainfo::read_metainfo_to_buffer(torrent_file);
-        std::string info_dict = Metainfo::read_info_dict_str(metainfo);
+        EventType event = current_event();
+        in_progress = true;
+        deadline = std::chrono::steady_clock::now() + std::chrono::seconds(announce_timeout());
+        if (!start(event, get_stats()))
+        {
+            failed("could not start announce");
+        }
+    }
 
-        // set all fields on creation
-        announce_url = Metainfo::read_announce_url(metainfo);
-        info_hash = Hash::truncated_sha1_hash(info_dict, 20);
-        peer_id = p_id;
-        client_port = c_port;
-        uploaded = "0";
-        downloaded = "0";
-        left = "0";
-        compact = 1;
-        no_peer_id = 0;
-        event = EventType::STARTED;
-        tracker_addr = get_tracker_addr(announce_url);
-        tracker_id = "";
+    int Tracker::announce_timeout()
+    {
+        return ANNOUNCE_TIMEOUT;
+    }
 
-        // get socket set up
-        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        assert(sock >= 0);
+    void Tracker::tick(bool want_peers)
+    {
+        auto now = std::chrono::steady_clock::now();
+        on_tick();
+        if (in_progress)
+        {
+            if (now >= deadline)
+            {
+                abort();
+                failed("announce timed out");
+            }
+            return;
+        }
 
-        if (connect(sock, (sockaddr *) &tracker_addr, sizeof(sockaddr_in)) < 0)
+        // nothing follows a STOPPED
+        if (stopped && events.empty())
         {
-            std::cerr << "Failed to connect to tracker" << std::endl;
-            std::cerr << strerror(errno) << std::endl;
-            exit(1);
+            return;
         }
 
-        sent_completed = false;
+        // a torrent that is short of peers does not wait the whole interval, but never announces more often than
+        // the tracker allows
+        bool early = want_peers && failures == 0 && now >= last_announce + std::chrono::seconds(early_announce_gap());
+        if (now >= next_announce || (events.empty() && early))
+        {
+            begin();
+        }
+    }
+
+    int Tracker::early_announce_gap()
+    {
+        int regular = interval > 0 ? interval : DEFAULT_INTERVAL;
+        if (min_interval > 0)
+        {
+            return std::min(std::max(min_interval, MIN_INTERVAL_FLOOR), regular);
+        }
+        // a tracker that does not say how often it may be asked only expects an announce every interval
+        return std::min(std::max(regular / 4, EARLY_ANNOUNCE_MIN), regular);
+    }
+
+    bool Tracker::busy()
+    {
+        return in_progress || !events.empty();
+    }
+
+    bool Tracker::announcing()
+    {
+        return in_progress;
+    }
+
+    bool Tracker::working()
+    {
+        return started && failures == 0;
+    }
+
+    bool Tracker::failing()
+    {
+        return failures > 0;
+    }
+
+    std::string Tracker::get_announce_url()
+    {
+        return announce_url;
+    }
+
+    void Tracker::succeeded(std::vector<Peer::PeerClient> &peers)
+    {
+        in_progress = false;
+        failures = 0;
+        EventType event = current_event();
+        if (!events.empty())
+        {
+            events.pop_front();
+        }
+        if (event == EventType::STARTED)
+        {
+            started = true;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        last_announce = now;
+        next_announce = now + std::chrono::seconds(interval > 0 ? interval : DEFAULT_INTERVAL);
+        std::cout << "announced to " << announce_url << ": " << peers.size() << " peers, next in " << interval << " s" << std::endl;
+
+        // we are leaving, so the peers are of no use
+        if (event != EventType::STOPPED && !peers.empty())
+        {
+            on_peers(peers);
+        }
+
+        // the next event follows right away
+        if (!events.empty())
+        {
+            begin();
+        }
+    }
+
+    void Tracker::failed(std::string reason)
+    {
+        in_progress = false;
+        std::cout << "announce to " << announce_url << " failed: " << reason << std::endl;
+
+        // the tracker may have moved, so its host is looked up again for the retry
+        address_known = false;
+
+        // we are leaving, so there is no point trying again
+        if (current_event() == EventType::STOPPED)
+        {
+            events.pop_front();
+            return;
+        }
+
+        int backoff = RETRY_BACKOFF_MIN << std::min(failures, 16);
+        failures++;
+        next_announce = std::chrono::steady_clock::now() + std::chrono::seconds(std::min(backoff, RETRY_BACKOFF_MAX));
+    }
+
+    HttpTracker::HttpTracker(std::string announce_url, std::string info_hash, std::string peer_id, int client_port, Net::Reactor *reactor,
+                             std::function<AnnounceStats()> get_stats, std::function<void(std::vector<Peer::PeerClient> &)> on_peers)
+        : Tracker(announce_url, info_hash, peer_id, client_port, reactor, get_stats, on_peers), response(HTTP_HEADER_MAX_SIZE, HTTP_MAX_SIZE)
+    {
+        sock = -1;
+        connected = false;
+        idle = false;
+        reused = false;
+        request_sent = 0;
+    }
+
+    HttpTracker::~HttpTracker()
+    {
+        close_connection();
+    }
+
+    bool HttpTracker::open_connection()
+    {
+        sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+        if (sock < 0)
+        {
+            return false;
+        }
+        if (connect(sock, (sockaddr *)&tracker_addr, sizeof(sockaddr_in)) < 0 && errno != EINPROGRESS)
+        {
+            close(sock);
+            sock = -1;
+            return false;
+        }
+        connected = false;
+        idle = false;
+        reactor->add(sock, EPOLLIN | EPOLLOUT, this);
+        return true;
+    }
+
+    void HttpTracker::close_connection()
+    {
+        if (sock >= 0)
+        {
+            reactor->remove(sock, this);
+            close(sock);
+            sock = -1;
+        }
+        idle = false;
+    }
+
+    bool HttpTracker::start(EventType event, AnnounceStats stats)
+    {
+        request = construct_http_string(event, stats);
+        if (request.empty())
+        {
+            return false;
+        }
+        request_sent = 0;
+        response.reset();
+
+        // a connection that the tracker kept open is already writable, so it raises no new event and the request goes now
+        if (sock >= 0 && idle)
+        {
+            idle = false;
+            reused = true;
+            if (send_request())
+            {
+                return true;
+            }
+            close_connection();
+        }
+        reused = false;
+
+        // the connect waits for the tracker's host to be looked up, unless its address is cached
+        if (!address_cached())
+        {
+            return resolve();
+        }
+        return open_connection();
+    }
+
+    void HttpTracker::on_address()
+    {
+        if (!open_connection())
+        {
+            failed(std::string("connect failed: ") + strerror(errno));
+        }
+    }
+
+    void HttpTracker::abort()
+    {
+        resolver.cancel();
+        close_connection();
+    }
+
+    void HttpTracker::on_writable()
+    {
+        if (sock < 0 || idle)
+        {
+            return;
+        }
+
+        // the first writable event tells us whether the connect succeeded
+        if (!connected)
+        {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+            {
+                abort();
+                failed(std::string("connect failed: ") + strerror(error));
+                return;
+            }
+            connected = true;
+        }
+        if (!send_request())
+        {
+            abort();
+            failed(std::string("send failed: ") + strerror(errno));
+        }
+    }
+
+    void HttpTracker::on_readable()
+    {
+        if (sock < 0)
+        {
+            return;
+        }
+
+        // a kept-alive connection has nothing to say between announces, except that the tracker closed it
+        if (idle)
+        {
+            char buffer[64];
+            ssize_t n;
+            while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0 || (n < 0 && errno == EINTR))
+            {
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                close_connection();
+            }
+            return;
+        }
+        recv_response();
+    }
+
+    void HttpTracker::on_error()
+    {
+        if (idle)
+        {
+            close_connection();
+            return;
+        }
+        abort();
+        failed("connection error");
+    }
+
+    bool HttpTracker::send_request()
+    {
+        while (request_sent < request.length())
+        {
+            ssize_t n = send(sock, request.data() + request_sent, request.length() - request_sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0)
+            {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            request_sent += n;
+        }
+        return true;
     }
 
     // Function to craft HTTP GET request using the provided fields
     // manually constructs the HTTP request
     // assumes all fields are defined.
-    std::string TrackerManager::construct_http_string()
+    std::string HttpTracker::construct_http_string(EventType event, AnnounceStats stats)
     {
-        // get the host part of the announce URL
+        // get the host, path and query of the announce URL, and its port if it names one
         CURLU *handle = curl_url();
+        char *host = nullptr;
+        char *path = nullptr;
+        char *port = nullptr;
+        char *query = nullptr;
         CURLUcode rc = curl_url_set(handle, CURLUPART_URL, announce_url.c_str(), 0);
-        char *host;
-        rc = curl_url_get(handle, CURLUPART_HOST, &host, 0);
+        if (rc == CURLUE_OK)
+        {
+            rc = curl_url_get(handle, CURLUPART_HOST, &host, 0);
+        }
+        if (rc == CURLUE_OK)
+        {
+            rc = curl_url_get(handle, CURLUPART_PATH, &path, 0);
+        }
+        if (rc != CURLUE_OK)
+        {
+            fprintf(stderr, "bad announce url: %s\n", announce_url.c_str());
+            curl_free(host);
+            curl_url_cleanup(handle);
+            return "";
+        }
 
-        // get the port of the announce URL
-        char *port;
-        rc = curl_url_get(handle, CURLUPART_PORT, &port, 0);
+        // without them, these leave port and query null
+        curl_url_get(handle, CURLUPART_PORT, &port, 0);
+        curl_url_get(handle, CURLUPART_QUERY, &query, 0);
 
         std::string host_url(host);
+        std::string target = std::string(path) + "?" + (query != nullptr ? std::string(query) + "&" : "");
+        if (port != nullptr)
+        {
+            host_url += ":" + std::string(port);
+        }
 
         // clean up
         curl_free(host);
+        curl_free(path);
+        curl_free(port);
+        curl_free(query);
         curl_url_cleanup(handle);
 
-        curl_global_init(CURL_GLOBAL_DEFAULT);
         CURL *curl = curl_easy_init();
         assert(curl);
 
@@ -110,17 +487,17 @@ namespace TrackerProtocol
         assert(url_encoded_info);
         assert(url_encoded_peer_id);
 
-        // "GET /announce?param=value&param=value HTTP/1.1\r\nHost: {}\r\n\r\n"
+        // "GET /announce?param=value&param=value HTTP/1.1\r\nHost: {}\r\n\r\n", after the url's own path and query
         std::string request = "";
-        request += "GET /announce?";
+        request += "GET " + target;
         request += "info_hash=" + std::string(url_encoded_info) + "&";  // urlencoded
         request += "peer_id=" + std::string(url_encoded_peer_id) + "&"; // urlencoded
         request += "port=" + std::to_string(client_port) + "&";
-        request += "uploaded=" + uploaded + "&";
-        request += "downloaded=" + downloaded + "&";
-        request += "left=" + left + "&";
-        request += "compact=" + std::to_string(compact) + "&";
-        request += "no_peer_id=" + std::to_string(no_peer_id) + "&";
+        request += "uploaded=" + std::to_string(stats.uploaded) + "&";
+        request += "downloaded=" + std::to_string(stats.downloaded) + "&";
+        request += "left=" + std::to_string(stats.left) + "&";
+        request += "compact=1&";
+        request += "no_peer_id=0&";
 
         switch (event)
         {
@@ -147,163 +524,363 @@ namespace TrackerProtocol
 
         // add tracker id
         if(tracker_id != "") {
-            request += "tracker id=" + tracker_id + "&";
+            char *url_encoded_tracker_id = curl_easy_escape(curl, tracker_id.c_str(), tracker_id.length());
+            request += "trackerid=" + std::string(url_encoded_tracker_id) + "&";
+            curl_free(url_encoded_tracker_id);
         }
 
         // add HTTP version
         request += " HTTP/1.1\r\n";
-        request += "User-Agent: NewBT\r\n"; 
+        request += "User-Agent: NewBT\r\n";
         // add host std::string
-        request += "Host: " + host_url + ":" + port + "\r\n\r\n";
+        request += "Host: " + host_url + "\r\n\r\n";
 
-        free(url_encoded_info);
-        free(url_encoded_peer_id);
-        curl_global_cleanup();
+        curl_free(url_encoded_info);
+        curl_free(url_encoded_peer_id);
+        curl_easy_cleanup(curl);
 
         return request;
     }
 
-    // Pack all headers into a std::string, transmit the HTTP request with TCP
-    void TrackerManager::send_http()
+    void HttpTracker::recv_response()
     {
-        std::string http_req = construct_http_string();
-        uint32_t length = http_req.length();
-        assert(sendall(sock, http_req.c_str(), &length) == 0);
-    }
-
-    void TrackerManager::recv_http()
-    {
-
-        // Split a string on a delimiter sequence into a list of std::strings
-        // this function helps parse HTTP responses into fields based on CRLF="\r\n"
-        auto split = [](std::string input, std::string delimiter)
+        char buffer[HTTP_HEADER_MAX_SIZE];
+        while (true)
         {
-            std::vector<std::string> tokens;
-
-            std::string token;
-            size_t last_break_end = 0;
-            size_t found_pos = input.find(delimiter, last_break_end);
-            // find delimiter in the string, substring input between
-            // last occurrenace of the delimiter and new occurrence
-            // add as token
-            while (found_pos != std::string::npos)
+            ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR)
             {
-                size_t substr_len = found_pos - last_break_end + 1;
-                std::string token = input.substr(last_break_end, substr_len);
-                tokens.push_back(token);
-                last_break_end = found_pos + delimiter.length(); // need to advance past the delimiter
-                found_pos = input.find(delimiter, last_break_end);
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                return;
+            }
+            if (n < 0)
+            {
+                abort();
+                failed(std::string("recv failed: ") + strerror(errno));
+                return;
             }
 
-            // add last token, which should run from last_break_end to end of std::string
-            tokens.push_back(input.substr(last_break_end, std::string::npos));
-
-            return tokens;
-        };
-
-        char buffer[HTTP_HEADER_MAX_SIZE];
-        int response_code = 0;
-        int payload_length = 0;
-
-        // read the HTTP header, ensure that we got successful message
-        // and successfully parsed payload length
-
-        int recv_length = recv(sock, &buffer, HTTP_HEADER_MAX_SIZE, 0);
-        assert(recv_length > 0); // make sure socket didn't close on us
-        std::string http_resp = std::string(buffer, recv_length);
+            if (n == 0)
+            {
+                // the tracker closed a kept-alive connection just as we reused it, so the request goes again on a new one
+                if (reused && response.empty())
+                {
+                    close_connection();
+                    reused = false;
+                    request_sent = 0;
+                    if (!open_connection())
+                    {
+                        failed("could not reconnect");
+                    }
+                    return;
+                }
+                response.finish();
+            }
+            else
+            {
+                response.feed(buffer, n);
+            }
 
-        // Split on CRLF, parse the response code and content length
-        // header fields
-        std::vector<std::string> lines = split(http_resp, "\r\n");
-        assert(!lines.empty());
+            if (response.failed())
+            {
+                abort();
+                failed("bad response: " + response.error);
+                return;
+            }
+            if (response.complete())
+            {
+                finish_response();
+                return;
+            }
+        }
+    }
 
-        for (auto &line : lines)
+    void HttpTracker::finish_response()
+    {
+        // the connection stays open for the next announce if the tracker allows it
+        if (response.keep_alive)
         {
-            std::vector<std::string> words = split(line, " ");
-
-            if (words[0] == "HTTP/1.1 ")
-                response_code = stoi(words[1]);
-            else if (words[0] == "Content-Length: ")
-                payload_length = stoi(words[1]);
+            idle = true;
+        }
+        else
+        {
+            close_connection();
         }
 
-        // make sure we got the full message, and OK status
-        std::string bencoded_payload = lines.back();
-        assert(response_code == HTTP_OK);
-        assert(payload_length > 0);
-        assert(bencoded_payload.length() == payload_length);
+        if (response.status != HTTP_OK)
+        {
+            failed("HTTP status " + std::to_string(response.status));
+            return;
+        }
 
-        // bdecode the payload and fill in fields
-        parse_payload(bencoded_payload);
+        std::vector<Peer::PeerClient> peers;
+        if (!parse_payload(response.body, peers))
+        {
+            failed("bad response: " + failure_reason);
+            return;
+        }
+        succeeded(peers);
     }
 
-    void TrackerManager::parse_payload(std::string payload)
+    bool HttpTracker::parse_payload(std::string payload, std::vector<Peer::PeerClient> &peers)
     {
-        bencode::data data = bencode::decode(payload);
-        bencode::dict resp_dict = std::get<bencode::dict>(data);
+        // a malformed response is the tracker's fault, and must not take the client down
+        bencode::dict resp_dict;
+        try
+        {
+            resp_dict = std::get<bencode::dict>(bencode::decode(payload));
+        }
+        catch (const std::exception &err)
+        {
+            failure_reason = err.what();
+            return false;
+        }
+
+        auto get_int = [&](const std::string &key, long long fallback)
+        {
+            auto it = resp_dict.find(key);
+            if (it != resp_dict.end() && std::holds_alternative<long long>(it->second.base()))
+            {
+                return std::get<long long>(it->second.base());
+            }
+            return fallback;
+        };
+        auto get_string = [&](const std::string &key, std::string fallback)
+        {
+            auto it = resp_dict.find(key);
+            if (it != resp_dict.end() && std::holds_alternative<std::string>(it->second.base()))
+            {
+                return std::get<std::string>(it->second.base());
+            }
+            return fallback;
+        };
 
         // If we failed, other fields are not guaranteed to exist
         if (resp_dict.find("failure reason") != resp_dict.end())
         {
-            failure_reason = std::get<std::string>(resp_dict["failure reason"]);
+            failure_reason = get_string("failure reason", "malformed failure reason");
             std::cout << failure_reason << std::endl;
+            return false;
         }
         else
         {
+            tracker_id = get_string("tracker id", tracker_id);
 
-            if (resp_dict.find("tracker id") != resp_dict.end())
+            interval = get_int("interval", DEFAULT_INTERVAL);
+            min_interval = get_int("min interval", 0);
+            num_seeders = get_int("complete", 0);
+            num_leechers = get_int("incomplete", 0);
+            if (resp_dict.find("peers") == resp_dict.end())
             {
-                tracker_id = std::get<std::string>(resp_dict["tracker id"]);
+                return true;
             }
 
-            interval = std::get<long long>(resp_dict["interval"]);
-            num_seeders = std::get<long long>(resp_dict["complete"]);
-            num_leechers = std::get<long long>(resp_dict["incomplete"]);
-
-            // match peers onto its specified type using a visit
-            std::visit([&](auto &&arg)
-                       {
-            using T = std::decay_t <decltype(arg)>;
+            // a peer entry of the wrong type throws from std::get
+            try
+            {
+                // match peers onto its specified type using a visit
+                std::visit([&](auto &&arg)
+                           {
+                using T = std::decay_t <decltype(arg)>;
             
-            // Integer peers? According to bittorrent protocol, this isn't possible.
-            if constexpr (std::is_same_v<T, bencode::integer>) { std::cout << "peers mapped to int?" << std::endl; }
+                // Integer peers? According to bittorrent protocol, this isn't possible.
+                if constexpr (std::is_same_v<T, bencode::integer>) { std::cout << "peers mapped to int?" << std::endl; }
 
-            // Map peers? According to bittorrent protocol, this isn't possible.
-            else if constexpr (std::is_same_v<T, bencode::dict>) { std::cout << "peers mapped to map?" << std::endl; }
+                // Map peers? According to bittorrent protocol, this isn't possible.
+                else if constexpr (std::is_same_v<T, bencode::dict>) { std::cout << "peers mapped to map?" << std::endl; }
 
-            // Binary peer model
-            else if constexpr (std::is_same_v<T, bencode::string>) {
+                // Binary peer model
+                else if constexpr (std::is_same_v<T, bencode::string>) {
                 
-                // read 6 bytes at a time for each peer 
-                std::stringstream ss(arg);
-                char block[6]; 
-                while(ss.read(block, 6)) { 
+                    // read 6 bytes at a time for each peer 
+                    std::stringstream ss(arg);
+                    char block[6]; 
+                    while(ss.read(block, 6)) { 
                     
-                    uint32_t ip_addr; 
-                    uint16_t port; 
+                        uint32_t ip_addr; 
+                        uint16_t port; 
 
-                    // first 4 bytes are for ip address in network byte order; 
-                    // last 2 bytes are for port in network byte order;
-                    memcpy(&ip_addr, block, sizeof(uint32_t));
-                    memcpy(&port, block + sizeof(uint32_t), sizeof(uint16_t)); 
+                        // first 4 bytes are for ip address in network byte order; 
+                        // last 2 bytes are for port in network byte order;
+                        memcpy(&ip_addr, block, sizeof(uint32_t));
+                        memcpy(&port, block + sizeof(uint32_t), sizeof(uint16_t)); 
                     
-                    Peer::PeerClient peer(ip_addr, port); 
-                    peers.push_back(peer); 
+                        Peer::PeerClient peer(ip_addr, port); 
+                        peers.push_back(peer); 
+                    }
                 }
-            }
             
-            // Dictionary peer model
-            else if constexpr (std::is_same_v<T, bencode::list>) {
-                for(auto && entry : arg) {
-                    auto peer_dict = std::get<bencode::dict>(entry); 
-                    std::string peer_id = std::get<std::string>(peer_dict["peer id"]);
-                    std::string ip = std::get<std::string>(peer_dict["ip"]); 
-                    int port = std::get<long long>(peer_dict["port"]);
+                // Dictionary peer model
+                else if constexpr (std::is_same_v<T, bencode::list>) {
+                    for(auto && entry : arg) {
+                        auto peer_dict = std::get<bencode::dict>(entry); 
+                        std::string peer_id = std::get<std::string>(peer_dict["peer id"]);
+                        std::string ip = std::get<std::string>(peer_dict["ip"]); 
+                        int port = std::get<long long>(peer_dict["port"]);
                     
-                    Peer::PeerClient peer(peer_id, ip, port); 
-                    peers.push_back(peer);
+                        Peer::PeerClient peer(peer_id, ip, port); 
+                        peers.push_back(peer);
+                    }
+                } }, resp_dict["peers"].base());
+            }
+            catch (const std::exception &err)
+            {
+                failure_reason = err.what();
+                return false;
+            }
+            return true;
+        }
+    }
+
+    std::unique_ptr<Tracker> create_tracker(std::string announce_url, std::string info_hash, std::string peer_id, int client_port, Net::Reactor *reactor,
+                                            std::function<AnnounceStats()> get_stats, std::function<void(std::vector<Peer::PeerClient> &)> on_peers)
+    {
+        if (announce_url.rfind("udp://", 0) == 0)
+        {
+            return std::make_unique<UdpTracker>(announce_url, info_hash, peer_id, client_port, reactor, get_stats, on_peers);
+        }
+        return std::make_unique<HttpTracker>(announce_url, info_hash, peer_id, client_port, reactor, get_stats, on_peers);
+    }
+
+    TrackerManager::TrackerManager(std::string metainfo_buffer, std::string peer_id, int client_port, Net::Reactor *reactor,
+                                   std::function<AnnounceStats()> get_stats, std::function<void(std::vector<Peer::PeerClient> &)> on_peers)
+    {
+        std::string info_dict = Metainfo::read_info_dict_str(metainfo_buffer);
+        std::string info_hash = Hash::truncated_sha1_hash(info_dict, 20);
+
+        // a tracker may list a peer twice, and the trackers of a torrent list many of the same peers, which the owner
+        // drops against the peers it is connected to
+        auto unique_peers = [on_peers](std::vector<Peer::PeerClient> &peers)
+        {
+            std::unordered_set<uint64_t> seen;
+            std::vector<Peer::PeerClient> unique;
+            for (Peer::PeerClient &peer : peers)
+            {
+                if (seen.insert((uint64_t)peer.sockaddr.sin_addr.s_addr << 16 | peer.sockaddr.sin_port).second)
+                {
+                    unique.push_back(peer);
+                }
+            }
+            on_peers(unique);
+        };
+
+        // the urls of a tier are shuffled, so that clients spread their load over its trackers
+        std::mt19937 rng(std::random_device{}());
+        for (std::vector<std::string> &urls : Metainfo::read_announce_tiers(metainfo_buffer))
+        {
+            std::shuffle(urls.begin(), urls.end(), rng);
+            std::vector<std::unique_ptr<Tracker>> tier;
+            for (std::string &url : urls)
+            {
+                tier.push_back(create_tracker(url, info_hash, peer_id, client_port, reactor, get_stats, unique_peers));
+            }
+            tiers.push_back(std::move(tier));
+        }
+        if (tiers.empty())
+        {
+            std::cout << "the torrent names no tracker" << std::endl;
+        }
+
+        activated = 0;
+        stopping = false;
+        sent_completed = false;
+    }
+
+    void TrackerManager::announce(EventType event)
+    {
+        stopping = stopping || event == EventType::STOPPED;
+
+        // trackers of tiers that were never needed hear nothing, and send their STARTED if they are
+        for (size_t i = 0; i < activated; i++)
+        {
+            for (auto &tracker : tiers[i])
+            {
+                tracker->announce(event);
+            }
+        }
+    }
+
+    bool TrackerManager::tick_tier(std::vector<std::unique_ptr<Tracker>> &tier, bool want_peers)
+    {
+        // a tier whose front tracker works only announces to it. The others finish what they started
+        bool settled = tier.front()->working();
+        for (size_t i = 0; i < tier.size(); i++)
+        {
+            if (i == 0 || !settled || tier[i]->announcing())
+            {
+                tier[i]->tick(want_peers);
+            }
+        }
+
+        // promote the first tracker that answered
+        if (!tier.front()->working())
+        {
+            auto it = std::find_if(tier.begin(), tier.end(), [](std::unique_ptr<Tracker> &tracker)
+                                   { return tracker->working(); });
+            if (it != tier.end())
+            {
+                std::cout << "promoted " << (*it)->get_announce_url() << " to the front of its tier" << std::endl;
+                std::rotate(tier.begin(), it, it + 1);
+            }
+        }
+
+        // the tier is given up on once every tracker in it failed its last announce
+        return std::any_of(tier.begin(), tier.end(), [](std::unique_ptr<Tracker> &tracker)
+                           { return !tracker->failing(); });
+    }
+
+    void TrackerManager::tick_announcing(size_t from, bool want_peers)
+    {
+        for (size_t i = from; i < activated; i++)
+        {
+            for (auto &tracker : tiers[i])
+            {
+                if (tracker->announcing())
+                {
+                    tracker->tick(want_peers);
+                }
+            }
+        }
+    }
+
+    void TrackerManager::tick(bool want_peers)
+    {
+        // once we are leaving, no new tier is started, and only the exchanges in progress are driven
+        if (stopping)
+        {
+            tick_announcing(0, want_peers);
+            return;
+        }
+
+        size_t used = 0;
+        for (; used < tiers.size(); used++)
+        {
+            activated = std::max(activated, used + 1);
+            if (tick_tier(tiers[used], want_peers))
+            {
+                break;
+            }
+        }
+
+        // trackers of tiers that are no longer needed still finish an exchange
+        tick_announcing(used + 1, want_peers);
+    }
+
+    bool TrackerManager::busy()
+    {
+        for (auto &tier : tiers)
+        {
+            for (auto &tracker : tier)
+            {
+                if (tracker->announcing())
+                {
+                    return true;
                 }
-            } }, resp_dict["peers"].base());
+            }
         }
+        return false;
     }
 }
@@ -0,0 +1,370 @@
+#include "udp_tracker.hpp"
+
+#include <endian.h>
+
+namespace TrackerProtocol
+{
+    // append an integer to a packet in network byte order
+    static void put_u32(std::vector<uint8_t> &packet, uint32_t value)
+    {
+        value = htonl(value);
+        packet.insert(packet.end(), (uint8_t *)&value, (uint8_t *)&value + sizeof(value));
+    }
+
+    static void put_u64(std::vector<uint8_t> &packet, uint64_t value)
+    {
+        value = htobe64(value);
+        packet.insert(packet.end(), (uint8_t *)&value, (uint8_t *)&value + sizeof(value));
+    }
+
+    // read an integer in network byte order
+    static uint32_t get_u32(const uint8_t *data)
+    {
+        uint32_t value;
+        memcpy(&value, data, sizeof(value));
+        return ntohl(value);
+    }
+
+    static uint64_t get_u64(const uint8_t *data)
+    {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        return be64toh(value);
+    }
+
+    UdpTracker::UdpTracker(std::string announce_url, std::string info_hash, std::string peer_id, int client_port, Net::Reactor *reactor,
+                           std::function<AnnounceStats()> get_stats, std::function<void(std::vector<Peer::PeerClient> &)> on_peers,
+                           int retransmit_base_ms)
+        : Tracker(announce_url, info_hash, peer_id, client_port, reactor, get_stats, on_peers), rng(std::random_device{}())
+    {
+        sock = -1;
+        connection_id = 0;
+        has_connection_id = false;
+        operation = NONE;
+        connecting = false;
+        transaction_id = 0;
+        attempts = 0;
+        this->retransmit_base_ms = retransmit_base_ms;
+        scrape_due = false;
+        announce_event = EventType::EMPTY;
+        announce_stats = AnnounceStats{0, 0, 0};
+        key = rng();
+        num_completed = 0;
+        datagram.resize(UDP_MAX_PACKET);
+    }
+
+    UdpTracker::~UdpTracker()
+    {
+        close_socket();
+    }
+
+    bool UdpTracker::open_socket()
+    {
+        if (sock >= 0)
+        {
+            return true;
+        }
+
+        // a connected datagram socket only receives from the tracker
+        sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+        if (sock < 0)
+        {
+            return false;
+        }
+        if (connect(sock, (sockaddr *)&tracker_addr, sizeof(sockaddr_in)) < 0)
+        {
+            close(sock);
+            sock = -1;
+            return false;
+        }
+        reactor->add(sock, EPOLLIN, this);
+        return true;
+    }
+
+    void UdpTracker::close_socket()
+    {
+        if (sock >= 0)
+        {
+            reactor->remove(sock, this);
+            close(sock);
+            sock = -1;
+        }
+        has_connection_id = false;
+    }
+
+    bool UdpTracker::start(EventType event, AnnounceStats stats)
+    {
+        announce_event = event;
+        announce_stats = stats;
+
+        // the socket is made again for a new address, once the old one expired or an announce failed
+        if (!address_cached())
+        {
+            close_socket();
+            if (!resolve())
+            {
+                return false;
+            }
+            operation = ANNOUNCE;
+            return true;
+        }
+        if (!open_socket())
+        {
+            return false;
+        }
+
+        // an announce takes over from a scrape
+        operation = ANNOUNCE;
+        send_request();
+        return true;
+    }
+
+    void UdpTracker::on_address()
+    {
+        if (!open_socket())
+        {
+            fail_operation(std::string("could not create socket: ") + strerror(errno));
+            return;
+        }
+        send_request();
+    }
+
+    bool UdpTracker::scrape()
+    {
+        if (operation != NONE || !address_cached() || !open_socket())
+        {
+            return false;
+        }
+        operation = SCRAPE;
+        send_request();
+        return true;
+    }
+
+    void UdpTracker::abort()
+    {
+        resolver.cancel();
+        operation = NONE;
+    }
+
+    int UdpTracker::announce_timeout()
+    {
+        // a connect and an announce, each of which may be sent every attempt, plus a second of slack.
+        // the exchange normally fails on its own before this
+        int total_ms = 0;
+        for (int i = 0; i < UDP_MAX_ATTEMPTS; i++)
+        {
+            total_ms += retransmit_base_ms << i;
+        }
+        return 2 * total_ms / 1000 + 1;
+    }
+
+    void UdpTracker::send_request()
+    {
+        packet.clear();
+        connecting = !has_connection_id || std::chrono::steady_clock::now() >= connection_expires;
+        if (connecting)
+        {
+            // connect: protocol id, action, transaction id
+            put_u64(packet, UDP_PROTOCOL_ID);
+            put_u32(packet, UDP_CONNECT);
+            put_u32(packet, 0);
+        }
+        else if (operation == ANNOUNCE)
+        {
+            // BEP 15 numbers the events none, completed, started, stopped
+            uint32_t event = 0;
+            switch (announce_event)
+            {
+            case COMPLETED:
+                event = 1;
+                break;
+            case STARTED:
+                event = 2;
+                break;
+            case STOPPED:
+                event = 3;
+                break;
+            case EMPTY:
+                break;
+            }
+
+            // announce: connection id, action, transaction id, info hash, peer id, downloaded, left, uploaded,
+            // event, ip (0 for the sender's), key, number of peers wanted (-1 for the default), port
+            put_u64(packet, connection_id);
+            put_u32(packet, UDP_ANNOUNCE);
+            put_u32(packet, 0);
+            packet.insert(packet.end(), info_hash.begin(), info_hash.end());
+            std::string id = peer_id;
+            id.resize(20, '0');
+            packet.insert(packet.end(), id.begin(), id.end());
+            put_u64(packet, announce_stats.downloaded);
+            put_u64(packet, announce_stats.left);
+            put_u64(packet, announce_stats.uploaded);
+            put_u32(packet, event);
+            put_u32(packet, 0);
+            put_u32(packet, key);
+            put_u32(packet, (uint32_t)-1);
+            uint16_t port = htons(client_port);
+            packet.insert(packet.end(), (uint8_t *)&port, (uint8_t *)&port + sizeof(port));
+        }
+        else
+        {
+            // scrape: connection id, action, transaction id, info hashes
+            put_u64(packet, connection_id);
+            put_u32(packet, UDP_SCRAPE);
+            put_u32(packet, 0);
+            packet.insert(packet.end(), info_hash.begin(), info_hash.end());
+        }
+        begin_exchange();
+    }
+
+    void UdpTracker::begin_exchange()
+    {
+        // the transaction id sits after the 8 byte protocol or connection id and the 4 byte action
+        transaction_id = rng();
+        uint32_t id = htonl(transaction_id);
+        memcpy(packet.data() + 12, &id, sizeof(id));
+        attempts = 0;
+        transmit();
+    }
+
+    void UdpTracker::transmit()
+    {
+        // a datagram that the socket could not take is as good as lost, and is sent again on timeout
+        send(sock, packet.data(), packet.size(), MSG_NOSIGNAL);
+        retransmit_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(retransmit_base_ms << attempts);
+        attempts++;
+    }
+
+    void UdpTracker::on_tick()
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (operation == NONE)
+        {
+            if (scrape_due && now >= scrape_at)
+            {
+                scrape_due = false;
+                scrape();
+            }
+            return;
+        }
+        if (resolver.busy() || now < retransmit_at)
+        {
+            return;
+        }
+        if (attempts >= UDP_MAX_ATTEMPTS)
+        {
+            fail_operation("no response from tracker");
+            return;
+        }
+        transmit();
+    }
+
+    void UdpTracker::fail_operation(std::string reason)
+    {
+        Operation failed_operation = operation;
+        operation = NONE;
+        if (failed_operation == ANNOUNCE)
+        {
+            failed(reason);
+        }
+        else
+        {
+            std::cout << "scrape of " << announce_url << " failed: " << reason << std::endl;
+        }
+    }
+
+    void UdpTracker::on_readable()
+    {
+        while (true)
+        {
+            ssize_t n = recv(sock, datagram.data(), datagram.size(), 0);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            // an unreachable port shows up as an error on the connected socket, and the resend timer deals with it
+            if (n < 0)
+            {
+                return;
+            }
+            handle_response(datagram.data(), n);
+        }
+    }
+
+    void UdpTracker::handle_response(const uint8_t *data, size_t length)
+    {
+        // every response starts with the action and the transaction id of its request. Late responses to requests that
+        // were sent again, or that belong to an exchange that was given up on, are dropped
+        if (operation == NONE || length < 8 || get_u32(data + 4) != transaction_id)
+        {
+            return;
+        }
+        uint32_t action = get_u32(data);
+
+        if (action == UDP_ERROR)
+        {
+            // the tracker may have forgotten our connection id, so get a new one next time
+            has_connection_id = false;
+            failure_reason = std::string((const char *)data + 8, length - 8);
+            fail_operation("tracker error: " + failure_reason);
+            return;
+        }
+
+        if (connecting)
+        {
+            if (action != UDP_CONNECT || length < 16)
+            {
+                return;
+            }
+            connection_id = get_u64(data + 8);
+            connection_expires = std::chrono::steady_clock::now() + std::chrono::seconds(UDP_CONNECTION_ID_LIFETIME);
+            has_connection_id = true;
+            send_request();
+            return;
+        }
+
+        if (operation == ANNOUNCE)
+        {
+            // interval, leechers and seeders, then 6 bytes for each peer
+            if (action != UDP_ANNOUNCE || length < 20)
+            {
+                return;
+            }
+            interval = get_u32(data + 8);
+            num_leechers = get_u32(data + 12);
+            num_seeders = get_u32(data + 16);
+
+            std::vector<Peer::PeerClient> peers;
+            for (size_t offset = 20; offset + 6 <= length; offset += 6)
+            {
+                uint32_t ip_addr;
+                uint16_t port;
+                memcpy(&ip_addr, data + offset, sizeof(uint32_t));
+                memcpy(&port, data + offset + sizeof(uint32_t), sizeof(uint16_t));
+                peers.push_back(Peer::PeerClient(ip_addr, port));
+            }
+            operation = NONE;
+
+            // scrape while there is nothing else to ask the tracker, unless we are leaving
+            scrape_due = !stopped;
+            scrape_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(interval * 500ll);
+            succeeded(peers);
+        }
+        else
+        {
+            // seeders, completed and leechers of the one torrent asked about
+            if (action != UDP_SCRAPE || length < 20)
+            {
+                return;
+            }
+            num_seeders = get_u32(data + 8);
+            num_completed = get_u32(data + 12);
+            num_leechers = get_u32(data + 16);
+            operation = NONE;
+            std::cout << "scraped " << announce_url << ": " << num_seeders << " seeders, " << num_leechers << " leechers, "
+                      << num_completed << " completed" << std::endl;
+        }
+    }
+}
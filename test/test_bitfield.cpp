@@ -1,47 +1,159 @@
+#undef NDEBUG
 #include <iostream>
-#include <cstring>
-#include <string>
-#include <thread>
-
-#include <assert.h>
-#include <sys/socket.h>
-#include <netdb.h>
-#include <sys/types.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <sys/epoll.h>
-#include <assert.h>
-
-#include "client.h"
-#include "tracker_protocol.h"
-#include "peer_wire_protocol.h"
-
-#define TIMEOUT 120
-
-const std::string torrent_file_path = "bigfile.torrent";
-const std::string id = "EZ6969";
-const int listen_port = 6881;
-const int MAX_LISTEN_Q = 50;
-
-
-int main() {
-    ProtocolUtils::BitField bf = ProtocolUtils::BitField(63);
-    assert(bf.num_bits == 63 && bf.bitfield.size() == 8);
-    for (int i = 0; i < 8; i++) {
-        assert(bf.bitfield[i] == 0);
+#include <random>
+#include <vector>
+#include <cassert>
+
+#include "file.hpp"
+#include "bit_ops.hpp"
+
+// Checks the bitfield scans, and the word kernels under them, against a bit at a time reference.
+// Sizes run across word and SIMD block boundaries, and the bits are random with a few densities, so that the kernel in
+// use, AVX2, NEON or portable, sees hits in every lane and in the tail words.
+
+// the reference for first_match and next_match: the first bit at or after from that a lacks and b has
+static int scalar_next_match(File::BitField &a, File::BitField &b, uint32_t from)
+{
+    for (uint32_t i = from; i < a.num_bits; i++)
+    {
+        if (!a.is_bit_set(i) && b.is_bit_set(i))
+        {
+            return i;
+        }
     }
+    return -1;
+}
+
+// a random bitfield of num_bits bits, each set with a chance of one in density
+static File::BitField random_bitfield(std::mt19937 &rng, uint32_t num_bits, uint32_t density)
+{
+    File::BitField bitfield(num_bits);
+    for (uint32_t i = 0; i < num_bits; i++)
+    {
+        if (rng() % density == 0)
+        {
+            bitfield.set_bit(i);
+        }
+    }
+    return bitfield;
+}
+
+static void test_scans(std::mt19937 &rng)
+{
+    for (uint32_t num_bits : {1u, 63u, 64u, 65u, 255u, 256u, 257u, 511u, 1000u, 4099u})
+    {
+        for (uint32_t density : {1u, 2u, 50u, 100000u})
+        {
+            File::BitField a = random_bitfield(rng, num_bits, density);
+            File::BitField b = random_bitfield(rng, num_bits, density);
+
+            assert(a.first_match(&b) == scalar_next_match(a, b, 0));
+            for (uint32_t from = 0; from <= num_bits + 1; from++)
+            {
+                assert(a.next_match(&b, from) == scalar_next_match(a, b, from));
+            }
 
-    for (int i = 0; i < 8; i++) {
-        bf.set_bit(8*i + i);
+            int unflipped = -1;
+            uint32_t count = 0;
+            for (uint32_t i = 0; i < num_bits; i++)
+            {
+                unflipped = unflipped == -1 && !a.is_bit_set(i) ? (int)i : unflipped;
+                count += a.is_bit_set(i);
+            }
+            assert(a.first_unflipped() == unflipped);
+            assert(a.all_flipped() == (unflipped == -1));
+            assert(a.count() == count);
+
+            for (uint32_t from = 0; from <= num_bits; from += 1 + num_bits / 64)
+            {
+                int next = -1;
+                for (uint32_t i = from; i < num_bits && next == -1; i++)
+                {
+                    next = a.is_bit_set(i) ? (int)i : -1;
+                }
+                assert(a.find_next_set(from) == next);
+            }
+
+            // and_not keeps the bits of a that b lacks, and the count follows
+            File::BitField c = a;
+            c.and_not(&b);
+            uint32_t kept = 0;
+            for (uint32_t i = 0; i < num_bits; i++)
+            {
+                assert(c.is_bit_set(i) == (a.is_bit_set(i) && !b.is_bit_set(i)));
+                kept += c.is_bit_set(i);
+            }
+            assert(c.count() == kept);
+        }
     }
-    std::cout << "FLIPPED BITS" << std::endl;
-    for (int i = 0; i < 8; i++) {
-        std::cout << "Byte " << i << " is " << std::bitset<8>(bf.bitfield[i]).to_string() << std::endl;
-        //assert(bf.bitfield[i] == (128 >> i));
+}
+
+static void test_kernels(std::mt19937 &rng)
+{
+    for (size_t num_words = 0; num_words <= 21; num_words++)
+    {
+        for (int trial = 0; trial < 200; trial++)
+        {
+            // mostly full or empty words, with one word at a random place that differs
+            std::vector<uint64_t> want(num_words, ~0ull), have(num_words, ~0ull), zero(num_words, 0);
+            size_t odd = num_words == 0 ? 0 : rng() % num_words;
+            if (num_words > 0)
+            {
+                uint64_t bit = 1ull << (rng() % 64);
+                have[odd] &= ~bit;
+                zero[odd] |= bit;
+            }
+            for (size_t i = 0; i < num_words; i++)
+            {
+                if (trial % 4 == 0)
+                {
+                    want[i] = (uint64_t)rng() << 32 | rng();
+                }
+            }
+
+            size_t and_not = num_words, not_full = num_words, nonzero = num_words, popcount = 0;
+            for (size_t i = num_words; i-- > 0;)
+            {
+                and_not = (want[i] & ~have[i]) != 0 ? i : and_not;
+                not_full = have[i] != ~0ull ? i : not_full;
+                nonzero = zero[i] != 0 ? i : nonzero;
+                popcount += __builtin_popcountll(want[i]);
+            }
+            assert(Util::first_word_and_not(want.data(), have.data(), num_words) == and_not);
+            assert(Util::first_word_not_full(have.data(), num_words) == not_full);
+            assert(Util::first_word_nonzero(zero.data(), num_words) == nonzero);
+            assert(Util::popcount_words(want.data(), num_words) == popcount);
+
+            std::vector<uint64_t> cleared = want;
+            Util::and_not_words(cleared.data(), have.data(), num_words);
+            for (size_t i = 0; i < num_words; i++)
+            {
+                assert(cleared[i] == (want[i] & ~have[i]));
+            }
+        }
     }
-    std::cout << "CORRECT BITS WERE FLIPPED" << std::endl;
-    assert(!bf.all_flipped());
-    assert(bf.first_unflipped() == 1);
+}
+
+static void test_payload()
+{
+    // bit 0 is the highest bit of the first byte, and bits past num_bits are dropped
+    uint8_t payload[2] = {0x81, 0xff};
+    File::BitField bitfield(payload, 2, 10);
+    assert(bitfield.is_bit_set(0) && bitfield.is_bit_set(7) && bitfield.is_bit_set(8) && bitfield.is_bit_set(9));
+    assert(!bitfield.is_bit_set(1) && bitfield.count() == 4);
+    assert(bitfield.num_bytes() == 2);
+
+    // a short payload leaves the rest unset
+    File::BitField short_bitfield(payload, 1, 100);
+    assert(short_bitfield.count() == 2 && short_bitfield.first_unflipped() == 1);
+}
 
+int main()
+{
+    std::mt19937 rng(1);
+    std::cout << "kernels: " << Util::bit_ops_isa() << std::endl;
+    test_scans(rng);
+    test_kernels(rng);
+    test_payload();
     std::cout << "FINISHED!" << std::endl;
-}
\ No newline at end of file
+}
@@ -0,0 +1,114 @@
+#undef NDEBUG
+#include <iostream>
+#include <cassert>
+#include <set>
+#include <vector>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "connection_manager.hpp"
+
+// Checks that the connection manager connects to each peer once, never has more connects in progress than it is
+// allowed, skips our own address, and asks for more peers once the candidates it has are used up.
+
+// listen on a free loopback port, and set port to it in network order
+static int listener(uint16_t *port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(sock >= 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(sock, (sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(listen(sock, 16) == 0);
+    socklen_t len = sizeof(addr);
+    assert(getsockname(sock, (sockaddr *)&addr, &len) == 0);
+    *port = addr.sin_port;
+    return sock;
+}
+
+static void test_connects()
+{
+    Net::Reactor reactor;
+    std::vector<Peer::PeerClient> connected;
+
+    // three peers that accept, ten that refuse, and ourselves
+    uint16_t good_ports[3];
+    int good[3];
+    for (int i = 0; i < 3; i++)
+    {
+        good[i] = listener(&good_ports[i]);
+    }
+    uint16_t self_port;
+    int self = listener(&self_port);
+
+    std::vector<Peer::PeerClient> peers;
+    for (int i = 0; i < 10; i++)
+    {
+        uint16_t port;
+        close(listener(&port));
+        peers.push_back(Peer::PeerClient(htonl(INADDR_LOOPBACK), port));
+    }
+    for (uint16_t port : good_ports)
+    {
+        peers.push_back(Peer::PeerClient(htonl(INADDR_LOOPBACK), port));
+    }
+    peers.push_back(Peer::PeerClient(htonl(INADDR_LOOPBACK), good_ports[0]));
+    peers.push_back(Peer::PeerClient(htonl(INADDR_LOOPBACK), self_port));
+
+    sockaddr_in self_addr{};
+    self_addr.sin_family = AF_INET;
+    self_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    self_addr.sin_port = self_port;
+    Peer::ConnectionManager manager(&reactor, self_addr, 2, 5, [&](Peer::PeerClient &peer)
+                                    { connected.push_back(peer); });
+    manager.add_peers(peers);
+    manager.tick(0);
+    assert(!manager.want_peers(0));
+
+    // every candidate is tried once: the refused ones fail, and the good ones connect
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    do
+    {
+        reactor.run_once(10);
+        manager.tick(connected.size());
+        assert(manager.half_open() <= 2);
+    } while ((connected.size() < 3 || manager.half_open() > 0) && std::chrono::steady_clock::now() < deadline);
+
+    assert(connected.size() == 3);
+    std::set<uint16_t> ports;
+    for (Peer::PeerClient &peer : connected)
+    {
+        ports.insert(peer.sockaddr.sin_port);
+    }
+    assert(ports.size() == 3 && ports.count(self_port) == 0);
+
+    // the candidates are used up, so the free slots call for more peers
+    assert(manager.want_peers(connected.size()));
+
+    // a peer that leaves is not reconnected before its backoff
+    manager.disconnected(connected[0].sockaddr, 0);
+    for (int i = 0; i < 10; i++)
+    {
+        reactor.run_once(10);
+        manager.tick(connected.size() - 1);
+    }
+    assert(connected.size() == 3 && manager.half_open() == 0);
+
+    for (Peer::PeerClient &peer : connected)
+    {
+        close(peer.socket);
+    }
+    for (int sock : good)
+    {
+        close(sock);
+    }
+    close(self);
+}
+
+int main()
+{
+    test_connects();
+    std::cout << "FINISHED!" << std::endl;
+    return 0;
+}
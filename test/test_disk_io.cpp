@@ -0,0 +1,151 @@
+#undef NDEBUG
+#include <iostream>
+#include <cassert>
+#include <vector>
+#include <memory>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bencode.hpp"
+#include "disk_io.hpp"
+#include "file.hpp"
+
+// Checks that the disk thread writes every submitted piece where it belongs, whether or not the pieces are contiguous,
+// and that a result comes back for each of them. Also checks that a torrent flushes more verified pieces than the
+// job and result queues hold, which stalls unless results are popped while waiting.
+
+static const uint32_t PIECE_SIZE = 16384;
+static const uint32_t NUM_PIECES = 8;
+
+// pop results until every piece in expected has been reported
+static void wait_for_results(Disk::DiskThread &disk, size_t expected, std::vector<Disk::WriteResult> &out)
+{
+    while (out.size() < expected)
+    {
+        pollfd pfd{disk.notify_fd(), POLLIN, 0};
+        assert(poll(&pfd, 1, 5000) == 1);
+        disk.drain_results(out);
+    }
+}
+
+static void test_writes()
+{
+    char path[] = "/tmp/test_disk_io_XXXXXX";
+    int tmp = mkstemp(path);
+    assert(tmp != -1);
+    close(tmp);
+
+    std::vector<std::unique_ptr<uint8_t[]>> pieces;
+    for (uint32_t i = 0; i < NUM_PIECES; i++)
+    {
+        pieces.emplace_back(new uint8_t[PIECE_SIZE]);
+        for (uint32_t j = 0; j < PIECE_SIZE; j++)
+            pieces[i][j] = (uint8_t)(i * 31 + j);
+    }
+
+    {
+        File::FileStorage storage(path, (long long)PIECE_SIZE * NUM_PIECES);
+        Disk::DiskThread disk(&storage);
+
+        // a contiguous run, submitted out of order, then the pieces around a gap
+        std::vector<uint32_t> order = {2, 1, 0, 3, 5, 7, 4, 6};
+        for (uint32_t index : order)
+            assert(disk.submit({index, (long long)index * PIECE_SIZE, pieces[index].get(), PIECE_SIZE}));
+
+        std::vector<Disk::WriteResult> results;
+        wait_for_results(disk, NUM_PIECES, results);
+        assert(results.size() == NUM_PIECES);
+
+        std::vector<bool> seen(NUM_PIECES, false);
+        for (const Disk::WriteResult &result : results)
+        {
+            assert(result.ok);
+            assert(!seen[result.piece_index]);
+            seen[result.piece_index] = true;
+        }
+    }
+
+    int fd = open(path, O_RDONLY);
+    assert(fd != -1);
+    std::vector<uint8_t> buffer(PIECE_SIZE);
+    for (uint32_t i = 0; i < NUM_PIECES; i++)
+    {
+        assert(pread(fd, buffer.data(), PIECE_SIZE, (off_t)i * PIECE_SIZE) == PIECE_SIZE);
+        for (uint32_t j = 0; j < PIECE_SIZE; j++)
+            assert(buffer[j] == pieces[i][j]);
+    }
+    close(fd);
+    unlink(path);
+}
+
+// the contents of piece i of the flushed torrent
+static std::string piece_contents(uint32_t i)
+{
+    return std::string(PIECE_SIZE, (char)('a' + i % 26));
+}
+
+static void test_flush_many()
+{
+    const uint32_t num_pieces = 3 * Disk::QUEUE_SIZE;
+    char dir_template[] = "/tmp/test_disk_io_XXXXXX";
+    std::string dir = mkdtemp(dir_template);
+    std::string path = dir + "/download";
+
+    std::string hashes;
+    for (uint32_t i = 0; i < num_pieces; i++)
+        hashes += Hash::truncated_sha1_hash(piece_contents(i), 20);
+    bencode::dict info;
+    info["name"] = path;
+    info["length"] = (long long)PIECE_SIZE * num_pieces;
+    info["piece length"] = (long long)PIECE_SIZE;
+    info["pieces"] = hashes;
+    bencode::dict metainfo;
+    metainfo["announce"] = std::string("http://127.0.0.1/announce");
+    metainfo["info"] = info;
+
+    File::TorrentConfig config;
+    config.resume = false;
+    config.memory_budget = 2ll * PIECE_SIZE * num_pieces;
+    std::unique_ptr<File::Torrent> torrent = File::create_torrent(bencode::encode(metainfo), config);
+
+    // every piece arrives and is verified, without the disk results being popped
+    File::BitField all(num_pieces);
+    for (uint32_t i = 0; i < num_pieces; i++)
+        all.set_bit(i);
+    torrent->add_availability(&all);
+    std::vector<File::Block> blocks;
+    torrent->pick_blocks(1, &all, num_pieces, blocks);
+    assert(blocks.size() == num_pieces);
+    for (File::Block &block : blocks)
+    {
+        std::string data = piece_contents(block.index);
+        torrent->write_block(block.index, block.begin, (const uint8_t *)data.data(), block.length, 1);
+    }
+    pollfd pfd{torrent->hash_notify_fd(), POLLIN, 0};
+    while (poll(&pfd, 1, 1000) == 1)
+        torrent->process_hash_results();
+
+    torrent->flush_writes();
+    assert(torrent->piece_bitfield->all_flipped());
+
+    int fd = open(path.c_str(), O_RDONLY);
+    assert(fd != -1);
+    std::vector<char> buffer(PIECE_SIZE);
+    for (uint32_t i = 0; i < num_pieces; i++)
+    {
+        assert(pread(fd, buffer.data(), PIECE_SIZE, (off_t)i * PIECE_SIZE) == PIECE_SIZE);
+        assert(std::string(buffer.data(), PIECE_SIZE) == piece_contents(i));
+    }
+    close(fd);
+    unlink(path.c_str());
+    rmdir(dir.c_str());
+}
+
+int main()
+{
+    test_writes();
+    test_flush_many();
+    std::cout << "FINISHED!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,158 @@
+#undef NDEBUG
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cassert>
+
+#include "bencode.hpp"
+#include "http_response.hpp"
+#include "tracker_protocol.hpp"
+
+// Checks the streaming HTTP parser on responses fed in pieces of several sizes, from one byte at a time, so that every
+// line, chunk size and body is split across reads somewhere. Also checks that the bencoded body of an announce
+// response is rejected rather than thrown on when its fields have the wrong types.
+using TrackerProtocol::HttpResponse;
+
+// feed the response in segments of segment bytes, then close the connection if close_after
+static HttpResponse parse(const std::string &input, size_t segment, bool close_after, size_t max_header = 1024,
+                          size_t max_body = 1024)
+{
+    HttpResponse response(max_header, max_body);
+    for (size_t i = 0; i < input.length() && !response.complete() && !response.failed(); i += segment)
+    {
+        response.feed(input.data() + i, std::min(segment, input.length() - i));
+    }
+    if (close_after)
+    {
+        response.finish();
+    }
+    return response;
+}
+
+static void test_framing(size_t segment)
+{
+    HttpResponse response = parse("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello", segment, false);
+    assert(response.complete() && response.status == 200 && response.body == "hello" && response.keep_alive);
+
+    // a body without a length runs until the connection closes
+    response = parse("HTTP/1.0 200 OK\r\n\r\nuntil close", segment, false);
+    assert(!response.complete());
+    response = parse("HTTP/1.0 200 OK\r\n\r\nuntil close", segment, true);
+    assert(response.complete() && response.body == "until close" && !response.keep_alive);
+
+    // chunk sizes in hex with extensions, and a trailer after the last chunk
+    response = parse("HTTP/1.1 200 OK\r\nConnection: close\r\nTransfer-Encoding: chunked\r\n\r\n"
+                     "3\r\nabc\r\nA;name=value\r\n0123456789\r\n0\r\nX-Trailer: 1\r\n\r\n",
+                     segment, false);
+    assert(response.complete() && response.body == "abc0123456789" && !response.keep_alive);
+
+    // interim responses are skipped, and the final one is parsed
+    response = parse("HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 103 Early Hints\r\nLink: </a>\r\n\r\n"
+                     "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok",
+                     segment, false);
+    assert(response.complete() && response.status == 200 && response.body == "ok");
+
+    // responses that never have a body
+    response = parse("HTTP/1.1 204 No Content\r\n\r\n", segment, false);
+    assert(response.complete() && response.status == 204 && response.body.empty());
+    response = parse("HTTP/1.1 304 Not Modified\r\nContent-Length: 100\r\n\r\n", segment, false);
+    assert(response.complete() && response.body.empty());
+
+    // bare line feeds are taken as line breaks
+    response = parse("HTTP/1.1 200 OK\nContent-Length: 2\n\nhi", segment, false);
+    assert(response.complete() && response.body == "hi");
+}
+
+static void test_malformed(size_t segment)
+{
+    for (const char *length : {"abc", "-1", "5x", "", "99999999999999999999999"})
+    {
+        HttpResponse response = parse(std::string("HTTP/1.1 200 OK\r\nContent-Length: ") + length + "\r\n\r\nhello", segment, false);
+        assert(response.failed());
+    }
+    assert(parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", segment, false).failed());
+    assert(parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabcX\r\n", segment, false).failed());
+    assert(parse("garbage\r\n\r\n", segment, false).failed());
+    assert(parse("HTTP/1.1 200 OK\r\nno colon\r\n\r\n", segment, false).failed());
+
+    // a connection that closes early cuts the response short
+    assert(parse("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort", segment, true).failed());
+    assert(parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nab", segment, true).failed());
+    assert(parse("HTTP/1.1 200 OK\r\nContent-Le", segment, true).failed());
+}
+
+static void test_limits(size_t segment)
+{
+    // bodies and headers past the limits, announced or not
+    assert(parse("HTTP/1.1 200 OK\r\nContent-Length: 5000\r\n\r\n", segment, false).failed());
+    assert(parse("HTTP/1.0 200 OK\r\n\r\n" + std::string(2000, 'a'), segment, true).failed());
+    assert(parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n800\r\n" + std::string(2048, 'a') + "\r\n0\r\n\r\n",
+                 segment, false)
+               .failed());
+    assert(parse("HTTP/1.1 200 OK\r\nX: " + std::string(2000, 'a') + "\r\n\r\n", segment, false).failed());
+    assert(parse("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n" + std::string(2 * HttpResponse::MAX_CHUNK_LINE, '0'),
+                 segment, false)
+               .failed());
+}
+
+static void test_reuse()
+{
+    // a response on a connection that is kept alive stops at its end, and the parser is reset for the next one
+    std::string two = "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\noneHTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\ntwo";
+    HttpResponse response(1024, 1024);
+    assert(response.empty());
+    size_t used = response.feed(two.data(), two.length());
+    assert(response.complete() && response.body == "one" && used == two.length() / 2);
+
+    response.reset();
+    assert(response.empty());
+    response.feed(two.data() + used, two.length() - used);
+    assert(response.complete() && response.body == "two");
+
+    // a connection that closes before any byte is an empty response, which fails
+    HttpResponse nothing(10, 10);
+    nothing.finish();
+    assert(nothing.failed());
+}
+
+static void test_payload()
+{
+    Net::Reactor reactor;
+    TrackerProtocol::HttpTracker tracker("http://127.0.0.1:1/announce", std::string(20, 'h'), "-TT0001-000000000000", 6881, &reactor,
+                                         []()
+                                         { return TrackerProtocol::AnnounceStats{0, 0, 0}; }, [](std::vector<Peer::PeerClient> &) {});
+    std::vector<Peer::PeerClient> peers;
+
+    bencode::dict refused;
+    refused["failure reason"] = std::string("not registered");
+    assert(!tracker.parse_payload(bencode::encode(refused), peers));
+
+    // a failure reason that is not a string still refuses the announce
+    refused["failure reason"] = 7ll;
+    assert(!tracker.parse_payload(bencode::encode(refused), peers));
+
+    // a tracker id that is not a string is ignored, and the peers are still read
+    bencode::dict ok;
+    ok["tracker id"] = bencode::list{};
+    ok["interval"] = 900ll;
+    ok["peers"] = std::string("\x7f\x00\x00\x01\x1a\xe1", 6);
+    assert(tracker.parse_payload(bencode::encode(ok), peers));
+    assert(peers.size() == 1 && ntohs(peers[0].sockaddr.sin_port) == 6881);
+
+    // a body that is not a dictionary
+    assert(!tracker.parse_payload("i5e", peers));
+    assert(!tracker.parse_payload("d8:intervali", peers));
+}
+
+int main()
+{
+    for (size_t segment : {1, 2, 3, 7, 64, 4096})
+    {
+        test_framing(segment);
+        test_malformed(segment);
+        test_limits(segment);
+    }
+    test_reuse();
+    test_payload();
+    std::cout << "FINISHED!" << std::endl;
+}
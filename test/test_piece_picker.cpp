@@ -0,0 +1,147 @@
+#undef NDEBUG
+#include <iostream>
+#include <random>
+#include <cassert>
+
+#include "file.hpp"
+#include "piece_picker.hpp"
+
+// Checks that the picker returns the rarest candidate a peer has, against a scan of every piece, as availability and
+// the candidates change, including peers that lack the rarest pieces and so take the bounded fallback of a pick.
+
+// the lowest availability of a candidate that the peer has, or -1 if it has none
+static int rarest(File::PiecePicker &picker, std::vector<bool> &candidate, File::BitField &bitfield)
+{
+    int best = -1;
+    for (uint32_t i = 0; i < bitfield.num_bits; i++)
+    {
+        if (candidate[i] && bitfield.is_bit_set(i) && (best == -1 || picker.get_availability(i) < (uint32_t)best))
+        {
+            best = picker.get_availability(i);
+        }
+    }
+    return best;
+}
+
+static void test_rarest(std::mt19937 &rng)
+{
+    const uint32_t num_pieces = 3000;
+    File::PiecePicker picker(num_pieces);
+    std::vector<bool> candidate(num_pieces, true);
+    for (uint32_t i = 0; i < num_pieces; i++)
+    {
+        picker.add_candidate(i);
+    }
+    assert(picker.num_candidates() == num_pieces);
+
+    // peers with a few densities, so some pieces are common and some are rare
+    std::vector<File::BitField> peers;
+    for (uint32_t density : {1u, 1u, 2u, 2u, 3u, 10u, 100u})
+    {
+        File::BitField bitfield(num_pieces);
+        for (uint32_t i = 0; i < num_pieces; i++)
+        {
+            if (rng() % density == 0)
+            {
+                bitfield.set_bit(i);
+            }
+        }
+        peers.push_back(bitfield);
+    }
+    for (File::BitField &bitfield : peers)
+    {
+        picker.add_bitfield(&bitfield);
+    }
+
+    for (int round = 0; round < 500; round++)
+    {
+        File::BitField &peer = peers[rng() % peers.size()];
+        int index = picker.pick(&peer);
+        int best = rarest(picker, candidate, peer);
+        if (best == -1)
+        {
+            assert(index == -1);
+            continue;
+        }
+        assert(index >= 0 && candidate[index] && peer.is_bit_set(index));
+
+        // a peer that has every piece gets the rarest, and the bounded search of others gets one no rarer than that
+        assert(picker.get_availability(index) >= (uint32_t)best);
+        if (&peer == &peers[0])
+        {
+            assert(picker.get_availability(index) == (uint32_t)best);
+        }
+
+        // the piece is started, and sometimes a peer announces a piece
+        picker.remove_candidate(index);
+        candidate[index] = false;
+        uint32_t announced = rng() % num_pieces;
+        if (!peers.back().is_bit_set(announced))
+        {
+            peers.back().set_bit(announced);
+            picker.increment(announced);
+        }
+    }
+
+    // peers leave, and availability goes back to what the rest have
+    for (File::BitField &bitfield : peers)
+    {
+        picker.remove_bitfield(&bitfield);
+    }
+    for (uint32_t i = 0; i < num_pieces; i++)
+    {
+        assert(picker.get_availability(i) == 0);
+    }
+}
+
+static void test_bounded_fallback()
+{
+    // every piece is common except two that only one peer has, so a peer without them misses every rare bucket
+    const uint32_t num_pieces = 20000;
+    File::PiecePicker picker(num_pieces);
+    File::BitField common(num_pieces), rare(num_pieces), late(num_pieces);
+    for (uint32_t i = 0; i < num_pieces; i++)
+    {
+        picker.add_candidate(i);
+        if (i != 7 && i != 5007)
+        {
+            common.set_bit(i);
+        }
+        if (i >= 15000 && i != 7 && i != 5007)
+        {
+            late.set_bit(i);
+        }
+    }
+    rare.set_bit(7);
+    rare.set_bit(5007);
+    for (int i = 0; i < 3; i++)
+    {
+        picker.add_bitfield(&common);
+    }
+    picker.add_bitfield(&rare);
+
+    int index = picker.pick(&rare);
+    assert(index == 7 || index == 5007);
+    for (int i = 0; i < 100; i++)
+    {
+        index = picker.pick(&late);
+        assert(index >= 15000 && picker.get_availability(index) == 3);
+    }
+
+    // once the peer's pieces are no longer candidates, there is nothing to pick
+    for (uint32_t i = 15000; i < num_pieces; i++)
+    {
+        picker.remove_candidate(i);
+    }
+    assert(picker.pick(&late) == -1);
+    File::BitField none(num_pieces);
+    assert(picker.pick(&none) == -1);
+}
+
+int main()
+{
+    std::mt19937 rng(1);
+    test_rarest(rng);
+    test_bounded_fallback();
+    std::cout << "FINISHED!" << std::endl;
+}
@@ -0,0 +1,75 @@
+#undef NDEBUG
+#include <iostream>
+#include <thread>
+#include <cassert>
+
+#include "request_table.hpp"
+
+// Checks the bookkeeping of blocks in flight: duplicates to several peers, answers, peers leaving, and timeouts,
+// including requests that were answered or released before they would have expired.
+
+static void test_requests()
+{
+    File::RequestTable table;
+    table.add(1, 0, 16384, 7);
+    table.add(1, 0, 16384, 8); // the same block, in flight to two peers
+    table.add(1, 0, 16384, 7); // already asked of this peer
+    table.add(1, 16384, 16384, 7);
+    assert(table.size() == 2 && table.count(7) == 2 && table.count(8) == 1);
+    assert(table.contains(1, 0) && table.requested_from(1, 0, 8) && !table.requested_from(1, 16384, 8));
+
+    // the block arrived, and every peer it was asked of is returned to be cancelled
+    std::vector<File::InFlightRequest> removed;
+    table.remove(1, 0, removed);
+    assert(removed.size() == 2 && !table.contains(1, 0));
+    assert(table.count(7) == 1 && table.count(8) == 0);
+
+    // the peer left, and its requests are released
+    std::vector<File::InFlightRequest> released;
+    table.release(7, released);
+    assert(released.size() == 1 && released[0].index == 1 && released[0].begin == 16384);
+    assert(table.size() == 0 && table.count(7) == 0);
+}
+
+static void test_expire()
+{
+    File::RequestTable table;
+    table.add(1, 0, 16384, 7);
+    table.add(2, 0, 16384, 7);
+    table.add(3, 0, 16384, 8);
+    table.add(4, 0, 16384, 9);
+
+    // answered and released requests are not expired later
+    std::vector<File::InFlightRequest> done;
+    table.remove(1, 0, done);
+    table.release(8, done);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    // a request for a block made again after it was released is newer than the first one
+    table.add(3, 0, 16384, 8);
+    table.add(5, 0, 16384, 9);
+
+    std::vector<File::InFlightRequest> expired;
+    table.expire(std::chrono::milliseconds(25), expired);
+    assert(expired.size() == 2);
+    assert(expired[0].index == 2 && expired[0].owner == 7);
+    assert(expired[1].index == 4 && expired[1].owner == 9);
+    assert(table.size() == 2 && table.contains(3, 0) && table.contains(5, 0));
+    assert(table.count(7) == 0 && table.count(8) == 1 && table.count(9) == 1);
+
+    // nothing is due yet
+    expired.clear();
+    table.expire(std::chrono::milliseconds(25), expired);
+    assert(expired.empty() && table.size() == 2);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    table.expire(std::chrono::milliseconds(25), expired);
+    assert(expired.size() == 2 && table.size() == 0);
+}
+
+int main()
+{
+    test_requests();
+    test_expire();
+    std::cout << "FINISHED!" << std::endl;
+}
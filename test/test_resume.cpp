@@ -0,0 +1,203 @@
+#undef NDEBUG
+#include <iostream>
+#include <cassert>
+#include <fstream>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "bencode.hpp"
+#include "file.hpp"
+#include "resume.hpp"
+
+// Checks that resume data survives a save and load, and that a missing or corrupt resume file is rejected.
+// Also checks that a torrent saves its resume data through the disk thread, and picks up its pieces from it, for a
+// single file torrent and for a multi file torrent with one file.
+
+static const uint32_t NUM_PIECES = 4;
+static const long long PIECE_LENGTH = 1 << 15;
+
+static void test_round_trip()
+{
+    char path[] = "/tmp/test_resume_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+
+    File::ResumeData saved;
+    saved.file_size = 123456789012ll;
+    saved.file_mtime = 1700000000123456789ll;
+    saved.piece_bits = std::string("\xff\x0f\x00\x80", 4);
+    saved.partial_pieces[5] = std::string("\x01\x02", 2);
+    saved.partial_pieces[300] = std::string("\x00\xfe", 2);
+    saved.uncertain_pieces = {7, 1};
+    assert(saved.save(path));
+
+    File::ResumeData loaded;
+    assert(loaded.load(path));
+    assert(loaded.file_size == saved.file_size);
+    assert(loaded.file_mtime == saved.file_mtime);
+    assert(loaded.piece_bits == saved.piece_bits);
+    assert(loaded.partial_pieces == saved.partial_pieces);
+    assert(loaded.uncertain_pieces == saved.uncertain_pieces);
+
+    // the file is written through a temporary, which must not be left behind
+    assert(access((std::string(path) + ".tmp").c_str(), F_OK) != 0);
+
+    long long size, mtime;
+    assert(File::stat_file(path, size, mtime));
+    assert(size > 0 && mtime > 0);
+    unlink(path);
+}
+
+static void test_bad_files()
+{
+    File::ResumeData data;
+    assert(!data.load("/tmp/test_resume_does_not_exist"));
+
+    long long size, mtime;
+    assert(!File::stat_file("/tmp/test_resume_does_not_exist", size, mtime));
+
+    char path[] = "/tmp/test_resume_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+    {
+        std::ofstream stream(path, std::ios::out | std::ios::trunc);
+        stream << "d9:file sizei1ee";
+    }
+    assert(!data.load(path));
+    unlink(path);
+}
+
+// the contents of piece i
+static std::string piece_contents(uint32_t i)
+{
+    return std::string(PIECE_LENGTH, (char)('a' + i));
+}
+
+// overwrite piece index of the file at path, then put its modification time back, so that only a recheck can tell
+static void corrupt_piece(std::string path, uint32_t index)
+{
+    struct stat st;
+    assert(stat(path.c_str(), &st) == 0);
+    int fd = open(path.c_str(), O_WRONLY);
+    assert(fd >= 0);
+    std::string garbage(PIECE_LENGTH, 'z');
+    assert(pwrite(fd, garbage.data(), garbage.size(), index * PIECE_LENGTH) == PIECE_LENGTH);
+    close(fd);
+    timespec times[2] = {st.st_atim, st.st_mtim};
+    assert(utimensat(AT_FDCWD, path.c_str(), times, 0) == 0);
+}
+
+// a single file torrent saved at path, or if inner is not empty, a multi file torrent whose one file is path/inner
+static std::string make_metainfo(std::string path, std::string inner)
+{
+    std::string hashes;
+    for (uint32_t i = 0; i < NUM_PIECES; i++)
+    {
+        hashes += Hash::truncated_sha1_hash(piece_contents(i), 20);
+    }
+    bencode::dict info;
+    info["name"] = path;
+    if (inner.empty())
+    {
+        info["length"] = PIECE_LENGTH * NUM_PIECES;
+    }
+    else
+    {
+        bencode::dict file;
+        file["length"] = PIECE_LENGTH * NUM_PIECES;
+        file["path"] = bencode::list{inner};
+        info["files"] = bencode::list{file};
+    }
+    info["piece length"] = PIECE_LENGTH;
+    info["pieces"] = hashes;
+
+    bencode::dict metainfo;
+    metainfo["announce"] = std::string("http://127.0.0.1/announce");
+    metainfo["info"] = info;
+    return bencode::encode(metainfo);
+}
+
+static void test_torrent(File::StorageMode mode, std::string inner)
+{
+    char dir_template[] = "/tmp/test_resume_XXXXXX";
+    std::string dir = mkdtemp(dir_template);
+    std::string path = dir + "/download";
+    std::string data_path = inner.empty() ? path : path + "/" + inner; // the directory of a multi file torrent is created by its storage
+    File::TorrentConfig config;
+    config.storage_mode = mode;
+
+    {
+        std::unique_ptr<File::Torrent> torrent = File::create_torrent(make_metainfo(path, inner), config);
+        assert(torrent->piece_bitfield->count() == 0);
+
+        // pieces 0 and 2 arrive, are verified and stored
+        File::BitField even(NUM_PIECES);
+        even.set_bit(0);
+        even.set_bit(2);
+        torrent->add_availability(&even);
+        std::vector<File::Block> blocks;
+        torrent->pick_blocks(1, &even, 64, blocks);
+        for (File::Block &block : blocks)
+        {
+            std::string data = piece_contents(block.index);
+            torrent->write_block(block.index, block.begin, (const uint8_t *)data.data() + block.begin, block.length, 1);
+        }
+        while (torrent->piece_bitfield->count() != 2)
+        {
+            pollfd pfds[2] = {{torrent->hash_notify_fd(), POLLIN, 0}, {torrent->disk_notify_fd(), POLLIN, 0}};
+            assert(poll(pfds, 2, 5000) > 0);
+            torrent->process_hash_results();
+            torrent->process_disk_completions();
+        }
+
+        // the save finishes on the disk thread
+        torrent->save_resume();
+        torrent->flush_writes();
+        File::ResumeData saved;
+        assert(saved.load(path + ".resume"));
+        assert(saved.piece_bits == std::string("\xa0", 1));
+        long long size, mtime;
+        assert(File::stat_file(data_path, size, mtime));
+        assert(saved.file_size == size && saved.file_mtime == mtime);
+    }
+
+    // opening the download again takes its pieces from the resume data without reading them, so a piece that was
+    // changed behind its back is still reported
+    corrupt_piece(data_path, 2);
+    std::unique_ptr<File::Torrent> reopened = File::create_torrent(make_metainfo(path, inner), config);
+    assert(reopened->piece_bitfield->count() == 2);
+    assert(reopened->piece_bitfield->is_bit_set(0) && reopened->piece_bitfield->is_bit_set(2));
+    reopened.reset();
+
+    // once the modification time changes, the resume data is not trusted, and the recheck finds the changed piece
+    timespec times[2] = {{0, UTIME_OMIT}, {0, UTIME_NOW}};
+    assert(utimensat(AT_FDCWD, data_path.c_str(), times, 0) == 0);
+    reopened = File::create_torrent(make_metainfo(path, inner), config);
+    assert(reopened->piece_bitfield->count() == 1);
+    assert(reopened->piece_bitfield->is_bit_set(0));
+    reopened.reset();
+
+    unlink(data_path.c_str());
+    unlink((path + ".resume").c_str());
+    if (!inner.empty())
+    {
+        rmdir(path.c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+int main()
+{
+    test_round_trip();
+    test_bad_files();
+    test_torrent(File::PWRITE, "");
+    test_torrent(File::MMAP, "");
+    test_torrent(File::PWRITE, "inner.bin");
+    test_torrent(File::MMAP, "inner.bin");
+    std::cout << "FINISHED!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,89 @@
+#undef NDEBUG
+#include <iostream>
+#include <cassert>
+#include <cstring>
+#include <string>
+
+#include "ring_buffer.hpp"
+
+// Checks that a ring hands out its free space in order, and that reads which wrap around its end see the bytes in
+// the order they were written.
+
+// write len bytes of src into the ring through its free iovecs, as readv would
+static size_t fill(Util::RingBuffer &ring, const char *src, size_t len)
+{
+    iovec iov[2];
+    int iovcnt = ring.free_iov(iov);
+    size_t written = 0;
+    for (int i = 0; i < iovcnt && written < len; i++)
+    {
+        size_t n = std::min(iov[i].iov_len, len - written);
+        memcpy(iov[i].iov_base, src + written, n);
+        written += n;
+    }
+    ring.commit(written);
+    return written;
+}
+
+static void test_sizes()
+{
+    Util::RingBuffer ring(1000);
+    assert(ring.capacity() == 1024);
+    assert(ring.size() == 0);
+    assert(ring.space() == 1024);
+
+    iovec iov[2];
+    assert(ring.free_iov(iov) == 1);
+    assert(iov[0].iov_len == 1024);
+
+    std::string data(1024, 'a');
+    assert(fill(ring, data.data(), data.size()) == 1024);
+    assert(ring.space() == 0);
+    assert(ring.free_iov(iov) == 0);
+}
+
+static void test_wrap()
+{
+    Util::RingBuffer ring(16);
+    std::string first = "0123456789ab";
+    assert(fill(ring, first.data(), first.size()) == 12);
+    ring.consume(10);
+
+    // the free space now runs from the write position to the end, then from the start to the read position
+    iovec iov[2];
+    assert(ring.free_iov(iov) == 2);
+    assert(iov[0].iov_len + iov[1].iov_len == 14);
+
+    std::string second = "cdefghijklmn";
+    assert(fill(ring, second.data(), second.size()) == 12);
+    assert(ring.size() == 14);
+
+    // a range before the end is contiguous, a range across it is not, but can be copied
+    const uint8_t *ptr = ring.contiguous(0, 6);
+    assert(ptr != nullptr);
+    assert(memcmp(ptr, "abcdef", 6) == 0);
+    assert(ring.contiguous(2, 6) == nullptr);
+
+    char out[14];
+    ring.copy(0, (uint8_t *)out, 14);
+    assert(std::string(out, 14) == "abcdefghijklmn");
+    ring.copy(5, (uint8_t *)out, 4);
+    assert(std::string(out, 4) == "fghi");
+
+    // after the wrap, the read position is at the start again
+    ring.consume(8);
+    ptr = ring.contiguous(0, 6);
+    assert(ptr != nullptr);
+    assert(memcmp(ptr, "ijklmn", 6) == 0);
+    ring.consume(6);
+    assert(ring.size() == 0);
+    assert(ring.space() == 16);
+}
+
+int main()
+{
+    test_sizes();
+    test_wrap();
+    std::cout << "FINISHED!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,103 @@
+#undef NDEBUG
+#include <iostream>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "send_queue.hpp"
+
+// Checks that a send queue writes owned bytes and ranges of storage in the order they were queued, keeps its place
+// when the socket is full, and reports a socket that failed.
+
+// copy s into a buffer that the queue can own
+static std::unique_ptr<uint8_t[]> to_buffer(const std::string &s)
+{
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[s.size()]);
+    memcpy(buffer.get(), s.data(), s.size());
+    return buffer;
+}
+
+// read everything that is waiting on the nonblocking socket fd
+static std::string read_available(int fd)
+{
+    std::string out;
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        out.append(buffer, n);
+    }
+    return out;
+}
+
+static void test_order()
+{
+    char path[] = "/tmp/test_send_queue_XXXXXX";
+    int tmp = mkstemp(path);
+    assert(tmp != -1);
+    close(tmp);
+
+    std::string file_data;
+    for (int i = 0; i < 100000; i++)
+        file_data.push_back((char)(i * 7));
+    File::FileStorage storage(path, file_data.size());
+    assert(storage.write(0, (const uint8_t *)file_data.data(), file_data.size()));
+
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+
+    Net::SendQueue queue;
+    assert(queue.empty());
+    queue.push(to_buffer("header"), 6);
+    queue.push_file(&storage, 1000, 5000);
+    queue.push(to_buffer("a"), 1);
+    queue.push(to_buffer("bc"), 2);
+    assert(queue.size() == 5009);
+
+    size_t storage_sent = 0;
+    assert(queue.flush(fds[0], SIZE_MAX, &storage_sent));
+    assert(queue.empty());
+    assert(storage_sent == 5000);
+    assert(read_available(fds[1]) == "header" + file_data.substr(1000, 5000) + "abc");
+
+    // queue more than the socket holds, and flush it as the other end reads
+    std::string expected;
+    for (int i = 0; i < 64; i++)
+    {
+        std::string chunk(65536, (char)('a' + i % 26));
+        queue.push(to_buffer(chunk), chunk.size());
+        expected += chunk;
+        queue.push_file(&storage, i * 1000, 1000);
+        expected += file_data.substr(i * 1000, 1000);
+    }
+    assert(queue.above_high_water());
+
+    std::string received;
+    while (!queue.empty())
+    {
+        size_t before = queue.size();
+        assert(queue.flush(fds[0]));
+        assert(queue.size() < before || received.size() < expected.size());
+        received += read_available(fds[1]);
+    }
+    received += read_available(fds[1]);
+    assert(received == expected);
+    assert(!queue.above_high_water());
+
+    // a closed socket fails the flush
+    close(fds[1]);
+    queue.push(to_buffer("lost"), 4);
+    assert(!queue.flush(fds[0]));
+
+    close(fds[0]);
+    unlink(path);
+}
+
+int main()
+{
+    test_order();
+    std::cout << "FINISHED!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,263 @@
+#undef NDEBUG
+#include <iostream>
+#include <cassert>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <poll.h>
+
+#include "bencode.hpp"
+#include "hash.h"
+#include "session.hpp"
+
+// Checks that a session frames a peer's messages correctly however the bytes arrive: a handshake split across
+// reads, and messages whose length prefix or body wraps around the end of the receive ring.
+// Also checks that pieces which finish after a peer's handshake are announced to it with have messages.
+
+static const uint32_t NUM_PIECES = 45;
+static const long long PIECE_LENGTH = 1 << 16;
+
+// the contents of the first piece, the only piece whose hash in the metainfo is right
+static std::string first_piece()
+{
+    return std::string(PIECE_LENGTH, 'a');
+}
+
+// the metainfo of a torrent that we have none of
+static std::string make_metainfo(std::string path)
+{
+    bencode::dict info;
+    info["name"] = path;
+    info["length"] = PIECE_LENGTH * NUM_PIECES;
+    info["piece length"] = PIECE_LENGTH;
+    info["pieces"] = Hash::truncated_sha1_hash(first_piece(), 20) + std::string(20 * (NUM_PIECES - 1), 'x');
+
+    bencode::dict metainfo;
+    metainfo["announce"] = std::string("http://127.0.0.1/announce");
+    metainfo["info"] = info;
+    return bencode::encode(metainfo);
+}
+
+// the handshake a peer sends for info_hash
+static std::string peer_handshake(std::string info_hash)
+{
+    std::string stream;
+    stream.push_back(19);
+    stream += "BitTorrent protocol";
+    stream += std::string(8, '\0');
+    stream += info_hash;
+    stream += "-XX0001-peeridpeerid";
+    return stream;
+}
+
+// everything that can be read from fd without blocking
+static std::string read_available(int fd)
+{
+    std::string out;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        out.append(buffer, n);
+    }
+    return out;
+}
+
+// append a message with id and payload to stream
+static void append_message(std::string &stream, uint8_t id, std::string payload)
+{
+    uint32_t len = htonl(payload.size() + 1);
+    stream.append((const char *)&len, sizeof(len));
+    stream.push_back((char)id);
+    stream += payload;
+}
+
+// append messages with an id we do not know until stream is offset bytes long
+static void pad_to(std::string &stream, size_t offset)
+{
+    while (stream.size() < offset)
+    {
+        size_t gap = offset - stream.size();
+        assert(gap >= 5);
+        size_t payload = std::min(gap - 5, (size_t)16000);
+        if (gap - 5 - payload != 0 && gap - 5 - payload < 5)
+        {
+            payload -= 5;
+        }
+        append_message(stream, 20, std::string(payload, 'p'));
+    }
+}
+
+// a bitfield payload where piece i is set when i % step == 0
+static std::string bitfield_payload(uint32_t step)
+{
+    std::string payload((NUM_PIECES + 7) / 8, '\0');
+    for (uint32_t i = 0; i < NUM_PIECES; i += step)
+    {
+        payload[i / 8] |= (char)(0x80 >> (i % 8));
+    }
+    return payload;
+}
+
+static void test_framing()
+{
+    char dir_template[] = "/tmp/test_session_XXXXXX";
+    std::string dir = mkdtemp(dir_template);
+    File::TorrentConfig config;
+    config.resume = false;
+    std::unique_ptr<File::Torrent> torrent = File::create_torrent(make_metainfo(dir + "/download"), config);
+
+    Net::Reactor reactor;
+    Peer::SessionContext context{};
+    context.torrent = torrent.get();
+    context.reactor = &reactor;
+    context.info_hash = std::string(20, 'h');
+    context.client_id = "-TT0001-000000000000";
+    context.outgoing_request_queue_size = 5;
+
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+    Peer::PeerClient peer;
+    peer.socket = fds[0];
+    peer.connected = true;
+    Peer::Session session(context, peer);
+
+    std::string stream = peer_handshake(context.info_hash);
+
+    // a bitfield that wraps around the end of the ring, then an interested whose length prefix does
+    size_t ring_size = session.peer.recv_buffer->capacity();
+    pad_to(stream, ring_size - 6);
+    append_message(stream, Messages::BITFIELD_ID, bitfield_payload(3));
+    append_message(stream, Messages::NOTINTERESTED_ID, "");
+    stream += std::string(4, '\0');
+    pad_to(stream, 2 * ring_size - 2);
+    append_message(stream, Messages::INTERESTED_ID, "");
+    stream += std::string(4, '\0');
+    pad_to(stream, 2 * ring_size + 70000);
+    append_message(stream, Messages::BITFIELD_ID, bitfield_payload(4));
+
+    // deliver the stream in odd sized chunks, starting with part of the handshake
+    size_t sent = 0;
+    size_t chunk = 30;
+    while (sent < stream.size())
+    {
+        size_t len = std::min(chunk, stream.size() - sent);
+        assert(write(fds[1], stream.data() + sent, len) == (ssize_t)len);
+        sent += len;
+        session.on_readable();
+        assert(!session.closed());
+        chunk = 7919;
+
+        if (sent >= ring_size && sent < ring_size + chunk)
+        {
+            assert(session.peer.recv_shake);
+            assert(session.peer.peer_id == "-XX0001-peeridpeerid");
+        }
+    }
+
+    assert(session.peer.peer_interested);
+    assert(session.peer.peer_bitfield != nullptr);
+    for (uint32_t i = 0; i < NUM_PIECES; i++)
+    {
+        assert(session.peer.peer_bitfield->is_bit_set(i) == (i % 4 == 0));
+    }
+
+    // a message longer than the ring closes the session
+    std::string bad;
+    append_message(bad, 20, std::string(ring_size, 'p'));
+    assert(write(fds[1], bad.data(), 16) == 16);
+    session.on_readable();
+    assert(session.closed());
+
+    close(fds[1]);
+    unlink((dir + "/download").c_str());
+    rmdir(dir.c_str());
+}
+
+static void test_have()
+{
+    char dir_template[] = "/tmp/test_session_XXXXXX";
+    std::string dir = mkdtemp(dir_template);
+    File::TorrentConfig config;
+    config.resume = false;
+    std::unique_ptr<File::Torrent> torrent = File::create_torrent(make_metainfo(dir + "/download"), config);
+
+    Net::Reactor reactor;
+    Peer::SessionContext context{};
+    context.torrent = torrent.get();
+    context.reactor = &reactor;
+    context.info_hash = std::string(20, 'h');
+    context.client_id = "-TT0001-000000000000";
+    context.outgoing_request_queue_size = 5;
+
+    // a peer that handshakes before we have any piece is sent our handshake alone
+    int early_fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, early_fds) == 0);
+    Peer::PeerClient early_peer;
+    early_peer.socket = early_fds[0];
+    early_peer.connected = true;
+    Peer::Session early(context, early_peer);
+    std::string shake = peer_handshake(context.info_hash);
+    assert(write(early_fds[1], shake.data(), shake.size()) == (ssize_t)shake.size());
+    early.on_readable();
+    assert(read_available(early_fds[1]).size() == shake.size());
+
+    // the first piece arrives from another peer, and is verified and stored
+    File::BitField only_first(NUM_PIECES);
+    only_first.set_bit(0);
+    torrent->add_availability(&only_first);
+    std::vector<File::Block> blocks;
+    torrent->pick_blocks(1000, &only_first, 64, blocks);
+    assert(!blocks.empty());
+    std::string data = first_piece();
+    for (File::Block &block : blocks)
+    {
+        assert(block.index == 0);
+        torrent->write_block(0, block.begin, (const uint8_t *)data.data() + block.begin, block.length, 1000);
+    }
+    while (!torrent->piece_bitfield->is_bit_set(0))
+    {
+        pollfd pfds[2] = {{torrent->hash_notify_fd(), POLLIN, 0}, {torrent->disk_notify_fd(), POLLIN, 0}};
+        assert(poll(pfds, 2, 5000) > 0);
+        torrent->process_hash_results();
+        torrent->process_disk_completions();
+    }
+
+    // the early peer is told with a have message
+    early.pump();
+    std::string have = read_available(early_fds[1]);
+    assert(have == std::string("\0\0\0\5\4\0\0\0\0", 9));
+    early.pump();
+    assert(read_available(early_fds[1]).empty());
+
+    // a peer that handshakes now finds the piece in our bitfield, and is not sent a have for it
+    int late_fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, late_fds) == 0);
+    Peer::PeerClient late_peer;
+    late_peer.socket = late_fds[0];
+    late_peer.connected = true;
+    Peer::Session late(context, late_peer);
+    assert(write(late_fds[1], shake.data(), shake.size()) == (ssize_t)shake.size());
+    late.on_readable();
+    std::string sent = read_available(late_fds[1]);
+    uint32_t bitfield_bytes = (NUM_PIECES + 7) / 8;
+    assert(sent.size() == shake.size() + 5 + bitfield_bytes);
+    assert(sent[shake.size() + 4] == (char)Messages::BITFIELD_ID);
+    assert((uint8_t)sent[shake.size() + 5] == 0x80);
+    late.pump();
+    assert(read_available(late_fds[1]).empty());
+
+    close(early_fds[1]);
+    close(late_fds[1]);
+    unlink((dir + "/download").c_str());
+    rmdir(dir.c_str());
+}
+
+int main()
+{
+    test_framing();
+    test_have();
+    std::cout << "FINISHED!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,127 @@
+#undef NDEBUG
+#include <iostream>
+#include <cassert>
+#include <vector>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "storage.hpp"
+
+// Checks that a multi-file storage maps torrent offsets onto the right files, including ranges that cross file
+// boundaries and empty files, and that it keeps working when it has to close files to open others.
+// Also checks that single file storage creates the directory of a multi file torrent with one file.
+
+// read the whole file at path
+static std::string read_file(std::string path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    assert(fd != -1);
+    std::string data(4096, '\0');
+    ssize_t len = read(fd, &data[0], data.size());
+    assert(len >= 0);
+    close(fd);
+    data.resize(len);
+    return data;
+}
+
+static void test_spans()
+{
+    char dir_template[] = "/tmp/test_storage_XXXXXX";
+    std::string dir = mkdtemp(dir_template);
+
+    // a, an empty file, a file in a sub directory, and d
+    std::vector<File::FileSpan> spans = {
+        {dir + "/a", 0, 10},
+        {dir + "/sub/empty", 10, 0},
+        {dir + "/sub/c", 10, 7},
+        {dir + "/d", 17, 20},
+    };
+    std::string torrent;
+    for (int i = 0; i < 37; i++)
+        torrent.push_back((char)('A' + i));
+
+    {
+        // at most two files are open at once, so writing all four evicts handles
+        File::MultiFileStorage storage(spans, 2);
+        for (const File::FileSpan &span : spans)
+        {
+            struct stat st;
+            assert(stat(span.path.c_str(), &st) == 0);
+            assert(st.st_size == span.length);
+        }
+
+        // a vectored write whose buffers do not line up with the files
+        iovec iov[3] = {
+            {&torrent[0], 4},
+            {&torrent[4], 9},
+            {&torrent[13], 24},
+        };
+        assert(storage.writev(0, iov, 3));
+
+        // a write that runs off the end is refused
+        assert(!storage.write(30, (const uint8_t *)torrent.data(), 10));
+
+        // reads that start inside a file and cross into the next one
+        std::vector<uint8_t> buffer(37);
+        assert(storage.read(0, buffer.data(), 37));
+        assert(std::string(buffer.begin(), buffer.end()) == torrent);
+        assert(storage.read(8, buffer.data(), 12));
+        assert(std::string(buffer.begin(), buffer.begin() + 12) == torrent.substr(8, 12));
+
+        // overwrite a range that covers the whole of c
+        std::string patch = "0123456789";
+        assert(storage.write(9, (const uint8_t *)patch.data(), patch.size()));
+        torrent.replace(9, patch.size(), patch);
+        storage.sync();
+    }
+
+    assert(read_file(dir + "/a") == torrent.substr(0, 10));
+    assert(read_file(dir + "/sub/empty") == "");
+    assert(read_file(dir + "/sub/c") == torrent.substr(10, 7));
+    assert(read_file(dir + "/d") == torrent.substr(17, 20));
+
+    unlink((dir + "/a").c_str());
+    unlink((dir + "/sub/empty").c_str());
+    unlink((dir + "/sub/c").c_str());
+    unlink((dir + "/d").c_str());
+    rmdir((dir + "/sub").c_str());
+    rmdir(dir.c_str());
+}
+
+// the one file of a multi file torrent is inside the torrent's directory, which does not exist yet
+static void test_nested_single_file()
+{
+    char dir_template[] = "/tmp/test_storage_XXXXXX";
+    std::string dir = mkdtemp(dir_template);
+    std::string path = dir + "/name/inner.bin";
+    std::string data = "nested";
+
+    {
+        File::FileStorage storage(path, data.size());
+        assert(storage.write(0, (const uint8_t *)data.data(), data.size()));
+        storage.sync();
+    }
+    assert(read_file(path) == data);
+    unlink(path.c_str());
+
+    {
+        File::MmapStorage storage(path, data.size());
+        assert(storage.write(0, (const uint8_t *)data.data(), data.size()));
+        storage.sync();
+    }
+    assert(read_file(path) == data);
+
+    unlink(path.c_str());
+    rmdir((dir + "/name").c_str());
+    rmdir(dir.c_str());
+}
+
+int main()
+{
+    test_spans();
+    test_nested_single_file();
+    std::cout << "FINISHED!" << std::endl;
+    return 0;
+}
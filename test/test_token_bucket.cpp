@@ -0,0 +1,69 @@
+#undef NDEBUG
+#include <iostream>
+#include <climits>
+#include <cassert>
+
+#include "token_bucket.hpp"
+
+// Checks that a bucket allows its rate over time, saves up no more than its burst, and that the limits of several
+// scopes combine to the tightest one.
+
+static void test_rate()
+{
+    Util::TokenBucket bucket(10000);
+    assert(bucket.rate() == 10000);
+    assert(bucket.available() == 10000 * Util::BUCKET_BURST_MS / 1000);
+
+    // spending more than is available leaves a debt that later refills pay off first
+    bucket.consume(bucket.available() + 1000);
+    assert(bucket.available() == 0);
+    bucket.refill(Util::REFILL_INTERVAL_MS);
+    assert(bucket.available() == 0);
+    bucket.refill(Util::REFILL_INTERVAL_MS);
+    assert(bucket.available() == 1000);
+    bucket.consume(1000);
+
+    // a second of refills allows a second of bytes, and an idle bucket stops at its burst
+    long long sent = 0;
+    for (int elapsed = 0; elapsed < 1000; elapsed += Util::REFILL_INTERVAL_MS)
+    {
+        bucket.refill(Util::REFILL_INTERVAL_MS);
+        sent += bucket.available();
+        bucket.consume(bucket.available());
+    }
+    assert(sent == 10000);
+    bucket.refill(60 * 1000);
+    assert(bucket.available() == 10000 * Util::BUCKET_BURST_MS / 1000);
+
+    // a lower rate keeps only the tokens that fit its burst
+    bucket.set_rate(1000);
+    assert(bucket.available() == 1000 * Util::BUCKET_BURST_MS / 1000);
+}
+
+static void test_unlimited()
+{
+    Util::TokenBucket bucket;
+    assert(bucket.rate() == 0 && bucket.available() == LLONG_MAX);
+    bucket.consume(1 << 30);
+    assert(bucket.available() == LLONG_MAX);
+}
+
+static void test_scopes()
+{
+    Util::TokenBucket global(100000), torrent(5000), peer;
+    assert(Util::available({&global, &torrent, &peer, nullptr}) == torrent.available());
+    assert(Util::available({nullptr}) == LLONG_MAX);
+
+    Util::consume({&global, &torrent, &peer, nullptr}, 1000);
+    assert(global.available() == 100000 * Util::BUCKET_BURST_MS / 1000 - 1000);
+    assert(torrent.available() == 5000 * Util::BUCKET_BURST_MS / 1000 - 1000);
+    assert(peer.available() == LLONG_MAX);
+}
+
+int main()
+{
+    test_rate();
+    test_unlimited();
+    test_scopes();
+    std::cout << "FINISHED!" << std::endl;
+}
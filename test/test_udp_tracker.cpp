@@ -0,0 +1,201 @@
+#undef NDEBUG
+#include <iostream>
+#include <cassert>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+
+#include "udp_tracker.hpp"
+
+// Checks the UDP tracker client against the tracker in tools/udp_tracker, whose path is the first argument, on loopback:
+// that it connects, announces and scrapes, and that a request the tracker drops is sent again after a growing timeout
+// until the announce fails.
+
+static const int RETRANSMIT_BASE_MS = 50; // short resends, so that a lost announce fails within a second
+
+// the tracker tool, running on a free loopback port, with its output read from a pipe
+struct TrackerProcess
+{
+    pid_t pid;
+    int output;
+    int port;
+};
+
+// find a free UDP port on loopback
+static int free_port()
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    assert(sock >= 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(sock, (sockaddr *)&addr, sizeof(addr)) == 0);
+    socklen_t len = sizeof(addr);
+    assert(getsockname(sock, (sockaddr *)&addr, &len) == 0);
+    close(sock);
+    return ntohs(addr.sin_port);
+}
+
+// the number of times text is in output
+static int occurrences(const std::string &output, const std::string &text)
+{
+    int count = 0;
+    for (size_t at = output.find(text); at != std::string::npos; at = output.find(text, at + text.size()))
+    {
+        count++;
+    }
+    return count;
+}
+
+// read the tool's output until it contains text count times, or it has been read to the end
+static std::string read_until(int fd, std::string text, int count = 1)
+{
+    std::string output;
+    char buffer[256];
+    while (occurrences(output, text) < count)
+    {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0)
+        {
+            break;
+        }
+        output.append(buffer, n);
+    }
+    return output;
+}
+
+// start the tool with an announce interval of interval seconds, dropping loss_percent of the requests
+static TrackerProcess start_tracker(const char *tool, int interval, int loss_percent)
+{
+    TrackerProcess tracker;
+    tracker.port = free_port();
+    int fds[2];
+    assert(pipe(fds) == 0);
+    tracker.pid = fork();
+    assert(tracker.pid >= 0);
+    if (tracker.pid == 0)
+    {
+        // the tool goes away with the test, even one that fails
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        std::string port = std::to_string(tracker.port);
+        std::string interval_arg = std::to_string(interval);
+        std::string loss = std::to_string(loss_percent);
+        execl(tool, tool, "-p", port.c_str(), "-i", interval_arg.c_str(), "-l", loss.c_str(), (char *)nullptr);
+        _exit(127);
+    }
+    close(fds[1]);
+    tracker.output = fds[0];
+    assert(occurrences(read_until(tracker.output, "listening"), "listening") == 1);
+    return tracker;
+}
+
+static void stop_tracker(TrackerProcess &tracker)
+{
+    kill(tracker.pid, SIGTERM);
+    waitpid(tracker.pid, nullptr, 0);
+    close(tracker.output);
+}
+
+static std::unique_ptr<TrackerProtocol::UdpTracker> make_client(Net::Reactor *reactor, int port, int *responses)
+{
+    std::string url = "udp://127.0.0.1:" + std::to_string(port) + "/announce";
+    return std::make_unique<TrackerProtocol::UdpTracker>(
+        url, std::string(20, 'h'), "-GB0001-000000000000", 6881, reactor, []()
+        { return TrackerProtocol::AnnounceStats{0, 0, 0}; }, [responses](std::vector<Peer::PeerClient> &)
+        { (*responses)++; }, RETRANSMIT_BASE_MS);
+}
+
+// run the event loop until done returns true, or the timeout runs out
+// return whether done returned true
+static bool run_until(Net::Reactor &reactor, TrackerProtocol::UdpTracker &client, std::chrono::milliseconds timeout,
+                      std::function<bool()> done)
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!done())
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            return false;
+        }
+        reactor.run_once(10);
+        client.tick(false);
+    }
+    return true;
+}
+
+static void test_announce_and_scrape(const char *tool)
+{
+    // an interval of 2 seconds schedules the scrape a second after the announce
+    TrackerProcess tracker = start_tracker(tool, 2, 0);
+    Net::Reactor reactor;
+    int responses = 0;
+    std::unique_ptr<TrackerProtocol::UdpTracker> client = make_client(&reactor, tracker.port, &responses);
+
+    // we have nothing left to download, so we are the one seeder, and there are no other peers to hand on
+    assert(run_until(reactor, *client, std::chrono::seconds(5), [&]()
+                     { return client->working(); }));
+    assert(responses == 0);
+    assert(client->interval == 2);
+    assert(client->num_seeders == 1 && client->num_leechers == 0);
+    assert(client->num_completed == 0);
+
+    // the tool counts seeders as completed downloads
+    assert(run_until(reactor, *client, std::chrono::milliseconds(1800), [&]()
+                     { return client->num_completed == 1; }));
+
+    stop_tracker(tracker);
+}
+
+static void test_lost_requests(const char *tool)
+{
+    // every request is dropped
+    TrackerProcess tracker = start_tracker(tool, 60, 100);
+    Net::Reactor reactor;
+    int responses = 0;
+    std::unique_ptr<TrackerProtocol::UdpTracker> client = make_client(&reactor, tracker.port, &responses);
+
+    // the connect is sent every attempt, each after twice the wait of the one before, then the announce fails
+    auto start = std::chrono::steady_clock::now();
+    assert(run_until(reactor, *client, std::chrono::seconds(5), [&]()
+                     { return client->failing(); }));
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    int backoff_ms = 0;
+    for (int i = 0; i < TrackerProtocol::UDP_MAX_ATTEMPTS; i++)
+    {
+        backoff_ms += RETRANSMIT_BASE_MS << i;
+    }
+    assert(elapsed >= std::chrono::milliseconds(backoff_ms));
+    assert(responses == 0);
+    assert(!client->working());
+
+    // the tool saw each attempt, and no more
+    std::string dropped = "dropped a request";
+    assert(occurrences(read_until(tracker.output, dropped, TrackerProtocol::UDP_MAX_ATTEMPTS), dropped) ==
+           TrackerProtocol::UDP_MAX_ATTEMPTS);
+    run_until(reactor, *client, std::chrono::milliseconds(200), []()
+              { return false; });
+    fcntl(tracker.output, F_SETFL, O_NONBLOCK);
+    assert(occurrences(read_until(tracker.output, dropped), dropped) == 0);
+
+    stop_tracker(tracker);
+}
+
+int main(int argc, char *argv[])
+{
+    assert(argc == 2);
+    test_announce_and_scrape(argv[1]);
+    test_lost_requests(argv[1]);
+    std::cout << "FINISHED!" << std::endl;
+    return 0;
+}
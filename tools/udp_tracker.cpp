@@ -0,0 +1,230 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <unordered_map>
+#include <cstring>
+#include <endian.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <argparse/argparse.hpp>
+
+// A small UDP tracker (BEP 15) to test the client against without a network.
+// It hands out connection ids, remembers the peers that announce each info hash, and answers announces with the
+// other peers of the same torrent and scrapes with their counts. With -l it drops that percentage of requests, to
+// exercise the client's resends.
+static const uint64_t PROTOCOL_ID = 0x41727101980ull;
+static const int CONNECTION_ID_LIFETIME = 120; // seconds a connection id is accepted for, longer than clients use it
+static const int PEER_TIMEOUT = 30 * 60;	   // seconds after which a peer that stopped announcing is forgotten
+static const int MAX_PEERS = 200;			   // the most peers in an announce response
+
+struct PeerEntry
+{
+    uint32_t ip;   // in network byte order
+    uint16_t port; // in network byte order
+    uint64_t left;
+    std::chrono::steady_clock::time_point last_seen;
+};
+
+static void put_u32(std::vector<uint8_t> &packet, uint32_t value)
+{
+    value = htonl(value);
+    packet.insert(packet.end(), (uint8_t *)&value, (uint8_t *)&value + sizeof(value));
+}
+
+static void put_u64(std::vector<uint8_t> &packet, uint64_t value)
+{
+    value = htobe64(value);
+    packet.insert(packet.end(), (uint8_t *)&value, (uint8_t *)&value + sizeof(value));
+}
+
+static uint32_t get_u32(const uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return ntohl(value);
+}
+
+static uint64_t get_u64(const uint8_t *data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return be64toh(value);
+}
+
+int main(int argc, char *argv[])
+{
+    argparse::ArgumentParser program("udp_tracker");
+    int port;
+    int interval;
+    int loss_percent;
+
+    program.add_argument("-p").default_value(6969).store_into(port);        // the port to listen on
+    program.add_argument("-i").default_value(60).store_into(interval);      // the announce interval given to clients, in seconds
+    program.add_argument("-l").default_value(0).store_into(loss_percent);   // the percentage of requests to drop
+
+    try
+    {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception &err)
+    {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        std::exit(1);
+    };
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (sock < 0 || bind(sock, (sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        std::cerr << "Failed to bind port " << port << ": " << strerror(errno) << std::endl;
+        std::exit(1);
+    }
+    std::cout << "udp tracker listening on port " << port << std::endl;
+
+    std::mt19937_64 rng(std::random_device{}());
+    std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> connections;				 // connection id to its expiry
+    std::unordered_map<std::string, std::unordered_map<uint64_t, PeerEntry>> torrents; // info hash to its peers, by address
+
+    uint8_t buffer[2048];
+    while (true)
+    {
+        sockaddr_in from = {};
+        socklen_t from_length = sizeof(from);
+        ssize_t n = recvfrom(sock, buffer, sizeof(buffer), 0, (sockaddr *)&from, &from_length);
+        if (n < 16)
+        {
+            continue;
+        }
+        if ((int)(rng() % 100) < loss_percent)
+        {
+            std::cout << "dropped a request" << std::endl;
+            continue;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        uint64_t id = get_u64(buffer);
+        uint32_t action = get_u32(buffer + 8);
+        uint32_t transaction_id = get_u32(buffer + 12);
+        std::vector<uint8_t> response;
+
+        auto error = [&](const std::string &message)
+        {
+            response.clear();
+            put_u32(response, 3);
+            put_u32(response, transaction_id);
+            response.insert(response.end(), message.begin(), message.end());
+        };
+
+        if (action == 0)
+        {
+            if (id != PROTOCOL_ID)
+            {
+                continue;
+            }
+            uint64_t connection_id = rng();
+            connections[connection_id] = now + std::chrono::seconds(CONNECTION_ID_LIFETIME);
+            put_u32(response, 0);
+            put_u32(response, transaction_id);
+            put_u64(response, connection_id);
+            std::cout << "connect from " << inet_ntoa(from.sin_addr) << std::endl;
+        }
+        else if (connections.count(id) == 0 || connections[id] < now)
+        {
+            connections.erase(id);
+            error("unknown connection id");
+        }
+        else if (action == 1 && n >= 98)
+        {
+            std::string info_hash((char *)buffer + 16, 20);
+            uint64_t left = get_u64(buffer + 64);
+            uint32_t event = get_u32(buffer + 80);
+            uint32_t ip;
+            memcpy(&ip, buffer + 84, sizeof(ip));
+            int32_t num_want = (int32_t)get_u32(buffer + 92);
+            uint16_t peer_port;
+            memcpy(&peer_port, buffer + 96, sizeof(peer_port));
+
+            // a peer is known by the address it announces from and the port it listens on
+            PeerEntry entry = {ip != 0 ? ip : from.sin_addr.s_addr, peer_port, left, now};
+            uint64_t key = (uint64_t)entry.ip << 16 | entry.port;
+            auto &peers = torrents[info_hash];
+            if (event == 3)
+            {
+                peers.erase(key);
+            }
+            else
+            {
+                peers[key] = entry;
+            }
+
+            uint32_t seeders = 0;
+            uint32_t leechers = 0;
+            std::vector<uint8_t> listed;
+            int limit = num_want < 0 ? MAX_PEERS : std::min(num_want, MAX_PEERS);
+            for (auto it = peers.begin(); it != peers.end();)
+            {
+                if (now - it->second.last_seen > std::chrono::seconds(PEER_TIMEOUT))
+                {
+                    it = peers.erase(it);
+                    continue;
+                }
+                (it->second.left == 0 ? seeders : leechers)++;
+                if (it->first != key && (int)(listed.size() / 6) < limit)
+                {
+                    listed.insert(listed.end(), (uint8_t *)&it->second.ip, (uint8_t *)&it->second.ip + 4);
+                    listed.insert(listed.end(), (uint8_t *)&it->second.port, (uint8_t *)&it->second.port + 2);
+                }
+                it++;
+            }
+
+            put_u32(response, 1);
+            put_u32(response, transaction_id);
+            put_u32(response, interval);
+            put_u32(response, leechers);
+            put_u32(response, seeders);
+            response.insert(response.end(), listed.begin(), listed.end());
+            std::cout << "announce from " << inet_ntoa(from.sin_addr) << ":" << ntohs(peer_port) << ", event " << event
+                      << ", left " << left << ", " << listed.size() / 6 << " peers returned" << std::endl;
+        }
+        else if (action == 2)
+        {
+            put_u32(response, 2);
+            put_u32(response, transaction_id);
+            for (ssize_t offset = 16; offset + 20 <= n; offset += 20)
+            {
+                uint32_t seeders = 0;
+                uint32_t leechers = 0;
+                auto it = torrents.find(std::string((char *)buffer + offset, 20));
+                if (it != torrents.end())
+                {
+                    for (auto &peer : it->second)
+                    {
+                        (peer.second.left == 0 ? seeders : leechers)++;
+                    }
+                }
+
+                // completed downloads are not tracked, so the seeders stand in for them
+                put_u32(response, seeders);
+                put_u32(response, seeders);
+                put_u32(response, leechers);
+            }
+            std::cout << "scrape from " << inet_ntoa(from.sin_addr) << std::endl;
+        }
+        else
+        {
+            error("bad request");
+        }
+
+        sendto(sock, response.data(), response.size(), 0, (sockaddr *)&from, from_length);
+    }
+    return 0;
+}